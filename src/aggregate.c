@@ -0,0 +1,215 @@
+/*
+ * aggregate -- hourly, daily and monthly consumption totals.
+ *
+ * Kept in its own translation unit (separate from watermeter.c, which has
+ * main()) so it can be linked into the unit tests.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "common.h"
+#include "aggregate.h"
+
+#define AGGREGATE_MAGIC "moses-aggregate 1"
+
+static const char *const period_name[AGGREGATE_PERIODS] = {
+    [AGGREGATE_HOUR ] = "hour",
+    [AGGREGATE_DAY  ] = "day",
+    [AGGREGATE_MONTH] = "month",
+};
+
+
+const char *
+aggregate_period_name(enum aggregate_period period)
+{
+    return period_name[period];
+}
+
+
+time_t
+aggregate_period_start(enum aggregate_period period, time_t t)
+{
+    struct tm tm;
+    localtime_r(&t, &tm);
+
+    switch (period) {
+    case AGGREGATE_MONTH:
+	tm.tm_mday = 1;
+	[[fallthrough]];
+    case AGGREGATE_DAY:
+	tm.tm_hour = 0;
+	[[fallthrough]];
+    case AGGREGATE_HOUR:
+	tm.tm_min  = 0;
+	tm.tm_sec  = 0;
+	break;
+    default:
+	return t;
+    }
+    tm.tm_isdst = -1;                   // as in effect at that time
+    return mktime(&tm);
+}
+
+
+void
+aggregate_init(struct aggregate *a, time_t now)
+{
+    *a = (struct aggregate) { .minute = now - now % 60 };
+    for (int p = 0 ; p < AGGREGATE_PERIODS ; p++) {
+	a->current[p].start  = aggregate_period_start(p, now);
+	a->previous[p].start = aggregate_period_start(p,
+						      a->current[p].start - 1);
+    }
+}
+
+
+unsigned int
+aggregate_tick(struct aggregate *a, time_t now)
+{
+    unsigned int closed = 0;
+
+    // Pending minute: its volume is a flow candidate for the periods it
+    // belongs to, which are still the current ones.
+    time_t minute = now - now % 60;
+    if (minute > a->minute) {
+	for (int p = 0 ; p < AGGREGATE_PERIODS ; p++)
+	    if (a->minute_volume > a->current[p].peak_flow)
+		a->current[p].peak_flow = a->minute_volume;
+	a->minute        = minute;
+	a->minute_volume = 0;
+    }
+
+    // Ended periods (a clock going backwards closes nothing)
+    for (int p = 0 ; p < AGGREGATE_PERIODS ; p++) {
+	struct aggregate_bucket *cur = &a->current[p];
+	time_t start = aggregate_period_start(p, now);
+	if (start <= cur->start)
+	    continue;
+
+	if (p == AGGREGATE_HOUR)
+	    a->hours[(cur->start / 3600) % 24] = *cur;
+
+	// After a gap (daemon stopped), the period just before is empty
+	time_t prev = aggregate_period_start(p, start - 1);
+	a->previous[p] = (prev == cur->start)
+	               ? *cur : (struct aggregate_bucket) { .start = prev };
+	*cur = (struct aggregate_bucket) { .start = start };
+	closed |= 1u << p;
+    }
+
+    return closed;
+}
+
+
+unsigned int
+aggregate_add(struct aggregate *a, time_t t, double volume)
+{
+    unsigned int closed = aggregate_tick(a, t);
+
+    a->minute_volume += volume;
+    for (int p = 0 ; p < AGGREGATE_PERIODS ; p++)
+	a->current[p].volume += volume;
+
+    return closed;
+}
+
+
+double
+aggregate_last24h(const struct aggregate *a)
+{
+    const struct aggregate_bucket *cur = &a->current[AGGREGATE_HOUR];
+    double volume = cur->volume;
+    for (int i = 0 ; i < 24 ; i++)
+	if ((a->hours[i].start <  cur->start) &&
+	    (a->hours[i].start >= cur->start - 23 * 3600))
+	    volume += a->hours[i].volume;
+    return volume;
+}
+
+
+static void
+aggregate_save_bucket(FILE *f, const char *name,
+		      const struct aggregate_bucket *b)
+{
+    fprintf(f, "%s %lld %.17g %.17g\n",
+	    name, (long long)b->start, b->volume, b->peak_flow);
+}
+
+static void
+aggregate_write(FILE *f, const void *ctx)
+{
+    const struct aggregate *a = ctx;
+
+    fprintf(f, "%s\n", AGGREGATE_MAGIC);
+    fprintf(f, "minute %lld %.17g\n",
+	    (long long)a->minute, a->minute_volume);
+    for (int p = 0 ; p < AGGREGATE_PERIODS ; p++) {
+	aggregate_save_bucket(f, period_name[p], &a->current[p]);
+	aggregate_save_bucket(f, period_name[p], &a->previous[p]);
+    }
+    for (int i = 0 ; i < 24 ; i++)
+	aggregate_save_bucket(f, "h24", &a->hours[i]);
+}
+
+int
+aggregate_save(const struct aggregate *a, const char *path)
+{
+    return atomic_write_file(path, aggregate_write, a);
+}
+
+
+static int
+aggregate_load_bucket(FILE *f, const char *name, struct aggregate_bucket *b)
+{
+    char      label[8];
+    long long start;
+    if ((fscanf(f, "%7s %lld %lg %lg",
+		label, &start, &b->volume, &b->peak_flow) != 4) ||
+	(strcmp(label, name) != 0))
+	return -1;
+    b->start = start;
+    return 0;
+}
+
+int
+aggregate_load(struct aggregate *a, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+	return -1;
+
+    struct aggregate s = { 0 };
+    char      magic[sizeof(AGGREGATE_MAGIC) + 1];
+    long long minute;
+    int       rc = -1;
+
+    if ((fgets(magic, sizeof(magic), f) == NULL) ||
+	(strcmp(magic, AGGREGATE_MAGIC "\n") != 0))
+	goto done;
+    if (fscanf(f, " minute %lld %lg", &minute, &s.minute_volume) != 2)
+	goto done;
+    s.minute = minute;
+    for (int p = 0 ; p < AGGREGATE_PERIODS ; p++)
+	if ((aggregate_load_bucket(f, period_name[p], &s.current[p])  < 0) ||
+	    (aggregate_load_bucket(f, period_name[p], &s.previous[p]) < 0))
+	    goto done;
+    for (int i = 0 ; i < 24 ; i++)
+	if (aggregate_load_bucket(f, "h24", &s.hours[i]) < 0)
+	    goto done;
+
+    *a = s;
+    rc = 0;
+
+ done:
+    fclose(f);
+    if (rc < 0)
+	errno = EINVAL;
+    return rc;
+}
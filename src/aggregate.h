@@ -0,0 +1,66 @@
+#ifndef __AGGREGATE_H
+#define __AGGREGATE_H
+
+/*
+ * Consumption aggregates: hourly, daily and monthly totals (local time) of
+ * the water volume, with the peak flow seen in each period, so consumers do
+ * not have to sum the raw readings themselves.
+ *
+ * Volumes are added as they are measured; the flow is the volume of each
+ * calendar minute, its peak is kept per period. Periods close when time
+ * moves past their end, the last closed one being kept as `previous`.
+ * The state can be saved to and restored from a small text file, so the
+ * totals survive restarts.
+ */
+
+#include <stdbool.h>
+#include <time.h>
+
+enum aggregate_period {
+    AGGREGATE_HOUR,
+    AGGREGATE_DAY,
+    AGGREGATE_MONTH,
+    AGGREGATE_PERIODS
+};
+
+struct aggregate_bucket {
+    time_t  start;                      // period start
+    double  volume;                     // consumption (L)
+    double  peak_flow;                  // highest minute volume (L/min)
+};
+
+struct aggregate {
+    struct aggregate_bucket current [AGGREGATE_PERIODS];
+    struct aggregate_bucket previous[AGGREGATE_PERIODS]; // last closed
+    struct aggregate_bucket hours[24];  // closed hours, for the last 24h
+    time_t  minute;                     // minute being accumulated
+    double  minute_volume;
+};
+
+// Name of a period ("hour", "day", "month")
+const char *aggregate_period_name(enum aggregate_period period);
+
+// Start of the period holding `t` (local time).
+time_t aggregate_period_start(enum aggregate_period period, time_t t);
+
+// Empty aggregates, periods starting at `now`.
+void aggregate_init(struct aggregate *a, time_t now);
+
+// Move time forward to `now`: close the pending minute and the periods
+// that ended. Returns the mask (1 << period) of the periods closed.
+unsigned int aggregate_tick(struct aggregate *a, time_t now);
+
+// Add a volume (L) measured at `t`, ticking first. Measurements older than
+// the pending minute are accounted in it. Returns as aggregate_tick().
+unsigned int aggregate_add(struct aggregate *a, time_t t, double volume);
+
+// Consumption over the last 24 hours: current hour and 23 previous ones.
+double aggregate_last24h(const struct aggregate *a);
+
+// Save (atomically: written aside then renamed) or restore the state.
+// 0 on success, -1 on failure (errno set; for load, ENOENT when there is
+// no saved state yet, EINVAL when the file is not understood).
+int aggregate_save(const struct aggregate *a, const char *path);
+int aggregate_load(struct aggregate *a, const char *path);
+
+#endif
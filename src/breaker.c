@@ -12,6 +12,45 @@
  * publish is taken into account so we don't publish twice in a row).
  * Failures to drive the line are reported on the `error` topic.
  *
+ * Commands are not applied on the MQTT network thread, where they would
+ * wait behind keep-alives, retries and TLS work: on_message only parses
+ * them and drops the requested state in a single-slot mailbox (a newer
+ * command replaces one not yet applied), and a dedicated actuator thread
+ * drives the line. The receive to actuate latency of every command is
+ * published on `stats/breaker/actuator`. To spare the relay and the
+ * solenoid coil, transitions can be limited (--min-dwell,
+ * --max-transitions): one coming too soon is held back, latest wins,
+ * until admitted; closing the valve is never held back.
+ *
+ * Hit-and-hold (--hold-duty): a closed valve keeps its coil powered for
+ * as long as it stays closed, hours for a leak. With a solid-state driver
+ * (a MOSFET, not a mechanical relay), the coil can instead be fully driven
+ * only for the pull-in time (--pull-in), then switched by the actuator at
+ * --hold-frequency with the hold duty cycle. This is software PWM on the
+ * requested line on purpose: a kernel PWM channel would keep driving the
+ * coil after a crash, where the line is released. The energised and
+ * actually driven time of each coil, and the energy with --coil-power,
+ * are published on `stats/breaker/coil`.
+ *
+ * A command may carry a correlation id and the client timestamp
+ * (`1 id=42 ts=1736899200.125`): each one is acknowledged on `state/ack`
+ * with its id, result (ok, failed, superseded, suppressed, invalid), the
+ * resulting state and the receive/actuate times.
+ *
+ * Timed and scheduled commands (`state/schedule`, see breaker_schedule.h)
+ * run from a timerfd inside the daemon, and are persisted with
+ * --schedule: closing the valve for a holiday and reopening it does not
+ * depend on an external scheduler, nor on the broker. The pending
+ * transition is announced (retained) on `state/pending`. A plain
+ * `state/set` (or `all/state/set`) cancels it: the valve stays as
+ * explicitly set.
+ *
+ * Zone valves (--zone) are driven next to the main one, all of them from
+ * a single multi-line GPIO request: each zone has its own topics under
+ * `zone/<name>/`, and commands on `all/state/set` switch every line with
+ * one ioctl (so at the same instant). Whatever commands the actuator finds
+ * pending when it wakes up are applied together the same way.
+ *
  * The valve is normally open (NO): driving the relay closes the water,
  * so the line default keeps the valve open. Use --mode/--active to match
  * the relay wiring. All topics are relative to MQTT_TOPIC_PREFIX.
@@ -23,6 +62,15 @@
  * supply. There is therefore deliberately no signal handler driving the
  * valve to a "safe" position on shutdown. (The broker also publishes the
  * MQTT `availability` last will on any ungraceful disconnect.)
+ *
+ * Hot restart (--handover): a deliberate restart (upgrade) must not go
+ * through that, or a valve closed because of a leak reopens for the
+ * restart. The running instance listens on a Unix socket; a new instance
+ * started with the same options connects to it, receives the line request
+ * fd (SCM_RIGHTS) and reads the current states from the lines, then the
+ * running one ends its MQTT session cleanly and exits. The lines are never
+ * released, so the outputs do not glitch. A crash is not a handover: the
+ * lines are released as above.
  */
 
 #ifndef _GNU_SOURCE
@@ -37,7 +85,14 @@
 #include <assert.h>
 
 #include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 
 #include <string.h>
 #include <errno.h>
@@ -50,52 +105,143 @@
 #include <mosquitto.h>
 
 #include "common.h"
+#include "module.h"
 #include "breaker_state.h"
-
-#ifndef timespeccmp
-#define timespeccmp(tvp, uvp, cmp)                                      \
-        (((tvp)->tv_sec == (uvp)->tv_sec) ?                             \
-            ((tvp)->tv_nsec cmp (uvp)->tv_nsec) :                       \
-            ((tvp)->tv_sec cmp (uvp)->tv_sec))
-#endif
-
+#include "breaker_schedule.h"
 
 #define NICKNAME "breaker"
 
+#define LATENCY_BUCKETS 11              // see latency_bounds_us[]
+#define BREAKER_LINES   16              // main valve + zones, at most
+#define HANDOVER_MAGIC  "moses-handover 1"
+#define HANDOVER_TIMEOUT 2              // s, for each handover exchange
+
 
 //== Structures ========================================================
 
+struct breaker_request {                // Command in flight
+    struct breaker_command command;     // as parsed
+    int               line;             // line index, -1 = all lines
+    uint64_t          seq;              // submission order
+    uint64_t          received_ns;      // CLOCK_MONOTONIC
+    unsigned int      lines;            // lines it is still held on
+    bool              deferred;         // held back by the admission
+    bool              failed;           // failed on a line
+    uint64_t          actuated_ns;      // applied on a line (last time)
+};
+
+struct breaker_line {                   // Valve line
+    char             *name;             // zone name (NULL = main valve)
+    char             *put;              // PUT_DATA measurement
+    uint32_t          pin;              // line offset on the controller
+    struct breaker_status status;       // state, actuation (CLOCK_MONOTONIC)
+                                        //  and publish (INTERVAL_CLOCK) time
+    struct breaker_request *_Atomic mailbox; // pending command, NULL = none
+    struct breaker_admission admission; // anti-chatter (actuator only)
+    struct breaker_hold hold;           // hit-and-hold (actuator only)
+    int               level;            //  - level driven while holding
+    struct {                            // coil usage (actuator only)
+	unsigned long closures;         //  - times energised
+	uint64_t      energised_ns;     //  - energised, past closures
+	uint64_t      driven_ns;        //  - actually driven, past closures
+    } coil;
+    struct {                            // topics (main valve: breaker_mqtt's)
+	char *setter;
+	char *publish;
+	char *ack;
+    } topic;
+};
+
 struct breaker_control {
     struct {                            // Controller
 	char       *id;                 //  - identifier
 	int         fd;                 //  - file descriptor
     } ctrl;
-    struct {                            // Pin
-	uint32_t    id;                 //  - identifier
-	int         fd;                 //  - file descriptor
+    struct {                            // Pin(s)
+	uint32_t    id;                 //  - main valve identifier
+	int         fd;                 //  - file descriptor (all lines)
 	uint64_t    flags;              //  - flags
 	char       *label;              //  - label
 	int         defval;             //  - default value
     } pin;
     unsigned long   idle_timeout;       // idle timeout in s
-    int             state;              // actual state
-    pthread_mutex_t mutex;              // mutex
-    struct timespec set_time_published; // last pubished set state
+    unsigned int    linecount;          // main valve + zones
+    struct breaker_line line[BREAKER_LINES]; // bit i of the GPIO values
+};
+
+struct breaker_actuator {               // Command hand-off
+    struct breaker_request *_Atomic group; // pending all-lines command
+    _Atomic uint64_t  sequence;         // submission order
+    _Atomic unsigned long superseded;   // replaced before being applied
+    int               efd;              // eventfd waking the actuator
+    struct {                            // anti-chatter admission
+	uint64_t      dwell_ns;         //  - min time between transitions
+	unsigned int  rate;             //  - max transitions per minute
+	unsigned long deferred;         //  - commands held back (actuator)
+	unsigned long suppressed;       //  - dropped while held back
+    } admission;
+    struct {                            // hit-and-hold drive
+	uint64_t      pull_in_ns;       //  - fully driven after closing
+	uint64_t      period_ns;        //  - then switched at this period
+	unsigned int  duty;             //  - percent on (0 = disabled)
+	double        power;            //  - coil power in W (0 = unknown)
+    } hold;
+    struct {                            // receive -> actuate (actuator only)
+	unsigned long count;
+	uint64_t      last_ns;
+	uint64_t      total_ns;
+	uint64_t      max_ns;
+	unsigned long hist[LATENCY_BUCKETS];
+    } latency;
+};
+
+struct breaker_scheduler {              // Timed/scheduled commands
+    char             *file;             // persistence (NULL = none)
+    int               tfd;              // timerfd (CLOCK_REALTIME)
+    int               efd;              // eventfd: current to be saved
+    pthread_mutex_t   lock;             // guards current, dirty
+    struct breaker_schedule current;    // pending transition
+    bool              dirty;            // current not saved yet
+};
+
+struct breaker_handover {               // Hot restart
+    char             *path;             // Unix socket (NULL = none)
+    int               lfd;              // listening socket
+    _Atomic int       conn;             // successor waiting, -1 = none
+};
+
+struct breaker_handover_msg {           // Sent with the line request fd
+    char              magic[sizeof(HANDOVER_MAGIC)];
+    char              chip[64];         // controller, as configured
+    uint64_t          flags;            // line flags
+    uint32_t          linecount;        // main valve + zones
+    uint32_t          pins[BREAKER_LINES];
 };
 
 struct breaker_mqtt {                   // MQTT
-    struct mqtt handler;
+    struct mqtt *handler;
     struct {
 	char *setter;
+	char *schedule;
+	char *pending;
 	char *publish;
 	char *error;
 	char *avail;
+	char *stats;
+	char *actuator;
+	char *coil;
+	char *ack;
+	char *group_setter;
+	char *group_ack;
     } topic;
 };
 
 struct breaker {
-    struct breaker_mqtt    mqtt;
-    struct breaker_control control;
+    struct breaker_mqtt     mqtt;
+    struct breaker_control  control;
+    struct breaker_actuator actuator;
+    struct breaker_scheduler scheduler;
+    struct breaker_handover handover;
     int reduced_latency;
 };
 
@@ -103,15 +249,25 @@ struct breaker {
 
 //== Global context ====================================================
 
+#ifndef MOSES_HUB
 char *__progname = "??";
+#endif
 
 struct breaker breaker =  {
     .mqtt = {
-	.handler        = MQTT_INITIALIZER(),
+	.handler        = &(struct mqtt) MQTT_INITIALIZER(),
 	.topic.setter   = "state/set",
+	.topic.schedule = "state/schedule",
+	.topic.pending  = "state/pending",
 	.topic.publish  = "state",
 	.topic.error    = "error",
 	.topic.avail    = "availability/breaker",
+	.topic.stats    = "stats/breaker",
+	.topic.actuator = "stats/breaker/actuator",
+	.topic.coil     = "stats/breaker/coil",
+	.topic.ack      = "state/ack",
+	.topic.group_setter = "all/state/set",
+	.topic.group_ack    = "all/state/ack",
     },
     .control = {
 	.ctrl.id              = NULL,
@@ -120,7 +276,27 @@ struct breaker breaker =  {
 	.pin.fd               = -1,
 	.pin.flags            = 0,
 	.pin.label            = "breaker-control",
+	.linecount            = 1,
+	.line[0].put          = NICKNAME,
+    },
+    .actuator = {
+	.efd                  = -1,
+	.hold.pull_in_ns      = 200000000,
+	.hold.period_ns       = 10000000,
+    },
+    .scheduler = {
+	.tfd                  = -1,
+	.efd                  = -1,
     },
+    .handover = {
+	.lfd                  = -1,
+	.conn                 = -1,
+    },
+};
+
+// Upper bounds of the latency histogram buckets (the last one is open)
+static const unsigned int latency_bounds_us[LATENCY_BUCKETS - 1] = {
+    10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000,
 };
 
 //== Mosquitto callbacks ===============================================
@@ -139,31 +315,34 @@ void on_message(struct mosquitto *mosq, void *obj, const struct mosquitto_messag
 int
 breaker_control_init(struct breaker_control *bc)
 {
-    if (pthread_mutex_init(&bc->mutex, NULL) != 0) {
-	LOG_ERRNO("failed to create mutex");
-	return -1;
-    }
-
     // State
-    bc->state = bc->pin.defval ? 1 : 0;
+    int      state = bc->pin.defval ? 1 : 0;
+    uint32_t pins[BREAKER_LINES];
+    uint64_t mask  = 0;
+    bc->line[0].pin = bc->pin.id;
+    for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	breaker_status_init(&bc->line[i].status, state);
+	pins[i] = bc->line[i].pin;
+	mask   |= 1ull << i;
+    }
 
-    // Single output line, driven to the default state on acquisition.
+    // Output lines (main valve and zones) in a single request, driven to
+    // the default state on acquisition.
     struct gpio_v2_line_request req = {
 	.config.flags     = GPIO_V2_LINE_FLAG_OUTPUT |  bc->pin.flags,
 	.config.num_attrs = 1,
 	.config.attrs     = {
-	    { .mask        = 1 << 0,
+	    { .mask        = mask,
 	      .attr.id     = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES,
-	      .attr.values = bc->state << 0
+	      .attr.values = state ? mask : 0
 	    },
 	}
     };
 
-    int ctrl_fd = gpio_open_line(bc->ctrl.id, bc->pin.id, bc->pin.label, &req);
-    if (ctrl_fd < 0) {
-	pthread_mutex_destroy(&bc->mutex);
+    int ctrl_fd = gpio_open_lines(bc->ctrl.id, pins, bc->linecount,
+				  bc->pin.label, &req);
+    if (ctrl_fd < 0)
 	return -1;
-    }
 
     bc->ctrl.fd = ctrl_fd;
     bc->pin.fd  = req.fd;
@@ -174,37 +353,332 @@ breaker_control_init(struct breaker_control *bc)
 //== MQTT ==============================================================
 
 int
-breaker_mqtt_init(struct breaker_mqtt *mqtt)
+breaker_mqtt_init(struct breaker_mqtt *mqtt, struct breaker_control *bc,
+		  struct mqtt *shared)
 {
     // Adjust prefix
     const char *prefix = mqtt_topic_prefix();
     MQTT_ADJUST_TOPIC(mqtt, setter,  prefix);
+    MQTT_ADJUST_TOPIC(mqtt, schedule, prefix);
+    MQTT_ADJUST_TOPIC(mqtt, pending, prefix);
     MQTT_ADJUST_TOPIC(mqtt, publish, prefix);
     MQTT_ADJUST_TOPIC(mqtt, error,   prefix);
     MQTT_ADJUST_TOPIC(mqtt, avail,   prefix);
+    MQTT_ADJUST_TOPIC(mqtt, stats,   prefix);
+    MQTT_ADJUST_TOPIC(mqtt, actuator, prefix);
+    MQTT_ADJUST_TOPIC(mqtt, coil,    prefix);
+    MQTT_ADJUST_TOPIC(mqtt, ack,     prefix);
+    MQTT_ADJUST_TOPIC(mqtt, group_setter, prefix);
+    MQTT_ADJUST_TOPIC(mqtt, group_ack,    prefix);
+
+    // Main valve on the historical topics, zones under zone/<name>/
+    bc->line[0].topic.setter  = mqtt->topic.setter;
+    bc->line[0].topic.publish = mqtt->topic.publish;
+    bc->line[0].topic.ack     = mqtt->topic.ack;
+    for (unsigned int i = 1 ; i < bc->linecount ; i++) {
+	struct breaker_line *line = &bc->line[i];
+	if ((asprintf(&line->topic.setter,  "%s/zone/%s/state/set",
+		      prefix, line->name) < 0) ||
+	    (asprintf(&line->topic.publish, "%s/zone/%s/state",
+		      prefix, line->name) < 0) ||
+	    (asprintf(&line->topic.ack,     "%s/zone/%s/state/ack",
+		      prefix, line->name) < 0))
+	    DIE(2, "failed to allocate MQTT topic string");
+    }
+
+    if (shared)
+	mqtt->handler = shared;
 
-    if (mqtt_enabled(&mqtt->handler)) {
+    if (mqtt_enabled(mqtt->handler)) {
 	LOG("MQTT state           : %s", mqtt->topic.publish);
 	LOG("MQTT set state       : %s", mqtt->topic.setter);
+	LOG("MQTT set state ack   : %s", mqtt->topic.ack);
+	LOG("MQTT schedule state  : %s", mqtt->topic.schedule);
+	LOG("MQTT pending state   : %s", mqtt->topic.pending);
 	LOG("MQTT error reporting : %s", mqtt->topic.error);
 	LOG("MQTT availability    : %s", mqtt->topic.avail);
+	LOG("MQTT statistics      : %s", mqtt->topic.stats);
+	LOG("MQTT actuator stats  : %s", mqtt->topic.actuator);
+	LOG("MQTT coil stats      : %s", mqtt->topic.coil);
+	if (bc->linecount > 1)
+	    LOG("MQTT set all lines   : %s", mqtt->topic.group_setter);
+	for (unsigned int i = 1 ; i < bc->linecount ; i++)
+	    LOG("MQTT zone %-10s : %s", bc->line[i].name,
+		bc->line[i].topic.setter);
     }
 
-    // Subscribe to the setter topic, advertise liveness and route incoming
-    // commands to on_message (0 = MQTT disabled).
-    int rc = mqtt_connect(&mqtt->handler, 1, &(struct mqtt_subscription) {
-	    .topic = mqtt->topic.setter,
-	    .qos   = 1,
-	}, mqtt->topic.avail, on_message);
+    // Incoming commands are routed to on_message: setters of the main
+    // valve, of all lines (with zones) and of each zone, and the schedule.
+    struct mqtt_subscription sub[BREAKER_LINES + 2];
+    unsigned int subcount = 0;
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	sub[subcount++] = (struct mqtt_subscription) {
+	    .topic = bc->line[i].topic.setter, .qos = 1,
+	    .on_message = on_message };
+    if (bc->linecount > 1)
+	sub[subcount++] = (struct mqtt_subscription) {
+	    .topic = mqtt->topic.group_setter, .qos = 1,
+	    .on_message = on_message };
+    sub[subcount++] = (struct mqtt_subscription) {
+	.topic = mqtt->topic.schedule, .qos = 1, .on_message = on_message };
+
+    // Within moses_hub the connection (and its availability) belongs to
+    // the hub: only register our subscriptions.
+    if (shared) {
+	for (unsigned int i = 0 ; i < subcount ; i++)
+	    if (mqtt_add_subscription(shared, &sub[i]) < 0)
+		return -1;
+	return 0;
+    }
+
+    // Connection-quality statistics
+    mqtt_set_stats(mqtt->handler, mqtt->topic.stats);
+
+    // Subscribe to the setter and schedule topics and advertise liveness
+    // (0 = MQTT disabled).
+    int rc = mqtt_connect(mqtt->handler, subcount, sub, mqtt->topic.avail,
+			  NULL);
     if (rc < 0) return -1;
     if (rc > 0) LOG("MQTT connection established");
 
     return 0;
 }
 
-int breaker_init(struct breaker *b) {
-    if ((breaker_control_init(&b->control) < 0) ||
-	(breaker_mqtt_init(&b->mqtt)       < 0))
+int
+breaker_actuator_init(struct breaker_actuator *ba)
+{
+    ba->efd = eventfd(0, EFD_CLOEXEC);
+    if (ba->efd < 0) {
+	LOG_ERRNO("failed to create actuator eventfd");
+	return -1;
+    }
+    return 0;
+}
+
+// Arm the timer for the pending transition, or disarm it (lock held)
+static void
+breaker_scheduler_arm(struct breaker_scheduler *bs)
+{
+    struct itimerspec its = { 0 };
+    if (bs->current.pending)
+	its.it_value.tv_sec = bs->current.at;
+    if (timerfd_settime(bs->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	LOG_ERRNO("failed to arm the schedule timer");
+}
+
+// Have the pending transition persisted, if asked to (lock held). The
+// file is written by the scheduler thread, not by the caller (usually
+// the MQTT network thread).
+static void
+breaker_scheduler_store(struct breaker_scheduler *bs)
+{
+    if (bs->file == NULL)
+	return;
+    bs->dirty = true;
+    uint64_t one = 1;
+    if (write(bs->efd, &one, sizeof(one)) < 0)
+	LOG_ERRNO("failed to wake the scheduler");
+}
+
+// Write the pending transition as last changed, if not saved yet
+static void
+breaker_scheduler_save(struct breaker_scheduler *bs)
+{
+    pthread_mutex_lock(&bs->lock);
+    struct breaker_schedule current = bs->current;
+    bool                    dirty   = bs->dirty;
+    bs->dirty = false;
+    pthread_mutex_unlock(&bs->lock);
+
+    if (dirty && (breaker_schedule_save(&current, bs->file) < 0))
+	LOG_ERRNO("failed to save schedule to %s", bs->file);
+}
+
+// Drop the pending transition (lock not held). true if there was one.
+static bool
+breaker_scheduler_cancel(struct breaker_scheduler *bs)
+{
+    pthread_mutex_lock(&bs->lock);
+    bool pending = bs->current.pending;
+    if (pending) {
+	bs->current.pending = false;
+	breaker_scheduler_store(bs);
+	breaker_scheduler_arm(bs);
+    }
+    pthread_mutex_unlock(&bs->lock);
+    return pending;
+}
+
+int
+breaker_scheduler_init(struct breaker_scheduler *bs)
+{
+    bs->tfd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC);
+    if (bs->tfd < 0) {
+	LOG_ERRNO("failed to create schedule timerfd");
+	return -1;
+    }
+    if (pthread_mutex_init(&bs->lock, NULL) != 0) {
+	LOG_ERRNO("failed to create schedule mutex");
+	return -1;
+    }
+    bs->efd = eventfd(0, EFD_CLOEXEC);
+    if (bs->efd < 0) {
+	LOG_ERRNO("failed to create schedule eventfd");
+	return -1;
+    }
+
+    // A transition that fell due while we were stopped fires at once
+    if (bs->file != NULL) {
+	if (breaker_schedule_load(&bs->current, bs->file) == 0) {
+	    LOG("schedule restored from %s", bs->file);
+	} else if (errno != ENOENT) {
+	    LOG_ERRNO("failed to restore schedule from %s", bs->file);
+	    return -1;
+	}
+    }
+    breaker_scheduler_arm(bs);
+    return 0;
+}
+
+// What the handover describes: the same lines, configured the same way
+static void
+breaker_handover_describe(struct breaker_control *bc,
+			  struct breaker_handover_msg *msg)
+{
+    memset(msg, 0, sizeof(*msg));       // compared as a whole, padding too
+    memcpy(msg->magic, HANDOVER_MAGIC, sizeof(msg->magic));
+    snprintf(msg->chip, sizeof(msg->chip), "%s", bc->ctrl.id);
+    msg->flags     = bc->pin.flags;
+    msg->linecount = bc->linecount;
+    msg->pins[0] = bc->pin.id;
+    for (unsigned int i = 1 ; i < bc->linecount ; i++)
+	msg->pins[i] = bc->line[i].pin;
+}
+
+// Take the lines over from a running instance, if one listens on the
+// handover socket: its line request fd (so the lines are never released,
+// and keep their values) and, from the lines, the current states.
+// 1 if taken over, 0 if there is no instance to take over from, -1 if it
+// failed.
+static int
+breaker_handover_take(struct breaker *b)
+{
+    struct breaker_control  *bc = &b->control;
+    struct breaker_handover *bh = &b->handover;
+
+    if (bh->path == NULL)
+	return 0;
+
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", bh->path);
+    int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	LOG_ERRNO("failed to create handover socket");
+	return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) {
+	int rc = ((errno == ENOENT) || (errno == ECONNREFUSED)) ? 0 : -1;
+	if (rc < 0)
+	    LOG_ERRNO("failed to reach the running instance (%s)", bh->path);
+	close(fd);
+	return rc;
+    }
+    struct timeval tv = { .tv_sec = HANDOVER_TIMEOUT };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    // Description and line request fd
+    struct breaker_handover_msg msg, want;
+    union {
+	char           buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+    } control;
+    struct iovec  iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh  = {
+	.msg_iov        = &iov,           .msg_iovlen     = 1,
+	.msg_control    = control.buf,    .msg_controllen = sizeof(control.buf),
+    };
+    int     lfd = -1;
+    memset(&msg, 0, sizeof(msg));
+    ssize_t len = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = (len > 0) ? CMSG_FIRSTHDR(&mh) : NULL;
+    if ((cmsg != NULL) && (cmsg->cmsg_level == SOL_SOCKET) &&
+	(cmsg->cmsg_type == SCM_RIGHTS) &&
+	(cmsg->cmsg_len == CMSG_LEN(sizeof(int))))
+	memcpy(&lfd, CMSG_DATA(cmsg), sizeof(int));
+
+    breaker_handover_describe(bc, &want);
+    uint64_t mask = (bc->linecount < 64) ? (1ull << bc->linecount) - 1 : ~0ull;
+    struct gpio_v2_line_values values = { .mask = mask };
+    const char *why = NULL;
+    if      (lfd < 0)
+	why = "no line request received";
+    else if (((size_t)len != sizeof(msg)) || memcmp(&msg, &want, sizeof(msg)))
+	why = "lines configured differently";
+    else if (ioctl(lfd, GPIO_V2_LINE_GET_VALUES_IOCTL, &values) < 0)
+	why = "line request not usable";
+
+    // Acknowledge (or refuse), then wait for the running instance to be
+    // gone, so its MQTT session has ended before ours starts.
+    char reply = why ? 'N' : 'Y';
+    send(fd, &reply, 1, MSG_NOSIGNAL);
+    if (why) {
+	LOG("refusing handover from the running instance: %s", why);
+	if (lfd >= 0) close(lfd);
+	close(fd);
+	return -1;
+    }
+    char eof;
+    if (recv(fd, &eof, 1, 0) != 0)
+	LOG("previous instance still running after handover");
+    close(fd);
+
+    // Running on the received lines
+    bc->pin.fd = lfd;
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	breaker_status_init(&bc->line[i].status, (values.bits >> i) & 1);
+    bc->line[0].pin = bc->pin.id;
+    LOG("lines taken over from the running instance");
+    return 1;
+}
+
+// Listen on the handover socket, for the next instance
+static int
+breaker_handover_init(struct breaker_handover *bh)
+{
+    if (bh->path == NULL)
+	return 0;
+
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    if (strlen(bh->path) >= sizeof(sun.sun_path)) {
+	LOG("handover socket path too long");
+	return -1;
+    }
+    strcpy(sun.sun_path, bh->path);
+
+    // Our predecessor (if any) is still bound to it, but not for long
+    unlink(bh->path);
+    bh->lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if ((bh->lfd < 0) ||
+	(bind(bh->lfd, (struct sockaddr *)&sun, sizeof(sun)) < 0) ||
+	(listen(bh->lfd, 1) < 0)) {
+	LOG_ERRNO("failed to listen on %s", bh->path);
+	return -1;
+    }
+    return 0;
+}
+
+int breaker_init(struct breaker *b, struct mqtt *shared) {
+    // Lines from the running instance, or requested afresh
+    int taken = breaker_handover_take(b);
+    if (taken < 0)
+	return -1;
+
+    // The mailbox must be ready before the first command can arrive
+    if (((taken == 0) && (breaker_control_init(&b->control) < 0)) ||
+	(breaker_actuator_init(&b->actuator)   < 0) ||
+	(breaker_scheduler_init(&b->scheduler) < 0) ||
+	(breaker_handover_init(&b->handover)   < 0) ||
+	(breaker_mqtt_init(&b->mqtt, &b->control, shared) < 0))
 	return -1;
     return 0;
 }
@@ -214,76 +688,96 @@ void
 breaker_control_destroy(struct breaker_control *bc) {
     if (bc->ctrl.fd >= 0) close(bc->ctrl.fd);
     if (bc->pin.fd  >= 0) close(bc->pin.fd );
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	free(atomic_exchange(&bc->line[i].mailbox, NULL));
+}
+
+void
+breaker_actuator_destroy(struct breaker_actuator *ba) {
+    if (ba->efd >= 0) close(ba->efd);
+    ba->efd = -1;
+    free(atomic_exchange(&ba->group, NULL));
+}
+
+void
+breaker_scheduler_destroy(struct breaker_scheduler *bs) {
+    if (bs->efd >= 0) {
+	breaker_scheduler_save(bs);     // last change, if still pending
+	close(bs->efd);
+    }
+    if (bs->tfd >= 0) close(bs->tfd);
+    bs->efd = -1;
+    bs->tfd = -1;
+}
+
+void
+breaker_handover_destroy(struct breaker_handover *bh) {
+    if (bh->lfd >= 0) close(bh->lfd);
+    bh->lfd = -1;
+    int conn = atomic_exchange(&bh->conn, -1);
+    if (conn >= 0) close(conn);
 }
 
 void
 breaker_mqtt_destroy(struct breaker_mqtt *mqtt) {
-    mqtt_destroy(&mqtt->handler);
+    mqtt_destroy(mqtt->handler);
 }
 
 void
 breaker_destroy(struct breaker *b) {
     breaker_mqtt_destroy(&b->mqtt);
+    breaker_handover_destroy(&b->handover);
+    breaker_scheduler_destroy(&b->scheduler);
+    breaker_actuator_destroy(&b->actuator);
     breaker_control_destroy(&b->control);
 }
 
 
+// Drive the lines of `mask` to `bits` with a single ioctl (so at the same
+// instant), then publish their new state. The actuation time is returned
+// in `actuated_ns`.
 int
-breaker_set_state(struct breaker *b, int state, bool publish) {
+breaker_set_lines(struct breaker *b, uint64_t mask, uint64_t bits,
+		  uint64_t *actuated_ns) {
     struct breaker_control *bc   = &b->control;
     struct breaker_mqtt    *mqtt = &b->mqtt;
 
-    // Sanity check
-    if (state < 0) {
-	errno = EINVAL;
-	return -1;
-    }
-
-    // Normalize
-    state = (state == 0) ? 0 : 1;
-	
-    // Set line
+    // Set lines
     struct gpio_v2_line_values values = {
-	.mask = 1     << 0,
-	.bits = state << 0,
+	.mask = mask,
+	.bits = bits & mask,
     };
-    int rc = ioctl(b->control.pin.fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+    int rc = ioctl(bc->pin.fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
     if (rc < 0) {
 	return -1;
     } 
-
-    // Save state
-    pthread_mutex_lock(&bc->mutex);
-    b->control.state = state;
-    pthread_mutex_unlock(&bc->mutex);
-    
-    // Publish new state
-    if (publish) {
-	pthread_mutex_lock(&bc->mutex);
-	clock_gettime(INTERVAL_CLOCK, &bc->set_time_published);
-	pthread_mutex_unlock(&bc->mutex);
-	
-	PUT_DATA(NICKNAME, "state=%d", state);
-	MQTT_PUBLISH(mqtt, publish, 1, false, "%d", state);
+    uint64_t ts = clock_ns(CLOCK_MONOTONIC);
+    uint64_t published = clock_ns(INTERVAL_CLOCK);
+
+    // Save and publish the new states. A state change is urgent: it goes
+    // out at once, with whatever readings were held back when batching.
+    for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	if (!(mask & (1ull << i)))
+	    continue;
+	struct breaker_line *line  = &bc->line[i];
+	int                  state = (bits >> i) & 1;
+	breaker_status_set(&line->status, state, ts);
+	breaker_status_published(&line->status, published);
+
+	PUT_DATA(line->put, "state=%d", state);
+	mqtt_publish_reading(mqtt->handler, line->topic.publish, 1, true, ts,
+			     "%d", state);
     }
 
     // Done
+    *actuated_ns = ts;
     return 0;
-    
 }
 
 
 int
-breaker_get_state(struct breaker *b) {
-    struct breaker_control *bc = &b->control;
-
-    int state;
-
-    pthread_mutex_lock(&bc->mutex);
-    state = bc->state;
-    pthread_mutex_unlock(&bc->mutex);
-
-    return state;
+breaker_get_state(struct breaker *b, int line) {
+    return breaker_status_get(&b->control.line[line].status, NULL);
 }
 
 
@@ -295,15 +789,24 @@ breaker_parse_config(int argc, char **argv, struct breaker *b)
 {
     struct breaker_control *bc = &b->control;
 
-    static const char *const shortopts = "+rP:L:M:A:I:h";
+    static const char *const shortopts = "+rP:Z:L:M:A:I:S:D:T:U:C:F:W:H:h";
     
     const struct option longopts[] = {
 	{ "reduced-latency", no_argument,	NULL, 'r' },
 	{ "pin",             required_argument, NULL, 'P' },
+	{ "zone",            required_argument, NULL, 'Z' },
 	{ "pin-label",       required_argument, NULL, 'L' },
 	{ "mode",            required_argument, NULL, 'M' },
 	{ "active",          required_argument, NULL, 'A' },
 	{ "idle-timeout",    required_argument, NULL, 'I' },
+	{ "schedule",        required_argument, NULL, 'S' },
+	{ "min-dwell",       required_argument, NULL, 'D' },
+	{ "max-transitions", required_argument, NULL, 'T' },
+	{ "pull-in",         required_argument, NULL, 'U' },
+	{ "hold-duty",       required_argument, NULL, 'C' },
+	{ "hold-frequency",  required_argument, NULL, 'F' },
+	{ "coil-power",      required_argument, NULL, 'W' },
+	{ "handover",        required_argument, NULL, 'H' },
 	{ "help",	     no_argument,	NULL, 'h' },
 	{ NULL },
     };
@@ -323,6 +826,32 @@ breaker_parse_config(int argc, char **argv, struct breaker *b)
 	    if (parse_gpio(optarg, &bc->ctrl.id, &bc->pin.id) < 0)
 		USAGE_DIE("invalid GPIO pin (chipset:pin)");
 	    break;
+	case 'Z': {
+	    // Same controller as the main valve: one multi-line request
+	    char                *chip;
+	    struct breaker_line *line = &bc->line[bc->linecount];
+	    if (bc->ctrl.id == NULL)
+		USAGE_DIE("zones must follow the main valve --pin");
+	    if (bc->linecount >= BREAKER_LINES)
+		USAGE_DIE("too many zones (at most %d)", BREAKER_LINES - 1);
+	    if (parse_gpio_zone(optarg, &line->name, &chip, &line->pin) < 0)
+		USAGE_DIE("invalid zone (name=chipset:pin)");
+	    if (strcmp(chip, bc->ctrl.id) != 0)
+		USAGE_DIE("zone %s is not on the main valve controller",
+			  line->name);
+	    free(chip);
+	    if (line->pin == bc->pin.id)
+		USAGE_DIE("zone %s uses the main valve pin", line->name);
+	    for (unsigned int i = 1 ; i < bc->linecount ; i++)
+		if ((bc->line[i].pin == line->pin) ||
+		    !strcmp(bc->line[i].name, line->name))
+		    USAGE_DIE("zone %s duplicates zone %s",
+			      line->name, bc->line[i].name);
+	    if (asprintf(&line->put, NICKNAME ",zone=%s", line->name) < 0)
+		DIE(2, "failed to allocate zone name");
+	    bc->linecount++;
+	    break;
+	}
 	case 'L':
 	    bc->pin.label = optarg;
 	    break;
@@ -338,15 +867,95 @@ breaker_parse_config(int argc, char **argv, struct breaker *b)
 	    if (parse_idle_timeout(optarg, &bc->idle_timeout) < 0)
 		USAGE_DIE("invalid idle timeout (1s .. 10w)");
 	    break;
+	case 'S':
+	    b->scheduler.file = optarg;
+	    break;
+	case 'D': {
+	    uint64_t v;
+	    if ((parse_us_period(optarg, &v) < 0) || (v > 3600000000ull))
+		USAGE_DIE("invalid minimum dwell time (0 .. 1h)");
+	    b->actuator.admission.dwell_ns = v * 1000;
+	    break;
+	}
+	case 'T': {
+	    char *end;
+	    errno = 0;
+	    unsigned long v = strtoul(optarg, &end, 10);
+	    if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+		(v < 1) || (v > BREAKER_RATE_MAX))
+		USAGE_DIE("invalid transitions per minute (1 .. %d)",
+			  BREAKER_RATE_MAX);
+	    b->actuator.admission.rate = v;
+	    break;
+	}
+	case 'U': {
+	    uint64_t v;
+	    if ((parse_us_period(optarg, &v) < 0) || (v < 1000) ||
+		(v > 10000000))
+		USAGE_DIE("invalid pull-in time (1ms .. 10s)");
+	    b->actuator.hold.pull_in_ns = v * 1000;
+	    break;
+	}
+	case 'C': {
+	    char *end;
+	    errno = 0;
+	    unsigned long v = strtoul(optarg, &end, 10);
+	    if ((*end == '%') && (end[1] == '\0'))
+		end++;
+	    if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+		(v < 1) || (v > 99))
+		USAGE_DIE("invalid hold duty cycle (1%% .. 99%%)");
+	    b->actuator.hold.duty = v;
+	    break;
+	}
+	case 'F': {
+	    char *end;
+	    errno = 0;
+	    unsigned long v = strtoul(optarg, &end, 10);
+	    if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+		(v < 1) || (v > 1000))
+		USAGE_DIE("invalid hold frequency (1 .. 1000 Hz)");
+	    b->actuator.hold.period_ns = 1000000000ull / v;
+	    break;
+	}
+	case 'W': {
+	    char *end;
+	    errno = 0;
+	    double v = strtod(optarg, &end);
+	    if ((errno != 0) || (end == optarg) || (*end != '\0') ||
+		!(v > 0) || (v > 1000))
+		USAGE_DIE("invalid coil power (0 .. 1000 W)");
+	    b->actuator.hold.power = v;
+	    break;
+	}
+	case 'H':
+#ifdef MOSES_HUB
+	    // Handing over exits the process, and with it the other
+	    // modules and their shared MQTT connection
+	    USAGE_DIE("--handover is not available within moses_hub");
+#else
+	    b->handover.path = optarg;
+#endif
+	    break;
 	case 'h':
 	    printf("%s [opts]\n", __progname);
 	    printf("  -r, --reduced-latency            try to reduce latency\n");
-	    printf("  -P, --pin=CTRL:PIN               gpio pulse counting pin\n");
+	    printf("  -P, --pin=CTRL:PIN               gpio main valve pin\n");
+	    printf("  -Z, --zone=NAME=CTRL:PIN         gpio zone valve pin (repeatable)\n");
 	    printf("  -L, --pin-label=STRING           gpio pin label\n");
 	    printf("  -M, --mode=as-is|push-pull|      gpio mode\n");
 	    printf("             open-drain|open-source\n");
 	    printf("  -A, --active=low|high            gpio active state\n");
 	    printf("  -I, --idle-timeout=SEC           notify state if no command send\n");
+	    printf("  -S, --schedule=FILE              keep scheduled commands in FILE\n");
+	    printf("  -D, --min-dwell=TIME             minimum time between transitions\n");
+	    printf("  -T, --max-transitions=N          transitions per minute, at most\n");
+	    printf("  -U, --pull-in=TIME               coil fully driven after closing\n");
+	    printf("                                   (default 200ms, with -C)\n");
+	    printf("  -C, --hold-duty=PERCENT          then coil switched with this duty\n");
+	    printf("  -F, --hold-frequency=HZ          ... at this frequency (default 100)\n");
+	    printf("  -W, --coil-power=WATTS           coil power, for the energy used\n");
+	    printf("  -H, --handover=SOCKET            hot restart through SOCKET\n");
 	    printf("\n");
 	    exit(0);
 	default:
@@ -366,28 +975,673 @@ breaker_parse_config(int argc, char **argv, struct breaker *b)
 
 
 
-int
-main(int argc, char **argv)
+//======================================================================
+
+// Heartbeat: re-publish the current state of each line every idle
+// timeout, unless a set command published it in the meantime.
+__attribute__((noreturn))
+static void * breaker_heartbeat_task(void *parameters) {
+    struct breaker         *b    = parameters;
+    struct breaker_control *bc   = &b->control;
+    struct breaker_mqtt    *mqtt = &b->mqtt;
+
+    // Polling
+    uint64_t next_polling[BREAKER_LINES];
+    uint64_t now = clock_ns(INTERVAL_CLOCK);
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	next_polling[i] = now;
+
+    while (1) {
+	uint64_t wakeup = UINT64_MAX;
+	now = clock_ns(INTERVAL_CLOCK);
+	for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	    struct breaker_line *line = &bc->line[i];
+	    if (next_polling[i] <= now) {
+		// Check if a set changed was already published
+		uint64_t published =
+		    breaker_status_last_published(&line->status);
+		if (next_polling[i] < published) {
+		    next_polling[i] = published;
+		} else {
+		    // Current state
+		    int state = breaker_get_state(b, i);
+		    uint64_t ts = clock_ns(CLOCK_MONOTONIC);
+
+		    // Publish
+		    PUT_DATA(line->put, "state=%d", state);
+		    mqtt_publish_reading(mqtt->handler, line->topic.publish,
+					 1, false, ts, "%d", state);
+		}
+		next_polling[i] += bc->idle_timeout * 1000000000ull;
+	    }
+	    if (next_polling[i] < wakeup)
+		wakeup = next_polling[i];
+	}
+
+	// Next	polling
+	struct timespec deadline = {
+	    .tv_sec  = wakeup / 1000000000ull,
+	    .tv_nsec = wakeup % 1000000000ull,
+	};
+	sleep_until(INTERVAL_CLOCK, &deadline);
+    }
+}
+
+
+// Latency instrumentation (actuator thread)
+static void
+breaker_actuator_account(struct breaker *b, uint64_t latency)
 {
-    __progname = basename(argv[0]);
+    struct breaker_actuator *ba   = &b->actuator;
 
-    //Shortcuts
-    struct breaker_control *bc = &breaker.control;
-    struct breaker_mqtt  *mqtt = &breaker.mqtt;
+    unsigned int bucket = 0;
+    while ((bucket < LATENCY_BUCKETS - 1) &&
+	   (latency > latency_bounds_us[bucket] * 1000ull))
+	bucket++;
 
-    // Configuration
-    mqtt_config_from_env(&breaker.mqtt.handler);
-    breaker_parse_config(argc, argv, &breaker);
-    
-    // Initialization
-    if (breaker_init(&breaker) < 0)
-	DIE(2, "failed to initialize");
-    
-    // Reducing latency
-    if (breaker.reduced_latency)
-	reduced_latency();
+    ba->latency.count++;
+    ba->latency.last_ns   = latency;
+    ba->latency.total_ns += latency;
+    if (latency > ba->latency.max_ns)
+	ba->latency.max_ns = latency;
+    ba->latency.hist[bucket]++;
+
+    PUT_DATA(NICKNAME, "actuate_us=%0.1f", latency / 1e3);
+}
+
+// Publication of the instrumentation and admission counters (actuator
+// thread)
+static void
+breaker_actuator_publish(struct breaker *b)
+{
+    struct breaker_actuator *ba   = &b->actuator;
+    struct breaker_mqtt     *mqtt = &b->mqtt;
+
+    MQTT_TOPIC_ENABLED(mqtt, actuator) {
+	char   *json = NULL;
+	size_t  size = 0;
+	FILE   *f    = open_memstream(&json, &size);
+	if (f == NULL)
+	    return;
+	fprintf(f, "{ \"commands\": %lu, \"superseded\": %lu, "
+		   "\"deferred\": %lu, \"suppressed\": %lu, "
+		   "\"last_us\": %.1f, \"mean_us\": %.1f, \"max_us\": %.1f, ",
+		ba->latency.count, atomic_load(&ba->superseded),
+		ba->admission.deferred, ba->admission.suppressed,
+		ba->latency.last_ns / 1e3,
+		ba->latency.count
+		    ? ba->latency.total_ns / 1e3 / ba->latency.count : 0.0,
+		ba->latency.max_ns / 1e3);
+	fprintf(f, "\"bounds_us\": [");
+	for (int i = 0 ; i < LATENCY_BUCKETS - 1 ; i++)
+	    fprintf(f, "%s%u", i ? ", " : " ", latency_bounds_us[i]);
+	fprintf(f, " ], \"hist\": [");
+	for (int i = 0 ; i < LATENCY_BUCKETS ; i++)
+	    fprintf(f, "%s%lu", i ? ", " : " ", ba->latency.hist[i]);
+	fprintf(f, " ] }");
+	if (fclose(f) == 0)
+	    MQTT_PUBLISH(mqtt, actuator, 0, true, "%s", json);
+	free(json);
+    }
+}
+
+
+// Publication of the coil usage of each line, up to now for an energised
+// one: energised and actually driven time (less with hit-and-hold) and,
+// knowing the coil power, the energy used and saved (actuator thread).
+static void
+breaker_coil_publish(struct breaker *b)
+{
+    struct breaker_control  *bc   = &b->control;
+    struct breaker_actuator *ba   = &b->actuator;
+    struct breaker_mqtt     *mqtt = &b->mqtt;
+
+    MQTT_TOPIC_ENABLED(mqtt, coil) {
+	char   *json = NULL;
+	size_t  size = 0;
+	FILE   *f    = open_memstream(&json, &size);
+	if (f == NULL)
+	    return;
+	uint64_t now = clock_ns(CLOCK_MONOTONIC);
+	fprintf(f, "{");
+	for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	    struct breaker_line *line = &bc->line[i];
+	    uint64_t since     = line->hold.since_ns;
+	    uint64_t energised = line->coil.energised_ns + (since ? now - since
+							             : 0);
+	    uint64_t driven    = line->coil.driven_ns
+		               + breaker_hold_driven_ns(&line->hold, now);
+	    fprintf(f, "%s\"%s\": { \"energised\": %s, \"closures\": %lu, "
+		       "\"energised_s\": %.3f, \"driven_s\": %.3f",
+		    i ? ", " : " ", i ? line->name : "main",
+		    since ? "true" : "false", line->coil.closures,
+		    energised / 1e9, driven / 1e9);
+	    if (ba->hold.power > 0)
+		fprintf(f, ", \"energy_wh\": %.3f, \"saved_wh\": %.3f",
+			ba->hold.power * driven / 3600e9,
+			ba->hold.power * (energised - driven) / 3600e9);
+	    fprintf(f, " }");
+	}
+	fprintf(f, " }");
+	if (fclose(f) == 0)
+	    MQTT_PUBLISH(mqtt, coil, 0, true, "%s", json);
+	free(json);
+    }
+}
 
 
+// The lines of `mask` were driven to `bits` at `now`: account their coils
+// being energised or not (actuator thread).
+static void
+breaker_coil_account(struct breaker *b, uint64_t mask, uint64_t bits,
+		     uint64_t now)
+{
+    struct breaker_control *bc      = &b->control;
+    bool                    changed = false;
+
+    for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	struct breaker_line *line = &bc->line[i];
+	if (!(mask & (1ull << i)))
+	    continue;
+	if ((bits >> i) & 1) {
+	    line->level = 1;
+	    if (line->hold.since_ns == 0) {
+		breaker_hold_start(&line->hold, now);
+		line->coil.closures++;
+		changed = true;
+	    }
+	} else if (line->hold.since_ns) {
+	    line->coil.energised_ns += now - line->hold.since_ns;
+	    line->coil.driven_ns    += breaker_hold_driven_ns(&line->hold, now);
+	    breaker_hold_stop(&line->hold);
+	    changed = true;
+	}
+    }
+    if (changed)
+	breaker_coil_publish(b);
+}
+
+
+// Hit-and-hold: switch the energised coils due at `now`, all at once.
+// When to be called next, 0 = never (actuator thread).
+static uint64_t
+breaker_hold_step(struct breaker *b, uint64_t now)
+{
+    struct breaker_control *bc = &b->control;
+
+    if (b->actuator.hold.duty == 0)
+	return 0;
+
+    uint64_t mask = 0, bits = 0, next = 0;
+    for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	struct breaker_line *line = &bc->line[i];
+	if (line->hold.since_ns == 0)
+	    continue;
+	uint64_t until;
+	int      level = breaker_hold_level(&line->hold, now, &until);
+	if (level != line->level) {
+	    mask |= 1ull << i;
+	    if (level)
+		bits |= 1ull << i;
+	}
+	if ((until != UINT64_MAX) && ((next == 0) || (until < next)))
+	    next = until;
+    }
+    if (mask == 0)
+	return next;
+
+    // Failing to switch leaves the coils as they are until the next edge
+    struct gpio_v2_line_values values = { .mask = mask, .bits = bits };
+    if (ioctl(bc->pin.fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
+	LOG_ERRNO("failed to switch the held coils");
+	PUT_FAIL(NICKNAME, "hold");
+	return next;
+    }
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	if (mask & (1ull << i))
+	    bc->line[i].level = (bits >> i) & 1;
+    return next;
+}
+
+
+// Acknowledge a command: its id (and source and reason, if given), what
+// became of it, the resulting state (of each line, by zone name, for an
+// all-lines command), and when it was received and applied (wall-clock
+// seconds; the actuation time only for an applied command).
+static void
+breaker_acknowledge(struct breaker *b, const struct breaker_request *req,
+		    const char *result, uint64_t actuated_ns)
+{
+    struct breaker_control *bc   = &b->control;
+    struct breaker_mqtt    *mqtt = &b->mqtt;
+    const struct breaker_command *cmd = &req->command;
+    const char *topic = (req->line < 0) ? mqtt->topic.group_ack
+	                                : bc->line[req->line].topic.ack;
+
+    if (mqtt->handler->mosq && topic) {
+	char   *json = NULL;
+	size_t  size = 0;
+	FILE   *f    = open_memstream(&json, &size);
+	if (f == NULL)
+	    return;
+	if (cmd->id[0]) fprintf(f, "{ \"id\": \"%s\", ", cmd->id);
+	else            fprintf(f, "{ \"id\": null, ");
+	// No quote nor backslash in there, see breaker_parse_command()
+	if (cmd->source[0]) fprintf(f, "\"source\": \"%s\", ", cmd->source);
+	if (cmd->reason[0]) fprintf(f, "\"reason\": \"%s\", ", cmd->reason);
+	fprintf(f, "\"result\": \"%s\", ", result);
+	if (req->line >= 0) {
+	    fprintf(f, "\"state\": %d, ", breaker_get_state(b, req->line));
+	} else {
+	    fprintf(f, "\"state\": {");
+	    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+		fprintf(f, "%s\"%s\": %d", i ? ", " : " ",
+			i ? bc->line[i].name : "main", breaker_get_state(b, i));
+	    fprintf(f, " }, ");
+	}
+	if (cmd->has_ts) fprintf(f, "\"client_ts\": %.6f, ", cmd->ts);
+	fprintf(f, "\"received\": %.6f",
+		clock_monotonic_to_realtime(req->received_ns) / 1e9);
+	if (actuated_ns)
+	    fprintf(f, ", \"actuated\": %.6f, \"latency_us\": %.1f",
+		    clock_monotonic_to_realtime(actuated_ns) / 1e9,
+		    (actuated_ns - req->received_ns) / 1e3);
+	fprintf(f, " }");
+	if (fclose(f) == 0)
+	    mqtt_publish(mqtt->handler, topic, 1, false, "%s", json);
+	free(json);
+    }
+}
+
+
+// Hand the lines over to the next instance, connected on `conn` (actuator
+// thread, so no line is driven meanwhile). Once it has them, leave, ending
+// the MQTT session cleanly (no last will): the lines stay requested
+// through the new instance, at their current values.
+static void
+breaker_handover_give(struct breaker *b, int conn)
+{
+    struct breaker_control *bc = &b->control;
+
+    // The next instance reads the states from the lines: held coils are
+    // fully driven for it (and until the next edge if it fails).
+    uint64_t held = 0;
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	if (bc->line[i].hold.since_ns)
+	    held |= 1ull << i;
+    struct gpio_v2_line_values values = { .mask = held, .bits = held };
+    if (held && (ioctl(bc->pin.fd, GPIO_V2_LINE_SET_VALUES_IOCTL,
+		       &values) < 0)) {
+	LOG_ERRNO("failed to drive the held coils for the handover");
+	close(conn);
+	return;
+    }
+    for (unsigned int i = 0 ; i < bc->linecount ; i++)
+	if (held & (1ull << i))
+	    bc->line[i].level = 1;
+
+    struct breaker_handover_msg msg;
+    breaker_handover_describe(bc, &msg);
+    union {
+	char           buf[CMSG_SPACE(sizeof(int))];
+	struct cmsghdr align;
+    } control = { 0 };
+    struct iovec  iov = { .iov_base = &msg, .iov_len = sizeof(msg) };
+    struct msghdr mh  = {
+	.msg_iov        = &iov,           .msg_iovlen     = 1,
+	.msg_control    = control.buf,    .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&mh);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &bc->pin.fd, sizeof(int));
+
+    // The next instance restores the schedule once it has the lines
+    breaker_scheduler_save(&b->scheduler);
+
+    struct timeval tv = { .tv_sec = HANDOVER_TIMEOUT };
+    setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    char reply = 0;
+    if ((sendmsg(conn, &mh, MSG_NOSIGNAL) != sizeof(msg)) ||
+	(recv(conn, &reply, 1, 0) != 1) || (reply != 'Y')) {
+	LOG("handover to the next instance failed, keeping the lines");
+	close(conn);
+	return;
+    }
+
+    LOG("lines handed over to the next instance, leaving");
+    breaker_mqtt_destroy(&b->mqtt);
+    exit(0);
+}
+
+
+// A command is done with on one of its lines: applied (at `actuated`),
+// failed, or replaced by a newer one (actuated = 0). Once done with on all
+// of them it is acknowledged and released. True if it was.
+static bool
+breaker_actuator_release(struct breaker *b, struct breaker_request *r,
+			 int rc, uint64_t actuated)
+{
+    struct breaker_actuator *ba = &b->actuator;
+
+    if      (rc < 0)   r->failed      = true;
+    else if (actuated) r->actuated_ns = actuated;
+    if (--r->lines > 0)
+	return false;
+
+    if (r->failed) {
+	breaker_acknowledge(b, r, "failed", 0);
+    } else if (r->actuated_ns) {
+	breaker_acknowledge(b, r, "ok", r->actuated_ns);
+	breaker_actuator_account(b, r->actuated_ns - r->received_ns);
+    } else if (r->deferred) {
+	ba->admission.suppressed++;
+	breaker_acknowledge(b, r, "suppressed", 0);
+    } else {
+	atomic_fetch_add(&ba->superseded, 1);
+	breaker_acknowledge(b, r, "superseded", 0);
+    }
+    free(r);
+    return true;
+}
+
+
+// Actuator: apply the commands handed over by on_message. Everything
+// pending is applied at once: the all-lines command, overridden on the
+// lines that got a more recent command of their own.
+//
+// Admission: a transition that comes too soon after the previous one, or
+// over the per-minute cap, is held back (closing always goes through).
+// Only the latest command of a line is held, and it is applied as soon
+// as it is admitted, unless a newer one replaces it first.
+__attribute__((noreturn))
+static void * breaker_actuator_task(void *parameters) {
+    struct breaker          *b    = parameters;
+    struct breaker_control  *bc   = &b->control;
+    struct breaker_actuator *ba   = &b->actuator;
+    struct breaker_mqtt     *mqtt = &b->mqtt;
+
+    struct breaker_request *held[BREAKER_LINES] = { 0 };
+    uint64_t deadline = 0;              // next admission, 0 = none held
+    uint64_t switching = 0;             // next hold edge, 0 = none
+    uint64_t closed = 0;                // lines closed at start
+    for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	bc->line[i].admission = (struct breaker_admission) {
+	    .dwell_ns = ba->admission.dwell_ns,
+	    .rate     = ba->admission.rate,
+	};
+	bc->line[i].hold = (struct breaker_hold) {
+	    .pull_in_ns = ba->hold.pull_in_ns,
+	    .period_ns  = ba->hold.period_ns,
+	    .duty       = ba->hold.duty,
+	};
+	if (breaker_get_state(b, i))
+	    closed |= 1ull << i;
+    }
+    uint64_t all = (bc->linecount < 64) ? (1ull << bc->linecount) - 1 : ~0ull;
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    breaker_coil_account(b, all, closed, now);
+    switching = breaker_hold_step(b, now);
+
+    while (1) {
+	// New commands, a held one becoming admissible, or a hold edge
+	struct pollfd    pfd  = { .fd = ba->efd, .events = POLLIN };
+	struct timespec  ts, *timeout = NULL;
+	uint64_t         wake = switching;
+	if (deadline && ((wake == 0) || (deadline < wake)))
+	    wake = deadline;
+	if (wake) {
+	    now = clock_ns(CLOCK_MONOTONIC);
+	    uint64_t delay = (wake > now) ? wake - now : 0;
+	    ts = (struct timespec) { .tv_sec  = delay / 1000000000ull,
+		                     .tv_nsec = delay % 1000000000ull };
+	    timeout = &ts;
+	}
+	int n = ppoll(&pfd, 1, timeout, NULL);
+	switching = breaker_hold_step(b, clock_ns(CLOCK_MONOTONIC));
+	if (n < 0) {
+	    if (errno != EINTR)
+		LOG_ERRNO("failed to wait for commands");
+	    continue;
+	}
+	uint64_t count;
+	if ((n > 0) && (read(ba->efd, &count, sizeof(count)) < 0)) {
+	    LOG_ERRNO("failed to read the actuator wake-up");
+	    continue;
+	}
+
+	// Next instance asking for the lines
+	int conn = atomic_exchange(&b->handover.conn, -1);
+	if (conn >= 0)
+	    breaker_handover_give(b, conn);
+
+	// Latest commands (earlier ones were superseded), and which one
+	// wins on each line: it replaces the command held there, if any
+	bool done = false;
+	struct breaker_request *group = atomic_exchange(&ba->group, NULL);
+	struct breaker_request *req[BREAKER_LINES];
+	for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	    req[i] = atomic_exchange(&bc->line[i].mailbox, NULL);
+	    struct breaker_request *winner =
+		(req[i] && (!group || (req[i]->seq > group->seq)))
+		? req[i] : group;
+	    if (winner == NULL)
+		continue;
+	    if (held[i])
+		done |= breaker_actuator_release(b, held[i], 0, 0);
+	    held[i] = winner;
+	    winner->lines++;
+	}
+	for (unsigned int i = 0 ; i <= bc->linecount ; i++) {
+	    struct breaker_request *r = (i < bc->linecount) ? req[i] : group;
+	    if (r && (r->lines == 0)) {
+		r->lines = 1;
+		done |= breaker_actuator_release(b, r, 0, 0);
+	    }
+	}
+
+	// Admitted lines: no transition, or within the anti-chatter limits
+	now = clock_ns(CLOCK_MONOTONIC);
+	uint64_t mask = 0, bits = 0, transitions = 0;
+	deadline = 0;
+	for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	    if (held[i] == NULL)
+		continue;
+	    int      state = held[i]->command.state;
+	    uint64_t until;
+	    if (state != breaker_get_state(b, i)) {
+		if (!breaker_admission_allows(&bc->line[i].admission,
+					      state, now, &until)) {
+		    if (!held[i]->deferred) {
+			held[i]->deferred = true;
+			ba->admission.deferred++;
+		    }
+		    if ((deadline == 0) || (until < deadline))
+			deadline = until;
+		    continue;
+		}
+		transitions |= 1ull << i;
+	    }
+	    mask |= 1ull << i;
+	    if (state)
+		bits |= 1ull << i;
+	}
+	if (mask == 0) {
+	    if (done)
+		breaker_actuator_publish(b);
+	    continue;
+	}
+
+	// Set breaker state, all lines at once
+	uint64_t actuated = 0;
+	int rc = breaker_set_lines(b, mask, bits, &actuated);
+	if (rc < 0) {
+	    LOG("failed to set breaker state!");
+	    PUT_FAIL(NICKNAME, "set-state");
+	    MQTT_ERROR(mqtt, error, 2, NICKNAME, "critical",
+		       "failed to set breaker state");
+	} else {
+	    MQTT_ERROR_CLEAR(mqtt, error, NICKNAME, "critical");
+	    breaker_coil_account(b, mask, bits, actuated);
+	    switching = breaker_hold_step(b, actuated);
+	}
+
+	// Acknowledge and account each command
+	for (unsigned int i = 0 ; i < bc->linecount ; i++) {
+	    if (!(mask & (1ull << i)))
+		continue;
+	    if ((rc == 0) && (transitions & (1ull << i)))
+		breaker_admission_record(&bc->line[i].admission, actuated);
+	    breaker_actuator_release(b, held[i], rc, actuated);
+	    held[i] = NULL;
+	}
+	breaker_actuator_publish(b);
+    }
+}
+
+
+// Hand a command for `line` (-1 = all lines) over to the actuator (any
+// thread). Only the latest one of each line matters: a command not yet
+// applied is superseded (and acknowledged as such).
+static void
+breaker_actuator_submit(struct breaker *b, int line,
+			const struct breaker_command *cmd, uint64_t received)
+{
+    struct breaker_actuator *ba = &b->actuator;
+    struct breaker_request *_Atomic *slot =
+	(line < 0) ? &ba->group : &b->control.line[line].mailbox;
+
+    struct breaker_request *req = malloc(sizeof(*req));
+    if (req == NULL) {
+	LOG_ERRNO("failed to hand over command");
+	return;
+    }
+    *req = (struct breaker_request) {
+	.command     = *cmd,
+	.line        = line,
+	.seq         = atomic_fetch_add(&ba->sequence, 1) + 1,
+	.received_ns = received,
+    };
+
+    struct breaker_request *previous = atomic_exchange(slot, req);
+    if (previous != NULL) {
+	atomic_fetch_add(&ba->superseded, 1);
+	breaker_acknowledge(b, previous, "superseded", 0);
+	free(previous);
+    }
+    uint64_t one = 1;
+    if (write(ba->efd, &one, sizeof(one)) < 0)
+	LOG_ERRNO("failed to wake the actuator");
+}
+
+
+// Announce the pending transition (retained)
+static void
+breaker_scheduler_announce(struct breaker *b)
+{
+    struct breaker_scheduler *bs   = &b->scheduler;
+    struct breaker_mqtt      *mqtt = &b->mqtt;
+
+    pthread_mutex_lock(&bs->lock);
+    struct breaker_schedule current = bs->current;
+    pthread_mutex_unlock(&bs->lock);
+
+    if (current.pending) {
+	PUT_DATA(NICKNAME, "pending=%d,at=%lld",
+		 current.state, (long long)current.at);
+	MQTT_PUBLISH(mqtt, pending, 1, true,
+		     "{ \"pending\": true, \"state\": %d, \"at\": %lld }",
+		     current.state, (long long)current.at);
+    } else {
+	MQTT_PUBLISH(mqtt, pending, 1, true, "{ \"pending\": false }");
+    }
+}
+
+
+// Scheduler: apply the pending transition when its timer fires, and
+// persist the changes made to it.
+__attribute__((noreturn))
+static void * breaker_scheduler_task(void *parameters) {
+    struct breaker           *b  = parameters;
+    struct breaker_scheduler *bs = &b->scheduler;
+
+    while (1) {
+	struct pollfd pfd[] = {
+	    { .fd = bs->tfd, .events = POLLIN },
+	    { .fd = bs->efd, .events = POLLIN },
+	};
+	if (poll(pfd, __arraycount(pfd), -1) < 0) {
+	    if (errno != EINTR)
+		LOG_ERRNO("failed to wait for the schedule timer");
+	    continue;
+	}
+	uint64_t count;
+	if ((pfd[1].revents & POLLIN) &&
+	    (read(bs->efd, &count, sizeof(count)) < 0))
+	    LOG_ERRNO("failed to read the scheduler wake-up");
+	if (!(pfd[0].revents & POLLIN) ||
+	    (read(bs->tfd, &count, sizeof(count)) < 0)) {
+	    breaker_scheduler_save(bs);
+	    continue;
+	}
+
+	// Replaced or cancelled in the meantime?
+	pthread_mutex_lock(&bs->lock);
+	int state = -1;
+	if (bs->current.pending && (bs->current.at <= time(NULL))) {
+	    state = bs->current.state;
+	    bs->current.pending = false;
+	    breaker_scheduler_store(bs);
+	    breaker_scheduler_arm(bs);
+	}
+	pthread_mutex_unlock(&bs->lock);
+	breaker_scheduler_save(bs);
+	if (state < 0)
+	    continue;
+
+	LOG("scheduled state %d due", state);
+	struct breaker_command cmd = { .state = state };
+	breaker_actuator_submit(b, 0, &cmd, clock_ns(CLOCK_MONOTONIC));
+	breaker_scheduler_announce(b);
+    }
+}
+
+
+// Handover: wait for the next instance, and pass it to the actuator,
+// which is the one to hand the lines over.
+__attribute__((noreturn))
+static void * breaker_handover_task(void *parameters) {
+    struct breaker          *b  = parameters;
+    struct breaker_handover *bh = &b->handover;
+
+    while (1) {
+	int conn = accept4(bh->lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (conn < 0) {
+	    if (errno != EINTR)
+		LOG_ERRNO("failed to accept handover");
+	    sleep(1);
+	    continue;
+	}
+	LOG("next instance asking for the lines");
+	int previous = atomic_exchange(&bh->conn, conn);
+	if (previous >= 0)
+	    close(previous);
+	uint64_t one = 1;
+	if (write(b->actuator.efd, &one, sizeof(one)) < 0)
+	    LOG_ERRNO("failed to wake the actuator");
+    }
+}
+
+
+static pthread_t thr_actuator;
+static pthread_t thr_heartbeat;
+static pthread_t thr_scheduler;
+static pthread_t thr_handover;
+
+static int
+breaker_start(void)
+{
     /* At this point the client is connected to the network socket, but may not
      * have completed CONNECT/CONNACK.
      * It is fairly safe to start queuing messages at this point, but if you
@@ -396,41 +1650,108 @@ main(int argc, char **argv)
      * In this case we know it is 1 second before we start publishing.
      */
 
-    // Without an idle timeout we never re-publish periodically: the state is
-    // only published when it changes (from the MQTT callback thread), so just
-    // idle here instead of looping.
-    if (breaker.control.idle_timeout == 0) {
-	for (;;) pause();
+    // Actuator, at the highest real-time priority when asked to reduce
+    // latency (the heartbeat is not urgent: it keeps the inherited one).
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (breaker.reduced_latency) {
+	struct sched_param sp = {
+	    .sched_priority = sched_get_priority_max(SCHED_FIFO),
+	};
+	pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	pthread_attr_setschedparam(&attr, &sp);
+    }
+    int rc = pthread_create(&thr_actuator, &attr,
+			    breaker_actuator_task, &breaker);
+    if ((rc == EPERM) && breaker.reduced_latency) {
+	LOG("no permission for a real-time actuator thread, using default");
+	rc = pthread_create(&thr_actuator, NULL,
+			    breaker_actuator_task, &breaker);
+    }
+    pthread_attr_destroy(&attr);
+    if (rc != 0) {
+	LOG("failed to start actuator thread");
+	return -1;
     }
 
-    // Polling
-    struct timespec next_polling;
-    clock_gettime(INTERVAL_CLOCK, &next_polling);
-    while (1) {
-	// Check if a set changed was already published
-	pthread_mutex_lock(&bc->mutex);
-	if (timespeccmp(&next_polling, &bc->set_time_published, <)) {
-	    next_polling = bc->set_time_published;
-	    pthread_mutex_unlock(&bc->mutex);
-	    goto sleep;
-	}
-	pthread_mutex_unlock(&bc->mutex);
+    // Scheduled transitions, then what is pending (if anything)
+    if (pthread_create(&thr_scheduler, NULL,
+		       breaker_scheduler_task, &breaker) != 0) {
+	LOG("failed to start scheduler thread");
+	return -1;
+    }
+    breaker_scheduler_announce(&breaker);
 
-	// Current state
-	int state = breaker_get_state(&breaker);
-	
-	// Publish
-	PUT_DATA(NICKNAME, "state=%d", state);
-	MQTT_PUBLISH(mqtt, publish, 1, false, "%d", state);
+    // Next instance, when hot restarting
+    if ((breaker.handover.lfd >= 0) &&
+	(pthread_create(&thr_handover, NULL,
+			breaker_handover_task, &breaker) != 0)) {
+	LOG("failed to start handover thread");
+	return -1;
+    }
 
-    sleep:
-	// Next	polling
-	next_polling.tv_sec += breaker.control.idle_timeout;
-	sleep_until(INTERVAL_CLOCK, &next_polling);
+    // Without an idle timeout we never re-publish periodically: the state is
+    // only published when it changes (from the actuator thread).
+    if (breaker.control.idle_timeout == 0)
+	return 0;
+
+    if (pthread_create(&thr_heartbeat, NULL,
+		       breaker_heartbeat_task, &breaker) != 0) {
+	LOG("failed to start heartbeat thread");
+	return -1;
     }
+    return 0;
+}
 
-    exit(0);
+static void
+breaker_configure(int argc, char **argv)
+{
+    breaker_parse_config(argc, argv, &breaker);
+}
+
+static int
+breaker_module_init(struct mqtt *shared)
+{
+    return breaker_init(&breaker, shared);
+}
+
+const struct moses_module breaker_module = {
+    .name            = NICKNAME,
+    .configure       = breaker_configure,
+    .init            = breaker_module_init,
+    .start           = breaker_start,
+    .reduced_latency = &breaker.reduced_latency,
+};
+
+
+#ifndef MOSES_HUB
+int
+main(int argc, char **argv)
+{
+    __progname = basename(argv[0]);
+
+    // Configuration
+    mqtt_config_from_env(breaker.mqtt.handler);
+    breaker_parse_config(argc, argv, &breaker);
+    
+    // Initialization
+    if (breaker_init(&breaker, NULL) < 0)
+	DIE(2, "failed to initialize");
+    
+    // Reducing latency
+    if (breaker.reduced_latency)
+	reduced_latency();
+
+    // State changes are applied by the actuator thread, scheduled ones
+    // are timed by the scheduler thread, the heartbeat (if any) runs in
+    // its own thread.
+    if (breaker_start() < 0)
+	DIE(2, "failed to start");
+
+    for (;;) pause();
 }
+#endif
 
 
 // Callback called when the client receives a message.
@@ -440,28 +1761,93 @@ on_message(struct mosquitto *mosq, void *obj,
 {
     (void)obj;
     struct breaker_mqtt *mqtt = &breaker.mqtt;
-    assert(mqtt->handler.mosq == mosq);
+    assert(mqtt->handler->mosq == mosq);
     (void)mosq;   // otherwise unused when assert() is compiled out (NDEBUG)
 
-    // Setter topic
-    if (!strcmp(mqtt->topic.setter, msg->topic)) {
-	// Parse requested state
-	int state = breaker_parse_state(msg->payload, msg->payloadlen);
-	if (state < 0) {
+    // Setter topics: a line (main valve or zone), or all of them
+    struct breaker_control *bc = &breaker.control;
+    int line = -2;
+    if (bc->linecount > 1 && !strcmp(mqtt->topic.group_setter, msg->topic))
+	line = -1;
+    for (unsigned int i = 0 ; (line == -2) && (i < bc->linecount) ; i++)
+	if (!strcmp(bc->line[i].topic.setter, msg->topic))
+	    line = i;
+
+    if (line >= -1) {
+	uint64_t received = clock_ns(CLOCK_MONOTONIC);
+
+	// Parse requested state (with its correlation id, if any); a
+	// duration is only meaningful for the scheduled main valve
+	struct breaker_command cmd;
+	if ((breaker_parse_command(msg->payload, msg->payloadlen, &cmd) < 0) ||
+	    ((cmd.duration > 0) && (line != 0))) {
 	    LOG("garbage content for MQTT topic %s", msg->topic);
+	    struct breaker_request req = {
+		.command = cmd, .line = line, .received_ns = received,
+	    };
+	    breaker_acknowledge(&breaker, &req, "invalid", 0);
 	    return;
 	}
 
-	// Set breaker state
-	int rc = breaker_set_state(&breaker, state, true);
-	if (rc < 0) {
-	    LOG("failed to set breaker state!");
-	    PUT_FAIL(NICKNAME, "set-state");
-	    static char *msg = MQTT_ERROR_MSG(NICKNAME, "critical",
-					      "failed to set breaker state");
-	    MQTT_PUBLISH(mqtt, error, 2, false, "%s", msg);
+	// Hand it over to the actuator
+	breaker_actuator_submit(&breaker, line, &cmd, received);
+
+	// An explicit main valve state overrides the pending transition
+	// (a leak shutoff is not to be undone by an earlier timed command)
+	if ((cmd.duration == 0) && (line <= 0) &&
+	    breaker_scheduler_cancel(&breaker.scheduler)) {
+	    LOG("pending transition cancelled by %s", msg->topic);
+	    breaker_scheduler_announce(&breaker);
+	}
 
+	// "for": the other state afterwards, as "<state> for <duration>"
+	// on the schedule topic
+	if (cmd.duration > 0) {
+	    struct breaker_scheduler *bs = &breaker.scheduler;
+	    pthread_mutex_lock(&bs->lock);
+	    bs->current = (struct breaker_schedule) {
+		.pending = true, .state = !cmd.state,
+		.at      = time(NULL) + (time_t)cmd.duration,
+	    };
+	    breaker_scheduler_store(bs);
+	    breaker_scheduler_arm(bs);
+	    pthread_mutex_unlock(&bs->lock);
+	    breaker_scheduler_announce(&breaker);
 	}
     }
+
+    // Schedule topic
+    else if (!strcmp(mqtt->topic.schedule, msg->topic)) {
+	uint64_t received = clock_ns(CLOCK_MONOTONIC);
+	struct breaker_scheduler *bs = &breaker.scheduler;
+
+	// Parse request
+	struct breaker_schedule_request req;
+	if (breaker_schedule_parse(msg->payload, msg->payloadlen,
+				   time(NULL), &req) < 0) {
+	    LOG("garbage content for MQTT topic %s", msg->topic);
+	    return;
+	}
+
+	// Replace or drop the pending transition
+	if (req.command != BREAKER_SCHEDULE_QUERY) {
+	    pthread_mutex_lock(&bs->lock);
+	    if (req.command == BREAKER_SCHEDULE_SET)
+		bs->current = req.schedule;
+	    else
+		bs->current.pending = false;
+	    breaker_scheduler_store(bs);
+	    breaker_scheduler_arm(bs);
+	    pthread_mutex_unlock(&bs->lock);
+	}
+
+	// Timed command: its first half applies at once
+	if (req.now >= 0) {
+	    struct breaker_command cmd = { .state = req.now };
+	    breaker_actuator_submit(&breaker, 0, &cmd, received);
+	}
+
+	breaker_scheduler_announce(&breaker);
+    }
 }
 
@@ -0,0 +1,177 @@
+/*
+ * breaker_schedule -- timed and scheduled breaker commands.
+ *
+ * Kept in its own translation unit (separate from breaker.c, which has
+ * main()) so it can be linked into the unit tests.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+
+#include "common.h"
+#include "breaker_state.h"
+#include "breaker_schedule.h"
+
+#define SCHEDULE_MAGIC   "moses-schedule 1"
+#define SCHEDULE_MAXLEN  64             // longest payload accepted
+#define SCHEDULE_MAXTIME (366 * 86400)  // longest duration accepted (s)
+
+
+static int
+breaker_schedule_parse_time(const char *str, time_t *t)
+{
+    // Unix seconds
+    if (strspn(str, "0123456789") == strlen(str)) {
+	errno = 0;
+	char *end;
+	long long v = strtoll(str, &end, 10);
+	if ((errno != 0) || (v <= 0))
+	    return -1;
+	*t = v;
+	return 0;
+    }
+
+    // Local time, with or without seconds
+    static const char *const formats[] = {
+	"%Y-%m-%dT%H:%M:%S", "%Y-%m-%dT%H:%M",
+    };
+    for (size_t i = 0 ; i < sizeof(formats) / sizeof(formats[0]) ; i++) {
+	struct tm tm = { 0 };
+	const char *end = strptime(str, formats[i], &tm);
+	if ((end == NULL) || (*end != '\0'))
+	    continue;
+	tm.tm_isdst = -1;               // as in effect at that time
+	*t = mktime(&tm);
+	return (*t == (time_t)-1) ? -1 : 0;
+    }
+    return -1;
+}
+
+
+int
+breaker_schedule_parse(const char *data, int datalen, time_t now,
+		       struct breaker_schedule_request *req)
+{
+    // Same rules as breaker_parse_state(): no embedded NUL
+    if ((datalen < 0) || (datalen > SCHEDULE_MAXLEN))
+	return -1;
+    if (strnlen(data, datalen) != (size_t)datalen)
+	return -1;
+
+    char  buf[SCHEDULE_MAXLEN + 1];
+    char *tok[4], *saveptr;
+    int   n = 0;
+    memcpy(buf, data, datalen);
+    buf[datalen] = '\0';
+    for (char *t = strtok_r(buf, " ", &saveptr) ; t && (n < 4) ;
+	 t = strtok_r(NULL, " ", &saveptr))
+	tok[n++] = t;
+
+    // cancel | query
+    if (n == 1) {
+	if      (! strcasecmp(tok[0], "cancel"))
+	    req->command = BREAKER_SCHEDULE_CANCEL;
+	else if (! strcasecmp(tok[0], "query"))
+	    req->command = BREAKER_SCHEDULE_QUERY;
+	else
+	    return -1;
+	req->now = -1;
+	return 0;
+    }
+
+    // <state> for|in|at <arg>
+    if (n != 3)
+	return -1;
+    int state = breaker_parse_state(tok[0], strlen(tok[0]));
+    if (state < 0)
+	return -1;
+
+    time_t at = 0;
+    if (! strcasecmp(tok[1], "at")) {
+	if ((breaker_schedule_parse_time(tok[2], &at) < 0) || (at <= now))
+	    return -1;
+    } else {
+	uint64_t duration;
+	if ((parse_s_period(tok[2], &duration) < 0) ||
+	    (duration == 0) || (duration > SCHEDULE_MAXTIME))
+	    return -1;
+	at = now + (time_t)duration;
+    }
+
+    req->command  = BREAKER_SCHEDULE_SET;
+    req->schedule = (struct breaker_schedule) {
+	.pending = true, .state = state, .at = at,
+    };
+    if      (! strcasecmp(tok[1], "for")) {
+	req->now            = state;
+	req->schedule.state = ! state;
+    }
+    else if ((! strcasecmp(tok[1], "in")) || (! strcasecmp(tok[1], "at")))
+	req->now            = -1;
+    else
+	return -1;
+    return 0;
+}
+
+
+static void
+breaker_schedule_write(FILE *f, const void *ctx)
+{
+    const struct breaker_schedule *s = ctx;
+
+    fprintf(f, "%s\n", SCHEDULE_MAGIC);
+    if (s->pending)
+	fprintf(f, "%d %lld\n", s->state, (long long)s->at);
+    else
+	fprintf(f, "none\n");
+}
+
+int
+breaker_schedule_save(const struct breaker_schedule *s, const char *path)
+{
+    return atomic_write_file(path, breaker_schedule_write, s);
+}
+
+
+int
+breaker_schedule_load(struct breaker_schedule *s, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+	return -1;
+
+    char      magic[sizeof(SCHEDULE_MAGIC) + 1];
+    char      none[5];
+    int       state;
+    long long at;
+    int       rc = -1;
+
+    if ((fgets(magic, sizeof(magic), f) == NULL) ||
+	(strcmp(magic, SCHEDULE_MAGIC "\n") != 0))
+	goto done;
+    if (fscanf(f, "%d %lld", &state, &at) == 2) {
+	if ((state != 0) && (state != 1))
+	    goto done;
+	*s = (struct breaker_schedule) {
+	    .pending = true, .state = state, .at = at,
+	};
+	rc = 0;
+    } else if ((fscanf(f, "%4s", none) == 1) && (strcmp(none, "none") == 0)) {
+	*s = (struct breaker_schedule) { .pending = false };
+	rc = 0;
+    }
+
+ done:
+    fclose(f);
+    if (rc < 0)
+	errno = EINVAL;
+    return rc;
+}
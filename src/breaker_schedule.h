@@ -0,0 +1,56 @@
+#ifndef __BREAKER_SCHEDULE_H
+#define __BREAKER_SCHEDULE_H
+
+/*
+ * Timed and scheduled breaker commands, received on the `state/schedule`
+ * topic and executed by the daemon itself (so they do not depend on an
+ * external scheduler, nor on the broker being reachable when they are due).
+ *
+ * Payloads (states as for `state/set`, durations as for the options: 30,
+ * 30s, 30min, 2h, 14d, 2w):
+ *
+ *   <state> for <duration>   set <state> now, the other one after <duration>
+ *   <state> in <duration>    set <state> after <duration>
+ *   <state> at <time>        set <state> at <time>: Unix seconds, or local
+ *                            YYYY-MM-DDTHH:MM[:SS]
+ *   cancel                   drop the pending transition
+ *   query                    announce the pending transition again
+ *
+ * A single transition is pending at a time, a new schedule replaces it.
+ * It can be saved to and restored from a small text file, so it survives
+ * restarts.
+ */
+
+#include <stdbool.h>
+#include <time.h>
+
+struct breaker_schedule {
+    bool    pending;                    // a transition is pending
+    int     state;                      // state to set (0 or 1)
+    time_t  at;                         // when (Unix time)
+};
+
+enum breaker_schedule_command {
+    BREAKER_SCHEDULE_SET,
+    BREAKER_SCHEDULE_CANCEL,
+    BREAKER_SCHEDULE_QUERY,
+};
+
+struct breaker_schedule_request {
+    enum breaker_schedule_command command;
+    int     now;                        // state to set at once, -1 = none
+    struct breaker_schedule schedule;   // for BREAKER_SCHEDULE_SET
+};
+
+// Parse a `state/schedule` payload received at `now`. The time must be in
+// the future, the duration not zero. 0 on success, -1 if not recognized.
+int breaker_schedule_parse(const char *data, int datalen, time_t now,
+			   struct breaker_schedule_request *req);
+
+// Save (atomically: written aside then renamed) or restore the schedule.
+// 0 on success, -1 on failure (errno set; for load, ENOENT when there is
+// no saved schedule yet, EINVAL when the file is not understood).
+int breaker_schedule_save(const struct breaker_schedule *s, const char *path);
+int breaker_schedule_load(struct breaker_schedule *s, const char *path);
+
+#endif
@@ -1,12 +1,18 @@
 /*
  * breaker_parse_state -- interpret the breaker setter payload.
+ * breaker_parse_command -- same, with correlation id and client timestamp,
+ *                          or as a JSON object.
+ * breaker_status      -- lock-free breaker state shared between threads.
+ * breaker_admission   -- anti-chatter limits on the line transitions.
  *
  * Kept in its own translation unit (separate from breaker.c, which has
  * main()) so it can be linked into the unit tests.
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <math.h>
 
 #include "breaker_state.h"
 
@@ -37,3 +43,412 @@ breaker_parse_state(const char *data, int datalen)
 	    return breaker_state[i].value;
     return -1;
 }
+
+
+#define BREAKER_ID_CHARS \
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789._:-"
+
+
+/*
+ * Minimal JSON reader for the command object. The cursor never goes past
+ * `end`, and strings are returned as pointers into the payload.
+ */
+struct json_cursor {
+    const char *p;
+    const char *end;
+};
+
+static void
+json_ws(struct json_cursor *c)
+{
+    while ((c->p < c->end) &&
+	   ((*c->p == ' ') || (*c->p == '\t') ||
+	    (*c->p == '\n') || (*c->p == '\r')))
+	c->p++;
+}
+
+static bool
+json_char(struct json_cursor *c, char ch)
+{
+    json_ws(c);
+    if ((c->p < c->end) && (*c->p == ch)) {
+	c->p++;
+	return true;
+    }
+    return false;
+}
+
+// String of printable ASCII characters, no escape sequence
+static bool
+json_string(struct json_cursor *c, const char **str, size_t *len)
+{
+    json_ws(c);
+    if ((c->p >= c->end) || (*c->p != '"'))
+	return false;
+    const char *start = ++c->p;
+    while ((c->p < c->end) && (*c->p != '"')) {
+	if ((*c->p < 0x20) || (*c->p > 0x7e) || (*c->p == '\\'))
+	    return false;
+	c->p++;
+    }
+    if (c->p >= c->end)
+	return false;
+    *str = start;
+    *len = c->p++ - start;
+    return true;
+}
+
+static bool
+json_number(struct json_cursor *c, double *v)
+{
+    json_ws(c);
+    const char *start = c->p;
+    while ((c->p < c->end) &&
+	   (((*c->p >= '0') && (*c->p <= '9')) ||
+	    (*c->p == '-') || (*c->p == '+') || (*c->p == '.') ||
+	    (*c->p == 'e') || (*c->p == 'E')))
+	c->p++;
+
+    // strtod() wants a terminated string: a bounded copy on the stack
+    size_t len = c->p - start;
+    char   num[32], *num_end;
+    if ((len == 0) || (len >= sizeof(num)))
+	return false;
+    memcpy(num, start, len);
+    num[len] = '\0';
+    *v = strtod(num, &num_end);
+    return (*num_end == '\0') && isfinite(*v);
+}
+
+static bool
+json_literal(struct json_cursor *c, const char *literal)
+{
+    size_t len = strlen(literal);
+    json_ws(c);
+    if (((size_t)(c->end - c->p) < len) || memcmp(c->p, literal, len))
+	return false;
+    c->p += len;
+    return true;
+}
+
+// Copy a string member into a command field
+static bool
+json_copy(char *dst, size_t size, const char *str, size_t len)
+{
+    if ((len == 0) || (len >= size))
+	return false;
+    memcpy(dst, str, len);
+    dst[len] = '\0';
+    return true;
+}
+
+enum { JSON_STATE, JSON_ID, JSON_TS, JSON_FOR, JSON_REASON, JSON_SOURCE };
+static const char *const json_members[] = {
+    [JSON_STATE ] = "state",  [JSON_ID    ] = "id",
+    [JSON_TS    ] = "ts",     [JSON_FOR   ] = "for",
+    [JSON_REASON] = "reason", [JSON_SOURCE] = "source",
+};
+
+static int
+breaker_parse_json(const char *data, int datalen, struct breaker_command *cmd)
+{
+    struct json_cursor c     = { data, data + datalen };
+    unsigned int       seen  = 0;
+    bool               valid = true;
+    int                state = -1;
+
+    if (!json_char(&c, '{'))
+	return -1;
+    if (!json_char(&c, '}')) {
+	do {
+	    const char *key, *str;
+	    size_t      keylen, len;
+	    double      v;
+	    if (!json_string(&c, &key, &keylen) || !json_char(&c, ':'))
+		return -1;
+
+	    int m = -1;
+	    for (size_t i = 0 ; i < sizeof(json_members) / sizeof(json_members[0]) ; i++)
+		if ((strlen(json_members[i]) == keylen) &&
+		    !memcmp(json_members[i], key, keylen))
+		    m = i;
+	    if ((m < 0) || (seen & (1u << m)))
+		valid = false;          // unknown or repeated
+	    else
+		seen |= 1u << m;
+
+	    // Value: string, number or literal (nothing nested)
+	    json_ws(&c);
+	    if ((c.p < c.end) && (*c.p == '"')) {
+		if (!json_string(&c, &str, &len))
+		    return -1;
+		switch (m) {
+		case JSON_STATE:
+		    state = breaker_parse_state(str, len);
+		    break;
+		case JSON_ID:           // strspn() stops at the closing quote
+		    if ((len > BREAKER_ID_MAX) ||
+			(strspn(str, BREAKER_ID_CHARS) < len) ||
+			!json_copy(cmd->id, sizeof(cmd->id), str, len))
+			valid = false;
+		    break;
+		case JSON_REASON:
+		    valid &= json_copy(cmd->reason, sizeof(cmd->reason),
+				       str, len);
+		    break;
+		case JSON_SOURCE:
+		    valid &= json_copy(cmd->source, sizeof(cmd->source),
+				       str, len);
+		    break;
+		default:
+		    valid = false;
+		}
+	    } else if (json_literal(&c, "true")) {
+		if (m == JSON_STATE) state = 1;
+		else                 valid = false;
+	    } else if (json_literal(&c, "false")) {
+		if (m == JSON_STATE) state = 0;
+		else                 valid = false;
+	    } else if (json_literal(&c, "null")) {
+		valid = false;
+	    } else if (json_number(&c, &v)) {
+		switch (m) {
+		case JSON_STATE:
+		    state = (v == 0) ? 0 : (v == 1) ? 1 : -1;
+		    break;
+		case JSON_TS:
+		    cmd->ts     = v;
+		    cmd->has_ts = (v >= 0);
+		    valid      &= cmd->has_ts;
+		    break;
+		case JSON_FOR:
+		    if ((v < 1) || (v > BREAKER_FOR_MAX) || (v != (unsigned long)v))
+			valid = false;
+		    else
+			cmd->duration = v;
+		    break;
+		default:
+		    valid = false;
+		}
+	    } else {
+		return -1;
+	    }
+	} while (json_char(&c, ','));
+	if (!json_char(&c, '}'))
+	    return -1;
+    }
+    json_ws(&c);
+    if (c.p != c.end)
+	return -1;
+
+    return valid ? state : -1;
+}
+
+
+int
+breaker_parse_command(const char *data, int datalen,
+		      struct breaker_command *cmd)
+{
+    *cmd = (struct breaker_command) { .state = -1 };
+
+    if (datalen < 0)
+	return -1;
+    if (strnlen(data, datalen) != (size_t)datalen)
+	return -1;
+
+    // JSON object
+    struct json_cursor c = { data, data + datalen };
+    json_ws(&c);
+    if ((c.p < c.end) && (*c.p == '{')) {
+	cmd->state = breaker_parse_json(data, datalen, cmd);
+	return cmd->state;
+    }
+
+    // Optional tokens first, so the id is known whatever the outcome
+    const char *end   = data + datalen;
+    const char *sep   = memchr(data, ' ', datalen);
+    const char *state = data;
+    int         statelen = sep ? sep - data : datalen;
+    bool        valid = true;
+
+    for (const char *tok = sep ; tok && (tok < end) ; ) {
+	tok++;                          // skip the separator
+	const char *next = memchr(tok, ' ', end - tok);
+	size_t      len  = (next ? next : end) - tok;
+
+	if ((len > 3) && !strncmp(tok, "id=", 3) &&
+	    (len - 3 <= BREAKER_ID_MAX) && (cmd->id[0] == '\0')) {
+	    memcpy(cmd->id, tok + 3, len - 3);
+	    cmd->id[len - 3] = '\0';
+	    if (strspn(cmd->id, BREAKER_ID_CHARS) != len - 3) {
+		cmd->id[0] = '\0';
+		valid      = false;
+	    }
+	} else if ((len > 3) && (len < 32) && !strncmp(tok, "ts=", 3) &&
+		   !cmd->has_ts) {
+	    char  num[32], *num_end;
+	    memcpy(num, tok + 3, len - 3);
+	    num[len - 3] = '\0';
+	    cmd->ts     = strtod(num, &num_end);
+	    cmd->has_ts = (*num_end == '\0') && isfinite(cmd->ts) &&
+		          (cmd->ts >= 0);
+	    if (!cmd->has_ts)
+		valid = false;
+	} else {
+	    valid = false;
+	}
+	tok = next;
+    }
+
+    int rc = breaker_parse_state(state, statelen);
+    if (!valid)
+	rc = -1;
+    cmd->state = rc;
+    return rc;
+}
+
+
+void
+breaker_status_init(struct breaker_status *s, int state)
+{
+    atomic_init(&s->line,         state ? 1 : 0);
+    atomic_init(&s->published_ns, 0);
+}
+
+void
+breaker_status_set(struct breaker_status *s, int state, uint64_t actuated_ns)
+{
+    atomic_store_explicit(&s->line, (actuated_ns << 1) | (state ? 1 : 0),
+			  memory_order_release);
+}
+
+int
+breaker_status_get(struct breaker_status *s, uint64_t *actuated_ns)
+{
+    uint64_t line = atomic_load_explicit(&s->line, memory_order_acquire);
+    if (actuated_ns)
+	*actuated_ns = line >> 1;
+    return line & 1;
+}
+
+void
+breaker_status_published(struct breaker_status *s, uint64_t ns)
+{
+    uint64_t last = atomic_load_explicit(&s->published_ns,
+					 memory_order_relaxed);
+    while ((ns > last) &&
+	   !atomic_compare_exchange_weak_explicit(&s->published_ns, &last, ns,
+						  memory_order_release,
+						  memory_order_relaxed))
+	;
+}
+
+uint64_t
+breaker_status_last_published(struct breaker_status *s)
+{
+    return atomic_load_explicit(&s->published_ns, memory_order_acquire);
+}
+
+
+#define MINUTE_NS (60 * 1000000000ull)
+
+bool
+breaker_admission_allows(const struct breaker_admission *a, int state,
+			 uint64_t now_ns, uint64_t *until_ns)
+{
+    if (state)
+	return true;
+
+    // Dwell time since the last transition
+    uint64_t until = 0;
+    if ((a->dwell_ns > 0) && (a->last_ns > 0))
+	until = a->last_ns + a->dwell_ns;
+
+    // A full minute of history: the oldest one must have left the window
+    if ((a->rate > 0) && (a->count >= a->rate)) {
+	uint64_t oldest = a->history[a->next] + MINUTE_NS;
+	if (oldest > until)
+	    until = oldest;
+    }
+
+    if (now_ns >= until)
+	return true;
+    *until_ns = until;
+    return false;
+}
+
+void
+breaker_admission_record(struct breaker_admission *a, uint64_t now_ns)
+{
+    a->last_ns = now_ns;
+    if (a->rate == 0)
+	return;
+    a->history[a->next] = now_ns;
+    a->next = (a->next + 1) % a->rate;
+    if (a->count < a->rate)
+	a->count++;
+}
+
+
+bool
+breaker_hold_enabled(const struct breaker_hold *h)
+{
+    return (h->duty > 0) && (h->duty < 100) && (h->period_ns > 0);
+}
+
+
+void
+breaker_hold_start(struct breaker_hold *h, uint64_t now_ns)
+{
+    h->since_ns = now_ns;
+}
+
+
+void
+breaker_hold_stop(struct breaker_hold *h)
+{
+    h->since_ns = 0;
+}
+
+
+int
+breaker_hold_level(const struct breaker_hold *h, uint64_t now_ns,
+		   uint64_t *next_ns)
+{
+    uint64_t elapsed = (now_ns > h->since_ns) ? now_ns - h->since_ns : 0;
+
+    *next_ns = UINT64_MAX;
+    if (!breaker_hold_enabled(h))
+	return 1;
+    if (elapsed < h->pull_in_ns) {
+	*next_ns = h->since_ns + h->pull_in_ns;
+	return 1;
+    }
+
+    uint64_t off   = h->period_ns - h->period_ns * h->duty / 100;
+    uint64_t phase = (elapsed - h->pull_in_ns) % h->period_ns;
+    if (phase < off) {
+	*next_ns = now_ns - phase + off;
+	return 0;
+    }
+    *next_ns = now_ns - phase + h->period_ns;
+    return 1;
+}
+
+
+uint64_t
+breaker_hold_driven_ns(const struct breaker_hold *h, uint64_t now_ns)
+{
+    if ((h->since_ns == 0) || (now_ns <= h->since_ns))
+	return 0;
+    uint64_t elapsed = now_ns - h->since_ns;
+    if (!breaker_hold_enabled(h) || (elapsed <= h->pull_in_ns))
+	return elapsed;
+
+    uint64_t on     = h->period_ns * h->duty / 100;
+    uint64_t off    = h->period_ns - on;
+    uint64_t held   = elapsed - h->pull_in_ns;
+    uint64_t phase  = held % h->period_ns;
+    return h->pull_in_ns + (held / h->period_ns) * on
+	 + ((phase > off) ? phase - off : 0);
+}
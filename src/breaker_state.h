@@ -1,6 +1,10 @@
 #ifndef __BREAKER_STATE_H
 #define __BREAKER_STATE_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
 /*
  * Parse a breaker state command payload, as received on the MQTT setter
  * topic. Accepts 0/1, off/on, false/true (case insensitive). The match is
@@ -12,4 +16,136 @@
  */
 int breaker_parse_state(const char *data, int datalen);
 
+/*
+ * Parse a full `state/set` command: the state, optionally followed by a
+ * correlation id and the client timestamp, each separated by one space:
+ *
+ *   <state> [id=<id>] [ts=<Unix seconds, with fraction>]
+ *
+ * or a small JSON object, for the intents that do not fit in the above:
+ *
+ *   { "state": "on", "id": "42", "ts": 1767225600.125,
+ *     "for": 1800, "reason": "pressure test", "source": "ha" }
+ *
+ * where only "state" is required: a state string as above, 0/1 or
+ * true/false. "for" (seconds, up to BREAKER_FOR_MAX) asks for the other
+ * state afterwards. The JSON is parsed in place, within `datalen`, without
+ * allocation; it is strict: no nesting, no unknown or repeated member, no
+ * escape sequence in strings (reason and source are printable ASCII, up to
+ * BREAKER_TEXT_MAX characters).
+ *
+ * The id (up to BREAKER_ID_MAX characters among A-Z a-z 0-9 . _ : -) is
+ * echoed back in the acknowledgement; it is extracted even when the rest
+ * of the command is not understood, so that can be acknowledged too.
+ *
+ * Returns the requested state as breaker_parse_state(), -1 if the command
+ * is not recognized (cmd->state is then -1 as well).
+ */
+#define BREAKER_ID_MAX    64
+#define BREAKER_TEXT_MAX  64
+#define BREAKER_FOR_MAX   (366 * 86400)
+
+struct breaker_command {
+    int     state;                      // requested state, -1 = invalid
+    char    id[BREAKER_ID_MAX + 1];     // correlation id, "" = none
+    bool    has_ts;                     // client timestamp given
+    double  ts;                         // client timestamp (Unix s)
+    unsigned long duration;             // then the other state (s), 0 = none
+    char    reason[BREAKER_TEXT_MAX + 1]; // free text, "" = none
+    char    source[BREAKER_TEXT_MAX + 1]; // free text, "" = none
+};
+
+int breaker_parse_command(const char *data, int datalen,
+			  struct breaker_command *cmd);
+
+/*
+ * Breaker status, shared by the actuator, the heartbeat and the MQTT
+ * threads without locks: none of them ever blocks on another (the actuator
+ * may run SCHED_FIFO, a mutex held by a lower priority thread would be a
+ * priority inversion).
+ *
+ * The state and the time the line was driven to it are packed in a single
+ * word, so they are always read consistently; the last set-driven publish
+ * time only moves forward.
+ */
+struct breaker_status {
+    _Atomic uint64_t line;              // (actuated_ns << 1) | state
+    _Atomic uint64_t published_ns;      // last set-driven publish
+};
+
+// Initial state, never actuated nor published.
+void breaker_status_init(struct breaker_status *s, int state);
+
+// Line driven to `state` at `actuated_ns`.
+void breaker_status_set(struct breaker_status *s, int state,
+			uint64_t actuated_ns);
+
+// Current state (0 or 1), and when it was set if `actuated_ns` is not NULL.
+int breaker_status_get(struct breaker_status *s, uint64_t *actuated_ns);
+
+// Record a set-driven publish at `ns` (ignored if older than the last one),
+// and retrieve the last one.
+void breaker_status_published(struct breaker_status *s, uint64_t ns);
+uint64_t breaker_status_last_published(struct breaker_status *s);
+
+/*
+ * Anti-chatter admission of the transitions of a line: at least `dwell_ns`
+ * between two transitions, and at most `rate` of them in any minute (each
+ * 0 = no limit). Closing the valve (state 1) is always admitted, as it is
+ * the action that stops a leak; it still counts as a transition.
+ *
+ * Only used by the actuator thread, times are CLOCK_MONOTONIC.
+ */
+#define BREAKER_RATE_MAX  120           // transitions per minute, at most
+
+struct breaker_admission {
+    uint64_t     dwell_ns;              // min time between transitions
+    unsigned int rate;                  // max transitions per minute
+    uint64_t     last_ns;               // last transition, 0 = none
+    unsigned int count;                 // transitions in history (<= rate)
+    unsigned int next;                  // history slot of the next one
+    uint64_t     history[BREAKER_RATE_MAX]; // times of the last `rate` ones
+};
+
+// Whether a transition to `state` is admitted at `now_ns`. If not,
+// `until_ns` is set to the earliest time it will be.
+bool breaker_admission_allows(const struct breaker_admission *a, int state,
+			      uint64_t now_ns, uint64_t *until_ns);
+
+// Record a transition at `now_ns`.
+void breaker_admission_record(struct breaker_admission *a, uint64_t now_ns);
+
+/*
+ * Hit-and-hold drive of the solenoid coil of a line: fully driven for
+ * `pull_in_ns` once energised (the current that moves the plunger), then
+ * switched every `period_ns`, `duty` percent on (the much lower average
+ * current that keeps it seated), to cut the power and heat of a long
+ * closure. Each hold period starts with its off part. A duty of 0 (or
+ * 100) keeps the coil fully driven.
+ *
+ * Only used by the actuator thread, times are CLOCK_MONOTONIC.
+ */
+struct breaker_hold {
+    uint64_t     pull_in_ns;            // fully driven after energising
+    uint64_t     period_ns;             // then switched at this period
+    unsigned int duty;                  // percent on, while holding
+    uint64_t     since_ns;              // energised since, 0 = not
+};
+
+// Whether the coil is switched while holding.
+bool breaker_hold_enabled(const struct breaker_hold *h);
+
+// The coil is energised (closing) at `now_ns`, or de-energised.
+void breaker_hold_start(struct breaker_hold *h, uint64_t now_ns);
+void breaker_hold_stop(struct breaker_hold *h);
+
+// Level the energised line must be driven to at `now_ns`, and when that
+// changes next (UINT64_MAX = never).
+int breaker_hold_level(const struct breaker_hold *h, uint64_t now_ns,
+		       uint64_t *next_ns);
+
+// Time the coil has actually been driven since energised, up to `now_ns`.
+uint64_t breaker_hold_driven_ns(const struct breaker_hold *h,
+				uint64_t now_ns);
+
 #endif
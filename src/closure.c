@@ -0,0 +1,147 @@
+/*
+ * closure -- verification of the valve closure from the meter pulses.
+ *
+ * Kept in its own translation unit (separate from watermeter.c, which has
+ * main()) so it can be linked into the unit tests.
+ */
+
+#include <string.h>
+
+#include "closure.h"
+
+
+// Account a pulse in the running check
+static enum closure_result
+closure_account(struct closure *c, uint64_t ts)
+{
+    if (!c->active || (ts < c->closed_ns))
+	return CLOSURE_PENDING;
+
+    if (ts - c->closed_ns <= c->timeout_ns) {
+	c->residual++;
+	if (ts > c->last_pulse_ns)
+	    c->last_pulse_ns = ts;
+	return CLOSURE_PENDING;
+    }
+
+    c->late++;
+    c->active = false;
+    return CLOSURE_FAILED;
+}
+
+
+enum closure_result
+closure_start(struct closure *c, uint64_t closed_ns)
+{
+    enum closure_result result = CLOSURE_PENDING;
+
+    c->active        = true;
+    c->closed_ns     = closed_ns;
+    c->last_pulse_ns = 0;
+    c->residual      = 0;
+    c->late          = 0;
+
+    // Pulses seen before we knew of the closure
+    unsigned int first = (c->recent.next + CLOSURE_RECENT - c->recent.count)
+	               % CLOSURE_RECENT;
+    for (unsigned int i = 0 ; i < c->recent.count ; i++)
+	if (closure_account(c, c->recent.ts[(first + i) % CLOSURE_RECENT])
+	        == CLOSURE_FAILED)
+	    result = CLOSURE_FAILED;
+    return result;
+}
+
+
+void
+closure_cancel(struct closure *c)
+{
+    c->active = false;
+}
+
+
+enum closure_result
+closure_pulse(struct closure *c, uint64_t ts)
+{
+    c->recent.ts[c->recent.next] = ts;
+    c->recent.next = (c->recent.next + 1) % CLOSURE_RECENT;
+    if (c->recent.count < CLOSURE_RECENT)
+	c->recent.count++;
+
+    return closure_account(c, ts);
+}
+
+
+uint64_t
+closure_deadline(const struct closure *c)
+{
+    return c->active ? c->closed_ns + c->timeout_ns + c->window_ns : 0;
+}
+
+
+enum closure_result
+closure_tick(struct closure *c, uint64_t now)
+{
+    if (!c->active || (now < closure_deadline(c)))
+	return CLOSURE_PENDING;
+
+    c->active = false;
+    return CLOSURE_VERIFIED;
+}
+
+
+uint64_t
+closure_time_to_last_pulse(const struct closure *c)
+{
+    return c->last_pulse_ns ? c->last_pulse_ns - c->closed_ns : 0;
+}
+
+
+void
+closure_record(struct closure_history *h, const struct closure *c,
+	       enum closure_result result)
+{
+    if (result == CLOSURE_FAILED) {
+	h->failed++;
+	return;
+    }
+    if (result != CLOSURE_VERIFIED)
+	return;
+
+    h->verified++;
+    h->ttlp_ns[h->next] = closure_time_to_last_pulse(c);
+    h->next = (h->next + 1) % CLOSURE_HISTORY;
+    if (h->count < CLOSURE_HISTORY)
+	h->count++;
+}
+
+
+uint64_t
+closure_history_at(const struct closure_history *h, unsigned int i)
+{
+    unsigned int first = (h->next + CLOSURE_HISTORY - h->count)
+	               % CLOSURE_HISTORY;
+    return h->ttlp_ns[(first + i) % CLOSURE_HISTORY];
+}
+
+
+uint64_t
+closure_history_mean(const struct closure_history *h)
+{
+    if (h->count == 0)
+	return 0;
+    uint64_t total = 0;
+    for (unsigned int i = 0 ; i < h->count ; i++)
+	total += h->ttlp_ns[i];
+    return total / h->count;
+}
+
+
+uint64_t
+closure_history_max(const struct closure_history *h)
+{
+    uint64_t max = 0;
+    for (unsigned int i = 0 ; i < h->count ; i++)
+	if (h->ttlp_ns[i] > max)
+	    max = h->ttlp_ns[i];
+    return max;
+}
@@ -0,0 +1,89 @@
+#ifndef __CLOSURE_H
+#define __CLOSURE_H
+
+/*
+ * Closure verification: after the valve is closed, the meter pulses must
+ * stop. Driving the relay does not prove the valve moved, nor that it
+ * seals, but the pulse stream of the meter downstream of it can.
+ *
+ * A check starts when the valve is reported closed (at `closed_ns`). The
+ * pulses seen within `timeout_ns` of it are the residual flow (water still
+ * moving while the valve shuts, pipes depressurizing); the time to the
+ * last of them measures how fast the valve closes. The check is verified
+ * when no pulse follows during `window_ns` after that, and fails at the
+ * first pulse that does (water still flowing). Pulses are recorded as they
+ * come, so those that preceded the start of the check (the closure being
+ * reported a few milliseconds late) are still accounted for.
+ *
+ * The time to last pulse of the verified checks is kept over the last
+ * CLOSURE_HISTORY ones, to spot a valve getting slower.
+ *
+ * Times are CLOCK_MONOTONIC (as the GPIO event timestamps).
+ */
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define CLOSURE_RECENT   64             // pulses remembered before a check
+#define CLOSURE_HISTORY  32             // verified checks remembered
+
+enum closure_result {
+    CLOSURE_PENDING,                    // no check, or not concluded yet
+    CLOSURE_VERIFIED,                   // pulses stopped in time
+    CLOSURE_FAILED,                     // pulses after the timeout
+};
+
+struct closure {
+    uint64_t      timeout_ns;           // pulses must stop within this
+    uint64_t      window_ns;            // ... then none during this
+    struct {                            // recent pulses (ring)
+	uint64_t      ts[CLOSURE_RECENT];
+	unsigned int  next;
+	unsigned int  count;
+    } recent;
+    bool          active;               // a check is running
+    uint64_t      closed_ns;            // valve closed
+    uint64_t      last_pulse_ns;        // last residual pulse, 0 = none
+    unsigned long residual;             // pulses within the timeout
+    unsigned long late;                 // pulses after the timeout
+};
+
+struct closure_history {
+    unsigned long verified;             // checks concluded so far
+    unsigned long failed;
+    unsigned int  count;                // time to last pulse (ring)
+    unsigned int  next;
+    uint64_t      ttlp_ns[CLOSURE_HISTORY];
+};
+
+// Start a check for a closure at `closed_ns` (replacing any running one).
+// CLOSURE_FAILED if the pulses already recorded fail it.
+enum closure_result closure_start(struct closure *c, uint64_t closed_ns);
+
+// Drop the running check (valve reopened).
+void closure_cancel(struct closure *c);
+
+// Record a pulse at `ts`. CLOSURE_FAILED if it fails the running check.
+enum closure_result closure_pulse(struct closure *c, uint64_t ts);
+
+// Time moved to `now`: CLOSURE_VERIFIED once the window elapsed without a
+// late pulse.
+enum closure_result closure_tick(struct closure *c, uint64_t now);
+
+// When the running check concludes if no pulse comes (0 = no check).
+uint64_t closure_deadline(const struct closure *c);
+
+// Time from the closure to its last residual pulse (0 = none).
+uint64_t closure_time_to_last_pulse(const struct closure *c);
+
+// Account a concluded check.
+void closure_record(struct closure_history *h, const struct closure *c,
+		    enum closure_result result);
+
+// Time to last pulse of the verified checks: mean and max over the
+// history, and the i-th one from the oldest (i < h->count).
+uint64_t closure_history_mean(const struct closure_history *h);
+uint64_t closure_history_max(const struct closure_history *h);
+uint64_t closure_history_at(const struct closure_history *h, unsigned int i);
+
+#endif
@@ -7,8 +7,10 @@
  *   - reduced_latency(): switch to the SCHED_FIFO real-time scheduler
  *     and lock memory, to keep pulse counting / valve control responsive.
  *   - A thin MQTT wrapper around libmosquitto (mqtt_*): connection,
- *     automatic reconnection with re-subscription, printf-style publish,
- *     and configuration from the MQTT_* environment variables.
+ *     automatic reconnection (exponential backoff with jitter) with
+ *     re-subscription, fail-over between several brokers, connection-quality
+ *     statistics, printf-style publish, and configuration from the MQTT_*
+ *     environment variables.
  */
 
 #include <unistd.h>
@@ -22,10 +24,16 @@
 #include <assert.h>
 #include <time.h>
 #include <sched.h>
+#include <signal.h>
 #include <sys/mman.h>
+#include <sys/timex.h>
 #include <sys/ioctl.h>
 #include <fcntl.h>
 #include <dirent.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <linux/gpio.h>
 #include <mosquitto.h>
@@ -87,9 +95,15 @@ rpi_gpio_chip(void)
 
 
 int
-gpio_open_line(const char *chip, uint32_t pin, const char *label,
-	       struct gpio_v2_line_request *req)
+gpio_open_lines(const char *chip, const uint32_t *pins, unsigned int count,
+		const char *label, struct gpio_v2_line_request *req)
 {
+    if ((count == 0) || (count > GPIO_V2_LINES_MAX)) {
+	errno = EINVAL;
+	LOG_ERRNO("unsupported number of GPIO lines (%u)", count);
+	return -1;
+    }
+
     // Build device path "/dev/<chip>"
     char *devpath = NULL;
     if (asprintf(&devpath, "/dev/%s", chip) < 0) {
@@ -109,21 +123,33 @@ gpio_open_line(const char *chip, uint32_t pin, const char *label,
     free(devpath);
 
     // The caller has filled req->config (flags/attrs); we own the
-    // single-line plumbing.
-    req->num_lines  = 1;
-    req->offsets[0] = pin;
+    // lines plumbing.
+    req->num_lines  = count;
+    for (unsigned int i = 0 ; i < count ; i++)
+	req->offsets[i] = pins[i];
     strncpy(req->consumer, label, sizeof(req->consumer) - 1);
 
     if (ioctl(fd, GPIO_V2_GET_LINE_IOCTL, req) < 0) {
-	LOG_ERRNO("failed to issue GPIO_V2_GET_LINE IOCTL for pin %u", pin);
+	LOG_ERRNO("failed to issue GPIO_V2_GET_LINE IOCTL for pin %u%s",
+		  pins[0], (count > 1) ? " (and others)" : "");
 	close(fd);
 	return -1;
     }
-    LOG("GPIO line configured as single pin %u (fd=%d)", pin, req->fd);
+    if (count == 1)
+	LOG("GPIO line configured as single pin %u (fd=%d)", pins[0], req->fd);
+    else
+	LOG("GPIO lines configured as %u pins (fd=%d)", count, req->fd);
 
     return fd;
 }
 
+int
+gpio_open_line(const char *chip, uint32_t pin, const char *label,
+	       struct gpio_v2_line_request *req)
+{
+    return gpio_open_lines(chip, &pin, 1, label, req);
+}
+
 
 /************************************************************************
  * Parsers                                                              *
@@ -151,6 +177,104 @@ parse_mbus_baudrate(const char *option, long *val)
 }
 
 
+int
+parse_pulse_volume(const char *option, double *val)
+{
+    char  *end = NULL;
+    double   v = strtod(option, &end);
+
+    // Liters, optionally suffixed
+    if ((*option == '\0') || (end == option))
+	return -1;
+    if ((*end != '\0') && (strcmp(end, "L") != 0) && (strcmp(end, "l") != 0))
+	return -1;
+    if (!(v >= 0.001) || !(v <= 1000.0))
+	return -1;
+
+    *val = v;
+    return 0;
+}
+
+int
+parse_replay_speed(const char *option, double *val)
+{
+    // Speed-up factor, optionally suffixed, or no wait at all (0)
+    if (strcmp(option, "max") == 0) {
+	*val = 0;
+	return 0;
+    }
+
+    char  *end = NULL;
+    double   v = strtod(option, &end);
+    if ((*option == '\0') || (end == option))
+	return -1;
+    if ((*end != '\0') && (strcmp(end, "x") != 0))
+	return -1;
+    if (!(v >= 0.001) || !(v <= 1e9))
+	return -1;
+
+    *val = v;
+    return 0;
+}
+
+// Oversampling factor (1, 2, 4, 8 or 16), end of it in `end`
+static int
+_parse_oversampling_factor(const char *option, char **end, uint8_t *val)
+{
+    unsigned long v = strtoul(option, end, 10);
+    if ((*end == option) || (v == 0) || (v > 16) || (v & (v - 1)))
+	return -1;
+    *val = v;
+    return 0;
+}
+
+int
+parse_oversampling(const char *option, uint8_t osr[3])
+{
+    // Same for all, or temperature,pressure,humidity
+    char    *end = NULL;
+    uint8_t  v[3];
+    if (_parse_oversampling_factor(option, &end, &v[0]) < 0)
+	return -1;
+    if (*end == '\0') {
+	osr[0] = osr[1] = osr[2] = v[0];
+	return 0;
+    }
+    for (int i = 1 ; i < 3 ; i++)
+	if ((*end != ',') ||
+	    (_parse_oversampling_factor(end + 1, &end, &v[i]) < 0))
+	    return -1;
+    if (*end != '\0')
+	return -1;
+
+    memcpy(osr, v, sizeof(v));
+    return 0;
+}
+
+int
+parse_iir_filter(const char *option, uint8_t *val)
+{
+    // Coefficient: off (0), 2, 4, 8 or 16
+    if (strcmp(option, "off") == 0) {
+	*val = 0;
+	return 0;
+    }
+
+    char *end = NULL;
+    unsigned long v = strtoul(option, &end, 10);
+    if ((*option == '\0') || (*end != '\0'))
+	return -1;
+    switch (v) {
+    case 0: case 2: case 4: case 8: case 16:
+	break;
+    default:
+	return -1;
+    }
+
+    *val = v;
+    return 0;
+}
+
 int
 parse_s_period(const char *option, uint64_t *val)
 {
@@ -259,6 +383,29 @@ parse_gpio(const char *option, char **chip_id, uint32_t *pin_id)
     return -1;
 }
 
+int
+parse_gpio_zone(const char *option, char **name,
+		char **chip_id, uint32_t *pin_id)
+{
+    // NAME=CTRL:PIN, NAME being usable as an MQTT topic level
+    size_t len = strcspn(option, "=");
+    if ((option[len] != '=') || (len == 0) || (len > 32) ||
+	(strspn(option, "abcdefghijklmnopqrstuvwxyz0123456789_-") != len))
+	return -1;
+
+    char *_name = strndup(option, len);
+    if (_name == NULL)
+	return -1;
+    if (parse_gpio(option + len + 1, chip_id, pin_id) < 0) {
+	free(_name);
+	return -1;
+    }
+
+    if (name) *name = _name;
+    else      free(_name);
+    return 0;
+}
+
 // Return delay in micro-seconds (range: 1 micro-sec to 1 hour)
 int
 parse_gpio_debounce(const char *option, uint32_t *val)
@@ -360,10 +507,163 @@ parse_gpio_active(const char *option, uint64_t *flags)
     return 0;
 }
 
+/* Comma separated list of `host[:port]` (`[addr]:port` for IPv6), or
+ * `unix:path` for a broker listening on a Unix domain socket, in order of
+ * preference. Entries without a port get 0 (= the configured port).
+ * Returns the number of entries, or -1. The host strings are allocated
+ * (released by free_mqtt_servers()). */
+int
+parse_mqtt_servers(const char *option,
+		   struct mqtt_server *list, unsigned int max)
+{
+    unsigned int count = 0;
+    const char  *p     = option;
+
+    for (;;) {
+	size_t len = strcspn(p, ",");
+	while ((len > 0) && ((*p == ' ') || (*p == '\t'))) { p++; len--; }
+	while ((len > 0) && ((p[len-1] == ' ') || (p[len-1] == '\t'))) len--;
+	if ((len == 0) || (count >= max))
+	    goto failed;
+
+	const char *host    = p;
+	size_t      hostlen = len;
+	const char *port    = NULL;
+	bool        local   = false;
+	if (strncmp(p, "unix:", 5) == 0) {              // unix:path
+	    host    = p   + 5;
+	    hostlen = len - 5;
+	    local   = true;
+	    if (hostlen == 0) goto failed;
+	} else if (*p == '[') {                         // [addr]:port
+	    const char *end = memchr(p, ']', len);
+	    if ((end == NULL) || (end == p + 1)) goto failed;
+	    host    = p + 1;
+	    hostlen = end - host;
+	    if (end + 1 < p + len) {
+		if (end[1] != ':') goto failed;
+		port = end + 2;
+	    }
+	} else {
+	    const char *colon = memchr(p, ':', len);
+	    if (colon && !memchr(colon + 1, ':', p + len - colon - 1)) {
+		hostlen = colon - p;                    // host:port
+		port    = colon + 1;
+	    }                                           // else bare IPv6
+	    if (hostlen == 0) goto failed;
+	}
+
+	int portnum = 0;
+	if (port) {
+	    char *endptr;
+	    long  v = strtol(port, &endptr, 10);
+	    if ((*port < '0') || (*port > '9') || (endptr != p + len) ||
+		(v <= 0) || (v > 65535))
+		goto failed;
+	    portnum = v;
+	}
+
+	list[count] = (struct mqtt_server) {
+	    .host  = strndup(host, hostlen),
+	    .port  = portnum,
+	    .local = local,
+	};
+	if (list[count].host == NULL)
+	    goto failed;
+	count++;
+
+	p += strcspn(p, ",");
+	if (*p == '\0')
+	    return count;
+	p++;
+    }
+
+ failed:
+    free_mqtt_servers(list, count);
+    return -1;
+}
+
+/* Release the host and name strings of the first `count` entries of
+ * `list`. */
+void
+free_mqtt_servers(struct mqtt_server *list, unsigned int count)
+{
+    for (unsigned int i = 0 ; i < count ; i++) {
+	free(list[i].host);
+	free(list[i].name);
+	list[i].host = NULL;
+	list[i].name = NULL;
+    }
+}
+
+/************************************************************************
+ * Files                                                                *
+ ************************************************************************/
+
+int
+atomic_write_file(const char *path,
+		  void (*write)(FILE *f, const void *ctx), const void *ctx)
+{
+    char *tmp;
+    if (asprintf(&tmp, "%s.tmp", path) < 0)
+	return -1;
+
+    FILE *f = fopen(tmp, "w");
+    if (f == NULL) {
+	free(tmp);
+	return -1;
+    }
+
+    write(f, ctx);
+
+    // Data on disk before the rename, so a crash leaves either version
+    int rc = 0;
+    if ((fflush(f) != 0) || (fsync(fileno(f)) < 0))
+	rc = -1;
+    if ((fclose(f) != 0) || (rc < 0) || (rename(tmp, path) < 0)) {
+	int errno_saved = errno;
+	unlink(tmp);
+	errno = errno_saved;
+	rc = -1;
+    }
+    free(tmp);
+    return rc;
+}
+
+
+
 /************************************************************************
  * System tuning                                                        *
  ************************************************************************/
 
+uint64_t
+clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+
+uint64_t
+clock_monotonic_to_realtime(uint64_t mono_ns)
+{
+    // Bracket the realtime read to keep the offset error to a minimum
+    uint64_t m0 = clock_ns(CLOCK_MONOTONIC);
+    uint64_t rt = clock_ns(CLOCK_REALTIME);
+    uint64_t m1 = clock_ns(CLOCK_MONOTONIC);
+    return rt - (m0 + (m1 - m0) / 2) + mono_ns;
+}
+
+
+bool
+clock_synced(void)
+{
+    struct timex tx = { 0 };
+    return adjtimex(&tx) != TIME_ERROR;
+}
+
+
 void
 sleep_until(clockid_t clock, const struct timespec *deadline)
 {
@@ -403,6 +703,11 @@ reduced_latency(void)
  * Mosquitto                                                            *
  ************************************************************************/
 
+// Period of the preferred server health checks, while on a fallback (s)
+#define MQTT_PROBE_PERIOD 5
+
+static void _mqtt_publish_stats(struct mqtt *mqtt);
+
 // Callback called when the client receives a CONNACK message from the broker.
 static void
 _mqtt_on_connect(struct mosquitto *mosq, void *obj, int reason_code)
@@ -410,6 +715,10 @@ _mqtt_on_connect(struct mosquitto *mosq, void *obj, int reason_code)
     struct mqtt *mqtt = obj;
     
     if (reason_code != 0) {
+	pthread_mutex_lock(&mqtt->stats_lock);
+	mqtt->stats.connect_failures++;
+	pthread_mutex_unlock(&mqtt->stats_lock);
+
 	// mosquitto_connack_string() produces an appropriate
 	// string for MQTT v3.x clients, the equivalent for MQTT v5.0
 	// clients is mosquitto_reason_string().
@@ -421,13 +730,39 @@ _mqtt_on_connect(struct mosquitto *mosq, void *obj, int reason_code)
 	} else {
 	    LOG("connection failed [DISCONNECTING] (%s)",
 		mosquitto_connack_string(reason_code));
+	    pthread_mutex_lock(&mqtt->stats_lock);
+	    mqtt->stopping = true;
+	    pthread_mutex_unlock(&mqtt->stats_lock);
 	    mosquitto_disconnect(mosq);
 	}
 	return;
     }
 
-    // Reset retry counter
+    // Reset retry counter, backoff and fail-over round
     mqtt->connection_retry = mqtt->cfg.connection_max_retry;
+    mqtt->backoff          = 0;
+    mqtt->tried            = 0;
+
+    // Connection quality: how long the handshake took, and how long we
+    // were offline if this is a reconnection.
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mqtt->stats_lock);
+    struct mqtt_stats *st = &mqtt->stats;
+    st->connects++;
+    st->connected_at_ns    = now;
+    st->connect_latency_ns = now - st->attempt_at_ns;
+    if (st->disconnected_at_ns) {
+	st->reconnect_ns  = now - st->disconnected_at_ns;
+	st->offline_ns   += st->reconnect_ns;
+    }
+    if ((st->connects > 1) && (st->server != mqtt->server)) {
+	st->switchovers++;
+	st->switchover_ns = st->reconnect_ns;
+    }
+    st->server = mqtt->server;
+    pthread_mutex_unlock(&mqtt->stats_lock);
+    LOG("MQTT connected to %s (latency %.1f ms)",
+	mqtt->cfg.servers[mqtt->server].name, st->connect_latency_ns / 1e6);
 
     // Announce we are online (retained), so a freshly connecting client
     // immediately knows the program is alive. Mirrors the last will set in
@@ -454,6 +789,894 @@ _mqtt_on_connect(struct mosquitto *mosq, void *obj, int reason_code)
 	    return;
 	}
     }
+
+    // Tell how the link behaved while we were away.
+    _mqtt_publish_stats(mqtt);
+}
+
+
+// Callback called when the connection to the broker is lost, or after a
+// mosquitto_disconnect() (reason_code 0).
+static void
+_mqtt_on_disconnect(struct mosquitto *mosq, void *obj, int reason_code)
+{
+    (void)mosq;
+    struct mqtt *mqtt = obj;
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mqtt->stats_lock);
+    struct mqtt_stats *st = &mqtt->stats;
+    if (st->connected_at_ns) {
+	st->disconnects++;
+	st->last_reason        = reason_code;
+	st->disconnected_at_ns = now;
+	st->connected_at_ns    = 0;
+	// Still unacknowledged: libmosquitto sends them again once
+	// reconnected, their latency then including the outage.
+	st->unacked_last       = st->inflight;
+	st->unacked           += st->inflight;
+    }
+    pthread_mutex_unlock(&mqtt->stats_lock);
+
+    LOG_ERRMQTT(reason_code, "MQTT disconnected");
+    PUT_DATA("mqtt", "disconnects=%lu,reason=%d",
+	     st->disconnects, reason_code);
+}
+
+
+unsigned int
+mqtt_backoff_delay(unsigned int min, unsigned int max,
+		   unsigned int attempt, unsigned int rnd)
+{
+    // min * 2^attempt, saturating at max
+    uint64_t step = min;
+    while ((attempt-- > 0) && (step < max))
+	step <<= 1;
+    if (step > max) step = max;
+
+    // Equal jitter: [step/2, step]
+    uint64_t half = step / 2;
+    return half + (half ? rnd % (step - half + 1) : 0);
+}
+
+
+void
+mqtt_get_stats(struct mqtt *mqtt, struct mqtt_stats *stats)
+{
+    pthread_mutex_lock(&mqtt->stats_lock);
+    *stats = mqtt->stats;
+    pthread_mutex_unlock(&mqtt->stats_lock);
+}
+
+
+const unsigned int mqtt_ack_bounds_us[MQTT_ACK_BUCKETS - 1] = {
+    500, 1000, 2000, 5000, 10000, 20000, 50000,
+    100000, 200000, 500000, 1000000,
+};
+
+unsigned int
+mqtt_ack_bucket(uint64_t latency_ns)
+{
+    unsigned int b = 0;
+    while ((b < MQTT_ACK_BUCKETS - 1) &&
+	   (latency_ns > mqtt_ack_bounds_us[b] * 1000ull))
+	b++;
+    return b;
+}
+
+
+int
+mqtt_get_topic_stats(struct mqtt *mqtt, const char *topic,
+		     struct mqtt_topic_stats *stats)
+{
+    int rc = -1;
+    pthread_mutex_lock(&mqtt->stats_lock);
+    for (unsigned int i = 0 ; i < mqtt->pubstatcount ; i++)
+	if (strcmp(mqtt->pubstats[i].topic, topic) == 0) {
+	    *stats = mqtt->pubstats[i];
+	    rc = 0;
+	    break;
+	}
+    pthread_mutex_unlock(&mqtt->stats_lock);
+    return rc;
+}
+
+
+// Remember a QoS 1/2 message until its acknowledgement (stats_lock held).
+static void
+_mqtt_track_publish(struct mqtt *mqtt, const char *topic, int mid)
+{
+    struct mqtt_stats *st = &mqtt->stats;
+
+    // Topic entry (a handful of topics per program: linear search)
+    unsigned int t;
+    for (t = 0 ; t < mqtt->pubstatcount ; t++)
+	if (strcmp(mqtt->pubstats[t].topic, topic) == 0)
+	    break;
+    if (t == mqtt->pubstatcount) {
+	struct mqtt_topic_stats *list =
+	    reallocarray(mqtt->pubstats, t + 1, sizeof(*list));
+	char *dup = strdup(topic);
+	if ((list == NULL) || (dup == NULL)) {
+	    if (list) mqtt->pubstats = list;
+	    free(dup);
+	    st->untracked++;
+	    return;
+	}
+	list[t] = (struct mqtt_topic_stats) { .topic = dup };
+	mqtt->pubstats = list;
+	mqtt->pubstatcount++;
+    }
+    mqtt->pubstats[t].sent++;
+
+    // In-flight slot
+    for (unsigned int i = 0 ; i < MQTT_TRACK_MAX ; i++)
+	if (mqtt->inflight[i].mid == 0) {
+	    mqtt->inflight[i] = (struct mqtt_inflight) {
+		.mid     = mid,
+		.topic   = t,
+		.sent_ns = clock_ns(CLOCK_MONOTONIC),
+	    };
+	    if (++st->inflight > st->inflight_max)
+		st->inflight_max = st->inflight;
+	    return;
+	}
+    st->untracked++;
+}
+
+
+// Callback called when a message has been fully sent: PUBACK (QoS 1) or
+// PUBCOMP (QoS 2) received, or written out for QoS 0 (not tracked).
+static void
+_mqtt_on_publish(struct mosquitto *mosq, void *obj, int mid)
+{
+    (void)mosq;
+    struct mqtt *mqtt = obj;
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mqtt->stats_lock);
+    for (unsigned int i = 0 ; i < MQTT_TRACK_MAX ; i++) {
+	struct mqtt_inflight *m = &mqtt->inflight[i];
+	if (m->mid != mid)
+	    continue;
+
+	struct mqtt_topic_stats *ts = &mqtt->pubstats[m->topic];
+	uint64_t latency = now - m->sent_ns;
+	ts->acked++;
+	ts->total_ns += latency;
+	if (latency > ts->max_ns) ts->max_ns = latency;
+	ts->hist[mqtt_ack_bucket(latency)]++;
+
+	m->mid = 0;
+	mqtt->stats.inflight--;
+	break;
+    }
+    pthread_mutex_unlock(&mqtt->stats_lock);
+}
+
+
+bool
+mqtt_bucket_take(struct mqtt_bucket *b, unsigned int burst,
+		 unsigned int rate, uint64_t now_ns)
+{
+    if (rate == 0)
+	return false;
+
+    uint64_t period = 60000000000ull / rate;
+    uint64_t refill = (now_ns - b->at_ns) / period;
+    if ((b->at_ns == 0) || (b->tokens + refill >= burst)) {
+	b->tokens = burst;
+	b->at_ns  = now_ns;
+    } else {
+	b->tokens += refill;
+	b->at_ns  += refill * period;
+    }
+
+    if (b->tokens == 0)
+	return false;
+    b->tokens--;
+    return true;
+}
+
+
+// Publish the error condition if something is due and the bucket allows
+// (errors_lock held): a raise or a clear at once, new occurrences of an
+// ongoing condition once per summary period.
+static void
+_mqtt_error_send(struct mqtt *mqtt, struct mqtt_error *e, uint64_t now)
+{
+    bool due = e->changed ||
+	       (e->active && (e->count > e->reported) &&
+		(now - e->sent_ns >= mqtt->cfg.error_summary * 1000000000ull));
+    if (!due)
+	return;
+    if (!mqtt_bucket_take(&mqtt->error_bucket, MQTT_ERROR_BURST,
+			  mqtt->cfg.error_rate, now))
+	return;
+
+    // Readings held in batches go out first, ahead of the news
+    if (e->changed)
+	mqtt_flush(mqtt);
+
+    int rc = mqtt_publish(mqtt, e->topic, e->qos, false,
+			  "{ "
+			    "\"source\": \"%s\", "
+			    "\"type\": \"%s\", "
+			    "\"msg\": \"%s\", "
+			    "\"state\": \"%s\", "
+			    "\"count\": %lu, "
+			    "\"first\": %.3f, "
+			    "\"last\": %.3f"
+			  " }",
+			  e->source, e->type, e->msg,
+			  e->active ? "active" : "cleared", e->count,
+			  e->first_ns / 1e9, e->last_ns / 1e9);
+    if (rc < 0)
+	return;                         // retried on the next flush
+    e->changed  = false;
+    e->reported = e->count;
+    e->sent_ns  = now;
+
+    pthread_mutex_lock(&mqtt->stats_lock);
+    mqtt->stats.errors_sent++;
+    pthread_mutex_unlock(&mqtt->stats_lock);
+}
+
+
+static struct mqtt_error *
+_mqtt_error_find(struct mqtt *mqtt, const char *topic,
+		 const char *source, const char *type)
+{
+    for (unsigned int i = 0 ; i < mqtt->errorcount ; i++) {
+	struct mqtt_error *e = &mqtt->errors[i];
+	if ((strcmp(e->topic,  topic)  == 0) &&
+	    (strcmp(e->source, source) == 0) &&
+	    (strcmp(e->type,   type)   == 0))
+	    return e;
+    }
+    return NULL;
+}
+
+
+void
+mqtt_error(struct mqtt *mqtt, const char *topic, int qos,
+	   const char *source, const char *type, const char *msg)
+{
+    if ((mqtt == NULL) || (topic == NULL))
+	return;
+
+    uint64_t now      = clock_ns(CLOCK_MONOTONIC);
+    uint64_t realtime = clock_ns(CLOCK_REALTIME);
+
+    pthread_mutex_lock(&mqtt->stats_lock);
+    mqtt->stats.errors++;
+    pthread_mutex_unlock(&mqtt->stats_lock);
+
+    pthread_mutex_lock(&mqtt->errors_lock);
+    struct mqtt_error *e = _mqtt_error_find(mqtt, topic, source, type);
+    if ((e == NULL) && (mqtt->errorcount < MQTT_ERROR_MAX)) {
+	e = &mqtt->errors[mqtt->errorcount++];
+	*e = (struct mqtt_error) {
+	    .topic = topic, .source = source, .type = type,
+	};
+    }
+    if (e == NULL) {
+	pthread_mutex_unlock(&mqtt->errors_lock);
+	pthread_mutex_lock(&mqtt->stats_lock);
+	mqtt->stats.errors_dropped++;
+	pthread_mutex_unlock(&mqtt->stats_lock);
+	return;
+    }
+
+    if (!e->active) {
+	e->active   = true;
+	e->changed  = true;
+	e->count    = 0;
+	e->reported = 0;
+	e->first_ns = realtime;
+	mqtt->errors_active++;
+    }
+    e->msg     = msg;
+    e->qos     = qos;
+    e->count++;
+    e->last_ns = realtime;
+    _mqtt_error_send(mqtt, e, now);
+    pthread_mutex_unlock(&mqtt->errors_lock);
+}
+
+
+void
+mqtt_error_clear(struct mqtt *mqtt, const char *topic,
+		 const char *source, const char *type)
+{
+    // Hot paths clear on every success: nothing to do most of the time
+    if ((mqtt == NULL) || (topic == NULL) || (mqtt->errors_active == 0))
+	return;
+
+    pthread_mutex_lock(&mqtt->errors_lock);
+    struct mqtt_error *e = _mqtt_error_find(mqtt, topic, source, type);
+    if (e && e->active) {
+	e->active  = false;
+	e->changed = true;
+	mqtt->errors_active--;
+	_mqtt_error_send(mqtt, e, clock_ns(CLOCK_MONOTONIC));
+    }
+    pthread_mutex_unlock(&mqtt->errors_lock);
+}
+
+
+int
+mqtt_get_error(struct mqtt *mqtt, const char *topic,
+	       const char *source, const char *type, struct mqtt_error *error)
+{
+    pthread_mutex_lock(&mqtt->errors_lock);
+    struct mqtt_error *e = _mqtt_error_find(mqtt, topic, source, type);
+    if (e)
+	*error = *e;
+    pthread_mutex_unlock(&mqtt->errors_lock);
+    return e ? 0 : -1;
+}
+
+
+// Summaries, and the messages held back by the bucket. Called from the
+// network loop.
+static void
+_mqtt_error_flush(struct mqtt *mqtt)
+{
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mqtt->errors_lock);
+    for (unsigned int i = 0 ; i < mqtt->errorcount ; i++)
+	_mqtt_error_send(mqtt, &mqtt->errors[i], now);
+    pthread_mutex_unlock(&mqtt->errors_lock);
+}
+
+
+// Publish a formatted payload (freed here)
+static int
+_mqtt_publish_data(struct mqtt *mqtt, const char *topic, int qos, bool retain,
+		   char *data, int datalen)
+{
+    // QoS 1/2 are tracked until acknowledged. The lock is held across
+    // the publish so the ack cannot be processed before the tracking.
+    int mid;
+    pthread_mutex_lock(&mqtt->stats_lock);
+    int rc = mosquitto_publish(mqtt->mosq, &mid, topic,
+			       datalen, data, qos, retain);
+    if ((rc == MOSQ_ERR_SUCCESS) && (qos > 0))
+	_mqtt_track_publish(mqtt, topic, mid);
+    pthread_mutex_unlock(&mqtt->stats_lock);
+
+    if (rc != MOSQ_ERR_SUCCESS) {
+	LOG_ERRMQTT_PUBLISH(rc, topic);
+	rc = -1;
+    } else {
+	rc = 1;
+    }
+
+    free(data);
+    return rc;
+}
+
+
+// Publish the readings of a batch as one array (batch_lock held). The
+// capture times are converted to wall-clock time now.
+static int
+_mqtt_batch_flush(struct mqtt *mqtt, struct mqtt_batch *b)
+{
+    if (b->count == 0)
+	return 0;
+
+    bool     synced = clock_synced();
+    uint64_t offset = clock_monotonic_to_realtime(0);
+
+    char   *data = NULL;
+    size_t  size = 0;
+    FILE   *f    = open_memstream(&data, &size);
+    if (f) {
+	fprintf(f, "[");
+	for (unsigned int i = 0 ; i < b->count ; i++)
+	    fprintf(f, "%s{ \"ts\": %.3f, \"value\": %s, \"synced\": %s }",
+		    i ? ", " : " ",
+		    (b->readings[i].ts_ns + offset) / 1e9,
+		    b->readings[i].value, synced ? "true" : "false");
+	fprintf(f, " ]");
+    }
+
+    int rc = -1;
+    if ((f == NULL) || (fclose(f) != 0)) {
+	free(data);
+	LOG("failed to allocate memory for MQTT batch");
+    } else {
+	rc = _mqtt_publish_data(mqtt, b->topic, b->qos, false, data, size);
+    }
+
+    for (unsigned int i = 0 ; i < b->count ; i++)
+	free(b->readings[i].value);
+    b->count = 0;
+    b->qos   = 0;
+    return rc;
+}
+
+
+void
+mqtt_flush(struct mqtt *mqtt)
+{
+    pthread_mutex_lock(&mqtt->batch_lock);
+    for (unsigned int i = 0 ; i < mqtt->batchcount ; i++)
+	_mqtt_batch_flush(mqtt, &mqtt->batches[i]);
+    pthread_mutex_unlock(&mqtt->batch_lock);
+}
+
+
+// Batches whose oldest reading reached cfg.batch_age. Called from the
+// network loop.
+static void
+_mqtt_batch_flush_aged(struct mqtt *mqtt)
+{
+    if (mqtt->cfg.batch_age == 0)
+	return;
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_lock(&mqtt->batch_lock);
+    for (unsigned int i = 0 ; i < mqtt->batchcount ; i++) {
+	struct mqtt_batch *b = &mqtt->batches[i];
+	if (b->count &&
+	    (now - b->oldest_ns >= mqtt->cfg.batch_age * 1000000000ull))
+	    _mqtt_batch_flush(mqtt, b);
+    }
+    pthread_mutex_unlock(&mqtt->batch_lock);
+}
+
+
+char *
+mqtt_stats_json(struct mqtt *mqtt)
+{
+    struct mqtt_stats st;
+    mqtt_get_stats(mqtt, &st);
+
+    uint64_t now    = clock_ns(CLOCK_MONOTONIC);
+    uint64_t uptime = st.connected_at_ns ? now - st.connected_at_ns : 0;
+    const char *server = mqtt->cfg.servers[st.server].name;
+
+    char *json = NULL;
+    if (asprintf(&json,
+		 "{ "
+		   "\"server\": \"%s\", "
+		   "\"connects\": %lu, "
+		   "\"connect_failures\": %lu, "
+		   "\"disconnects\": %lu, "
+		   "\"last_reason\": %d, "
+		   "\"last_reason_msg\": \"%s\", "
+		   "\"connect_latency_ms\": %.3f, "
+		   "\"reconnect_s\": %.3f, "
+		   "\"offline_s\": %.3f, "
+		   "\"uptime_s\": %.3f, "
+		   "\"switchovers\": %lu, "
+		   "\"switchover_ms\": %.3f, "
+		   "\"inflight\": %u, "
+		   "\"inflight_max\": %u, "
+		   "\"unacked_last\": %u, "
+		   "\"unacked\": %lu, "
+		   "\"untracked\": %lu, "
+		   "\"errors\": %lu, "
+		   "\"errors_sent\": %lu, "
+		   "\"errors_dropped\": %lu"
+		 " }",
+		 server ? server : "",
+		 st.connects, st.connect_failures, st.disconnects,
+		 st.last_reason, mosquitto_strerror(st.last_reason),
+		 st.connect_latency_ns / 1e6, st.reconnect_ns / 1e9,
+		 st.offline_ns / 1e9, uptime / 1e9,
+		 st.switchovers, st.switchover_ns / 1e6,
+		 st.inflight, st.inflight_max, st.unacked_last, st.unacked,
+		 st.untracked, st.errors, st.errors_sent,
+		 st.errors_dropped) < 0)
+	return NULL;
+    return json;
+}
+
+
+char *
+mqtt_acks_json(struct mqtt *mqtt)
+{
+    char   *json = NULL;
+    size_t  size = 0;
+    FILE   *f    = open_memstream(&json, &size);
+    if (f == NULL)
+	return NULL;
+
+    fprintf(f, "{ \"bounds_ms\": [");
+    for (unsigned int b = 0 ; b < MQTT_ACK_BUCKETS - 1 ; b++)
+	fprintf(f, "%s%g", b ? ", " : " ", mqtt_ack_bounds_us[b] / 1e3);
+    fprintf(f, " ], \"topics\": {");
+
+    pthread_mutex_lock(&mqtt->stats_lock);
+    for (unsigned int i = 0 ; i < mqtt->pubstatcount ; i++) {
+	const struct mqtt_topic_stats *ts = &mqtt->pubstats[i];
+	fprintf(f, "%s \"%s\": { \"sent\": %lu, \"acked\": %lu, "
+		   "\"mean_ms\": %.3f, \"max_ms\": %.3f, \"hist\": [",
+		i ? "," : "", ts->topic, ts->sent, ts->acked,
+		ts->acked ? ts->total_ns / 1e6 / ts->acked : 0.0,
+		ts->max_ns / 1e6);
+	for (unsigned int b = 0 ; b < MQTT_ACK_BUCKETS ; b++)
+	    fprintf(f, "%s%lu", b ? ", " : " ", ts->hist[b]);
+	fprintf(f, " ] }");
+    }
+    pthread_mutex_unlock(&mqtt->stats_lock);
+
+    fprintf(f, " } }");
+    if (fclose(f) != 0) {
+	free(json);
+	return NULL;
+    }
+    return json;
+}
+
+
+static void
+_mqtt_publish_stats(struct mqtt *mqtt)
+{
+    if (mqtt->stats_topic == NULL)
+	return;
+
+    char *json = mqtt_stats_json(mqtt);
+    if (json)
+	mqtt_publish(mqtt, mqtt->stats_topic, 0, true, "%s", json);
+    free(json);
+
+    json = mqtt_acks_json(mqtt);
+    if (json && mqtt->acks_topic)
+	mqtt_publish(mqtt, mqtt->acks_topic, 0, true, "%s", json);
+    free(json);
+}
+
+
+// Local query: SIGUSR1 (kept blocked, see mqtt_start) dumps the
+// statistics on stderr. Polled from the network loop.
+static void
+_mqtt_query_stats(struct mqtt *mqtt)
+{
+    sigset_t        set;
+    struct timespec zero = { 0 };
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    if (sigtimedwait(&set, NULL, &zero) != SIGUSR1)
+	return;
+
+    char *stats = mqtt_stats_json(mqtt);
+    char *acks  = mqtt_acks_json(mqtt);
+    fprintf(stderr, "%s: mqtt stats %s\n", __progname, stats ? stats : "{}");
+    fprintf(stderr, "%s: mqtt acks %s\n",  __progname, acks  ? acks  : "{}");
+    free(stats);
+    free(acks);
+}
+
+
+// Health check: start a TCP connection to the server. Returns the socket
+// (connection possibly still in progress), or -1.
+static int
+_mqtt_probe_start(const struct mqtt_server *srv)
+{
+    if (srv->local) {
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	if (strlen(srv->host) >= sizeof(sun.sun_path))
+	    return -1;
+	strcpy(sun.sun_path, srv->host);
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if ((fd >= 0) &&
+	    (connect(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) &&
+	    (errno != EINPROGRESS) && (errno != EAGAIN)) {
+	    close(fd);
+	    fd = -1;
+	}
+	return fd;
+    }
+
+    char port[8];
+    snprintf(port, sizeof(port), "%d", srv->port);
+
+    struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+    struct addrinfo *res;
+    if (getaddrinfo(srv->host, port, &hints, &res) != 0)
+	return -1;
+
+    int fd = -1;
+    for (struct addrinfo *ai = res ; ai ; ai = ai->ai_next) {
+	fd = socket(ai->ai_family,
+		    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+		    ai->ai_protocol);
+	if (fd < 0)
+	    continue;
+	if ((connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) ||
+	    (errno == EINPROGRESS))
+	    break;
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+// Health check outcome, waiting up to timeout_ms:
+// 1 = reachable, 0 = still pending, -1 = unreachable.
+static int
+_mqtt_probe_check(int fd, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLOUT };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc <= 0)
+	return rc;
+
+    int       err = 0;
+    socklen_t len = sizeof(err);
+    if ((getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || err)
+	return -1;
+    return 1;
+}
+
+static bool
+_mqtt_probe(const struct mqtt_server *srv, unsigned int timeout_ms)
+{
+    int fd = _mqtt_probe_start(srv);
+    if (fd < 0)
+	return false;
+    int rc = _mqtt_probe_check(fd, timeout_ms);
+    close(fd);
+    return rc > 0;
+}
+
+
+// Pick the server to connect to: the most preferred one that has not
+// failed since we were last online and answers a health check (with a
+// single server there is nothing to choose, so no check). -1 if none.
+static int
+_mqtt_select_server(struct mqtt *mqtt)
+{
+    if (mqtt->cfg.servercount == 1)
+	return (mqtt->tried & 1) ? -1 : 0;
+
+    for (unsigned int i = 0 ; i < mqtt->cfg.servercount ; i++) {
+	const struct mqtt_server *srv = &mqtt->cfg.servers[i];
+	if (mqtt->tried & (1u << i))
+	    continue;
+	if (_mqtt_probe(srv, mqtt->cfg.probe_timeout))
+	    return i;
+	LOG("MQTT server %s unreachable", srv->name);
+	mqtt->tried |= 1u << i;
+    }
+    return -1;
+}
+
+
+static int
+_mqtt_connect_server(struct mqtt *mqtt, unsigned int i)
+{
+    const struct mqtt_server *srv = &mqtt->cfg.servers[i];
+
+    mqtt->server = i;
+    pthread_mutex_lock(&mqtt->stats_lock);
+    mqtt->stats.attempt_at_ns = clock_ns(CLOCK_MONOTONIC);
+    pthread_mutex_unlock(&mqtt->stats_lock);
+
+    // A local broker is reached over a Unix domain socket, which
+    // libmosquitto (>= 2.0) selects with port 0; Nagle only applies to TCP.
+    mosquitto_int_option(mqtt->mosq, MOSQ_OPT_TCP_NODELAY, !srv->local);
+    int rc = mosquitto_connect(mqtt->mosq, srv->host,
+			       srv->local ? 0 : srv->port, mqtt->cfg.keepalive);
+    if (rc != MOSQ_ERR_SUCCESS) {
+	LOG_ERRMQTT(rc, "unable to connect to MQTT server %s", srv->name);
+	pthread_mutex_lock(&mqtt->stats_lock);
+	mqtt->stats.connect_failures++;
+	pthread_mutex_unlock(&mqtt->stats_lock);
+	mqtt->tried |= 1u << i;
+	return -1;
+    }
+    return 0;
+}
+
+
+// While on a fallback server, keep checking the preferred one -- without
+// blocking the network loop -- and leave for it once it has been healthy
+// for cfg.failback seconds; the move itself is done by the loop.
+static void
+_mqtt_failback(struct mqtt *mqtt)
+{
+    if ((mqtt->server == 0) || mqtt->failback.pending)
+	return;
+
+    const struct mqtt_server *srv = &mqtt->cfg.servers[0];
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+
+    // Start a probe
+    if (mqtt->failback.fd < 0) {
+	if (now < mqtt->failback.due_ns)
+	    return;
+	mqtt->failback.fd     = _mqtt_probe_start(srv);
+	mqtt->failback.due_ns = now + mqtt->cfg.probe_timeout * 1000000ull;
+	if (mqtt->failback.fd >= 0)
+	    return;
+    }
+
+    // Collect its outcome
+    int rc = (mqtt->failback.fd < 0) ? -1
+	                             : _mqtt_probe_check(mqtt->failback.fd, 0);
+    if ((rc == 0) && (now < mqtt->failback.due_ns))
+	return;
+    if (mqtt->failback.fd >= 0)
+	close(mqtt->failback.fd);
+    mqtt->failback.fd     = -1;
+    mqtt->failback.due_ns = now + MQTT_PROBE_PERIOD * 1000000000ull;
+
+    if (rc <= 0) {
+	mqtt->failback.healthy_since_ns = 0;
+	return;
+    }
+    if (mqtt->failback.healthy_since_ns == 0) {
+	mqtt->failback.healthy_since_ns = now;
+	LOG("preferred MQTT server %s is reachable again", srv->name);
+    }
+    if (now - mqtt->failback.healthy_since_ns <
+	mqtt->cfg.failback * 1000000000ull)
+	return;
+
+    // Stable: leave. A clean disconnection does not trigger the last
+    // will, so publish the offline state ourselves (queued before the
+    // DISCONNECT, so sent first). QoS 0: a QoS 1 message would still be
+    // in flight and be re-sent to the next server after our "online".
+    LOG("returning to preferred MQTT server %s", srv->name);
+    mqtt->failback.healthy_since_ns = 0;
+    mqtt->failback.pending          = true;
+    if (mqtt->avail.topic)
+	mosquitto_publish(mqtt->mosq, NULL, mqtt->avail.topic,
+			  strlen(mqtt->avail.offline), mqtt->avail.offline,
+			  0, true);
+    mosquitto_disconnect(mqtt->mosq);
+}
+
+
+// Network loop. Replaces mosquitto_loop_start() so that reconnection is
+// paced by our own backoff (with jitter) instead of libmosquitto's fixed
+// schedule, so the connection attempts can be timed, and so that we can
+// fail over between servers.
+static void *
+_mqtt_loop_task(void *parameters)
+{
+    struct mqtt *mqtt = parameters;
+
+    uint64_t next_stats = 0;
+    if (mqtt->cfg.stats_interval)
+	next_stats = clock_ns(CLOCK_MONOTONIC) +
+	             mqtt->cfg.stats_interval * 1000000000ull;
+
+    for (;;) {
+	int rc = mosquitto_loop(mqtt->mosq, 1000, 1);
+	_mqtt_query_stats(mqtt);
+
+	// Periodic stats (only meaningful, and only sent, while online)
+	uint64_t now = clock_ns(CLOCK_MONOTONIC);
+	if (next_stats && (now >= next_stats)) {
+	    if (rc == MOSQ_ERR_SUCCESS)
+		_mqtt_publish_stats(mqtt);
+	    next_stats = now + mqtt->cfg.stats_interval * 1000000000ull;
+	}
+
+	if (rc == MOSQ_ERR_SUCCESS) {
+	    _mqtt_batch_flush_aged(mqtt);
+	    _mqtt_error_flush(mqtt);
+	    _mqtt_failback(mqtt);
+	    continue;
+	}
+
+	// Connection lost or attempt failed.
+	pthread_mutex_lock(&mqtt->stats_lock);
+	bool stopping = mqtt->stopping;
+	pthread_mutex_unlock(&mqtt->stats_lock);
+	if (stopping)
+	    break;
+
+	if (mqtt->failback.fd >= 0)
+	    close(mqtt->failback.fd);
+	mqtt->failback.fd               = -1;
+	mqtt->failback.due_ns           = 0;
+	mqtt->failback.healthy_since_ns = 0;
+
+	// Deliberately left for the preferred server
+	if (mqtt->failback.pending) {
+	    mqtt->failback.pending = false;
+	    if (_mqtt_connect_server(mqtt, 0) == 0)
+		continue;
+	}
+
+	// Fail over at once to the next healthy server, if any
+	mqtt->tried |= 1u << mqtt->server;
+	int next = _mqtt_select_server(mqtt);
+	if (next >= 0) {
+	    LOG("MQTT failing over to %s", mqtt->cfg.servers[next].name);
+	    _mqtt_connect_server(mqtt, next);
+	    continue;
+	}
+
+	// Every server failed: wait, unless we are deliberately going
+	// away, then start over from the preferred one.
+	mqtt->tried = 0;
+	unsigned int delay = mqtt_backoff_delay(mqtt->cfg.reconnect_min,
+						mqtt->cfg.reconnect_max,
+						mqtt->backoff,
+						rand_r(&mqtt->seed));
+	if (mqtt->backoff < UINT_MAX)
+	    mqtt->backoff++;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec  += delay / 1000;
+	deadline.tv_nsec += (delay % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+	    deadline.tv_sec++;
+	    deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&mqtt->stats_lock);
+	while (!mqtt->stopping &&
+	       (pthread_cond_timedwait(&mqtt->loop_cond, &mqtt->stats_lock,
+				       &deadline) != ETIMEDOUT))
+	    ;
+	stopping = mqtt->stopping;
+	pthread_mutex_unlock(&mqtt->stats_lock);
+	if (stopping)
+	    break;
+
+	LOG("MQTT reconnecting (after %u ms)", delay);
+	next = _mqtt_select_server(mqtt);
+	if (next < 0) {
+	    pthread_mutex_lock(&mqtt->stats_lock);
+	    mqtt->stats.connect_failures++;
+	    pthread_mutex_unlock(&mqtt->stats_lock);
+	    continue;
+	}
+	_mqtt_connect_server(mqtt, next);
+    }
+
+    return NULL;
+}
+
+
+// Callback called when the client receives a message: hand it to the
+// callback of the (first) matching subscription.
+static void
+_mqtt_on_message(struct mosquitto *mosq, void *obj,
+		 const struct mosquitto_message *msg)
+{
+    struct mqtt *mqtt = obj;
+
+    for (unsigned int i = 0 ; i < mqtt->subcount ; i++) {
+	bool match = false;
+	if ((mqtt->sub[i].on_message == NULL) ||
+	    (mosquitto_topic_matches_sub(mqtt->sub[i].topic, msg->topic,
+					 &match) != MOSQ_ERR_SUCCESS) ||
+	    (! match))
+	    continue;
+	mqtt->sub[i].on_message(mosq, obj, msg);
+	return;
+    }
+
+    if (mqtt->on_message)
+	mqtt->on_message(mosq, obj, msg);
+}
+
+
+int
+mqtt_add_subscription(struct mqtt *mqtt, const struct mqtt_subscription *sub)
+{
+    struct mqtt_subscription *list =
+	reallocarray(mqtt->sub, mqtt->subcount + 1, sizeof(*sub));
+    if (list == NULL) {
+	LOG("unable to allocate memory");
+	return -1;
+    }
+
+    list[mqtt->subcount++] = *sub;
+    mqtt->sub = list;
+    return 0;
 }
 
 
@@ -468,17 +1691,10 @@ mqtt_init(struct mqtt *mqtt, unsigned int subcount,
     }
 
     // Deal with subscriptions
-    if ((subcount != 0) && (sub != NULL)) {
-	mqtt->subcount = subcount;
-	mqtt->sub      = calloc(subcount, sizeof(struct mqtt_subscription));
-	if (mqtt->sub != NULL) {
-	    memcpy(mqtt->sub, sub, subcount * sizeof(struct mqtt_subscription));
-	} else {
-	    LOG("unable to allocate memory");
+    for (unsigned int i = 0 ; (sub != NULL) && (i < subcount) ; i++)
+	if (mqtt_add_subscription(mqtt, &sub[i]) < 0)
 	    return -1;
-	}
-    }
-    
+
     // Mosquitto library initialization
     if (mosquitto_lib_init() != MOSQ_ERR_SUCCESS) {
 	LOG("unable to initialize MQTT library");
@@ -496,7 +1712,10 @@ mqtt_init(struct mqtt *mqtt, unsigned int subcount,
 
     // Callbacks
     mosquitto_connect_callback_set(mqtt->mosq, _mqtt_on_connect);
-    
+    mosquitto_disconnect_callback_set(mqtt->mosq, _mqtt_on_disconnect);
+    mosquitto_message_callback_set(mqtt->mosq, _mqtt_on_message);
+    mosquitto_publish_callback_set(mqtt->mosq, _mqtt_on_publish);
+
 
     // Done
     return 1;
@@ -505,6 +1724,27 @@ mqtt_init(struct mqtt *mqtt, unsigned int subcount,
 int
 mqtt_destroy(struct mqtt *mqtt)
 {
+    // Last readings (the session ends right after, so this is best effort
+    // for QoS 1/2)
+    if (mqtt->mosq)
+	mqtt_flush(mqtt);
+
+    // Stop the network loop: wake it if waiting for a reconnection,
+    // and have the current session (if any) end.
+    if (mqtt->loop_started) {
+	pthread_mutex_lock(&mqtt->stats_lock);
+	mqtt->stopping = true;
+	pthread_cond_signal(&mqtt->loop_cond);
+	pthread_mutex_unlock(&mqtt->stats_lock);
+	mosquitto_disconnect(mqtt->mosq);
+	pthread_join(mqtt->loop, NULL);
+	pthread_cond_destroy(&mqtt->loop_cond);
+	mqtt->loop_started = false;
+    }
+    if (mqtt->failback.fd >= 0)
+	close(mqtt->failback.fd);
+    mqtt->failback.fd = -1;
+
     if (mqtt->mosq)
 	mosquitto_destroy(mqtt->mosq);
     mqtt->mosq = NULL;
@@ -512,6 +1752,28 @@ mqtt_destroy(struct mqtt *mqtt)
     free(mqtt->sub);
     mqtt->sub      = NULL;
     mqtt->subcount = 0;
+
+    for (unsigned int i = 0 ; i < mqtt->pubstatcount ; i++)
+	free(mqtt->pubstats[i].topic);
+    free(mqtt->pubstats);
+    mqtt->pubstats     = NULL;
+    mqtt->pubstatcount = 0;
+
+    for (unsigned int i = 0 ; i < mqtt->batchcount ; i++) {
+	struct mqtt_batch *b = &mqtt->batches[i];
+	for (unsigned int r = 0 ; r < b->count ; r++)
+	    free(b->readings[r].value);
+	free(b->readings);
+    }
+    mqtt->batchcount = 0;
+
+    // Server list, with the host it provided if any: MQTT is disabled
+    // from then on
+    struct mqtt_config *cfg = &mqtt->cfg;
+    if ((cfg->servercount > 0) && (cfg->host == cfg->servers[0].host))
+	cfg->host = NULL;
+    free_mqtt_servers(cfg->servers, cfg->servercount);
+    cfg->servercount = 0;
     return 0;
 }
 
@@ -529,6 +1791,15 @@ mqtt_set_availability(struct mqtt *mqtt, char *topic,
 }
 
 
+void
+mqtt_set_stats(struct mqtt *mqtt, char *topic)
+{
+    mqtt->stats_topic = topic;
+    if (asprintf(&mqtt->acks_topic, "%s/acks", topic) < 0)
+	mqtt->acks_topic = NULL;
+}
+
+
 int
 mqtt_connect(struct mqtt *mqtt,
 	     unsigned int subcount, struct mqtt_subscription *sub,
@@ -536,6 +1807,8 @@ mqtt_connect(struct mqtt *mqtt,
 {
     // Create the client and register subscriptions (0 = MQTT disabled).
     int rc = mqtt_init(mqtt, subcount, sub);
+    if (rc < 0)
+	mqtt_destroy(mqtt);
     if (rc <= 0)
 	return rc;
 
@@ -545,7 +1818,7 @@ mqtt_connect(struct mqtt *mqtt,
 	mqtt_set_availability(mqtt, avail_topic, "online", "offline", 1);
 
     if (on_message)
-	mosquitto_message_callback_set(mqtt->mosq, on_message);
+	mqtt->on_message = on_message;
 
     // Connect and start the background network loop.
     if (mqtt_start(mqtt) < 0) {
@@ -565,8 +1838,6 @@ mqtt_publish(struct mqtt *mqtt, const char *topic, int qos, bool retain,
     if ((mqtt == NULL) || (mqtt->mosq == NULL) || (topic == NULL))
 	return 0;
 
-    int rc = -1;
-
     va_list ap;
     va_start(ap, fmt);
     char *data  = NULL;
@@ -575,18 +1846,96 @@ mqtt_publish(struct mqtt *mqtt, const char *topic, int qos, bool retain,
     
     if (datalen < 0) {
 	LOG("failed to allocate memory for asprintf");
-    } else {
-	rc = mosquitto_publish(mqtt->mosq, NULL, topic,
-			       datalen, data, qos, retain);
-	if (rc != MOSQ_ERR_SUCCESS) {
-	    LOG_ERRMQTT_PUBLISH(rc, topic);
-	} else {
-	    rc = 1;
+	return -1;
+    }
+
+    return _mqtt_publish_data(mqtt, topic, qos, retain, data, datalen);
+}
+
+
+int
+mqtt_publish_reading(struct mqtt *mqtt, const char *topic, int qos,
+		     bool urgent, uint64_t ts_ns, const char *fmt, ...)
+{
+    if ((mqtt == NULL) || (mqtt->mosq == NULL) || (topic == NULL))
+	return 0;
+
+    va_list ap;
+    va_start(ap, fmt);
+    char *value  = NULL;
+    int valuelen = vasprintf(&value, fmt, ap);
+    va_end(ap);
+
+    if (valuelen < 0) {
+	LOG("failed to allocate memory for asprintf");
+	return -1;
+    }
+
+    uint64_t now = clock_ns(CLOCK_MONOTONIC);
+    if (ts_ns == 0)
+	ts_ns = now;
+
+    // Not batching
+    if ((mqtt->cfg.batch_size == 0) && (mqtt->cfg.batch_age == 0)) {
+	if (!mqtt->cfg.timestamps)
+	    return _mqtt_publish_data(mqtt, topic, qos, false,
+				      value, valuelen);
+	int rc = mqtt_publish(mqtt, topic, qos, false,
+			      "{ \"value\": %s, \"ts\": %.3f, \"synced\": %s }",
+			      value, clock_monotonic_to_realtime(ts_ns) / 1e9,
+			      clock_synced() ? "true" : "false");
+	free(value);
+	return rc;
+    }
+
+    pthread_mutex_lock(&mqtt->batch_lock);
+
+    // Batch of the topic (a handful of topics per program: linear search)
+    struct mqtt_batch *b = NULL;
+    for (unsigned int i = 0 ; i < mqtt->batchcount ; i++)
+	if (strcmp(mqtt->batches[i].topic, topic) == 0) {
+	    b = &mqtt->batches[i];
+	    break;
 	}
-	
-	free(data);
+    if ((b == NULL) && (mqtt->batchcount < MQTT_BATCH_TOPICS)) {
+	struct mqtt_reading *readings =
+	    calloc(MQTT_BATCH_MAX, sizeof(*readings));
+	if (readings) {
+	    b = &mqtt->batches[mqtt->batchcount++];
+	    *b = (struct mqtt_batch) { .topic = topic, .readings = readings };
+	}
+    }
+    if (b == NULL) {                    // too many topics: sent alone
+	pthread_mutex_unlock(&mqtt->batch_lock);
+	return _mqtt_publish_data(mqtt, topic, qos, false, value, valuelen);
     }
 
+    // Append the reading
+    b->readings[b->count] = (struct mqtt_reading) {
+	.ts_ns = ts_ns,
+	.value = value,
+    };
+    if (b->count++ == 0)
+	b->oldest_ns = now;
+    if (qos > b->qos)
+	b->qos = qos;
+
+    // Flush when full, or everything on an urgent reading
+    unsigned int max = mqtt->cfg.batch_size ? mqtt->cfg.batch_size
+	                                    : MQTT_BATCH_MAX;
+    if (max > MQTT_BATCH_MAX)
+	max = MQTT_BATCH_MAX;
+    int rc = 1;
+    if (urgent) {
+	for (unsigned int i = 0 ; i < mqtt->batchcount ; i++) {
+	    int r = _mqtt_batch_flush(mqtt, &mqtt->batches[i]);
+	    if (r < 0) rc = r;
+	}
+    } else if (b->count >= max) {
+	rc = _mqtt_batch_flush(mqtt, b);
+    }
+    pthread_mutex_unlock(&mqtt->batch_lock);
+
     return rc;
 }
 	     
@@ -603,17 +1952,70 @@ mqtt_topic_prefix(void)
     return prefix ? prefix : MQTT_TOPIC_PREFIX;
 }
 
+// Read the server list from a file: `host[:port]` entries, one or more
+// (comma separated) per line, `#` starting a comment.
+static int
+_mqtt_servers_from_file(const char *path, struct mqtt_config *cfg)
+{
+    FILE *f = fopen(path, "re");
+    if (f == NULL)
+	return -1;
+
+    char   *line = NULL;
+    size_t  size = 0;
+    int     rc   = 0;
+    while (getline(&line, &size, f) >= 0) {
+	line[strcspn(line, "#\r\n")] = '\0';
+	if (line[strspn(line, " \t")] == '\0')
+	    continue;
+	int n = parse_mqtt_servers(line, &cfg->servers[cfg->servercount],
+				   MQTT_MAX_SERVERS - cfg->servercount);
+	if (n < 0) {
+	    rc = -1;
+	    break;
+	}
+	cfg->servercount += n;
+    }
+    free(line);
+    fclose(f);
+    if (rc < 0) {
+	free_mqtt_servers(cfg->servers, cfg->servercount);
+	cfg->servercount = 0;
+    }
+
+    return (cfg->servercount > 0) ? rc : -1;
+}
+
 void
 mqtt_config_from_env(struct mqtt *mqtt)
 {
     struct mqtt_config *cfg = &mqtt->cfg;
+
+    // SIGUSR1 (statistics query, see mqtt_start) blocked from start-up,
+    // before any thread exists: sent with MQTT disabled, or before the
+    // connection, it is left pending instead of killing the daemon.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
     
     // Use environment variable to overide default parameters
     char *s_host      = getenv("MQTT_HOST");
+    char *s_host_file = getenv("MQTT_HOST_FILE");
     char *s_port      = getenv("MQTT_PORT");
     char *s_client_id = getenv("MQTT_CLIENT_ID");
     if (s_host) {
-	cfg->host = s_host;
+	int n = parse_mqtt_servers(s_host, cfg->servers, MQTT_MAX_SERVERS);
+	if (n < 0)
+	    USAGE_DIE("invalid MQTT host list (host[:port],... up to %d)",
+		      MQTT_MAX_SERVERS);
+	cfg->servercount = n;
+    } else if (s_host_file) {
+	if (_mqtt_servers_from_file(s_host_file, cfg) < 0)
+	    USAGE_DIE("invalid MQTT host file %s", s_host_file);
+    }
+    if (cfg->servercount > 0) {
+	cfg->host = cfg->servers[0].host;
     }
     if (s_port) {
 	char *endptr;
@@ -626,6 +2028,94 @@ mqtt_config_from_env(struct mqtt *mqtt)
     if (s_client_id) {
 	cfg->client_id = s_client_id;
     }
+
+    // Reconnection backoff (ms resolution) and stats period
+    char *s_rc_min = getenv("MQTT_RECONNECT_MIN");
+    char *s_rc_max = getenv("MQTT_RECONNECT_MAX");
+    char *s_stats  = getenv("MQTT_STATS_INTERVAL");
+    uint64_t v;
+    if (s_rc_min) {
+	if ((parse_us_period(s_rc_min, &v) < 0) ||
+	    (v < 1000) || (v / 1000 > UINT_MAX / 2))
+	    USAGE_DIE("invalid MQTT reconnect minimum delay (1ms ..)");
+	cfg->reconnect_min = v / 1000;
+    }
+    if (s_rc_max) {
+	if ((parse_us_period(s_rc_max, &v) < 0) ||
+	    (v < 1000) || (v / 1000 > UINT_MAX / 2))
+	    USAGE_DIE("invalid MQTT reconnect maximum delay (1ms ..)");
+	cfg->reconnect_max = v / 1000;
+    }
+    if (cfg->reconnect_max < cfg->reconnect_min)
+	cfg->reconnect_max = cfg->reconnect_min;
+    if (s_stats) {
+	if (parse_idle_timeout(s_stats, &cfg->stats_interval) < 0)
+	    USAGE_DIE("invalid MQTT stats interval (1s .. 10w)");
+    }
+
+    // Dead broker detection and fail-over
+    char *s_keepalive = getenv("MQTT_KEEPALIVE");
+    char *s_probe     = getenv("MQTT_PROBE_TIMEOUT");
+    char *s_failback  = getenv("MQTT_FAILBACK");
+    if (s_keepalive) {
+	if ((parse_s_period(s_keepalive, &v) < 0) || (v < 5) || (v > 65535))
+	    USAGE_DIE("invalid MQTT keep alive (5s .. 65535s)");
+	cfg->keepalive = v;
+    }
+    if (s_probe) {
+	if ((parse_us_period(s_probe, &v) < 0) ||
+	    (v < 1000) || (v > 60000000))
+	    USAGE_DIE("invalid MQTT probe timeout (1ms .. 1min)");
+	cfg->probe_timeout = v / 1000;
+    }
+    if (s_failback) {
+	if (parse_idle_timeout(s_failback, &cfg->failback) < 0)
+	    USAGE_DIE("invalid MQTT fail-back delay (1s .. 10w)");
+    }
+
+    // Batching mode
+    char *s_batch_size = getenv("MQTT_BATCH_SIZE");
+    char *s_batch_age  = getenv("MQTT_BATCH_AGE");
+    if (s_batch_size) {
+	char *endptr;
+	long size = strtol(s_batch_size, &endptr, 10);
+	if ((*s_batch_size == '\0') || (*endptr != '\0') ||
+	    (size < 1) || (size > MQTT_BATCH_MAX))
+	    USAGE_DIE("invalid MQTT batch size (1 .. %d readings)",
+		      MQTT_BATCH_MAX);
+	cfg->batch_size = size;
+    }
+    if (s_batch_age) {
+	if (parse_idle_timeout(s_batch_age, &cfg->batch_age) < 0)
+	    USAGE_DIE("invalid MQTT batch age (1s .. 10w)");
+    }
+
+    // Capture timestamps in the payloads
+    char *s_timestamps = getenv("MQTT_TIMESTAMPS");
+    if (s_timestamps) {
+	if      (!strcmp(s_timestamps, "yes") || !strcmp(s_timestamps, "1"))
+	    cfg->timestamps = true;
+	else if (!strcmp(s_timestamps, "no")  || !strcmp(s_timestamps, "0"))
+	    cfg->timestamps = false;
+	else
+	    USAGE_DIE("invalid MQTT timestamps setting (yes, no)");
+    }
+
+    // Error reporting
+    char *s_err_rate    = getenv("MQTT_ERROR_RATE");
+    char *s_err_summary = getenv("MQTT_ERROR_SUMMARY");
+    if (s_err_rate) {
+	char *endptr;
+	long rate = strtol(s_err_rate, &endptr, 10);
+	if ((*s_err_rate == '\0') || (*endptr != '\0') ||
+	    (rate < 1) || (rate > 6000))
+	    USAGE_DIE("invalid MQTT error rate (1 .. 6000 per minute)");
+	cfg->error_rate = rate;
+    }
+    if (s_err_summary) {
+	if (parse_idle_timeout(s_err_summary, &cfg->error_summary) < 0)
+	    USAGE_DIE("invalid MQTT error summary period (1s .. 10w)");
+    }
     cfg->username = getenv("MQTT_USERNAME");
     cfg->password = getenv("MQTT_PASSWORD");
     unsetenv("MQTT_USERNAME");
@@ -642,12 +2132,49 @@ mqtt_start(struct mqtt *mqtt)
     if (mqtt->cfg.host == NULL)
 	return -1;
 
-    // Set retry
+    // Server list: the single host/port unless a fail-over list was
+    // given; entries without a port use the configured one. The entries
+    // own their strings (released by mqtt_destroy).
+    struct mqtt_config *cfg = &mqtt->cfg;
+    if (cfg->servercount == 0) {
+	bool local = strncmp(cfg->host, "unix:", 5) == 0;
+	cfg->servers[0]   = (struct mqtt_server) {
+	    .host  = strdup(local ? cfg->host + 5 : cfg->host),
+	    .port  = cfg->port,
+	    .local = local,
+	};
+	if (cfg->servers[0].host == NULL) {
+	    LOG("unable to allocate memory");
+	    return -1;
+	}
+	cfg->servercount  = 1;
+    }
+    for (unsigned int i = 0 ; i < cfg->servercount ; i++) {
+	struct mqtt_server *srv = &cfg->servers[i];
+	if (srv->port == 0)
+	    srv->port = cfg->port;
+	if (srv->name != NULL)
+	    continue;
+	int n = srv->local
+	    ? asprintf(&srv->name, "unix:%s", srv->host)
+	    : strchr(srv->host, ':')                    // IPv6
+	    ? asprintf(&srv->name, "[%s]:%d", srv->host, srv->port)
+	    : asprintf(&srv->name, "%s:%d",   srv->host, srv->port);
+	if (n < 0) {
+	    LOG("unable to allocate memory");
+	    return -1;
+	}
+    }
+
+    // Set retry, and seed the reconnection jitter so that daemons (and
+    // hosts) started together still draw different delays
     mqtt->connection_retry = mqtt->cfg.connection_max_retry;
+    mqtt->backoff          = 0;
+    mqtt->stopping         = false;
+    mqtt->failback.pending = false;
+    mqtt->seed             = (unsigned int)(clock_ns(CLOCK_REALTIME) ^
+					    ((uint64_t)getpid() << 16));
 
-    // Set options
-    mosquitto_int_option(mqtt->mosq, MOSQ_OPT_TCP_NODELAY, 1);
-    
     // Username / password
     rc = mosquitto_username_pw_set(mqtt->mosq,
 				   mqtt->cfg.username, mqtt->cfg.password);
@@ -670,20 +2197,40 @@ mqtt_start(struct mqtt *mqtt)
 	}
     }
 
-    // Connect
-    rc = mosquitto_connect(mqtt->mosq,
-			   mqtt->cfg.host, mqtt->cfg.port, mqtt->cfg.keepalive);
-    if (rc != MOSQ_ERR_SUCCESS) {
-	LOG_ERRMQTT(rc, "unable to connect to MQTT server");
+    // Connect to the most preferred server that answers (or, if none
+    // does, let the preferred one report the error)
+    mqtt->tried = 0;
+    int first = _mqtt_select_server(mqtt);
+    mqtt->tried = 0;
+    if (_mqtt_connect_server(mqtt, first < 0 ? 0 : first) < 0)
 	return -1;
-    }
 
-    // Run the network loop in a background thread
-    rc = mosquitto_loop_start(mqtt->mosq);
-    if (rc != MOSQ_ERR_SUCCESS) {
-	LOG_ERRMQTT(rc, "starting MQTT loop failed");
+    // Run the network loop in a background thread. The backoff wait is
+    // timed on CLOCK_MONOTONIC, so wall-clock steps do not disturb it.
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&mqtt->loop_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    // SIGUSR1 asks for the statistics (see _mqtt_query_stats). Blocked
+    // here (already by mqtt_config_from_env in the daemons), so for the
+    // threads started afterwards too, and collected by the loop: no
+    // handler interrupting system calls in the other threads.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    mosquitto_threaded_set(mqtt->mosq, true);
+    rc = pthread_create(&mqtt->loop, NULL, _mqtt_loop_task, mqtt);
+    if (rc != 0) {
+	errno = rc;
+	LOG_ERRNO("starting MQTT loop failed");
+	pthread_cond_destroy(&mqtt->loop_cond);
 	return -1;
     }
+    mqtt->loop_started = true;
     
     // Done
     return 0;
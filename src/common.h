@@ -2,6 +2,7 @@
 #define __COMMON_H
 
 #include <mosquitto.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <time.h>
@@ -20,6 +21,16 @@ struct gpio_v2_line_request;            // <linux/gpio.h>, only consumers need i
     { .cfg.port                 = 1883,				\
       .cfg.keepalive            = 60,				\
       .cfg.connection_max_retry = -1,				\
+      .cfg.reconnect_min        = 1000,				\
+      .cfg.reconnect_max        = 120000,			\
+      .cfg.probe_timeout        = 1000,				\
+      .cfg.failback             = 60,				\
+      .stats_lock               = PTHREAD_MUTEX_INITIALIZER,	\
+      .failback.fd              = -1,				\
+      .cfg.error_rate           = 6,				\
+      .cfg.error_summary        = 60,				\
+      .errors_lock              = PTHREAD_MUTEX_INITIALIZER,	\
+      .batch_lock               = PTHREAD_MUTEX_INITIALIZER,	\
     }
 
 #define MQTT_ADJUST_TOPIC(mqtt, _topic, prefix)	do {			\
@@ -29,18 +40,22 @@ struct gpio_v2_line_request;            // <linux/gpio.h>, only consumers need i
 	(mqtt)->topic._topic = str;					\
     } while(0)
 
-#define MQTT_ERROR_MSG(source, type, msg)			        \
-    "{ "							        \
-      "\"source\"" ": \"" source  "\", "			        \
-      "\"type\""   ": \"" type    "\", "			        \
-      "\"msg\""    ": \"" msg    "\""			        \
-    " }"
+#define MQTT_ERROR(mqtt, _topic, qos, source, type, msg)		\
+    mqtt_error((mqtt)->handler, (mqtt)->topic._topic, qos,		\
+	       source, type, msg)
+
+#define MQTT_ERROR_CLEAR(mqtt, _topic, source, type)			\
+    mqtt_error_clear((mqtt)->handler, (mqtt)->topic._topic, source, type)
+
+#define MQTT_PUBLISH_READING(mqtt, _topic, qos, urgent, ts, fmt, ...)	\
+    mqtt_publish_reading((mqtt)->handler, (mqtt)->topic._topic, qos,	\
+			 urgent, ts, fmt __VA_OPT__(,) __VA_ARGS__)
 
 #define MQTT_TOPIC_ENABLED(mqtt, _topic)				\
-    if ((mqtt)->handler.mosq && (mqtt)->topic._topic)
+    if ((mqtt)->handler->mosq && (mqtt)->topic._topic)
 
 #define MQTT_PUBLISH(mqtt, _topic, qos, retain, fmt, ...)		\
-    mqtt_publish(&(mqtt)->handler, (mqtt)->topic._topic, qos, retain,	\
+    mqtt_publish((mqtt)->handler, (mqtt)->topic._topic, qos, retain,	\
 		 fmt __VA_OPT__(,) __VA_ARGS__)
 
 
@@ -158,6 +173,9 @@ struct gpio_v2_line_request;            // <linux/gpio.h>, only consumers need i
  * Misc                                                                 *
  ************************************************************************/
 
+// Program name, defined (and set from argv[0]) by each program
+extern char *__progname;
+
 #define DIE(code, fmt, ...)						\
     do {								\
 	fprintf(stderr, "%s: " fmt "\n" , __progname			\
@@ -172,14 +190,117 @@ struct gpio_v2_line_request;            // <linux/gpio.h>, only consumers need i
  * Types                                                                *
  ************************************************************************/
 
+typedef void (*mqtt_message_cb)(struct mosquitto *mosq, void *obj,
+				const struct mosquitto_message *msg);
+
+#define MQTT_MAX_SERVERS 8
+
+struct mqtt_server {                    // Broker address
+    char    *host;                      //  - host, or socket path if local
+    int      port;                      //  - port (0 = mqtt_config.port)
+    bool     local;                     //  - Unix domain socket
+    char    *name;                      //  - for display (set on start)
+};
+
 struct mqtt_config {
-    char    *host;                      // host
+    char    *host;                      // host (preferred server)
     int      port;                      // port
+    struct mqtt_server servers[MQTT_MAX_SERVERS]; // fail-over list, by
+    unsigned int servercount;           //   preference (0 = host/port only)
     char    *client_id;                 // Client ID
     char    *username;                  // username
     char    *password;                  // password
     int      keepalive;                 // keep alive (>= 5)
     int      connection_max_retry;      // max retry (-1 = infinite)
+    unsigned int reconnect_min;         // reconnect backoff, first delay (ms)
+    unsigned int reconnect_max;         // reconnect backoff, upper bound (ms)
+    unsigned long stats_interval;       // stats re-publish period (s, 0 = off)
+    unsigned int probe_timeout;         // server health check timeout (ms)
+    unsigned long failback;             // preferred server healthy for (s)
+    unsigned int error_rate;            // error messages per minute (bucket)
+    unsigned long error_summary;        // ongoing error re-report period (s)
+    unsigned int batch_size;            // readings per message (0 = no limit)
+    unsigned long batch_age;            // oldest buffered reading (s)
+    bool     timestamps;                // readings as { value, ts, synced }
+};
+
+struct mqtt_stats {                     // Connection quality (CLOCK_MONOTONIC)
+    unsigned long connects;             //  - sessions established (CONNACK ok)
+    unsigned long connect_failures;     //  - attempts refused or unreachable
+    unsigned long disconnects;          //  - sessions lost
+    int           last_reason;          //  - last loss reason (MOSQ_ERR_*)
+    uint64_t      connect_latency_ns;   //  - last attempt -> CONNACK
+    uint64_t      reconnect_ns;         //  - last loss -> CONNACK
+    uint64_t      offline_ns;           //  - cumulated time offline
+    uint64_t      connected_at_ns;      //  - session start (0 = offline)
+    uint64_t      disconnected_at_ns;   //  - last loss (0 = none yet)
+    uint64_t      attempt_at_ns;        //  - last connection attempt
+    unsigned int  server;               //  - server of the current session
+    unsigned long switchovers;          //  - sessions on another server
+    uint64_t      switchover_ns;        //  - last switchover (loss -> CONNACK)
+    unsigned int  inflight;             //  - QoS 1/2 messages not yet acked
+    unsigned int  inflight_max;         //  - ... highest seen
+    unsigned int  unacked_last;         //  - ... at the last disconnection
+    unsigned long unacked;              //  - ... cumulated over disconnections
+    unsigned long untracked;            //  - not tracked (table full)
+    unsigned long errors;               //  - errors reported (occurrences)
+    unsigned long errors_sent;          //  - ... messages published
+    unsigned long errors_dropped;       //  - ... untracked (table full)
+};
+
+#define MQTT_ACK_BUCKETS 12             // see mqtt_ack_bucket()
+#define MQTT_TRACK_MAX   256            // QoS 1/2 messages awaiting their ack
+#define MQTT_ERROR_MAX   32             // distinct error conditions tracked
+#define MQTT_ERROR_BURST 10             // error messages sent back to back
+#define MQTT_BATCH_TOPICS 16            // topics with buffered readings
+#define MQTT_BATCH_MAX   256            // readings per message, at most
+
+struct mqtt_topic_stats {               // Acknowledgements, per topic
+    char         *topic;                //  - topic
+    unsigned long sent;                 //  - QoS 1/2 messages published
+    unsigned long acked;                //  - ... acknowledged
+    uint64_t      total_ns;             //  - cumulated ack latency
+    uint64_t      max_ns;               //  - worst ack latency
+    unsigned long hist[MQTT_ACK_BUCKETS]; // - ack latency histogram
+};
+
+struct mqtt_inflight {                  // Message awaiting PUBACK/PUBCOMP
+    int           mid;                  //  - message id (0 = free slot)
+    unsigned int  topic;                //  - index in mqtt.pubstats
+    uint64_t      sent_ns;              //  - handed to libmosquitto
+};
+
+struct mqtt_bucket {                    // Token bucket
+    unsigned int  tokens;               //  - available
+    uint64_t      at_ns;                //  - last refill (CLOCK_MONOTONIC)
+};
+
+struct mqtt_error {                     // Error condition (source, type)
+    const char   *topic;                //  - key (strings are borrowed)
+    const char   *source;
+    const char   *type;
+    const char   *msg;                  //  - last message
+    int           qos;
+    bool          active;               //  - still occurring
+    bool          changed;              //  - raised or cleared, unreported
+    unsigned long count;                //  - occurrences since raised
+    unsigned long reported;             //  - ... at the last message
+    uint64_t      first_ns;             //  - raised (CLOCK_REALTIME)
+    uint64_t      last_ns;              //  - last occurrence (CLOCK_REALTIME)
+    uint64_t      sent_ns;              //  - last message (CLOCK_MONOTONIC)
+};
+
+struct mqtt_reading {                   // Buffered reading
+    uint64_t      ts_ns;                //  - captured (CLOCK_MONOTONIC)
+    char         *value;                //  - JSON value
+};
+
+struct mqtt_batch {                     // Readings waiting to be published
+    const char   *topic;                //  - (borrowed)
+    int           qos;                  //  - highest of the readings
+    unsigned int  count;                //  - readings
+    uint64_t      oldest_ns;            //  - first one (CLOCK_MONOTONIC)
+    struct mqtt_reading *readings;      //  - (MQTT_BATCH_MAX, on first use)
 };
 
 struct mqtt_availability {              // Availability (LWT)
@@ -194,13 +315,44 @@ struct mqtt {                           // MQTT
     struct mqtt_config        cfg;      //  - mosquitto config
     unsigned int              subcount; //  - subscription count
     struct mqtt_subscription *sub;      //  - subscription list
+    mqtt_message_cb     on_message;     //  - default message callback
     int               connection_retry; //  - current retry
     struct mqtt_availability  avail;    //  - availability (LWT)
+    char                     *stats_topic; // - stats topic (NULL = disabled)
+    char                     *acks_topic;  // - per-topic ack stats topic
+    struct mqtt_stats         stats;    //  - connection quality
+    struct mqtt_topic_stats  *pubstats; //  - acknowledgements, per topic
+    unsigned int              pubstatcount;
+    struct mqtt_inflight      inflight[MQTT_TRACK_MAX];
+    pthread_mutex_t           stats_lock; // - guards stats, pubstats, inflight
+    struct mqtt_error         errors[MQTT_ERROR_MAX]; // - error conditions
+    unsigned int              errorcount;
+    _Atomic unsigned int      errors_active; // - raised, not yet cleared
+    struct mqtt_bucket        error_bucket;
+    pthread_mutex_t           errors_lock; // - guards errors, error_bucket
+    struct mqtt_batch         batches[MQTT_BATCH_TOPICS]; // - batching mode
+    unsigned int              batchcount;
+    pthread_mutex_t           batch_lock; // - guards batches
+    pthread_t                 loop;     //  - network loop thread
+    pthread_cond_t            loop_cond;//  - wakes the backoff wait
+    bool                      loop_started; // - loop thread running
+    bool                      stopping; //  - disconnect requested
+    unsigned int              backoff;  //  - failed attempts in a row
+    unsigned int              seed;     //  - jitter PRNG state
+    unsigned int              server;   //  - server in use (cfg.servers)
+    uint32_t                  tried;    //  - servers failed since online
+    struct {                            //  - preferred server health check
+	int                   fd;       //     - probe in progress (-1 = none)
+	uint64_t              due_ns;   //     - next probe / probe timeout
+	uint64_t              healthy_since_ns; // - up since (0 = down)
+	bool                  pending;  //     - leaving for it
+    } failback;
 };
 
 struct mqtt_subscription {
-    char *topic;
-    int   qos;
+    char            *topic;
+    int              qos;
+    mqtt_message_cb  on_message;        // NULL = mqtt->on_message
 };
 
 /************************************************************************
@@ -208,30 +360,122 @@ struct mqtt_subscription {
  ************************************************************************/
 
 int parse_mbus_baudrate(const char *option, long *val);
+int parse_pulse_volume(const char *option, double *val);
+int parse_replay_speed(const char *option, double *val);
+int parse_oversampling(const char *option, uint8_t osr[3]);
+int parse_iir_filter(const char *option, uint8_t *val);
 int parse_s_period(const char *option, uint64_t *val);
 int parse_us_period(const char *option, uint64_t *val);
 int parse_idle_timeout(const char *option, unsigned long *val);
 int parse_gpio(const char *option, char **chip_id, uint32_t *pin_id);
+int parse_gpio_zone(const char *option, char **name,
+		    char **chip_id, uint32_t *pin_id);
 int parse_gpio_debounce(const char *option, uint32_t *val);
 int parse_gpio_edge(const char *option, uint64_t *flags);
 int parse_gpio_bias(const char *option, uint64_t *flags);
 int parse_gpio_mode(const char *option, uint64_t *flags);
 int parse_gpio_active(const char *option, uint64_t *flags);
+int parse_mqtt_servers(const char *option,
+		       struct mqtt_server *list, unsigned int max);
+void free_mqtt_servers(struct mqtt_server *list, unsigned int count);
 
 int __attribute__ ((format(printf, 5, 6)))
 mqtt_publish(struct mqtt *mqtt, const char *topic, int qos, bool retain,
 	     const char *fmt, ...);
 
+// Publish a reading captured at `ts_ns` (CLOCK_MONOTONIC, 0 = now).
+// Unless batching is configured (cfg.batch_size or cfg.batch_age), it is
+// published at once: the bare value, or { "value", "ts", "synced" } with
+// cfg.timestamps. In batching mode it is buffered, and the readings of a
+// topic are published together as one JSON array of { "ts", "value",
+// "synced" } (non-retained, at the highest QoS given) when cfg.batch_size
+// readings are buffered, when the oldest is cfg.batch_age seconds old, or
+// at once for an `urgent` reading, which flushes every topic.
+// The capture time is turned into wall-clock time when the message is
+// sent, so a clock stepped in between (NTP synchronizing after boot) is
+// accounted for; "synced" tells whether the clock was synchronized then.
+// The payload must be a JSON value. The topic is borrowed. Returns as
+// mqtt_publish().
+int __attribute__ ((format(printf, 6, 7)))
+mqtt_publish_reading(struct mqtt *mqtt, const char *topic, int qos,
+		     bool urgent, uint64_t ts_ns, const char *fmt, ...);
+
+// Publish the buffered readings of every topic (batching mode).
+void mqtt_flush(struct mqtt *mqtt);
+
 int mqtt_init(struct mqtt *mqtt, unsigned int subcount,
 	      struct mqtt_subscription *sub);
 int mqtt_start(struct mqtt *mqtt);
+// Stop and release the handler, server list included: MQTT stays
+// disabled unless configured again.
 int mqtt_destroy(struct mqtt *mqtt);
 
 void mqtt_set_availability(struct mqtt *mqtt, char *topic,
 			   char *online, char *offline, int qos);
 
-typedef void (*mqtt_message_cb)(struct mosquitto *mosq, void *obj,
-				const struct mosquitto_message *msg);
+// Configure the connection-quality topic: a retained JSON snapshot of
+// struct mqtt_stats, published on every (re)connection and then every
+// cfg.stats_interval seconds, along with the per-topic acknowledgement
+// statistics on `<topic>/acks`. The topic is borrowed. Call before
+// mqtt_start().
+void mqtt_set_stats(struct mqtt *mqtt, char *topic);
+
+// Copy of the connection-quality counters. They keep counting while
+// offline, so this also works when the broker is unreachable.
+void mqtt_get_stats(struct mqtt *mqtt, struct mqtt_stats *stats);
+
+// Copy of the acknowledgement statistics of a topic (QoS 1/2 publishes,
+// sent to ack). -1 if nothing was published on it yet.
+int mqtt_get_topic_stats(struct mqtt *mqtt, const char *topic,
+			 struct mqtt_topic_stats *stats);
+
+// JSON documents published on the stats topics (caller frees), also
+// written on stderr when the process receives SIGUSR1.
+char *mqtt_stats_json(struct mqtt *mqtt);
+char *mqtt_acks_json(struct mqtt *mqtt);
+
+// Histogram bucket of an ack latency: bucket i counts latencies up to
+// mqtt_ack_bounds_us[i] (the last one, everything above).
+extern const unsigned int mqtt_ack_bounds_us[MQTT_ACK_BUCKETS - 1];
+unsigned int mqtt_ack_bucket(uint64_t latency_ns);
+
+// Report an error on `topic`, as a JSON object { "source", "type", "msg",
+// "state", "count", "first", "last" }. Occurrences are deduplicated on
+// (topic, source, type): the first one is published at once, the following
+// ones are only counted and summarized every cfg.error_summary seconds
+// while the condition lasts. mqtt_error_clear() ends the condition,
+// publishing a final "cleared" message (cheap when nothing is raised).
+// Messages are further limited by a token bucket (cfg.error_rate per
+// minute, bursts of MQTT_ERROR_BURST); the held back ones go out later.
+// Strings are borrowed and must stay valid. Thread safe.
+void mqtt_error(struct mqtt *mqtt, const char *topic, int qos,
+		const char *source, const char *type, const char *msg);
+void mqtt_error_clear(struct mqtt *mqtt, const char *topic,
+		      const char *source, const char *type);
+
+// Copy of an error condition. -1 if never reported.
+int mqtt_get_error(struct mqtt *mqtt, const char *topic,
+		   const char *source, const char *type,
+		   struct mqtt_error *error);
+
+// Take a token from a bucket refilled at `rate` tokens per minute, holding
+// at most `burst`. An untouched (zeroed) bucket is full.
+bool mqtt_bucket_take(struct mqtt_bucket *b, unsigned int burst,
+		      unsigned int rate, uint64_t now_ns);
+
+// Delay (ms) before reconnection attempt number `attempt` (0-based):
+// exponential from `min`, capped at `max`, with "equal jitter" -- a random
+// pick in the upper half of the step, drawn from `rnd` -- so daemons that
+// lost the broker together do not come back in lockstep.
+unsigned int mqtt_backoff_delay(unsigned int min, unsigned int max,
+				unsigned int attempt, unsigned int rnd);
+
+// Add a subscription (copied, the topic string is borrowed). Messages
+// matching it go to sub->on_message, or to the default callback when NULL;
+// this lets several components share one connection (see moses_hub).
+// Call before mqtt_start(). Returns 0, or -1 on allocation failure.
+int mqtt_add_subscription(struct mqtt *mqtt,
+			  const struct mqtt_subscription *sub);
 
 // init + (optional availability LWT) + (optional message callback) + start,
 // destroying the handler on failure. avail_topic / on_message may be NULL.
@@ -241,6 +485,9 @@ int mqtt_connect(struct mqtt *mqtt,
 		 unsigned int subcount, struct mqtt_subscription *sub,
 		 char *avail_topic, mqtt_message_cb on_message);
 
+// Configuration from the MQTT_* environment variables. Called first
+// thing by the daemons, it also blocks SIGUSR1 (statistics query) for
+// the threads to come.
 void mqtt_config_from_env(struct mqtt *mqtt);
 
 // True when MQTT is configured (a host is set). When false the daemon runs
@@ -258,10 +505,34 @@ const char *mqtt_topic_prefix(void);
 int gpio_open_line(const char *chip, uint32_t pin, const char *label,
 		   struct gpio_v2_line_request *req);
 
+// Same for `count` lines (up to GPIO_V2_LINES_MAX) in a single request, so
+// they can be read or set together with one ioctl; bit i of the masks and
+// values of the request and of GPIO_V2_LINE_{GET,SET}_VALUES_IOCTL is
+// pins[i].
+int gpio_open_lines(const char *chip, const uint32_t *pins, unsigned int count,
+		    const char *label, struct gpio_v2_line_request *req);
+
+// Current time of the given clock, in nanoseconds.
+uint64_t clock_ns(clockid_t clock);
+
+// CLOCK_MONOTONIC time converted to CLOCK_REALTIME with the current
+// offset between the clocks (so following any step of the wall clock).
+uint64_t clock_monotonic_to_realtime(uint64_t mono_ns);
+
+// True when the kernel considers the wall clock synchronized (NTP, PTP).
+bool clock_synced(void);
+
 // Sleep until the absolute deadline on the given clock, restarting if a signal
 // interrupts the wait.
 void sleep_until(clockid_t clock, const struct timespec *deadline);
 
+// Replace the file `path` with what `write` prints, through `path`.tmp
+// synced to disk then renamed over it: a crash leaves either the old or
+// the new content, never a truncated one. 0 on success, -1 (errno set)
+// on failure.
+int atomic_write_file(const char *path,
+		      void (*write)(FILE *f, const void *ctx), const void *ctx);
+
 void reduced_latency(void);
 
 #endif
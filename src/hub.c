@@ -0,0 +1,235 @@
+/*
+ * moses_hub -- run several moses daemons in a single process.
+ *
+ * The watermeter, breaker and sensors programs are linked in as modules
+ * (see module.h) and share one MQTT connection: one libmosquitto instance,
+ * one TCP session, one network thread and one set of locked pages, instead
+ * of one of each per daemon. Each module keeps its own worker threads,
+ * options and topics; incoming messages are dispatched to the module owning
+ * the matching subscription.
+ *
+ * Modules are selected on the command line, each followed by its usual
+ * options, groups being separated by `--`:
+ *
+ *   moses_hub -r -- watermeter -P rpi:38 -i 1min -- breaker -P rpi:36
+ *
+ * A connection has a single last will, so the hub advertises its liveness
+ * on `availability/hub` (and its link quality on `stats/hub`) instead of the
+ * per-daemon topics. The standalone programs are unaffected.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <getopt.h>
+#include <libgen.h>
+
+#include "common.h"
+#include "module.h"
+
+
+//== Structures ========================================================
+
+struct hub_mqtt {                       // MQTT
+    struct mqtt *handler;
+    struct {
+	char *avail;
+	char *stats;
+    } topic;
+};
+
+struct hub {
+    struct hub_mqtt  mqtt;
+    const struct moses_module *module[8];
+    unsigned int     modcount;
+    int              reduced_latency;
+};
+
+
+
+//== Global context ====================================================
+
+char *__progname = "??";
+
+static const struct moses_module *const modules[] = {
+    &watermeter_module,
+    &breaker_module,
+    &sensors_module,
+};
+
+struct hub hub = {
+    .mqtt = {
+	.handler     = &(struct mqtt) MQTT_INITIALIZER(),
+	.topic.avail = "availability/hub",
+	.topic.stats = "stats/hub",
+    },
+};
+
+
+
+//======================================================================
+
+static const struct moses_module *
+hub_find_module(const char *name)
+{
+    for (size_t i = 0 ; i < __arraycount(modules) ; i++)
+	if (strcmp(modules[i]->name, name) == 0)
+	    return modules[i];
+    return NULL;
+}
+
+
+static void
+hub_usage(void)
+{
+    printf("%s [opts] -- MODULE [module-opts] [-- MODULE [module-opts]]...\n",
+	   __progname);
+    printf("  -r, --reduced-latency            try to reduce latency\n");
+    printf("\n");
+    printf("Modules:");
+    for (size_t i = 0 ; i < __arraycount(modules) ; i++)
+	printf(" %s", modules[i]->name);
+    printf("\n(use `-- MODULE -h` for the module options)\n");
+    printf("\n");
+}
+
+
+static void
+hub_parse_config(int argc, char **argv, struct hub *h)
+{
+    static const char *const shortopts = "+rh";
+
+    const struct option longopts[] = {
+	{ "reduced-latency", no_argument,	NULL, 'r' },
+	{ "help",	     no_argument,	NULL, 'h' },
+	{ NULL },
+    };
+
+    int opti, optc;
+
+    for (;;) {
+	optc = getopt_long(argc, argv, shortopts, longopts, &opti);
+	if (optc < 0)
+	    break;
+
+	switch (optc) {
+	case 'r':
+	    h->reduced_latency = 1;
+	    break;
+	case 'h':
+	    hub_usage();
+	    exit(0);
+	default:
+	    exit(1);
+	}
+    }
+
+    // Module groups: NAME [opts], separated by "--" (getopt already
+    // consumed the one following the hub options).
+    int i = optind;
+    while (i < argc) {
+	if (strcmp(argv[i], "--") == 0) {
+	    i++;
+	    continue;
+	}
+
+	const struct moses_module *m = hub_find_module(argv[i]);
+	if (m == NULL)
+	    USAGE_DIE("unknown module %s", argv[i]);
+	for (unsigned int k = 0 ; k < h->modcount ; k++)
+	    if (h->module[k] == m)
+		USAGE_DIE("module %s given twice", m->name);
+	if (h->modcount >= __arraycount(h->module))
+	    USAGE_DIE("too many modules");
+
+	int end = i + 1;
+	while ((end < argc) && (strcmp(argv[end], "--") != 0))
+	    end++;
+
+	// Module sees its group as a command line of its own, named after
+	// it; optind = 0 makes getopt fully re-initialize.
+	optind = 0;
+	m->configure(end - i, &argv[i]);
+
+	h->module[h->modcount++] = m;
+	i = end;
+    }
+
+    if (h->modcount == 0)
+	USAGE_DIE("At least one module must be selected");
+}
+
+
+//== MQTT ==============================================================
+
+static int
+hub_mqtt_init(struct hub_mqtt *mqtt)
+{
+    // Adjust prefix
+    const char *prefix = mqtt_topic_prefix();
+    MQTT_ADJUST_TOPIC(mqtt, avail, prefix);
+    MQTT_ADJUST_TOPIC(mqtt, stats, prefix);
+
+    if (mqtt_enabled(mqtt->handler)) {
+	LOG("MQTT availability    : %s", mqtt->topic.avail);
+	LOG("MQTT statistics      : %s", mqtt->topic.stats);
+    }
+
+    // Connection-quality statistics
+    mqtt_set_stats(mqtt->handler, mqtt->topic.stats);
+
+    // Subscriptions were registered by the modules (0 = MQTT disabled)
+    int rc = mqtt_connect(mqtt->handler, 0, NULL, mqtt->topic.avail, NULL);
+    if (rc < 0) return -1;
+    if (rc > 0) LOG("MQTT connection established");
+
+    return 0;
+}
+
+
+
+//======================================================================
+
+int
+main(int argc, char **argv)
+{
+    __progname = basename(argv[0]);
+
+    // Configuration
+    mqtt_config_from_env(hub.mqtt.handler);
+    hub_parse_config(argc, argv, &hub);
+
+    // Initialization: modules first (devices, topics, subscriptions),
+    // then the shared connection.
+    for (unsigned int i = 0 ; i < hub.modcount ; i++) {
+	const struct moses_module *m = hub.module[i];
+	if (m->init(hub.mqtt.handler) < 0)
+	    DIE(2, "failed to initialize %s", m->name);
+	if (*m->reduced_latency)
+	    hub.reduced_latency = 1;
+    }
+    if (hub_mqtt_init(&hub.mqtt) < 0)
+	DIE(2, "failed to initialize MQTT");
+
+    // Reducing latency (the module threads inherit the scheduling policy)
+    if (hub.reduced_latency)
+	reduced_latency();
+
+    // Starting the modules
+    for (unsigned int i = 0 ; i < hub.modcount ; i++) {
+	const struct moses_module *m = hub.module[i];
+	if (m->start() < 0)
+	    DIE(2, "failed to start %s", m->name);
+	LOG("module %s started", m->name);
+    }
+
+    // Everything runs in the module threads
+    for (;;) pause();
+}
@@ -0,0 +1,27 @@
+#ifndef __MODULE_H
+#define __MODULE_H
+
+#include <stdbool.h>
+
+struct mqtt;
+
+/*
+ * A moses daemon seen as a component, so that moses_hub can run several of
+ * them in a single process sharing one MQTT connection. The standalone
+ * programs go through the same steps from their own main().
+ */
+struct moses_module {
+    const char *name;                     // name, as given to moses_hub
+    void (*configure)(int argc, char **argv); // parse the command line
+    int  (*init)(struct mqtt *shared);    // open devices, set up MQTT
+    int  (*start)(void);                  // start the worker threads
+    int  *reduced_latency;                // -r requested
+};
+
+// Components built in moses_hub (sources compiled with MOSES_HUB defined,
+// which leaves their main() out).
+extern const struct moses_module watermeter_module;
+extern const struct moses_module breaker_module;
+extern const struct moses_module sensors_module;
+
+#endif
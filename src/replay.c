@@ -0,0 +1,187 @@
+/*
+ * replay -- recorded trace and virtual clock of the watermeter replay.
+ *
+ * Kept in its own translation unit (separate from watermeter.c, which has
+ * main()) so it can be linked into the unit tests.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+#include "replay.h"
+
+
+// Wall-clock time: seconds, and an optional fraction (ns). NULL if invalid.
+static const char *
+replay_parse_time(const char *p, uint64_t *ts)
+{
+    if (!isdigit((unsigned char)*p))
+	return NULL;
+
+    errno = 0;
+    char *end;
+    unsigned long long s = strtoull(p, &end, 10);
+    if ((errno != 0) || (s > UINT64_MAX / 1000000000ull - 1))
+	return NULL;
+
+    uint64_t ns = 0;
+    if (*end == '.') {
+	unsigned int digits = 0;
+	for (p = end + 1 ; isdigit((unsigned char)*p) ; p++)
+	    if (digits++ < 9)
+		ns = ns * 10 + (*p - '0');
+	for ( ; digits < 9 ; digits++)
+	    ns *= 10;
+	end = (char *)p;
+    }
+
+    *ts = s * 1000000000ull + ns;
+    return end;
+}
+
+
+int
+replay_parse(const char *line, struct replay_record *rec)
+{
+    const char *p = line + strspn(line, " \t");
+    if ((*p == '\0') || (*p == '\r') || (*p == '\n') || (*p == '#'))
+	return 0;
+
+    if (((p = replay_parse_time(p, &rec->ts)) == NULL) ||
+	((*p != ' ') && (*p != '\t')))
+	return -1;
+
+    char kind[8];
+    int  n = 0;
+    if (sscanf(p, " %7s%n", kind, &n) != 1)
+	return -1;
+    p += n;
+
+    // Argument, then nothing but blanks
+    char *end = (char *)p;
+    if        (strcmp(kind, "pulse") == 0) {
+	rec->kind  = REPLAY_PULSE;
+	rec->count = 1;
+	p += strspn(p, " \t");
+	if (isdigit((unsigned char)*p)) {
+	    unsigned long count = strtoul(p, &end, 10);
+	    if ((count == 0) || (count > UINT32_MAX))
+		return -1;
+	    rec->count = count;
+	}
+    } else if (strcmp(kind, "index") == 0) {
+	rec->kind  = REPLAY_INDEX;
+	rec->index = strtod(p, &end);
+	if ((end == p) || !(rec->index >= 0))
+	    return -1;
+    } else if (strcmp(kind, "valve") == 0) {
+	rec->kind  = REPLAY_VALVE;
+	rec->state = strtol(p, &end, 10);
+	if ((end == p) || ((rec->state != 0) && (rec->state != 1)))
+	    return -1;
+    } else {
+	return -1;
+    }
+    if (end[strspn(end, " \t\r\n")] != '\0')
+	return -1;
+    return 1;
+}
+
+
+int
+replay_load(struct replay *r, const char *path, unsigned long *line)
+{
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+	return -1;
+
+    char   *buf  = NULL;
+    size_t  len  = 0;
+    int     rc   = -1;
+    *line = 0;
+    while (getline(&buf, &len, f) >= 0) {
+	struct replay_record rec;
+	++*line;
+	int found = replay_parse(buf, &rec);
+	if (found == 0)
+	    continue;
+	if ((found < 0) ||
+	    (r->count && (rec.ts < r->record[r->count - 1].ts))) {
+	    errno = EINVAL;
+	    goto done;
+	}
+
+	if (r->count == r->size) {
+	    size_t size = r->size ? 2 * r->size : 1024;
+	    struct replay_record *record =
+		realloc(r->record, size * sizeof(*record));
+	    if (record == NULL)
+		goto done;
+	    r->record = record;
+	    r->size   = size;
+	}
+	r->record[r->count++] = rec;
+
+	switch (rec.kind) {
+	case REPLAY_PULSE: r->pulses  += rec.count; break;
+	case REPLAY_INDEX: r->indexes++;            break;
+	case REPLAY_VALVE: r->valves++;             break;
+	}
+    }
+    rc = ferror(f) ? -1 : 0;
+
+ done:
+    free(buf);
+    fclose(f);
+    return rc;
+}
+
+
+void
+replay_free(struct replay *r)
+{
+    free(r->record);
+    r->record = NULL;
+    r->count  = 0;
+    r->size   = 0;
+}
+
+
+void
+replay_clock_start(struct replay *r, uint64_t mono_now, double speed)
+{
+    r->clock.trace_start = r->count ? r->record[0].ts : 0;
+    r->clock.mono_start  = mono_now;
+    r->clock.speed       = speed;
+}
+
+
+uint64_t
+replay_mono(const struct replay *r, uint64_t ts)
+{
+    return r->clock.mono_start + (ts - r->clock.trace_start);
+}
+
+
+uint64_t
+replay_realtime(const struct replay *r, uint64_t mono)
+{
+    return r->clock.trace_start + (mono - r->clock.mono_start);
+}
+
+
+uint64_t
+replay_due(const struct replay *r, uint64_t mono)
+{
+    if (r->clock.speed <= 0)
+	return r->clock.mono_start;
+    return r->clock.mono_start
+	 + (uint64_t)((mono - r->clock.mono_start) / r->clock.speed);
+}
@@ -0,0 +1,82 @@
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+/*
+ * Replay of a recorded trace: meter pulses, and optionally M-Bus index
+ * readings and valve closures, fed to the watermeter pipeline in place of
+ * the GPIO line and the M-Bus, to tune and regression-test it without
+ * waiting for water to flow.
+ *
+ * The trace is text, one record per line (blank lines and `#` comments are
+ * ignored), in time order:
+ *
+ *   <time> pulse [count]       count pulses (default 1), read at once
+ *   <time> index <m3>          meter index
+ *   <time> valve <0|1>         valve opened (0) or closed (1), as
+ *                              acknowledged by moses_breaker
+ *
+ * <time> is wall-clock time, in seconds since the epoch, with an optional
+ * fraction (down to the nanosecond).
+ *
+ * Virtual clock: the trace is laid on the CLOCK_MONOTONIC timeline, its
+ * first record at `mono_start` (the start of the replay), so the pipeline
+ * sees the same kind of timestamps as from the GPIO line. Virtual time
+ * goes `speed` times faster than real time; 1 is real time, 0 does not
+ * wait at all (as fast as the pipeline goes).
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+enum replay_kind {
+    REPLAY_PULSE,
+    REPLAY_INDEX,
+    REPLAY_VALVE,
+};
+
+struct replay_record {
+    uint64_t         ts;                // wall-clock (ns)
+    enum replay_kind kind;
+    union {
+	unsigned int count;             // pulse
+	double       index;             // index (m3)
+	int          state;             // valve
+    };
+};
+
+struct replay {
+    struct replay_record *record;
+    size_t                count;
+    size_t                size;         // allocated records
+    unsigned long         pulses;       // in the trace, per kind
+    unsigned long         indexes;
+    unsigned long         valves;
+    struct {                            // virtual clock
+	uint64_t          trace_start;  //  - first record (wall-clock)
+	uint64_t          mono_start;   //  - ... on the monotonic timeline
+	double            speed;        //  - speed-up (0 = no wait)
+    } clock;
+};
+
+// Parse a line of trace. 1 if a record was parsed, 0 if there is none on
+// the line (blank, comment), -1 if it is invalid.
+int replay_parse(const char *line, struct replay_record *rec);
+
+// Load a whole trace, so reading it is not part of what is replayed.
+// 0 on success, -1 on failure (errno set; EINVAL for an invalid or out of
+// order record, its line number in `line`).
+int replay_load(struct replay *r, const char *path, unsigned long *line);
+
+void replay_free(struct replay *r);
+
+// Start the virtual clock: first record at `mono_now`.
+void replay_clock_start(struct replay *r, uint64_t mono_now, double speed);
+
+// Trace time (wall-clock) on the virtual monotonic timeline, and back.
+uint64_t replay_mono(const struct replay *r, uint64_t ts);
+uint64_t replay_realtime(const struct replay *r, uint64_t mono);
+
+// Real CLOCK_MONOTONIC time when virtual time `mono` is reached.
+uint64_t replay_due(const struct replay *r, uint64_t mono);
+
+#endif
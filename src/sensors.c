@@ -5,6 +5,20 @@
  * every --interval seconds and publishes temperature (deg C), pressure
  * (Pa) and humidity (%RH) as a JSON object on the `sensors` topic.
  *
+ * The sensor runs in forced mode: it sleeps between readings, and each
+ * reading triggers a single conversion, waited for (the time it takes
+ * depends on --oversampling), then read at once. Converting continuously
+ * would only draw power and heat the sensor, skewing the temperature, for
+ * samples never read. The IIR filter (--filter, off by default) then
+ * smooths over successive readings.
+ *
+ * The status, control and data registers are read in a single I2C
+ * transaction (a burst from 0xF3 to 0xFE) and compensated locally; the
+ * read is only retried when the status shows the conversion was not over.
+ * The I2C transfers, sleeps and bus time per reading are published on
+ * `stats/sensors/i2c`. --read=split reads as the BME280 API does (status,
+ * then data), to compare.
+ *
  * When --altitude is given, the measured pressure is converted to the
  * equivalent sea-level pressure. Read failures are reported on the
  * `error` topic. All topics are relative to MQTT_TOPIC_PREFIX.
@@ -12,11 +26,13 @@
 
 #include <sys/cdefs.h>
 #include <stdbool.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 #include <math.h>
 #include <time.h>
+#include <pthread.h>
 
 #include <getopt.h>
 #include <libgen.h>
@@ -28,6 +44,7 @@
 #include "bme280.h"
 
 #include "common.h"
+#include "module.h"
 
 
 //== Helpers ===========================================================
@@ -57,25 +74,32 @@ static struct bitters_i2c_cfg rpi_i2c_cfg = {
 struct bme280_i2c {
     bitters_i2c_t      *dev;
     bitters_i2c_addr_t  addr;
+    unsigned long       transfers;    // I2C_RDWR ioctls
+    unsigned long       sleeps;
+    uint64_t            bus_ns;       // spent in transfers
 };
 
 static void
 bme280_delay_us(uint32_t period, void *ptr)
 {
-    (void)ptr;
+    struct bme280_i2c *i2c = ptr;
+    i2c->sleeps++;
     usleep(period);
 }
 
 static int
 bme280_i2c_read(uint8_t reg, uint8_t *data, uint32_t len, void *ptr)
 {
-    const struct bme280_i2c *i2c = ptr;
+    struct bme280_i2c *i2c = ptr;
     const struct bitters_i2c_transfer xfr[] = {
         { .buf = &reg, .len = sizeof(reg), .write = 1, },
         { .buf = data, .len = len,         .read  = 1, },
     };
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
     int rc = bitters_i2c_transfer(i2c->dev, i2c->addr,
                                   xfr, __arraycount(xfr));
+    i2c->bus_ns += clock_ns(CLOCK_MONOTONIC) - start;
+    i2c->transfers++;
     return rc < 0 ? rc : 0;
 }
 
@@ -86,12 +110,15 @@ bme280_i2c_write(uint8_t reg, const uint8_t *data, uint32_t len, void *ptr)
     buf[0] =  reg ;               // the write request in two ?!
     memcpy(buf + 1, data, len);   //   -> Use a temporary buffer
     
-    const struct bme280_i2c *i2c = ptr;
+    struct bme280_i2c *i2c = ptr;
     const struct bitters_i2c_transfer xfr[] = {
         { .buf = buf, .len =  len + 1, .write = 1, },
     };
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
     int rc = bitters_i2c_transfer(i2c->dev, i2c->addr,
                                   xfr, __arraycount(xfr));
+    i2c->bus_ns += clock_ns(CLOCK_MONOTONIC) - start;
+    i2c->transfers++;
     return rc < 0 ? rc : 0;
 }
 
@@ -103,16 +130,31 @@ struct sensors_bme280 {
     struct bme280_dev       dev;
     struct bme280_settings  settings;
     struct bme280_i2c       i2c;
+    uint8_t                 osr[3];     // oversampling: temp, press, hum
+    uint8_t                 filter;     // IIR filter coefficient (0 = off)
+    uint8_t                 ctrl_meas;  // starts a forced conversion
     uint32_t                measurement_delay;
+    bool                    split;      // status and data read apart
+    struct sensors_bme280_stats {       // I2C usage, per reading
+	unsigned long       samples;
+	unsigned long       failures;
+	unsigned long       retries;    //  - conversion not over yet
+	unsigned long       transfers;
+	unsigned long       sleeps;
+	uint64_t            bus_ns;
+	uint64_t            bus_max_ns;
+    } stats;
     bool                    initialized;
 };
 
 struct sensors_mqtt {
-    struct mqtt handler;
+    struct mqtt *handler;
     struct {
 	char *sensors;
 	char *error;
 	char *avail;
+	char *stats;
+	char *i2c;
     } topic;
 };
 
@@ -128,14 +170,18 @@ struct sensors {
 
 //== Global context ====================================================
 
+#ifndef MOSES_HUB
 char *__progname = "??";
+#endif
 
 struct sensors sensors = {
     .mqtt     = {
-	.handler         = MQTT_INITIALIZER(),
+	.handler         = &(struct mqtt) MQTT_INITIALIZER(),
 	.topic.sensors   = "sensors",
 	.topic.error     = "error",
 	.topic.avail     = "availability/sensors",
+	.topic.stats     = "stats/sensors",
+	.topic.i2c       = "stats/sensors/i2c",
     },
     .bme280   = {
 	.dev = {
@@ -149,6 +195,8 @@ struct sensors sensors = {
 	    .dev  = &rpi_i2c,
 	    .addr = BITTERS_I2C_ADDR_8 | BME280_I2C_ADDR_PRIM,
 	},
+	.osr    = { 2, 2, 2 },
+	.filter = 0,
     },
     .interval = 60,
     .altitude = NAN,
@@ -159,21 +207,35 @@ struct sensors sensors = {
 //== MQTT ==============================================================
 
 int
-sensors_mqtt_init(struct sensors_mqtt *mqtt)
+sensors_mqtt_init(struct sensors_mqtt *mqtt, struct mqtt *shared)
 {
     // Adjust prefix
     const char *prefix = mqtt_topic_prefix();
     MQTT_ADJUST_TOPIC(mqtt, sensors, prefix);
     MQTT_ADJUST_TOPIC(mqtt, error,   prefix);
     MQTT_ADJUST_TOPIC(mqtt, avail,   prefix);
+    MQTT_ADJUST_TOPIC(mqtt, stats,   prefix);
+    MQTT_ADJUST_TOPIC(mqtt, i2c,     prefix);
 
-    if (mqtt_enabled(&mqtt->handler)) {
+    if (shared)
+	mqtt->handler = shared;
+
+    if (mqtt_enabled(mqtt->handler)) {
 	LOG("MQTT sensors         : %s", mqtt->topic.sensors);
 	LOG("MQTT error reporting : %s", mqtt->topic.error);
 	LOG("MQTT availability    : %s", mqtt->topic.avail);
+	LOG("MQTT statistics      : %s", mqtt->topic.stats);
+	LOG("MQTT I2C statistics  : %s", mqtt->topic.i2c);
     }
 
-    int rc = mqtt_connect(&mqtt->handler, 0, NULL, mqtt->topic.avail, NULL);
+    // Within moses_hub the connection belongs to the hub
+    if (shared)
+	return 0;
+
+    // Connection-quality statistics
+    mqtt_set_stats(mqtt->handler, mqtt->topic.stats);
+
+    int rc = mqtt_connect(mqtt->handler, 0, NULL, mqtt->topic.avail, NULL);
     if (rc < 0) return -1;
     if (rc > 0) LOG("MQTT connection established");
 
@@ -184,6 +246,20 @@ sensors_mqtt_init(struct sensors_mqtt *mqtt)
 
 //== BME280 ============================================================
 
+// Register values: oversampling 1x .. 16x is 1 .. 5, filter 2 .. 16 is
+// 1 .. 4 (off is 0)
+#define BME280_OSR(factor)     ((uint8_t)ffs(factor))
+#define BME280_FILTER(coeff)   ((uint8_t)((coeff) ? ffs(coeff) - 1 : 0))
+
+// Status (0xF3) to the end of the data (0xFE), ctrl_meas and config
+// included: read in one transfer
+#define BME280_BURST_LEN						\
+    (BME280_REG_DATA + BME280_LEN_P_T_H_DATA - BME280_REG_STATUS)
+#define BME280_BURST(reg)      ((reg) - BME280_REG_STATUS)
+
+#define BME280_RETRIES         3        // conversion not over yet
+#define BME280_RETRY_US        500
+
 static int
 sensors_bme280_init(struct sensors_bme280 *bme280)
 {
@@ -197,15 +273,18 @@ sensors_bme280_init(struct sensors_bme280 *bme280)
 				   &bme280->dev) != BME280_OK)
 	return -1;
 
-    // Configuring the over-sampling rate, filter coefficient and standby time
-    bme280->settings.filter       = BME280_FILTER_COEFF_2;
-    bme280->settings.osr_h        = BME280_OVERSAMPLING_2X;
-    bme280->settings.osr_p        = BME280_OVERSAMPLING_2X;
-    bme280->settings.osr_t        = BME280_OVERSAMPLING_2X;
-    bme280->settings.standby_time = BME280_STANDBY_TIME_0_5_MS;
+    // Configuring the over-sampling rate and filter coefficient (no
+    // standby time: forced mode)
+    bme280->settings.osr_t        = BME280_OSR(bme280->osr[0]);
+    bme280->settings.osr_p        = BME280_OSR(bme280->osr[1]);
+    bme280->settings.osr_h        = BME280_OSR(bme280->osr[2]);
+    bme280->settings.filter       = BME280_FILTER(bme280->filter);
 
     // Save settings
-    if (bme280_set_sensor_settings(BME280_SEL_ALL_SETTINGS,
+    if (bme280_set_sensor_settings(BME280_SEL_OSR_TEMP  |
+				   BME280_SEL_OSR_PRESS |
+				   BME280_SEL_OSR_HUM   |
+				   BME280_SEL_FILTER,
 				   &bme280->settings,
 				   &bme280->dev) != BME280_OK)
 	return -1;
@@ -215,10 +294,22 @@ sensors_bme280_init(struct sensors_bme280 *bme280)
 			      &bme280->settings) != BME280_OK)
 	return -1;
 
-    // Always set the power mode after setting the configuration
-    if (bme280_set_sensor_mode(BME280_POWERMODE_NORMAL,
+    // Sleeping until a reading is wanted. The conversion is then started
+    // by writing ctrl_meas alone (ctrl_hum is already set), rather than
+    // through bme280_set_sensor_mode() which reads it back first.
+    if (bme280_set_sensor_mode(BME280_POWERMODE_SLEEP,
 			       &bme280->dev) != BME280_OK)
 	return -1;
+    bme280->ctrl_meas = (bme280->settings.osr_t << 5) |
+	                (bme280->settings.osr_p << 2) |
+	                BME280_POWERMODE_FORCED;
+
+    char filter[8] = "off";
+    if (bme280->filter)
+	snprintf(filter, sizeof(filter), "%u", bme280->filter);
+    LOG("BME280 forced mode: oversampling %ux/%ux/%ux, filter %s,"
+	" conversion %.2f ms", bme280->osr[0], bme280->osr[1], bme280->osr[2],
+	filter, bme280->measurement_delay / 1000.0);
 
     // Done
     bme280->initialized = true;
@@ -226,49 +317,149 @@ sensors_bme280_init(struct sensors_bme280 *bme280)
 }
 
 
+// Status, control and data registers in a single transfer, compensated
+// here. Read again only if the conversion was not over: still measuring,
+// or not back to sleep yet (the status can lag the start of it).
+static int
+sensors_bme280_read_burst(struct sensors_bme280 *bme280,
+			  struct bme280_data *data)
+{
+    uint8_t regs[BME280_BURST_LEN];
+    for (int retries = 0 ; ; retries++) {
+	if (bme280_get_regs(BME280_REG_STATUS, regs, sizeof(regs),
+			    &bme280->dev) != BME280_OK)
+	    return -1;
+
+	uint8_t status = regs[BME280_BURST(BME280_REG_STATUS)];
+	uint8_t mode   = regs[BME280_BURST(BME280_REG_CTRL_MEAS)] & 0x03;
+	if (!(status & (BME280_STATUS_MEAS_DONE | BME280_STATUS_IM_UPDATE)) &&
+	    (mode == BME280_POWERMODE_SLEEP))
+	    break;
+	if (retries == BME280_RETRIES)
+	    return -1;
+	bme280->stats.retries++;
+	bme280->dev.delay_us(BME280_RETRY_US, bme280->dev.intf_ptr);
+    }
+
+    struct bme280_uncomp_data uncomp;
+    bme280_parse_sensor_data(&regs[BME280_BURST(BME280_REG_DATA)], &uncomp);
+    if (bme280_compensate_data(BME280_ALL, &uncomp, data,
+			       &bme280->dev.calib_data) != BME280_OK)
+	return -1;
+    return 0;
+}
+
+
+// As through the BME280 API: status, then data, apart
+static int
+sensors_bme280_read_split(struct sensors_bme280 *bme280,
+			  struct bme280_data *data)
+{
+    uint8_t status;
+    if (bme280_get_regs(BME280_REG_STATUS, &status, sizeof(status),
+			&bme280->dev) != BME280_OK)
+	return -1;
+
+    // Is measuring being done?
+    if (status & BME280_STATUS_MEAS_DONE) {
+	bme280->stats.retries++;
+	bme280->dev.delay_us(bme280->measurement_delay, bme280->dev.intf_ptr);
+    }
+
+    if (bme280_get_sensor_data(BME280_ALL, data, &bme280->dev) != BME280_OK)
+	return -1;
+    return 0;
+}
+
+
 int
 sensors_get_tph(struct sensors *sensors,
 		float *temperature, float *pressure, float *humidity)
 {
     struct sensors_bme280 *bme280 = &sensors->bme280;
+    struct bme280_i2c     *i2c    = &bme280->i2c;
     
     // Sanity check
     if (! bme280->initialized)
 	return -1;
+
+    // I2C usage so far
+    unsigned long transfers = i2c->transfers;
+    unsigned long sleeps    = i2c->sleeps;
+    uint64_t      bus_ns    = i2c->bus_ns;
+    int           rc        = -1;
     
-    // Check status and wait for measurement delay if necessary
-    uint8_t status;
-    if (bme280_get_regs(BME280_REG_STATUS, &status, sizeof(status),
+    // Single conversion, back to sleep once done
+    uint8_t reg = BME280_REG_CTRL_MEAS;
+    if (bme280_set_regs(&reg, &bme280->ctrl_meas, 1,
 			&bme280->dev) != BME280_OK) {
-	return -1;
+	goto done;
     }
 
-    // Is measuring being done?
-    if (status & BME280_STATUS_MEAS_DONE) {
-	bme280->dev.delay_us(bme280->measurement_delay, bme280->dev.intf_ptr);
-    }
+    // Conversion time (the maximum, for the oversampling)
+    bme280->dev.delay_us(bme280->measurement_delay, bme280->dev.intf_ptr);
     
     // Read compensated data
     struct bme280_data comp_data;
-    if (bme280_get_sensor_data(BME280_ALL, &comp_data,
-			       &bme280->dev) != BME280_OK) {
-	return -1;
+    if ((bme280->split ? sensors_bme280_read_split(bme280, &comp_data)
+	               : sensors_bme280_read_burst(bme280, &comp_data)) < 0) {
+	goto done;
     }
 
     // Get data
     if (temperature) *temperature = comp_data.temperature;
     if (pressure   ) *pressure    = comp_data.pressure;
     if (humidity   ) *humidity    = comp_data.humidity;
+    rc = 0;
+
+ done:
+    // Account the I2C usage of this reading
+    bus_ns = i2c->bus_ns - bus_ns;
+    bme280->stats.samples++;
+    bme280->stats.failures  += (rc < 0);
+    bme280->stats.transfers += i2c->transfers - transfers;
+    bme280->stats.sleeps    += i2c->sleeps    - sleeps;
+    bme280->stats.bus_ns    += bus_ns;
+    if (bus_ns > bme280->stats.bus_max_ns)
+	bme280->stats.bus_max_ns = bus_ns;
 
     // Job's done
-    return 0;
+    return rc;
+}
+
+
+// I2C usage per reading (means, and the highest bus time)
+static void
+sensors_i2c_publish(struct sensors *s)
+{
+    struct sensors_mqtt *mqtt = &s->mqtt;
+    const struct sensors_bme280_stats *st = &s->bme280.stats;
+    if (st->samples == 0)
+	return;
+
+    static char *fmt =
+	"{" "\"read\""       ": \"%s\"" ", "
+	    "\"samples\""    ": %lu"    ", "
+	    "\"failures\""   ": %lu"    ", "
+	    "\"retries\""    ": %lu"    ", "
+	    "\"transfers\""  ": %.2f"   ", "
+	    "\"sleeps\""     ": %.2f"   ", "
+	    "\"bus_us\""     ": %.1f"   ", "
+	    "\"bus_max_us\"" ": %.1f"
+	"}";
+    mqtt_publish(mqtt->handler, mqtt->topic.i2c, 1, true, fmt,
+		 s->bme280.split ? "split" : "burst",
+		 st->samples, st->failures, st->retries,
+		 (double)st->transfers / st->samples,
+		 (double)st->sleeps    / st->samples,
+		 st->bus_ns / 1e3 / st->samples, st->bus_max_ns / 1e3);
 }
 
 
 
 //======================================================================
 
-int sensors_init(void) {
+int sensors_init(struct mqtt *shared) {
     // Initalize bitters library (low level gpio/spi/i2c handling)
     if ((bitters_init()                             < 0) ||
 	(bitters_i2c_enable(&rpi_i2c, &rpi_i2c_cfg) < 0)) {
@@ -276,8 +467,8 @@ int sensors_init(void) {
     }
 
     // Initialize sub-components
-    if ((sensors_mqtt_init(&sensors.mqtt)     < 0) ||
-	(sensors_bme280_init(&sensors.bme280) < 0))
+    if ((sensors_mqtt_init(&sensors.mqtt, shared) < 0) ||
+	(sensors_bme280_init(&sensors.bme280)    < 0))
 	return -1;
 
     // Done
@@ -292,12 +483,15 @@ static void
 sensors_parse_config(int argc, char **argv, struct sensors *s)
 {
     // Argument parsing
-    static const char *const shortopts = "+ri:a:h";
+    static const char *const shortopts = "+ri:a:o:f:R:h";
 
     struct option longopts[] = {
 	{ "reduced-latency", no_argument,	NULL, 'r' },
 	{ "interval",        required_argument, NULL, 'i' },
 	{ "altitude",        required_argument, NULL, 'a' },
+	{ "oversampling",    required_argument, NULL, 'o' },
+	{ "filter",          required_argument, NULL, 'f' },
+	{ "read",            required_argument, NULL, 'R' },
 	{ "help",	     no_argument,	NULL, 'h' },
 	{ NULL }
     };
@@ -323,11 +517,30 @@ sensors_parse_config(int argc, char **argv, struct sensors *s)
 	    if ((*optarg == '\0') || (*endptr != '\0'))
 		USAGE_DIE("invalid number for altitude");
 	    break;
+	case 'o':
+	    if (parse_oversampling(optarg, s->bme280.osr) < 0)
+		USAGE_DIE("invalid oversampling (1, 2, 4, 8, 16,"
+			  " or temperature,pressure,humidity)");
+	    break;
+	case 'f':
+	    if (parse_iir_filter(optarg, &s->bme280.filter) < 0)
+		USAGE_DIE("invalid filter coefficient (off, 2, 4, 8, 16)");
+	    break;
+	case 'R':
+	    if      (strcmp(optarg, "burst") == 0) s->bme280.split = false;
+	    else if (strcmp(optarg, "split") == 0) s->bme280.split = true;
+	    else    USAGE_DIE("invalid read (burst, split)");
+	    break;
 	case 'h':
 	    printf("%s [opts]\n", __progname);
 	    printf("  -r, --reduced-latency     try to reduce latency\n");
 	    printf("  -i, --interval=SEC        publish sensors information every SEC\n");
 	    printf("  -a, --altitude=METERS     compute sea level pressure\n");
+	    printf("  -o, --oversampling=N|T,P,H\n");
+	    printf("                            oversampling: 1, 2 (default), 4, 8, 16\n");
+	    printf("  -f, --filter=off|2|4|8|16 IIR filter over successive readings\n");
+	    printf("  -R, --read=burst|split    status and data in one I2C transfer\n");
+	    printf("                            (default), or apart\n");
 	    printf("\n");
 	    exit(0);
 	default:
@@ -339,24 +552,10 @@ sensors_parse_config(int argc, char **argv, struct sensors *s)
 }
 
 
-int main(int argc, char *argv[]) {
-    __progname = basename(argv[0]);
-
-    // Shortcuts
-    struct sensors      *s    = &sensors;
-    struct sensors_mqtt *mqtt = &sensors.mqtt;
-        
-    // Configuration
-    mqtt_config_from_env(&sensors.mqtt.handler);
-    sensors_parse_config(argc, argv, &sensors);
-    
-    // Initialization
-    if (sensors_init() < 0) 
-	DIE(2, "Failed to initialized");
-    
-    // Reducing latency
-    if (sensors.reduced_latency)
-	reduced_latency();
+__attribute__((noreturn))
+static void * sensors_polling_task(void *parameters) {
+    struct sensors      *s    = parameters;
+    struct sensors_mqtt *mqtt = &s->mqtt;
 
     // Polling
     struct timespec next_polling;
@@ -364,14 +563,14 @@ int main(int argc, char *argv[]) {
     while (1) {
 	// Environment (Temperature, Pressure, Humidity)
 	float temperature, pressure, humidity;
-	if (sensors_get_tph(s, &temperature, &pressure, &humidity) < 0) {
+	int rc = sensors_get_tph(s, &temperature, &pressure, &humidity);
+	uint64_t ts = clock_ns(CLOCK_MONOTONIC);     // I2C read complete
+	if (rc < 0) {
 	    PUT_FAIL("environment", "read");
-
-	    static char *msg =
-		MQTT_ERROR_MSG("environment", "error",
-			       "failed to read sensors values");
-	    MQTT_PUBLISH(mqtt, error, 1, false, "%s", msg);
+	    MQTT_ERROR(mqtt, error, 1, "environment", "read",
+		       "failed to read sensors values");
 	} else {
+	    MQTT_ERROR_CLEAR(mqtt, error, "environment", "read");
 	    if (! isnan(s->altitude))
 		pressure = sea_level_pressure(pressure, temperature,
 					      s->altitude);
@@ -384,12 +583,66 @@ int main(int argc, char *argv[]) {
 		         "\"pressure\""    ": %0.0f" ", "
 		         "\"humidity\""    ": %0.2f"
 		    "}";
-	    MQTT_PUBLISH(mqtt, sensors, 1, false,
-			 fmt, temperature, pressure, humidity);
+	    MQTT_PUBLISH_READING(mqtt, sensors, 1, false, ts,
+				 fmt, temperature, pressure, humidity);
 	}
+	sensors_i2c_publish(s);
 	
 	// Next
 	next_polling.tv_sec += s->interval;
 	sleep_until(CLOCK_REALTIME, &next_polling);
     }
 }
+
+
+static pthread_t thr_polling;
+
+static int
+sensors_start(void)
+{
+    if (pthread_create(&thr_polling, NULL,
+		       sensors_polling_task, &sensors) != 0) {
+	LOG("failed to start polling thread");
+	return -1;
+    }
+    return 0;
+}
+
+static void
+sensors_configure(int argc, char **argv)
+{
+    sensors_parse_config(argc, argv, &sensors);
+}
+
+const struct moses_module sensors_module = {
+    .name            = "sensors",
+    .configure       = sensors_configure,
+    .init            = sensors_init,
+    .start           = sensors_start,
+    .reduced_latency = &sensors.reduced_latency,
+};
+
+
+#ifndef MOSES_HUB
+int main(int argc, char *argv[]) {
+    __progname = basename(argv[0]);
+
+    // Configuration
+    mqtt_config_from_env(sensors.mqtt.handler);
+    sensors_parse_config(argc, argv, &sensors);
+    
+    // Initialization
+    if (sensors_init(NULL) < 0) 
+	DIE(2, "Failed to initialized");
+    
+    // Reducing latency
+    if (sensors.reduced_latency)
+	reduced_latency();
+
+    // Polling
+    if (sensors_start() < 0)
+	DIE(2, "Failed to start");
+    pthread_join(thr_polling, NULL);
+    return 0;
+}
+#endif
@@ -19,6 +19,27 @@
  * Either source may be left unconfigured; only the configured ones are
  * started. Read failures are reported on the `error` topic. All topics
  * are relative to MQTT_TOPIC_PREFIX (see common.c).
+ *
+ * With --aggregate, hourly, daily and monthly consumption totals (see
+ * aggregate.h) are kept from the pulses (--pulse-volume liters each) or,
+ * without pulse counting, from the index. They are saved to the given
+ * file and published retained on `consumption/{hour,day,month}` every
+ * minute they change and whenever a period closes.
+ *
+ * With --closure-timeout, each closure of the valve acknowledged by
+ * moses_breaker (`state/ack`, or `all/state/ack` for the main valve
+ * closed along with all the lines) is verified against the pulses (see
+ * closure.h): they must stop within the timeout, then stay quiet for
+ * --closure-window. The result, with the time to last pulse and the
+ * residual volume, is published retained on `closure`, and the history
+ * of the time to last pulse on `stats/watermeter/closure`.
+ *
+ * With --replay, a recorded trace (see replay.h) stands in for the GPIO
+ * line and the M-Bus: its pulses, index readings and valve closures go
+ * through the same processing, on a virtual clock running --replay-speed
+ * times faster than real time (as fast as possible with `max`), so rules
+ * can be tuned and regression-tested on a month of data in seconds. The
+ * program exits at the end of the trace.
  */
 
 #ifndef _GNU_SOURCE
@@ -41,9 +62,15 @@
 #include <getopt.h>
 #include <libgen.h>
 
+#include <sys/timerfd.h>
+
 #include <mbus/mbus.h>
 
 #include "common.h"
+#include "module.h"
+#include "aggregate.h"
+#include "closure.h"
+#include "replay.h"
 
 //== Constants =========================================================
 
@@ -82,13 +109,45 @@ struct index_reader {
     unsigned long interval;
 };
 
+struct aggregation {
+    char            *file;        // state file (NULL = disabled)
+    double           pulse_volume;// liters per pulse
+    struct aggregate data;        // totals
+    bool             changed;     // since last published
+    bool             has_index;   // last_index is valid
+    double           last_index;  // previous index (m3)
+    pthread_mutex_t  lock;
+};
+
+struct verification {
+    bool                   enabled;
+    struct closure         check;
+    struct closure_history history;
+    int                    tfd;         // timerfd, concludes the check
+    pthread_mutex_t        lock;
+};
+
+struct replaying {
+    char          *file;          // trace (NULL = disabled)
+    double         speed;         // virtual time speed-up (0 = no wait)
+    struct replay  trace;
+};
+
 struct watermeter_mqtt {          // MQTT
-    struct mqtt handler;
+    struct mqtt *handler;
     struct {
 	char *pulse;
 	char *index;
 	char *error;
 	char *avail;
+	char *stats;
+	char *hour;
+	char *day;
+	char *month;
+	char *ack;                // breaker acknowledgements (input)
+	char *group_ack;
+	char *closure;
+	char *closure_stats;
     } topic;
 };
 
@@ -96,21 +155,34 @@ struct watermeter {
     struct watermeter_mqtt mqtt;
     struct pulse_counting  pulse_counting;
     struct index_reader    index_reader;
+    struct aggregation     aggregation;
+    struct verification    verification;
+    struct replaying       replay;
     int                    reduced_latency;
 };
 
 
 //== Global context ====================================================
 
+#ifndef MOSES_HUB
 char *__progname = "??";
+#endif
 
 struct watermeter watermeter =  {
     .mqtt     = {
-	.handler     = MQTT_INITIALIZER(),
+	.handler     = &(struct mqtt) MQTT_INITIALIZER(),
 	.topic.pulse = "pulse",
 	.topic.index = "index",
 	.topic.error = "error",
 	.topic.avail = "availability/watermeter",
+	.topic.stats = "stats/watermeter",
+	.topic.hour  = "consumption/hour",
+	.topic.day   = "consumption/day",
+	.topic.month = "consumption/month",
+	.topic.ack           = "state/ack",
+	.topic.group_ack     = "all/state/ack",
+	.topic.closure       = "closure",
+	.topic.closure_stats = "stats/watermeter/closure",
     },
     .pulse_counting = {
 	.ctrl.id   = NULL,
@@ -126,6 +198,18 @@ struct watermeter watermeter =  {
 	.address   = "1",
 	.interval  = 60,
     },
+    .aggregation     = {
+	.pulse_volume = 1.0,
+	.lock         = PTHREAD_MUTEX_INITIALIZER,
+    },
+    .verification    = {
+	.check.window_ns = 60 * 1000000000ull,
+	.tfd          = -1,
+	.lock         = PTHREAD_MUTEX_INITIALIZER,
+    },
+    .replay          = {
+	.speed        = 1.0,
+    },
 };
 
 
@@ -259,9 +343,11 @@ mbus_watermeter_get_index(mbus_handle *h, char *addr, double *index)
 
 //== MQTT ==============================================================
 
+static void closure_on_message(struct mosquitto *mosq, void *obj,
+			       const struct mosquitto_message *msg);
 
 int
-watermeter_mqtt_init(struct watermeter_mqtt *mqtt)
+watermeter_mqtt_init(struct watermeter_mqtt *mqtt, struct mqtt *shared)
 {
     // Adjust prefix
     const char *prefix = mqtt_topic_prefix();
@@ -269,15 +355,59 @@ watermeter_mqtt_init(struct watermeter_mqtt *mqtt)
     MQTT_ADJUST_TOPIC(mqtt, index, prefix);
     MQTT_ADJUST_TOPIC(mqtt, error, prefix);
     MQTT_ADJUST_TOPIC(mqtt, avail, prefix);
-
-    if (mqtt_enabled(&mqtt->handler)) {
+    MQTT_ADJUST_TOPIC(mqtt, stats, prefix);
+    MQTT_ADJUST_TOPIC(mqtt, hour,  prefix);
+    MQTT_ADJUST_TOPIC(mqtt, day,   prefix);
+    MQTT_ADJUST_TOPIC(mqtt, month, prefix);
+    MQTT_ADJUST_TOPIC(mqtt, ack,   prefix);
+    MQTT_ADJUST_TOPIC(mqtt, group_ack,     prefix);
+    MQTT_ADJUST_TOPIC(mqtt, closure,       prefix);
+    MQTT_ADJUST_TOPIC(mqtt, closure_stats, prefix);
+
+    if (shared)
+	mqtt->handler = shared;
+
+    if (mqtt_enabled(mqtt->handler)) {
 	LOG("MQTT pulse           : %s", mqtt->topic.pulse);
 	LOG("MQTT index           : %s", mqtt->topic.index);
 	LOG("MQTT error reporting : %s", mqtt->topic.error);
 	LOG("MQTT availability    : %s", mqtt->topic.avail);
+	LOG("MQTT statistics      : %s", mqtt->topic.stats);
+	if (watermeter.aggregation.file)
+	    LOG("MQTT consumption     : %s, %s, %s",
+		mqtt->topic.hour, mqtt->topic.day, mqtt->topic.month);
+	if (watermeter.verification.enabled) {
+	    LOG("MQTT breaker ack     : %s, %s",
+		mqtt->topic.ack, mqtt->topic.group_ack);
+	    LOG("MQTT closure         : %s", mqtt->topic.closure);
+	    LOG("MQTT closure stats   : %s", mqtt->topic.closure_stats);
+	}
     }
 
-    int rc = mqtt_connect(&mqtt->handler, 0, NULL, mqtt->topic.avail, NULL);
+    // Closure verification follows the breaker acknowledgements
+    struct mqtt_subscription sub[] = {
+	{ .topic = mqtt->topic.ack,       .qos = 1,
+	  .on_message = closure_on_message },
+	{ .topic = mqtt->topic.group_ack, .qos = 1,
+	  .on_message = closure_on_message },
+    };
+    unsigned int subcount = watermeter.verification.enabled
+	                  ? __arraycount(sub) : 0;
+
+    // Within moses_hub the connection belongs to the hub: only register
+    // our subscriptions.
+    if (shared) {
+	for (unsigned int i = 0 ; i < subcount ; i++)
+	    if (mqtt_add_subscription(shared, &sub[i]) < 0)
+		return -1;
+	return 0;
+    }
+
+    // Connection-quality statistics
+    mqtt_set_stats(mqtt->handler, mqtt->topic.stats);
+
+    int rc = mqtt_connect(mqtt->handler, subcount, sub, mqtt->topic.avail,
+			  NULL);
     if (rc < 0) return -1;
     if (rc > 0) LOG("MQTT connection established");
 
@@ -286,17 +416,446 @@ watermeter_mqtt_init(struct watermeter_mqtt *mqtt)
 
 
 
+//== Sources ===========================================================
+
+// Wall-clock time (ns) of a CLOCK_MONOTONIC capture time, on the virtual
+// clock when replaying
+static uint64_t
+watermeter_realtime(struct watermeter *w, uint64_t ts)
+{
+    return w->replay.file ? replay_realtime(&w->replay.trace, ts)
+	                  : clock_monotonic_to_realtime(ts);
+}
+
+
+// Pulses are counted (GPIO line, or pulses in the trace)
+static bool
+watermeter_counts_pulses(struct watermeter *w)
+{
+    return w->replay.file ? (w->replay.trace.pulses > 0)
+	                  : (w->pulse_counting.ctrl.id != NULL);
+}
+
+
+
+//== Aggregates ========================================================
+
+static void
+aggregation_publish_period(struct watermeter *w, enum aggregate_period p)
+{
+    struct watermeter_mqtt        *mqtt = &w->mqtt;
+    const struct aggregate        *a    = &w->aggregation.data;
+    const struct aggregate_bucket *cur  = &a->current[p];
+    const struct aggregate_bucket *prev = &a->previous[p];
+
+    char *last24h = NULL;
+    if ((p == AGGREGATE_DAY) &&
+	(asprintf(&last24h, ", \"last_24h\": %.3f",
+		  aggregate_last24h(a)) < 0))
+	last24h = NULL;
+
+    static char *fmt =
+	"{" "\"start\""     ": %lld" ", "
+	    "\"volume\""    ": %.3f" ", "
+	    "\"peak_flow\"" ": %.3f" ", "
+	    "\"previous\""  ": {"
+	        " \"start\""     ": %lld" ", "
+	         "\"volume\""    ": %.3f" ", "
+	         "\"peak_flow\"" ": %.3f" " }"
+	    "%s"
+	"}";
+    const char *topic = (p == AGGREGATE_HOUR) ? mqtt->topic.hour
+	              : (p == AGGREGATE_DAY ) ? mqtt->topic.day
+	              :                         mqtt->topic.month;
+    mqtt_publish(mqtt->handler, topic, 1, true, fmt,
+		 (long long)cur->start,  cur->volume,  cur->peak_flow,
+		 (long long)prev->start, prev->volume, prev->peak_flow,
+		 last24h ? last24h : "");
+    free(last24h);
+}
+
+
+// Publish and save when something changed or a period closed (lock held)
+static void
+aggregation_update(struct watermeter *w, unsigned int closed)
+{
+    struct aggregation *ag = &w->aggregation;
+
+    if (!ag->changed && !closed)
+	return;
+
+    for (int p = 0 ; p < AGGREGATE_PERIODS ; p++)
+	aggregation_publish_period(w, p);
+
+    if (aggregate_save(&ag->data, ag->file) < 0)
+	LOG_ERRNO("failed to save aggregates to %s", ag->file);
+    ag->changed = false;
+}
+
+
+// Account a measured volume (L), captured at ts (CLOCK_MONOTONIC)
+static void
+aggregation_add(struct watermeter *w, uint64_t ts, double volume)
+{
+    struct aggregation *ag = &w->aggregation;
+    if (ag->file == NULL)
+	return;
+
+    time_t t = watermeter_realtime(w, ts) / 1000000000ull;
+    pthread_mutex_lock(&ag->lock);
+    unsigned int closed = aggregate_add(&ag->data, t, volume);
+    ag->changed = true;
+    if (closed)
+	aggregation_update(w, closed);
+    pthread_mutex_unlock(&ag->lock);
+}
+
+
+// Index source: the consumption is the increase of the index
+static void
+aggregation_add_index(struct watermeter *w, uint64_t ts, double index)
+{
+    struct aggregation *ag = &w->aggregation;
+    if (ag->file == NULL)
+	return;
+
+    pthread_mutex_lock(&ag->lock);
+    double delta   = index - ag->last_index;
+    bool   valid   = ag->has_index && (delta >= 0);
+    ag->last_index = index;             // a meter replaced starts over
+    ag->has_index  = true;
+    pthread_mutex_unlock(&ag->lock);
+
+    if (valid && (delta > 0))
+	aggregation_add(w, ts, delta * 1000.0);
+}
+
+
+static pthread_t thr_aggregation;
+
+// Close the periods on time, even without consumption, and publish the
+// changes once a minute.
+__attribute__((noreturn))
+static void * aggregation_task(void *parameters) {
+    struct watermeter  *w  = parameters;
+    struct aggregation *ag = &w->aggregation;
+
+    // Restored totals
+    pthread_mutex_lock(&ag->lock);
+    ag->changed = true;
+    aggregation_update(w, aggregate_tick(&ag->data, time(NULL)));
+    pthread_mutex_unlock(&ag->lock);
+
+    struct timespec next;
+    clock_gettime(CLOCK_REALTIME, &next);
+    while (1) {
+	// Next minute boundary
+	next.tv_sec  = next.tv_sec - next.tv_sec % 60 + 60;
+	next.tv_nsec = 0;
+	sleep_until(CLOCK_REALTIME, &next);
+
+	pthread_mutex_lock(&ag->lock);
+	aggregation_update(w, aggregate_tick(&ag->data, time(NULL)));
+	pthread_mutex_unlock(&ag->lock);
+    }
+}
+
+
+static int
+aggregation_init(struct aggregation *ag, time_t now)
+{
+    if (ag->file == NULL)
+	return 0;
+
+    if (aggregate_load(&ag->data, ag->file) == 0) {
+	LOG("consumption aggregates restored from %s", ag->file);
+    } else if (errno == ENOENT) {
+	aggregate_init(&ag->data, now);
+	LOG("consumption aggregates starting (%s)", ag->file);
+    } else {
+	LOG_ERRNO("failed to restore aggregates from %s", ag->file);
+	return -1;
+    }
+    return 0;
+}
+
+
+
+//== Closure verification ============================================
+
+// Publish the concluded check and the history (lock held)
+static void
+verification_publish(struct watermeter *w, enum closure_result result)
+{
+    struct watermeter_mqtt *mqtt = &w->mqtt;
+    struct verification    *v    = &w->verification;
+    const struct closure   *c    = &v->check;
+    struct closure_history *h    = &v->history;
+
+    closure_record(h, c, result);
+
+    uint64_t ttlp   = closure_time_to_last_pulse(c);
+    double   volume = c->residual * w->aggregation.pulse_volume;
+    LOG("valve closure %s (time to last pulse %.3fs, %lu residual pulses,"
+	" %lu late)", result == CLOSURE_VERIFIED ? "verified" : "failed",
+	ttlp / 1e9, c->residual, c->late);
+
+    static char *fmt =
+	"{" "\"result\""             ": \"%s\"" ", "
+	    "\"closed\""             ": %.6f"   ", "
+	    "\"time_to_last_pulse\"" ": %.3f"   ", "
+	    "\"residual_pulses\""    ": %lu"    ", "
+	    "\"residual_volume\""    ": %.3f"   ", "
+	    "\"late_pulses\""        ": %lu"
+	"}";
+    mqtt_publish(mqtt->handler, mqtt->topic.closure, 1, true, fmt,
+		 result == CLOSURE_VERIFIED ? "verified" : "failed",
+		 watermeter_realtime(w, c->closed_ns) / 1e9,
+		 ttlp / 1e9, c->residual, volume, c->late);
+
+    // Time to last pulse of the last verified closures, oldest first
+    char   *json = NULL;
+    size_t  size = 0;
+    FILE   *f    = open_memstream(&json, &size);
+    if (f == NULL)
+	return;
+    fprintf(f, "{ \"verified\": %lu, \"failed\": %lu, "
+	       "\"mean\": %.3f, \"max\": %.3f, \"history\": [",
+	    h->verified, h->failed,
+	    closure_history_mean(h) / 1e9, closure_history_max(h) / 1e9);
+    for (unsigned int i = 0 ; i < h->count ; i++)
+	fprintf(f, "%s%.3f", i ? ", " : " ", closure_history_at(h, i) / 1e9);
+    fprintf(f, " ] }");
+    if (fclose(f) == 0)
+	mqtt_publish(mqtt->handler, mqtt->topic.closure_stats, 1, true,
+		     "%s", json);
+    free(json);
+}
+
+
+// Arm the timer on the deadline of the running check (0 = disarm). None
+// when replaying: the replay concludes the checks on its virtual clock.
+static void
+verification_arm(struct verification *v)
+{
+    if (v->tfd < 0)
+	return;
+
+    uint64_t deadline = closure_deadline(&v->check);
+    struct itimerspec its = {
+	.it_value.tv_sec  = deadline / 1000000000ull,
+	.it_value.tv_nsec = deadline % 1000000000ull,
+    };
+    if (timerfd_settime(v->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	LOG_ERRNO("failed to arm closure timer");
+}
+
+
+// Account the pulses of a batch of events, each at its own capture time
+static void
+verification_add(struct watermeter *w,
+		 const struct gpio_v2_line_event *event, int pulse)
+{
+    struct verification *v = &w->verification;
+    if (!v->enabled)
+	return;
+
+    pthread_mutex_lock(&v->lock);
+    enum closure_result result = CLOSURE_PENDING;
+    for (int i = 0 ; i < pulse ; i++)
+	if (closure_pulse(&v->check, event[i].timestamp_ns) == CLOSURE_FAILED)
+	    result = CLOSURE_FAILED;
+    if (result == CLOSURE_FAILED) {
+	verification_arm(v);
+	verification_publish(w, result);
+    }
+    pthread_mutex_unlock(&v->lock);
+}
+
+
+// Value of the numeric member `key` of the flat JSON object `json`
+static bool
+verification_member(const char *json, const char *key, double *value)
+{
+    const char *p = strstr(json, key);
+    if (p == NULL)
+	return false;
+    p += strlen(key);
+    p += strspn(p, " \t\r\n");
+    if (*p++ != ':')
+	return false;
+    char *end;
+    *value = strtod(p, &end);
+    return end != p;
+}
+
+
+// State of the main valve in the acknowledgement `json`: a number for a
+// single line, an object keyed by line name for all of them at once
+// (`"state": { "main": 1, ... }`).
+static bool
+verification_state(const char *json, double *state)
+{
+    const char *p = strstr(json, "\"state\"");
+    if (p == NULL)
+	return false;
+    p += strlen("\"state\"");
+    p += strspn(p, " \t\r\n");
+    if (*p++ != ':')
+	return false;
+    p += strspn(p, " \t\r\n");
+    return (*p == '{') ? verification_member(p, "\"main\"", state)
+	               : verification_member(json, "\"state\"", state);
+}
+
+
+// Valve closed (at ts): start a check; opened: drop the running one
+static void
+verification_valve(struct watermeter *w, bool closed, uint64_t ts)
+{
+    struct verification *v = &w->verification;
+
+    pthread_mutex_lock(&v->lock);
+    if (closed) {
+	LOG("valve closed, verifying (pulses must stop within %.0fs)",
+	    v->check.timeout_ns / 1e9);
+	if (closure_start(&v->check, ts) == CLOSURE_FAILED)
+	    verification_publish(w, CLOSURE_FAILED);
+    } else if (v->check.active) {
+	closure_cancel(&v->check);
+	LOG("valve reopened, closure verification dropped");
+    }
+    verification_arm(v);
+    pthread_mutex_unlock(&v->lock);
+}
+
+
+// Breaker acknowledgement, of the main valve alone or of all the lines:
+// an applied closure of the main valve starts a check, an applied opening
+// drops the running one. The actuation time is wall-clock, so both
+// daemons must share the clock (same host). Ignored when replaying, the
+// valve closures come from the trace then.
+static void
+closure_on_message(struct mosquitto *mosq, void *obj,
+		   const struct mosquitto_message *msg)
+{
+    (void)mosq;
+    (void)obj;
+
+    if (watermeter.replay.file)
+	return;
+
+    // Bounded and terminated copy; quotes only delimit keys and values
+    // in there (see breaker_acknowledge), so the lookups cannot be fooled
+    // by the content of a string.
+    char json[512];
+    if ((msg->payloadlen <= 0) || (msg->payloadlen >= (int)sizeof(json)))
+	return;
+    memcpy(json, msg->payload, msg->payloadlen);
+    json[msg->payloadlen] = '\0';
+
+    double state, actuated;
+    if (!strstr(json, "\"result\": \"ok\"")                  ||
+	!verification_state(json, &state)                     ||
+	!verification_member(json, "\"actuated\"", &actuated) ||
+	(actuated <= 0))
+	return;
+
+    uint64_t rt  = actuated * 1e9;
+    uint64_t ts  = rt - clock_monotonic_to_realtime(0);
+
+    verification_valve(&watermeter, state == 1, ts);
+}
+
+
+static pthread_t thr_verification;
+
+// Conclude the checks that saw no late pulse
+__attribute__((noreturn))
+static void * verification_task(void *parameters) {
+    struct watermeter   *w = parameters;
+    struct verification *v = &w->verification;
+
+    while (1) {
+	uint64_t expirations;
+	if (read(v->tfd, &expirations, sizeof(expirations)) < 0) {
+	    if (errno != EINTR)
+		LOG_ERRNO("failed to read closure timer");
+	    continue;
+	}
+
+	pthread_mutex_lock(&v->lock);
+	enum closure_result result =
+	    closure_tick(&v->check, clock_ns(CLOCK_MONOTONIC));
+	if (result != CLOSURE_PENDING)
+	    verification_publish(w, result);
+	pthread_mutex_unlock(&v->lock);
+    }
+}
+
+
+static int
+verification_init(struct verification *v, bool replaying)
+{
+    if (!v->enabled)
+	return 0;
+
+    // Replay: concluded on the virtual clock, see verification_arm()
+    if (!replaying &&
+	((v->tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) < 0)) {
+	LOG_ERRNO("failed to create closure timerfd");
+	return -1;
+    }
+    LOG("closure verification: pulses stop within %.0fs, then none for %.0fs",
+	v->check.timeout_ns / 1e9, v->check.window_ns / 1e9);
+    return 0;
+}
+
+
+
 //======================================================================
 
 int
-watermeter_init(struct watermeter *w)
+watermeter_init(struct watermeter *w, struct mqtt *shared)
 {
     struct watermeter_mqtt *mqtt = &w->mqtt;
     struct pulse_counting  *pc   = &w->pulse_counting;
     struct index_reader    *ir   = &w->index_reader;
+    struct replaying       *rp   = &w->replay;
+    time_t                  now  = time(NULL);
     
-    if (watermeter_mqtt_init(mqtt) < 0)
+    if (watermeter_mqtt_init(mqtt, shared) < 0)
+	return -1;
+
+
+    //
+    // Replay (in place of the M-Bus and GPIO)
+    //
+    if (rp->file != NULL) {
+	unsigned long line;
+	if (replay_load(&rp->trace, rp->file, &line) < 0) {
+	    if (errno == EINVAL)
+		LOG("invalid trace record (%s:%lu)", rp->file, line);
+	    else
+		LOG_ERRNO("failed to load trace %s", rp->file);
+	    replay_free(&rp->trace);
+	    return -1;
+	}
+	if (rp->trace.count == 0) {
+	    LOG("nothing to replay in %s", rp->file);
+	    return -1;
+	}
+	now = rp->trace.record[0].ts / 1000000000ull;
+	LOG("replaying %s: %lu pulses, %lu index readings, %lu valve changes",
+	    rp->file, rp->trace.pulses, rp->trace.indexes, rp->trace.valves);
+    }
+
+    if (aggregation_init(&w->aggregation, now) < 0)
 	return -1;
+    if (verification_init(&w->verification, rp->file != NULL) < 0)
+	return -1;
+    if (rp->file != NULL)
+	return 0;
     
     
     //
@@ -381,8 +940,11 @@ watermeter_parse_config(int argc, char **argv, struct watermeter *w)
 {
     struct pulse_counting *pc = &w->pulse_counting;
     struct index_reader   *ir = &w->index_reader;
+    struct aggregation    *ag = &w->aggregation;
+    struct verification   *v  = &w->verification;
+    struct replaying      *rp = &w->replay;
 
-    static const char *const shortopts = "+rd:b:a:i:P:L:D:B:E:I:h";
+    static const char *const shortopts = "+rd:b:a:i:P:L:D:B:E:I:A:V:C:W:R:S:h";
     
     const struct option longopts[] = {
 	{ "reduced-latency", no_argument,	NULL,	'r' },
@@ -396,6 +958,12 @@ watermeter_parse_config(int argc, char **argv, struct watermeter *w)
 	{ "bias",            required_argument, NULL,	'B' },
 	{ "edge",            required_argument, NULL,	'E' },
 	{ "idle-timeout",    required_argument, NULL,	'I' },
+	{ "aggregate",       required_argument, NULL,	'A' },
+	{ "pulse-volume",    required_argument, NULL,	'V' },
+	{ "closure-timeout", required_argument, NULL,	'C' },
+	{ "closure-window",  required_argument, NULL,	'W' },
+	{ "replay",          required_argument, NULL,	'R' },
+	{ "replay-speed",    required_argument, NULL,	'S' },
 	{ "help",	     no_argument,	NULL,	'h' },
 	{ NULL },
     };
@@ -412,7 +980,7 @@ watermeter_parse_config(int argc, char **argv, struct watermeter *w)
 	    w->reduced_latency = 1;
 	    break;
 	case 'd':
-	    ir->device = optarg;
+	    ir->device = strcmp(optarg, "none") ? optarg : NULL;
 	    break;
 	case 'b':
 	    if (parse_mbus_baudrate(optarg, &ir->baudrate) < 0)
@@ -451,10 +1019,39 @@ watermeter_parse_config(int argc, char **argv, struct watermeter *w)
 		USAGE_DIE("invalid idle timeout (1s .. 10w)");
 	    pc->flags.idle_timeout = 1;
 	    break;
+	case 'A':
+	    ag->file = optarg;
+	    break;
+	case 'V':
+	    if (parse_pulse_volume(optarg, &ag->pulse_volume) < 0)
+		USAGE_DIE("invalid pulse volume (0.001L .. 1000L)");
+	    break;
+	case 'C': {
+	    unsigned long timeout;
+	    if (parse_idle_timeout(optarg, &timeout) < 0)
+		USAGE_DIE("invalid closure timeout (1s .. 10w)");
+	    v->check.timeout_ns = timeout * 1000000000ull;
+	    v->enabled = true;
+	    break;
+	}
+	case 'W': {
+	    unsigned long window;
+	    if (parse_idle_timeout(optarg, &window) < 0)
+		USAGE_DIE("invalid closure window (1s .. 10w)");
+	    v->check.window_ns = window * 1000000000ull;
+	    break;
+	}
+	case 'R':
+	    rp->file = optarg;
+	    break;
+	case 'S':
+	    if (parse_replay_speed(optarg, &rp->speed) < 0)
+		USAGE_DIE("invalid replay speed (0.001 .. 1e9, max)");
+	    break;
 	case 'h':
 	    printf("pulse-counting [opts]\n");
 	    printf("  -r, --reduced-latency            try to reduce latency\n");
-	    printf("  -d, --device=DEV                 m-bus serial device\n");
+	    printf("  -d, --device=DEV                 m-bus serial device (none: no m-bus)\n");
 	    printf("  -b, --baudrate=BAUDS             m-bus baudrate\n");
 	    printf("  -a, --address=ADDR               m-bus primary or secondary\n");
 	    printf("  -i, --interval=SEC               reporting index interval\n");
@@ -465,6 +1062,15 @@ watermeter_parse_config(int argc, char **argv, struct watermeter *w)
 	    printf("             pull-up|pull-down\n");
 	    printf("  -E, --edge=rising|falling        gpio edge detection\n");
 	    printf("  -I, --idle-timeout=SEC           gpio notify if no pulse\n");
+	    printf("  -A, --aggregate=FILE             consumption totals, saved to FILE\n");
+	    printf("  -V, --pulse-volume=LITERS        volume of a pulse (default 1)\n");
+	    printf("  -C, --closure-timeout=SEC        verify valve closures: pulses\n");
+	    printf("                                   stop within SEC\n");
+	    printf("  -W, --closure-window=SEC         then none for SEC (default 60)\n");
+	    printf("  -R, --replay=FILE                replay a recorded trace in place\n");
+	    printf("                                   of the m-bus and gpio\n");
+	    printf("  -S, --replay-speed=N|max         replay N times faster than\n");
+	    printf("                                   real time (default 1)\n");
 	    printf("\n");
 	    exit(0);
 	case 0:
@@ -475,6 +1081,9 @@ watermeter_parse_config(int argc, char **argv, struct watermeter *w)
     }
     argc -= optind;
     argv += optind;
+
+    if (v->enabled && (pc->ctrl.id == NULL) && (rp->file == NULL))
+	USAGE_DIE("closure verification requires pulse counting (-P)");
 }
 
 
@@ -485,6 +1094,40 @@ static pthread_t thr_pulse_counting;
 static pthread_t thr_index_reader;
 
 
+// An index reading, at `ts` (CLOCK_MONOTONIC), published as read at
+// `reading_ts` (0 = now)
+static void
+index_reader_process(struct watermeter *w, uint64_t ts, double value,
+		     uint64_t reading_ts)
+{
+    struct watermeter_mqtt *mqtt = &w->mqtt;
+
+    PUT_DATA("watermeter", "index=%0.3f", value);
+    if (!watermeter_counts_pulses(w))
+	aggregation_add_index(w, ts, value);
+    MQTT_PUBLISH_READING(mqtt, index, 1, false, reading_ts, "%0.3f", value);
+}
+
+
+// A batch of pulses (none: idle timeout), each at its event timestamp,
+// published as read at `reading_ts` (0 = now)
+static void
+pulse_counting_process(struct watermeter *w,
+		       const struct gpio_v2_line_event *event, int pulse,
+		       uint64_t reading_ts)
+{
+    struct watermeter_mqtt *mqtt = &w->mqtt;
+
+    if (pulse > 0) {
+	aggregation_add(w, event[pulse - 1].timestamp_ns,
+			pulse * w->aggregation.pulse_volume);
+	verification_add(w, event, pulse);
+    }
+    PUT_DATA("watermeter", "pulse=%d", pulse);
+    MQTT_PUBLISH_READING(mqtt, pulse, 2, false, reading_ts, "%u", pulse);
+}
+
+
 __attribute__((noreturn))
 static void * index_reader_task(void *parameters) {
     struct watermeter_mqtt *mqtt = &watermeter.mqtt;
@@ -496,15 +1139,15 @@ static void * index_reader_task(void *parameters) {
     while (1) {
 	// Watermeter
 	double value;
-	if (watermeter_get_index(&watermeter, &value) < 0) {
+	int rc = watermeter_get_index(&watermeter, &value);
+	uint64_t ts = clock_ns(CLOCK_MONOTONIC);     // M-Bus reply complete
+	if (rc < 0) {
 	    PUT_FAIL("watermeter", "read");
-	    static char *msg =
-		MQTT_ERROR_MSG("watermeter", "error",
-			       "failed to read index");
-	    MQTT_PUBLISH(mqtt, error, 1, false, "%s", msg);
+	    MQTT_ERROR(mqtt, error, 1, "watermeter", "index",
+		       "failed to read index");
 	} else {
-	    PUT_DATA("watermeter", "index=%0.3f", value);
-	    MQTT_PUBLISH(mqtt, index, 1, false, "%0.3f", value);
+	    MQTT_ERROR_CLEAR(mqtt, error, "watermeter", "index");
+	    index_reader_process(&watermeter, ts, value, ts);
 	}
 	
 	// Next
@@ -520,7 +1163,9 @@ static void * pulse_counting_task(void *parameters) {
     struct pulse_counting  *pc   = parameters;
 
     while(1) {
-	int pulse = 0;
+	struct gpio_v2_line_event event[MAX_EVENTS];
+	int      pulse = 0;
+	uint64_t ts    = 0;             // capture time (0 = idle timeout)
 
 	if (pc->flags.idle_timeout) {
 	    struct timespec ts = {
@@ -539,43 +1184,271 @@ static void * pulse_counting_task(void *parameters) {
 	    }
 	}
 
-	struct gpio_v2_line_event event[MAX_EVENTS];
 	ssize_t size = read(pc->pin.fd, event, sizeof(event));
 	    
 	if (size < 0) {
 	    LOG_ERRNO("failed to read event");
 	    PUT_FAIL("watermeter", "pulse");
-
-	    static char *msg =
-		MQTT_ERROR_MSG("watermeter", "error",
-			       "failed to read pulse");
-	    MQTT_PUBLISH(mqtt, error, 1, false, "%s", msg);
+	    MQTT_ERROR(mqtt, error, 1, "watermeter", "pulse",
+		       "failed to read pulse");
 	    continue;
 	} else if (size % sizeof(struct gpio_v2_line_event)) {
 	    LOG("got event of unexpected size");
 	    continue;
 	}
+	MQTT_ERROR_CLEAR(mqtt, error, "watermeter", "pulse");
 
 	pulse = size / sizeof(struct gpio_v2_line_event);
-	
+	ts    = event[pulse - 1].timestamp_ns; // kernel, CLOCK_MONOTONIC
+
     publish:
-	PUT_DATA("watermeter", "pulse=%d", pulse);
-	MQTT_PUBLISH(mqtt, pulse, 2, false, "%u", pulse);
+	pulse_counting_process(&watermeter, event, pulse, ts);
+    }
+}
+
+
+
+//== Replay ============================================================
+
+static pthread_t thr_replay;
+
+// Wait for virtual time `mono` (not at all at full speed)
+static void
+replay_wait(const struct replay *r, uint64_t mono)
+{
+    if (r->clock.speed <= 0)
+	return;
+
+    uint64_t due = replay_due(r, mono);
+    if (due <= clock_ns(CLOCK_MONOTONIC))
+	return;
+    struct timespec ts = {
+	.tv_sec  = due / 1000000000ull,
+	.tv_nsec = due % 1000000000ull,
+    };
+    sleep_until(CLOCK_MONOTONIC, &ts);
+}
+
+
+// Wait, within reason, for the MQTT session to be up (a fast replay would
+// be over before it), or for the messages in flight to be acknowledged
+static void
+replay_mqtt_wait(struct mqtt *mqtt, bool drain)
+{
+    if (!mqtt_enabled(mqtt))
+	return;
+
+    for (int i = 0 ; i < 100 ; i++) {
+	struct mqtt_stats st;
+	mqtt_get_stats(mqtt, &st);
+	if (drain ? (st.inflight == 0) : (st.connected_at_ns != 0))
+	    return;
+	usleep(100000);
+    }
+}
+
+
+// Virtual timers due before `until`, in time order: what the aggregation
+// and verification threads, and the idle timeout, do on the real clock.
+static void
+replay_timers(struct watermeter *w, uint64_t until,
+	      uint64_t *minute, uint64_t *idle)
+{
+    struct replay       *r  = &w->replay.trace;
+    struct aggregation  *ag = &w->aggregation;
+    struct verification *v  = &w->verification;
+
+    while (1) {
+	uint64_t deadline = closure_deadline(&v->check);
+	uint64_t next     = UINT64_MAX;
+	if (ag->file && (*minute < next))      next = *minute;
+	if (deadline && (deadline < next))     next = deadline;
+	if (*idle    && (*idle    < next))     next = *idle;
+	if (next >= until)
+	    return;
+	replay_wait(r, next);
+
+	if (ag->file && (next == *minute)) {
+	    pthread_mutex_lock(&ag->lock);
+	    aggregation_update(w, aggregate_tick(&ag->data,
+				 replay_realtime(r, next) / 1000000000ull));
+	    pthread_mutex_unlock(&ag->lock);
+	    *minute += 60 * 1000000000ull;
+	}
+	if (deadline == next) {
+	    pthread_mutex_lock(&v->lock);
+	    enum closure_result result = closure_tick(&v->check, next);
+	    if (result != CLOSURE_PENDING)
+		verification_publish(w, result);
+	    pthread_mutex_unlock(&v->lock);
+	}
+	if (*idle == next) {
+	    pulse_counting_process(w, NULL, 0, 0);
+	    *idle += w->pulse_counting.idle_timeout * 1000000000ull;
+	}
+    }
+}
+
+
+// Feed the trace to the pipeline, then have the last messages delivered.
+// Readings are published as read now, the trace time only shows in the
+// aggregates and closure checks.
+static void * replay_task(void *parameters) {
+    struct watermeter     *w  = parameters;
+    struct replaying      *rp = &w->replay;
+    struct replay         *r  = &rp->trace;
+    struct aggregation    *ag = &w->aggregation;
+    struct pulse_counting *pc = &w->pulse_counting;
+
+    replay_mqtt_wait(w->mqtt.handler, false);
+    uint64_t start = clock_ns(CLOCK_MONOTONIC);
+    replay_clock_start(r, start, rp->speed);
+
+    // Restored totals, and the minutes from the start of the trace
+    uint64_t minute = r->clock.trace_start - r->clock.trace_start
+	                                   % (60 * 1000000000ull);
+    minute = replay_mono(r, minute + 60 * 1000000000ull);
+    if (ag->file) {
+	pthread_mutex_lock(&ag->lock);
+	ag->changed = true;
+	aggregation_update(w, aggregate_tick(&ag->data,
+			     r->clock.trace_start / 1000000000ull));
+	pthread_mutex_unlock(&ag->lock);
+    }
+
+    // Idle timeout: running if there are pulses to count
+    uint64_t idle_timeout = (pc->flags.idle_timeout && r->pulses)
+	                  ? pc->idle_timeout * 1000000000ull : 0;
+    uint64_t idle         = idle_timeout ? start + idle_timeout : 0;
+
+    for (size_t i = 0 ; i < r->count ; i++) {
+	const struct replay_record *rec = &r->record[i];
+	uint64_t ts = replay_mono(r, rec->ts);
+
+	replay_timers(w, ts, &minute, &idle);
+	replay_wait(r, ts);
+
+	switch (rec->kind) {
+	case REPLAY_PULSE: {
+	    // As read from the line: batches of at most MAX_EVENTS
+	    struct gpio_v2_line_event event[MAX_EVENTS];
+	    for (unsigned int left = rec->count ; left > 0 ; ) {
+		int pulse = (left < MAX_EVENTS) ? left : MAX_EVENTS;
+		for (int j = 0 ; j < pulse ; j++)
+		    event[j] = (struct gpio_v2_line_event) {
+			.timestamp_ns = ts,
+			.id           = GPIO_V2_LINE_EVENT_RISING_EDGE,
+		    };
+		pulse_counting_process(w, event, pulse, 0);
+		left -= pulse;
+	    }
+	    if (idle_timeout)
+		idle = ts + idle_timeout;
+	    break;
+	}
+	case REPLAY_INDEX:
+	    index_reader_process(w, ts, rec->index, 0);
+	    break;
+	case REPLAY_VALVE:
+	    verification_valve(w, rec->state == 1, ts);
+	    break;
+	}
+    }
+
+    // Conclude: the pending minute and closure check, nothing more
+    uint64_t last = closure_deadline(&w->verification.check);
+    idle = 0;
+    replay_timers(w, ((last > minute) ? last : minute) + 1, &minute, &idle);
+
+#ifdef WITH_LOG
+    uint64_t end     = replay_mono(r, r->record[r->count - 1].ts);
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+    double   span    = (end - start) / 1e9;
+    LOG("replay of %s done: %.2f days of trace in %.3fs (x%.0f)",
+	rp->file, span / 86400, elapsed / 1e9,
+	elapsed ? span / (elapsed / 1e9) : 0);
+#endif
+
+    // Last messages out
+    mqtt_flush(w->mqtt.handler);
+    replay_mqtt_wait(w->mqtt.handler, true);
+    return NULL;
+}
+
+
+static int
+watermeter_start(void)
+{
+    // The trace stands in for every source
+    if (watermeter.replay.file) {
+	if (pthread_create(&thr_replay, NULL, replay_task, &watermeter) != 0) {
+	    LOG("failed to start replay thread");
+	    return -1;
+	}
+	return 0;
+    }
+
+    // Only the configured sources are started
+    if (watermeter.pulse_counting.ctrl.id &&
+	(pthread_create(&thr_pulse_counting, NULL,
+			pulse_counting_task, &watermeter.pulse_counting) != 0)) {
+	LOG("failed to start pulse counting thread");
+	return -1;
+    }
+    if (watermeter.index_reader.device &&
+	(pthread_create(&thr_index_reader,   NULL,
+			index_reader_task,   &watermeter.index_reader) != 0)) {
+	LOG("failed to start index reader thread");
+	return -1;
+    }
+    if (watermeter.aggregation.file &&
+	(pthread_create(&thr_aggregation,    NULL,
+			aggregation_task,    &watermeter) != 0)) {
+	LOG("failed to start aggregation thread");
+	return -1;
+    }
+    if (watermeter.verification.enabled &&
+	(pthread_create(&thr_verification,   NULL,
+			verification_task,   &watermeter) != 0)) {
+	LOG("failed to start closure verification thread");
+	return -1;
     }
+    return 0;
 }
 
+static void
+watermeter_configure(int argc, char **argv)
+{
+    watermeter_parse_config(argc, argv, &watermeter);
+}
+
+static int
+watermeter_module_init(struct mqtt *shared)
+{
+    return watermeter_init(&watermeter, shared);
+}
+
+const struct moses_module watermeter_module = {
+    .name            = "watermeter",
+    .configure       = watermeter_configure,
+    .init            = watermeter_module_init,
+    .start           = watermeter_start,
+    .reduced_latency = &watermeter.reduced_latency,
+};
+
 
+#ifndef MOSES_HUB
 int
 main(int argc, char **argv)
 {
     __progname = basename(argv[0]);
 
     // Configuration
-    mqtt_config_from_env(&watermeter.mqtt.handler);
+    mqtt_config_from_env(watermeter.mqtt.handler);
     watermeter_parse_config(argc, argv, &watermeter);
 
     // Initialization
-    if (watermeter_init(&watermeter) < 0)
+    if (watermeter_init(&watermeter, NULL) < 0)
 	DIE(2, "failed to initialize");
 
     // Reducing latency
@@ -583,22 +1456,28 @@ main(int argc, char **argv)
 	reduced_latency();
 
     // Starting threads
-    if (watermeter.pulse_counting.ctrl.id)
-	pthread_create(&thr_pulse_counting, NULL,
-		       pulse_counting_task, &watermeter.pulse_counting);
-    if (watermeter.index_reader.device)
-	pthread_create(&thr_index_reader,   NULL,
-		       index_reader_task,   &watermeter.index_reader);
+    if (watermeter_start() < 0)
+	DIE(2, "failed to start");
+
+    // Replay: over at the end of the trace
+    if (watermeter.replay.file) {
+	pthread_join(thr_replay, NULL);
+	mqtt_destroy(watermeter.mqtt.handler);
+	replay_free(&watermeter.replay.trace);
+	return 0;
+    }
 
     // Waiting... (they are not suppose to terminate)
     if (watermeter.pulse_counting.ctrl.id)
 	pthread_join(thr_pulse_counting, NULL);
     if (watermeter.index_reader.device)
 	pthread_join(thr_index_reader,   NULL);
+    if (watermeter.aggregation.file)
+	pthread_join(thr_aggregation,    NULL);
+    if (watermeter.verification.enabled)
+	pthread_join(thr_verification,   NULL);
     
     
     return 0;
 }
-
-
-
+#endif
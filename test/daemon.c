@@ -0,0 +1,122 @@
+/*
+ * daemon -- moses program under test, as a child process (see daemon.h).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/wait.h>
+
+#include "daemon.h"
+
+#define MAX_ARGS   32
+
+
+int
+cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+
+pid_t
+daemon_spawn(const char *path, const char *id,
+	     const char *host, uint16_t port, const char *const args[])
+{
+    char *argv[MAX_ARGS + 2];
+    int   argc = 0;
+    argv[argc++] = (char *)path;
+    for (int i = 0 ; args && args[i] ; i++) {
+	if (argc > MAX_ARGS)
+	    return -1;
+	argv[argc++] = (char *)args[i];
+    }
+    argv[argc] = NULL;
+
+    char s_port[8];
+    snprintf(s_port, sizeof(s_port), "%u", port);
+
+    pid_t pid = fork();
+    if (pid == 0) {
+	setenv("MQTT_HOST",          host,   1);
+	setenv("MQTT_PORT",          s_port, 1);
+	setenv("MQTT_TOPIC_PREFIX",  PREFIX, 1);
+	setenv("MQTT_CLIENT_ID",     id,     1);
+	execv(path, argv);
+	perror(path);
+	_exit(127);
+    }
+    return pid;
+}
+
+void
+daemon_stop(pid_t pid)
+{
+    if (pid <= 0)
+	return;
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+}
+
+
+int
+daemon_wait_for_cb(struct mqtt_client *c, const char *topic,
+		   struct mqtt_client_message *msg,
+		   void (*seen)(const struct mqtt_client_message *msg,
+				void *ctx), void *ctx)
+{
+    uint64_t deadline = now_ns() + TIMEOUT_MS * 1000000ull;
+    while (now_ns() < deadline) {
+	if (mqtt_client_receive(c, msg, 100) != 1)
+	    continue;
+	if (strcmp(msg->topic, topic) == 0)
+	    return 1;
+	if (seen)
+	    seen(msg, ctx);
+    }
+    return 0;
+}
+
+int
+daemon_wait_for(struct mqtt_client *c, const char *topic,
+		struct mqtt_client_message *msg)
+{
+    return daemon_wait_for_cb(c, topic, msg, NULL, NULL);
+}
+
+int
+daemon_wait_connected(struct mqtt_client *c, const char *name)
+{
+    char topic[128];
+    snprintf(topic, sizeof(topic), PREFIX "/stats/%s", name);
+
+    // A retained copy only tells of a previous run on the same broker
+    struct mqtt_client_message msg;
+    while (daemon_wait_for(c, topic, &msg))
+	if (!msg.retain)
+	    return 1;
+    return 0;
+}
+
+
+int
+daemon_set_state(struct mqtt_client *c, const char *want)
+{
+    struct mqtt_client_message msg;
+    if ((mqtt_client_publish(c, PREFIX "/state/set", want, strlen(want),
+			     1, false) < 0) ||
+	!daemon_wait_for(c, PREFIX "/state", &msg) ||
+	strcmp(msg.payload, want)) {
+	fprintf(stderr, "valve not set to %s\n", want);
+	return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,55 @@
+#ifndef __DAEMON_H
+#define __DAEMON_H
+
+/*
+ * Daemon under test: one of the moses programs run unmodified, as a child
+ * process, against the broker stand-in (mqtt_broker.h), and driven through
+ * a test client.
+ *
+ * The daemons are started with MQTT_TOPIC_PREFIX set to PREFIX, so every
+ * topic a test uses is PREFIX "/...".
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mqtt_broker.h"
+
+#define EXIT_SKIP  77                   // ctest SKIP_RETURN_CODE
+#define PREFIX     "moses-test"
+#define TIMEOUT_MS 2000                 // waiting for a message
+
+
+// qsort() comparison of uint64_t, for the latency distributions
+int cmp_u64(const void *a, const void *b);
+
+// Start `path` with the options `args` (NULL terminated), connecting to
+// the broker at `host` ("127.0.0.1", or "unix:<path>") on `port` with the
+// client id `id`. The child's pid, -1 on failure.
+pid_t daemon_spawn(const char *path, const char *id,
+		   const char *host, uint16_t port, const char *const args[]);
+
+// Terminate (SIGTERM) and reap. Nothing done if `pid` is not positive.
+void daemon_stop(pid_t pid);
+
+// Wait up to TIMEOUT_MS for a message on `topic`; the others received on
+// the way are handed to `seen` (if not NULL). 1 if found.
+int daemon_wait_for_cb(struct mqtt_client *c, const char *topic,
+		       struct mqtt_client_message *msg,
+		       void (*seen)(const struct mqtt_client_message *msg,
+				    void *ctx), void *ctx);
+int daemon_wait_for(struct mqtt_client *c, const char *topic,
+		    struct mqtt_client_message *msg);
+
+// Wait for the daemon `name` to be connected and subscribed: its
+// statistics (`stats/<name>`, which `c` must be subscribed to) are
+// published last in the connect callback. Only a live publish counts,
+// the retained one being possibly left by an earlier daemon on the same
+// broker. 1 if connected.
+int daemon_wait_connected(struct mqtt_client *c, const char *name);
+
+// Set the valve through `state/set` and wait for `state` to echo it.
+// 0 on success, -1 on failure (reported).
+int daemon_set_state(struct mqtt_client *c, const char *want);
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * Fuzz target for breaker_parse_command -- the `state/set` payload parser,
+ * fed with whatever reaches the broker.
+ *
+ * Each input is parsed from a buffer of exactly its size (no terminating
+ * NUL, as payloads are not guaranteed to have one), so an out-of-bounds
+ * read is caught by AddressSanitizer, and the result is checked against
+ * what the daemon relies on: a state of -1, 0 or 1, and printable, bounded
+ * id, reason and source that can be echoed in the acknowledgement as is.
+ *
+ * Built with -DFUZZING and -fsanitize=fuzzer it is a libFuzzer target
+ * (started from the seeds in test/corpus/breaker_command). Otherwise it
+ * replays the files or directories given as arguments, which is how the
+ * corpus is run as a regular test.
+ *
+ * Usage: fuzz_breaker_command file|directory...
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "breaker_state.h"
+
+// Bounded, printable, no quote nor backslash
+static int
+text_ok(const char *s, size_t size)
+{
+    size_t len = strnlen(s, size);
+    if (len == size)
+	return 0;
+    for (size_t i = 0 ; i < len ; i++)
+	if ((s[i] < 0x20) || (s[i] > 0x7e) || (s[i] == '"') || (s[i] == '\\'))
+	    return 0;
+    return 1;
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    if (size > 4096)
+	return 0;
+
+    struct breaker_command cmd;
+    int rc = breaker_parse_command((const char *)data, (int)size, &cmd);
+
+    if ((rc < -1) || (rc > 1) || (rc != cmd.state) ||
+	!text_ok(cmd.id,     sizeof(cmd.id))     ||
+	!text_ok(cmd.reason, sizeof(cmd.reason)) ||
+	!text_ok(cmd.source, sizeof(cmd.source)) ||
+	(cmd.duration > BREAKER_FOR_MAX)         ||
+	(cmd.has_ts && !(isfinite(cmd.ts) && (cmd.ts >= 0))))
+	abort();
+
+    // Something was understood: it must be understood again the same way
+    if (rc >= 0) {
+	struct breaker_command again;
+	if ((breaker_parse_command((const char *)data, (int)size, &again) != rc) ||
+	    memcmp(&cmd, &again, sizeof(cmd)))
+	    abort();
+    }
+    return 0;
+}
+
+
+#ifndef FUZZING
+static int
+replay_file(const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+	perror(path);
+	return -1;
+    }
+
+    // Into a buffer of its exact size
+    char   chunk[4096];
+    size_t size = fread(chunk, 1, sizeof(chunk), f);
+    int    err  = ferror(f);
+    fclose(f);
+    if (err) {
+	perror(path);
+	return -1;
+    }
+    uint8_t *data = malloc(size ? size : 1);
+    if (data == NULL)
+	return -1;
+    memcpy(data, chunk, size);
+    LLVMFuzzerTestOneInput(data, size);
+    free(data);
+    return 0;
+}
+
+static int
+replay(const char *path, int *count)
+{
+    struct stat st;
+    if (stat(path, &st) < 0) {
+	perror(path);
+	return -1;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+	(*count)++;
+	return replay_file(path);
+    }
+
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+	perror(path);
+	return -1;
+    }
+    int rc = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+	if (de->d_name[0] == '.')
+	    continue;
+	char *file;
+	if (asprintf(&file, "%s/%s", path, de->d_name) < 0) {
+	    rc = -1;
+	    break;
+	}
+	if (replay(file, count) < 0)
+	    rc = -1;
+	free(file);
+    }
+    closedir(dir);
+    return rc;
+}
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s file|directory...\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    int count = 0;
+    int rc    = EXIT_SUCCESS;
+    for (int i = 1 ; i < argc ; i++)
+	if (replay(argv[i], &count) < 0)
+	    rc = EXIT_FAILURE;
+
+    printf("%d inputs replayed\n", count);
+    return (count > 0) ? rc : EXIT_FAILURE;
+}
+#endif
@@ -0,0 +1,150 @@
+/*
+ * gpio_sim -- simulated GPIO chip for the tests (see gpio_sim.h).
+ *
+ * Layout used by the kernel driver:
+ *   /sys/kernel/config/gpio-sim/<name>/bank0/{num_lines,chip_name}
+ *   /sys/kernel/config/gpio-sim/<name>/{live,dev_name}
+ *   /sys/devices/platform/<dev_name>/<chip_name>/sim_gpio<N>/{value,pull}
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+
+#include <sys/stat.h>
+
+#include "gpio_sim.h"
+
+#define CONFIGFS "/sys/kernel/config/gpio-sim"
+
+
+static int
+write_file(const char *path, const char *value)
+{
+    int fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = write(fd, value, strlen(value));
+    close(fd);
+    return (n == (ssize_t)strlen(value)) ? 0 : -1;
+}
+
+static int
+read_file(const char *path, char *buf, size_t size)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t n = read(fd, buf, size - 1);
+    close(fd);
+    if (n <= 0) return -1;
+    buf[n] = '\0';
+    buf[strcspn(buf, "\n")] = '\0';
+    return 0;
+}
+
+int
+gpio_sim_create(struct gpio_sim *sim, const char *name, int lines)
+{
+    char path[256], value[16];
+
+    memset(sim, 0, sizeof(*sim));
+    snprintf(sim->name, sizeof(sim->name), "%s-%d", name, getpid());
+
+    snprintf(path, sizeof(path), CONFIGFS "/%s", sim->name);
+    if (mkdir(path, 0755) < 0)
+	return -1;
+    snprintf(path, sizeof(path), CONFIGFS "/%s/bank0", sim->name);
+    if (mkdir(path, 0755) < 0)
+	goto failed;
+
+    snprintf(path,  sizeof(path), CONFIGFS "/%s/bank0/num_lines", sim->name);
+    snprintf(value, sizeof(value), "%d", lines);
+    if (write_file(path, value) < 0)
+	goto failed;
+    snprintf(path, sizeof(path), CONFIGFS "/%s/live", sim->name);
+    if (write_file(path, "1") < 0)
+	goto failed;
+
+    snprintf(path, sizeof(path), CONFIGFS "/%s/bank0/chip_name", sim->name);
+    if (read_file(path, sim->chip, sizeof(sim->chip)) < 0)
+	goto failed;
+    snprintf(path, sizeof(path), CONFIGFS "/%s/dev_name", sim->name);
+    if (read_file(path, sim->dev, sizeof(sim->dev)) < 0)
+	goto failed;
+    return 0;
+
+ failed:
+    gpio_sim_destroy(sim);
+    return -1;
+}
+
+void
+gpio_sim_destroy(struct gpio_sim *sim)
+{
+    char path[256];
+
+    if (sim->name[0] == '\0')
+	return;
+    snprintf(path, sizeof(path), CONFIGFS "/%s/live", sim->name);
+    write_file(path, "0");
+    snprintf(path, sizeof(path), CONFIGFS "/%s/bank0", sim->name);
+    rmdir(path);
+    snprintf(path, sizeof(path), CONFIGFS "/%s", sim->name);
+    rmdir(path);
+    sim->name[0] = '\0';
+}
+
+static void
+line_path(struct gpio_sim *sim, int line, const char *attr,
+	  char *path, size_t size)
+{
+    snprintf(path, size, "/sys/devices/platform/%s/%s/sim_gpio%d/%s",
+	     sim->dev, sim->chip, line, attr);
+}
+
+int
+gpio_sim_get(struct gpio_sim *sim, int line)
+{
+    char path[256], value[8];
+    line_path(sim, line, "value", path, sizeof(path));
+    if (read_file(path, value, sizeof(value)) < 0)
+	return -1;
+    return value[0] == '1';
+}
+
+int
+gpio_sim_pull(struct gpio_sim *sim, int line, bool up)
+{
+    char path[256];
+    line_path(sim, line, "pull", path, sizeof(path));
+    return write_file(path, up ? "pull-up" : "pull-down");
+}
+
+int
+gpio_sim_value_fd(struct gpio_sim *sim, int line)
+{
+    char path[256];
+    line_path(sim, line, "value", path, sizeof(path));
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+int
+gpio_sim_pull_fd(struct gpio_sim *sim, int line)
+{
+    char path[256];
+    line_path(sim, line, "pull", path, sizeof(path));
+    return open(path, O_WRONLY | O_CLOEXEC);
+}
+
+int
+gpio_sim_pull_fd_set(int fd, bool up)
+{
+    const char *value = up ? "pull-up" : "pull-down";
+    size_t      len   = strlen(value);
+    return (pwrite(fd, value, len, 0) == (ssize_t)len) ? 0 : -1;
+}
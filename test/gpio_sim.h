@@ -0,0 +1,39 @@
+#ifndef __GPIO_SIM_H
+#define __GPIO_SIM_H
+
+/*
+ * Simulated GPIO chip (Linux gpio-sim, configured through configfs), so the
+ * daemons can drive or sample real character-device lines in tests.
+ *
+ * Needs root, configfs mounted on /sys/kernel/config and the gpio-sim
+ * module; gpio_sim_create() fails (and the tests skip) otherwise.
+ */
+
+#include <stdbool.h>
+
+struct gpio_sim {
+    char name[64];                      // configfs directory
+    char chip[32];                      // /dev name (gpiochipN)
+    char dev[32];                       // platform device (gpio-sim.N)
+};
+
+// Create and enable a chip of `lines` lines. 0 on success, -1 on failure.
+int  gpio_sim_create(struct gpio_sim *sim, const char *name, int lines);
+void gpio_sim_destroy(struct gpio_sim *sim);
+
+// Value of a line as seen from the outside world (what a requested output
+// drives, or the pull of an input). -1 on failure.
+int  gpio_sim_get(struct gpio_sim *sim, int line);
+
+// Pull an input line up or down (a pulse on the input). -1 on failure.
+int  gpio_sim_pull(struct gpio_sim *sim, int line, bool up);
+
+// Open the value attribute, for busy-polling with pread(). -1 on failure.
+int  gpio_sim_value_fd(struct gpio_sim *sim, int line);
+
+// Open the pull attribute, for fast toggling with gpio_sim_pull_fd_set().
+// -1 on failure.
+int  gpio_sim_pull_fd(struct gpio_sim *sim, int line);
+int  gpio_sim_pull_fd_set(int fd, bool up);
+
+#endif
@@ -0,0 +1,1095 @@
+/*
+ * mqtt_broker -- minimal MQTT 3.1.1 broker stand-in and test client.
+ *
+ * See mqtt_broker.h. Everything runs in a single broker thread driven by
+ * poll(); the control functions talk to it through atomics and a wake-up
+ * pipe. Packets are written with blocking writes, which is fine for the
+ * small volumes of the tests.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "mqtt_broker.h"
+
+#define MAX_CLIENTS        32
+#define MAX_SUBSCRIPTIONS  32
+#define MAX_QOS2_INFLIGHT  64
+#define MAX_QUEUED         256
+
+uint64_t
+now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int
+write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    while (len > 0) {
+	ssize_t n = write(fd, p, len);
+	if (n < 0) {
+	    if (errno == EINTR) continue;
+	    return -1;
+	}
+	p   += n;
+	len -= n;
+    }
+    return 0;
+}
+
+// Encode the fixed header (type/flags + remaining length) into hdr,
+// returning its size.
+static size_t
+encode_header(uint8_t *hdr, int type, int flags, size_t len)
+{
+    size_t n = 0;
+    hdr[n++] = (type << 4) | (flags & 0x0f);
+    do {
+	uint8_t byte = len % 128;
+	len /= 128;
+	if (len > 0) byte |= 0x80;
+	hdr[n++] = byte;
+    } while (len > 0);
+    return n;
+}
+
+static int
+send_packet(int fd, int type, int flags, const void *body, size_t len)
+{
+    uint8_t hdr[5];
+    size_t  hlen = encode_header(hdr, type, flags, len);
+    if (write_all(fd, hdr, hlen) < 0)
+	return -1;
+    return len ? write_all(fd, body, len) : 0;
+}
+
+static size_t
+put_string(uint8_t *p, const char *s, size_t len)
+{
+    p[0] = len >> 8;
+    p[1] = len & 0xff;
+    memcpy(p + 2, s, len);
+    return len + 2;
+}
+
+static int
+get_u16(const uint8_t **p, const uint8_t *end, uint16_t *v)
+{
+    if (end - *p < 2) return -1;
+    *v = ((*p)[0] << 8) | (*p)[1];
+    *p += 2;
+    return 0;
+}
+
+// Length-prefixed string/binary, returned in place (not NUL terminated).
+static int
+get_bytes(const uint8_t **p, const uint8_t *end,
+	  const uint8_t **data, uint16_t *len)
+{
+    if (get_u16(p, end, len) < 0) return -1;
+    if (end - *p < *len)          return -1;
+    *data = *p;
+    *p   += *len;
+    return 0;
+}
+
+bool
+mqtt_topic_match(const char *filter, const char *topic)
+{
+    while (*filter) {
+	if (filter[0] == '#')
+	    return true;
+	if (filter[0] == '+') {
+	    while (*topic && (*topic != '/')) topic++;
+	    filter++;
+	    continue;
+	}
+	if (*filter != *topic)
+	    // "a/#" also matches "a"
+	    return (*topic == '\0') && (strcmp(filter, "/#") == 0);
+	filter++;
+	topic++;
+    }
+    return *topic == '\0';
+}
+
+
+
+//== Broker ============================================================
+
+struct broker_client {
+    int       fd;
+    char      id[128];
+    bool      connected;
+    bool      clean_exit;               // DISCONNECT received
+    struct {
+	char    *topic;                 //  - NULL = no will
+	void    *payload;
+	size_t   len;
+	int      qos;
+	bool     retain;
+    } will;
+    struct {
+	char    *filter;
+	int      qos;
+    } sub[MAX_SUBSCRIPTIONS];
+    int       subcount;
+    uint16_t  qos2[MAX_QOS2_INFLIGHT];  // incoming QoS 2 awaiting PUBREL
+    int       qos2count;
+    uint16_t  next_id;
+    uint8_t  *buf;                      // input buffer
+    size_t    len, cap;
+};
+
+struct retained {
+    char   *topic;
+    void   *payload;
+    size_t  len;
+    int     qos;
+};
+
+struct mqtt_broker {
+    int              lfd;
+    _Atomic int      lfd_unix;          // -1 = none
+    char            *unix_path;
+    int              wake[2];
+    uint16_t         port;
+    pthread_t        thread;
+    struct broker_client *client[MAX_CLIENTS];
+    struct retained *retained;
+    size_t           retcount;
+    unsigned long    incoming;          // PUBLISH received (drop counting)
+
+    mqtt_broker_trace_cb trace;
+    void            *trace_ctx;
+
+    _Atomic uint32_t      delay_us;
+    _Atomic unsigned int  drop_every;
+    _Atomic int           refuse;
+    _Atomic unsigned long publishes;
+    _Atomic int           clients;
+    _Atomic int           kick;         // kick requested / clients kicked
+    _Atomic bool          stop;
+};
+
+
+static void
+trace(struct mqtt_broker *b, struct broker_client *c, bool inbound,
+      int type, int qos, bool retain, const char *topic,
+      const void *payload, size_t len)
+{
+    if (b->trace == NULL)
+	return;
+    struct mqtt_broker_packet pkt = {
+	.ts_ns      = now_ns(),
+	.inbound    = inbound,
+	.client_id  = c->id,
+	.type       = type,
+	.qos        = qos,
+	.retain     = retain,
+	.topic      = topic,
+	.payload    = payload,
+	.payloadlen = len,
+    };
+    b->trace(b->trace_ctx, &pkt);
+}
+
+static void
+broker_send(struct mqtt_broker *b, struct broker_client *c,
+	    int type, int flags, const void *body, size_t len)
+{
+    if (type != MQTT_PUBLISH)
+	trace(b, c, false, type, 0, false, NULL, NULL, 0);
+    send_packet(c->fd, type, flags, body, len);
+}
+
+static void
+broker_send_id(struct mqtt_broker *b, struct broker_client *c,
+	       int type, uint16_t id)
+{
+    uint8_t body[2] = { id >> 8, id & 0xff };
+    broker_send(b, c, type, type == MQTT_PUBREL ? 0x2 : 0, body, 2);
+}
+
+static void
+broker_deliver(struct mqtt_broker *b, struct broker_client *c,
+	       const char *topic, const void *payload, size_t len,
+	       int qos, bool retain)
+{
+    size_t   tlen = strlen(topic);
+    uint8_t *body = malloc(tlen + 4 + len);
+    if (body == NULL) return;
+
+    size_t n = put_string(body, topic, tlen);
+    if (qos > 0) {
+	if (++c->next_id == 0) c->next_id = 1;
+	body[n++] = c->next_id >> 8;
+	body[n++] = c->next_id & 0xff;
+    }
+    memcpy(body + n, payload, len);
+    n += len;
+
+    trace(b, c, false, MQTT_PUBLISH, qos, retain, topic, payload, len);
+    send_packet(c->fd, MQTT_PUBLISH, (qos << 1) | (retain ? 1 : 0), body, n);
+    free(body);
+}
+
+static void
+broker_route(struct mqtt_broker *b, const char *topic,
+	     const void *payload, size_t len, int qos, bool retain)
+{
+    atomic_fetch_add(&b->publishes, 1);
+
+    // Retained store: an empty payload deletes
+    if (retain) {
+	size_t i;
+	for (i = 0 ; i < b->retcount ; i++)
+	    if (strcmp(b->retained[i].topic, topic) == 0)
+		break;
+	if (i < b->retcount) {
+	    free(b->retained[i].topic);
+	    free(b->retained[i].payload);
+	    b->retained[i] = b->retained[--b->retcount];
+	}
+	if (len > 0) {
+	    struct retained *r = reallocarray(b->retained, b->retcount + 1,
+					      sizeof(*r));
+	    if (r != NULL) {
+		b->retained = r;
+		r[b->retcount].topic   = strdup(topic);
+		r[b->retcount].payload = malloc(len);
+		r[b->retcount].len     = len;
+		r[b->retcount].qos     = qos;
+		memcpy(r[b->retcount].payload, payload, len);
+		b->retcount++;
+	    }
+	}
+    }
+
+    // Live delivery (retain flag is cleared, as for any live message)
+    for (int i = 0 ; i < MAX_CLIENTS ; i++) {
+	struct broker_client *c = b->client[i];
+	if ((c == NULL) || !c->connected)
+	    continue;
+	int best = -1;
+	for (int s = 0 ; s < c->subcount ; s++)
+	    if (mqtt_topic_match(c->sub[s].filter, topic) &&
+		(c->sub[s].qos > best))
+		best = c->sub[s].qos;
+	if (best >= 0)
+	    broker_deliver(b, c, topic, payload, len,
+			   qos < best ? qos : best, false);
+    }
+}
+
+static void
+broker_drop_client(struct mqtt_broker *b, int slot)
+{
+    struct broker_client *c = b->client[slot];
+
+    // Last will, unless the client said goodbye
+    if (c->connected && !c->clean_exit && c->will.topic)
+	broker_route(b, c->will.topic, c->will.payload, c->will.len,
+		     c->will.qos, c->will.retain);
+
+    close(c->fd);
+    free(c->will.topic);
+    free(c->will.payload);
+    for (int s = 0 ; s < c->subcount ; s++)
+	free(c->sub[s].filter);
+    free(c->buf);
+    free(c);
+    b->client[slot] = NULL;
+    atomic_fetch_sub(&b->clients, 1);
+}
+
+static char *
+strndup_bytes(const uint8_t *data, uint16_t len)
+{
+    return strndup((const char *)data, len);
+}
+
+// Handle one complete packet. Returns -1 to drop the client.
+static int
+broker_handle(struct mqtt_broker *b, struct broker_client *c,
+	      int type, int flags, const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint16_t id;
+
+    if (!c->connected && (type != MQTT_CONNECT))
+	return -1;
+
+    switch (type) {
+    case MQTT_CONNECT: {
+	const uint8_t *name, *cid;
+	uint16_t       namelen, cidlen, keepalive;
+	if ((get_bytes(&p, end, &name, &namelen) < 0) || (end - p < 2))
+	    return -1;
+	uint8_t level  = *p++;
+	uint8_t cflags = *p++;
+	if ((get_u16(&p, end, &keepalive) < 0) ||
+	    (get_bytes(&p, end, &cid, &cidlen) < 0))
+	    return -1;
+	snprintf(c->id, sizeof(c->id), "%.*s", cidlen, (const char *)cid);
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+
+	if (cflags & 0x04) {                            // will
+	    const uint8_t *wt, *wp;
+	    uint16_t       wtlen, wplen;
+	    if ((get_bytes(&p, end, &wt, &wtlen) < 0) ||
+		(get_bytes(&p, end, &wp, &wplen) < 0))
+		return -1;
+	    c->will.topic   = strndup_bytes(wt, wtlen);
+	    c->will.payload = malloc(wplen ? wplen : 1);
+	    memcpy(c->will.payload, wp, wplen);
+	    c->will.len     = wplen;
+	    c->will.qos     = (cflags >> 3) & 0x3;
+	    c->will.retain  = cflags & 0x20;
+	}
+	// username / password are accepted and ignored
+
+	int code = atomic_load(&b->refuse);
+	if ((namelen != 4) || memcmp(name, "MQTT", 4) || (level != 4))
+	    code = 1;                           // unacceptable protocol
+	uint8_t ack[2] = { 0, code };
+	broker_send(b, c, MQTT_CONNACK, 0, ack, sizeof(ack));
+	if (code != 0)
+	    return -1;
+	c->connected = true;
+	return 0;
+    }
+
+    case MQTT_PUBLISH: {
+	int  qos    = (flags >> 1) & 0x3;
+	bool retain = flags & 0x1;
+	const uint8_t *t;
+	uint16_t       tlen;
+	if (get_bytes(&p, end, &t, &tlen) < 0)
+	    return -1;
+	id = 0;
+	if ((qos > 0) && (get_u16(&p, end, &id) < 0))
+	    return -1;
+	char *topic = strndup_bytes(t, tlen);
+	trace(b, c, true, type, qos, retain, topic, p, end - p);
+
+	// Injected trouble
+	uint32_t delay = atomic_load(&b->delay_us);
+	unsigned drop  = atomic_load(&b->drop_every);
+	b->incoming++;
+	if (drop && (b->incoming % drop == 0)) {
+	    free(topic);
+	    return 0;
+	}
+	if (delay)
+	    usleep(delay);
+
+	bool route = true;
+	if (qos == 1) {
+	    broker_send_id(b, c, MQTT_PUBACK, id);
+	} else if (qos == 2) {
+	    // Exactly once: a retransmission of a message still awaiting
+	    // its PUBREL is acknowledged again but not routed twice.
+	    for (int i = 0 ; i < c->qos2count ; i++)
+		if (c->qos2[i] == id)
+		    route = false;
+	    if (route && (c->qos2count < MAX_QOS2_INFLIGHT))
+		c->qos2[c->qos2count++] = id;
+	    broker_send_id(b, c, MQTT_PUBREC, id);
+	}
+	if (route)
+	    broker_route(b, topic, p, end - p, qos, retain);
+	free(topic);
+	return 0;
+    }
+
+    case MQTT_PUBREL:
+	if (get_u16(&p, end, &id) < 0) return -1;
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	for (int i = 0 ; i < c->qos2count ; i++)
+	    if (c->qos2[i] == id) {
+		c->qos2[i] = c->qos2[--c->qos2count];
+		break;
+	    }
+	broker_send_id(b, c, MQTT_PUBCOMP, id);
+	return 0;
+
+    case MQTT_PUBREC:
+	if (get_u16(&p, end, &id) < 0) return -1;
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	broker_send_id(b, c, MQTT_PUBREL, id);
+	return 0;
+
+    case MQTT_PUBACK:
+    case MQTT_PUBCOMP:
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	return 0;
+
+    case MQTT_SUBSCRIBE: {
+	if (get_u16(&p, end, &id) < 0) return -1;
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	uint8_t ack[2 + MAX_SUBSCRIPTIONS] = { id >> 8, id & 0xff };
+	size_t  n = 2;
+	char   *added[MAX_SUBSCRIPTIONS];
+	int     addedqos[MAX_SUBSCRIPTIONS];
+	int     addcount = 0;
+	while ((p < end) && (n < sizeof(ack))) {
+	    const uint8_t *f;
+	    uint16_t       flen;
+	    if ((get_bytes(&p, end, &f, &flen) < 0) || (p >= end))
+		return -1;
+	    int   qos    = *p++ & 0x3;
+	    char *filter = strndup_bytes(f, flen);
+
+	    // Replace an identical filter, else add
+	    int s;
+	    for (s = 0 ; s < c->subcount ; s++)
+		if (strcmp(c->sub[s].filter, filter) == 0)
+		    break;
+	    if (s < c->subcount) {
+		free(c->sub[s].filter);
+	    } else if (c->subcount < MAX_SUBSCRIPTIONS) {
+		c->subcount++;
+	    } else {
+		free(filter);
+		ack[n++] = 0x80;
+		continue;
+	    }
+	    c->sub[s].filter = filter;
+	    c->sub[s].qos    = qos;
+	    added[addcount]    = filter;
+	    addedqos[addcount] = qos;
+	    addcount++;
+	    ack[n++] = qos;
+	}
+	broker_send(b, c, MQTT_SUBACK, 0, ack, n);
+
+	// Retained messages matching the new filters
+	for (int a = 0 ; a < addcount ; a++)
+	    for (size_t r = 0 ; r < b->retcount ; r++)
+		if (mqtt_topic_match(added[a], b->retained[r].topic)) {
+		    int q = b->retained[r].qos;
+		    broker_deliver(b, c, b->retained[r].topic,
+				   b->retained[r].payload, b->retained[r].len,
+				   q < addedqos[a] ? q : addedqos[a], true);
+		}
+	return 0;
+    }
+
+    case MQTT_UNSUBSCRIBE:
+	if (get_u16(&p, end, &id) < 0) return -1;
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	while (p < end) {
+	    const uint8_t *f;
+	    uint16_t       flen;
+	    if (get_bytes(&p, end, &f, &flen) < 0)
+		return -1;
+	    for (int s = 0 ; s < c->subcount ; s++)
+		if ((strlen(c->sub[s].filter) == flen) &&
+		    (memcmp(c->sub[s].filter, f, flen) == 0)) {
+		    free(c->sub[s].filter);
+		    c->sub[s] = c->sub[--c->subcount];
+		    break;
+		}
+	}
+	broker_send_id(b, c, MQTT_UNSUBACK, id);
+	return 0;
+
+    case MQTT_PINGREQ:
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	broker_send(b, c, MQTT_PINGRESP, 0, NULL, 0);
+	return 0;
+
+    case MQTT_DISCONNECT:
+	trace(b, c, true, type, 0, false, NULL, NULL, 0);
+	c->clean_exit = true;
+	return -1;
+
+    default:
+	return -1;
+    }
+}
+
+// Read what is available and handle the complete packets.
+static int
+broker_read(struct mqtt_broker *b, struct broker_client *c)
+{
+    if (c->cap - c->len < 4096) {
+	uint8_t *buf = realloc(c->buf, c->cap + 8192);
+	if (buf == NULL) return -1;
+	c->buf  = buf;
+	c->cap += 8192;
+    }
+    ssize_t n = read(c->fd, c->buf + c->len, c->cap - c->len);
+    if (n <= 0)
+	return -1;
+    c->len += n;
+
+    for (;;) {
+	// Fixed header
+	size_t rlen = 0, mult = 1, hlen = 1;
+	for (;;) {
+	    if (hlen >= c->len) return 0;           // incomplete
+	    uint8_t byte = c->buf[hlen++];
+	    rlen += (byte & 0x7f) * mult;
+	    mult *= 128;
+	    if (!(byte & 0x80)) break;
+	    if (hlen > 4) return -1;
+	}
+	if (c->len < hlen + rlen) return 0;         // incomplete
+
+	int type  = c->buf[0] >> 4;
+	int flags = c->buf[0] & 0x0f;
+	if (broker_handle(b, c, type, flags, c->buf + hlen, rlen) < 0)
+	    return -1;
+
+	memmove(c->buf, c->buf + hlen + rlen, c->len - hlen - rlen);
+	c->len -= hlen + rlen;
+    }
+}
+
+static void *
+broker_task(void *parameters)
+{
+    struct mqtt_broker *b = parameters;
+
+    while (!atomic_load(&b->stop)) {
+	struct pollfd pfd[MAX_CLIENTS + 2];
+	int           slot[MAX_CLIENTS + 2];
+	int           n = 0;
+	pfd[n++] = (struct pollfd) { .fd = b->wake[0],  .events = POLLIN };
+	pfd[n++] = (struct pollfd) { .fd = b->lfd,      .events = POLLIN };
+	pfd[n++] = (struct pollfd) { .fd = b->lfd_unix, .events = POLLIN };
+	for (int i = 0 ; i < MAX_CLIENTS ; i++)
+	    if (b->client[i]) {
+		slot[n] = i;
+		pfd[n++] = (struct pollfd) { .fd     = b->client[i]->fd,
+					     .events = POLLIN };
+	    }
+
+	if (poll(pfd, n, -1) < 0) {
+	    if (errno == EINTR) continue;
+	    break;
+	}
+
+	// Control
+	if (pfd[0].revents & POLLIN) {
+	    char cmd;
+	    if (read(b->wake[0], &cmd, 1) == 1 && cmd == 'k') {
+		int count = 0;
+		for (int i = 0 ; i < MAX_CLIENTS ; i++)
+		    if (b->client[i]) {
+			broker_drop_client(b, i);
+			count++;
+		    }
+		atomic_store(&b->kick, count);
+	    }
+	    continue;                   // client slots may have changed
+	}
+
+	// New client (TCP or Unix domain socket)
+	for (int l = 1 ; l <= 2 ; l++) {
+	    if (!(pfd[l].revents & POLLIN))
+		continue;
+	    int fd = accept4(pfd[l].fd, NULL, NULL, SOCK_CLOEXEC);
+	    if (fd >= 0) {
+		int i;
+		for (i = 0 ; i < MAX_CLIENTS && b->client[i] ; i++)
+		    ;
+		struct broker_client *c = NULL;
+		if ((i == MAX_CLIENTS) ||
+		    ((c = calloc(1, sizeof(*c))) == NULL)) {
+		    close(fd);
+		} else {
+		    int one = 1;
+		    if (l == 1)
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+				   &one, sizeof(one));
+		    c->fd = fd;
+		    b->client[i] = c;
+		    atomic_fetch_add(&b->clients, 1);
+		}
+	    }
+	}
+
+	// Client traffic
+	for (int k = 3 ; k < n ; k++)
+	    if (pfd[k].revents & (POLLIN | POLLHUP | POLLERR))
+		if (b->client[slot[k]] &&
+		    (broker_read(b, b->client[slot[k]]) < 0))
+		    broker_drop_client(b, slot[k]);
+    }
+
+    return NULL;
+}
+
+
+struct mqtt_broker *
+mqtt_broker_start(uint16_t port)
+{
+    struct mqtt_broker *b = calloc(1, sizeof(*b));
+    if (b == NULL)
+	return NULL;
+
+    b->lfd_unix = -1;
+    b->lfd      = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (b->lfd < 0)
+	goto failed;
+    int one = 1;
+    setsockopt(b->lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in addr = {
+	.sin_family      = AF_INET,
+	.sin_port        = htons(port),
+	.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t alen = sizeof(addr);
+    if ((bind(b->lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+	(listen(b->lfd, 16) < 0) ||
+	(getsockname(b->lfd, (struct sockaddr *)&addr, &alen) < 0))
+	goto failed_socket;
+    b->port = ntohs(addr.sin_port);
+
+    if (pipe2(b->wake, O_CLOEXEC) < 0)
+	goto failed_socket;
+    if (pthread_create(&b->thread, NULL, broker_task, b) != 0)
+	goto failed_pipe;
+    return b;
+
+ failed_pipe:
+    close(b->wake[0]);
+    close(b->wake[1]);
+ failed_socket:
+    close(b->lfd);
+ failed:
+    free(b);
+    return NULL;
+}
+
+void
+mqtt_broker_stop(struct mqtt_broker *b)
+{
+    atomic_store(&b->stop, true);
+    if (write(b->wake[1], "s", 1) != 1) { /* poll wakes up anyway */ }
+    pthread_join(b->thread, NULL);
+
+    for (int i = 0 ; i < MAX_CLIENTS ; i++)
+	if (b->client[i]) {
+	    b->client[i]->clean_exit = true;    // no wills on shutdown
+	    broker_drop_client(b, i);
+	}
+    for (size_t r = 0 ; r < b->retcount ; r++) {
+	free(b->retained[r].topic);
+	free(b->retained[r].payload);
+    }
+    free(b->retained);
+    if (b->lfd_unix >= 0) {
+	close(b->lfd_unix);
+	unlink(b->unix_path);
+	free(b->unix_path);
+    }
+    close(b->lfd);
+    close(b->wake[0]);
+    close(b->wake[1]);
+    free(b);
+}
+
+uint16_t
+mqtt_broker_port(struct mqtt_broker *b)
+{
+    return b->port;
+}
+
+int
+mqtt_broker_listen_unix(struct mqtt_broker *b, const char *path)
+{
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    if ((b->lfd_unix >= 0) || (strlen(path) >= sizeof(sun.sun_path)))
+	return -1;
+    strcpy(sun.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+	return -1;
+    unlink(path);
+    if ((bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0) ||
+	(listen(fd, 16) < 0) ||
+	((b->unix_path = strdup(path)) == NULL)) {
+	close(fd);
+	return -1;
+    }
+
+    // Picked up by the broker thread on its next wake-up
+    b->lfd_unix = fd;
+    if (write(b->wake[1], "u", 1) != 1) { /* seen on the next packet */ }
+    return 0;
+}
+
+void
+mqtt_broker_set_trace(struct mqtt_broker *b,
+		      mqtt_broker_trace_cb cb, void *ctx)
+{
+    b->trace_ctx = ctx;
+    b->trace     = cb;
+}
+
+void
+mqtt_broker_set_delay(struct mqtt_broker *b, uint32_t delay_us)
+{
+    atomic_store(&b->delay_us, delay_us);
+}
+
+void
+mqtt_broker_set_drop(struct mqtt_broker *b, unsigned int drop_every)
+{
+    atomic_store(&b->drop_every, drop_every);
+}
+
+void
+mqtt_broker_set_refuse(struct mqtt_broker *b, int connack_code)
+{
+    atomic_store(&b->refuse, connack_code);
+}
+
+int
+mqtt_broker_kick(struct mqtt_broker *b)
+{
+    atomic_store(&b->kick, -1);
+    if (write(b->wake[1], "k", 1) != 1)
+	return -1;
+    while (atomic_load(&b->kick) < 0)
+	usleep(1000);
+    return atomic_load(&b->kick);
+}
+
+unsigned long
+mqtt_broker_publish_count(struct mqtt_broker *b)
+{
+    return atomic_load(&b->publishes);
+}
+
+int
+mqtt_broker_client_count(struct mqtt_broker *b)
+{
+    return atomic_load(&b->clients);
+}
+
+
+
+//== Test client =======================================================
+
+struct mqtt_client {
+    int       fd;
+    uint16_t  next_id;
+    struct mqtt_client_message queue[MAX_QUEUED];
+    unsigned  head, count;
+};
+
+// Read one packet, waiting up to timeout_ms (-1 = forever). The body is
+// returned in buf (at most cap bytes). 1 = packet, 0 = timeout, -1 = error.
+static int
+client_read(struct mqtt_client *c, int *type, int *flags,
+	    uint8_t *buf, size_t cap, size_t *len, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+    int rc = poll(&pfd, 1, timeout_ms);
+    if (rc <= 0)
+	return rc;
+
+    uint8_t byte;
+    if (read(c->fd, &byte, 1) != 1)
+	return -1;
+    *type  = byte >> 4;
+    *flags = byte & 0x0f;
+
+    size_t rlen = 0, mult = 1;
+    do {
+	if (read(c->fd, &byte, 1) != 1)
+	    return -1;
+	rlen += (byte & 0x7f) * mult;
+	mult *= 128;
+    } while (byte & 0x80);
+    if (rlen > cap)
+	return -1;
+
+    size_t got = 0;
+    while (got < rlen) {
+	ssize_t n = read(c->fd, buf + got, rlen - got);
+	if (n <= 0) return -1;
+	got += n;
+    }
+    *len = rlen;
+    return 1;
+}
+
+// Process an unsolicited packet: queue messages, complete QoS flows.
+static int
+client_handle(struct mqtt_client *c, int type, int flags,
+	      const uint8_t *p, size_t len)
+{
+    const uint8_t *end = p + len;
+    uint16_t id = 0;
+
+    switch (type) {
+    case MQTT_PUBLISH: {
+	struct mqtt_client_message msg = {
+	    .qos    = (flags >> 1) & 0x3,
+	    .retain = flags & 0x1,
+	    .ts_ns  = now_ns(),
+	};
+	const uint8_t *t;
+	uint16_t       tlen;
+	if (get_bytes(&p, end, &t, &tlen) < 0)
+	    return -1;
+	if ((msg.qos > 0) && (get_u16(&p, end, &id) < 0))
+	    return -1;
+	snprintf(msg.topic, sizeof(msg.topic), "%.*s", tlen, (const char *)t);
+	msg.payloadlen = end - p;
+	if (msg.payloadlen >= sizeof(msg.payload))
+	    msg.payloadlen = sizeof(msg.payload) - 1;
+	memcpy(msg.payload, p, msg.payloadlen);
+	msg.payload[msg.payloadlen] = '\0';
+
+	if (c->count < MAX_QUEUED) {
+	    c->queue[(c->head + c->count) % MAX_QUEUED] = msg;
+	    c->count++;
+	}
+
+	uint8_t body[2] = { id >> 8, id & 0xff };
+	if (msg.qos == 1) return send_packet(c->fd, MQTT_PUBACK, 0, body, 2);
+	if (msg.qos == 2) return send_packet(c->fd, MQTT_PUBREC, 0, body, 2);
+	return 0;
+    }
+    case MQTT_PUBREL: {
+	uint8_t body[2] = { p[0], p[1] };
+	return (len < 2) ? -1 : send_packet(c->fd, MQTT_PUBCOMP, 0, body, 2);
+    }
+    default:
+	return 0;
+    }
+}
+
+// Wait for a packet of the given type (and packet id, unless 0), handling
+// whatever else comes in meanwhile.
+static int
+client_wait(struct mqtt_client *c, int want, uint16_t id,
+	    uint8_t *buf, size_t cap, size_t *len)
+{
+    for (;;) {
+	int type, flags;
+	if (client_read(c, &type, &flags, buf, cap, len, 5000) <= 0)
+	    return -1;
+	if ((type == want) &&
+	    ((id == 0) || ((*len >= 2) && (((buf[0] << 8) | buf[1]) == id))))
+	    return 0;
+	if (client_handle(c, type, flags, buf, *len) < 0)
+	    return -1;
+    }
+}
+
+// CONNECT on an open socket, waiting for the CONNACK. Frees c on failure.
+static struct mqtt_client *
+client_handshake(struct mqtt_client *c, const char *id,
+		 const char *will_topic, const char *will_payload,
+		 int will_qos, bool will_retain)
+{
+    uint8_t body[1024];
+    size_t  n = put_string(body, "MQTT", 4);
+    uint8_t cflags = 0x02;                              // clean session
+    if (will_topic)
+	cflags |= 0x04 | (will_qos << 3) | (will_retain ? 0x20 : 0);
+    body[n++] = 4;                                      // 3.1.1
+    body[n++] = cflags;
+    body[n++] = 0;
+    body[n++] = 60;                                     // keep-alive
+    n += put_string(body + n, id, strlen(id));
+    if (will_topic) {
+	n += put_string(body + n, will_topic,   strlen(will_topic));
+	n += put_string(body + n, will_payload, strlen(will_payload));
+    }
+    if (send_packet(c->fd, MQTT_CONNECT, 0, body, n) < 0)
+	goto failed;
+
+    size_t len;
+    if ((client_wait(c, MQTT_CONNACK, 0, body, sizeof(body), &len) < 0) ||
+	(len != 2) || (body[1] != 0))
+	goto failed;
+    return c;
+
+ failed:
+    close(c->fd);
+    free(c);
+    return NULL;
+}
+
+struct mqtt_client *
+mqtt_client_connect(uint16_t port, const char *id,
+		    const char *will_topic, const char *will_payload,
+		    int will_qos, bool will_retain)
+{
+    struct mqtt_client *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+	return NULL;
+
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    struct sockaddr_in addr = {
+	.sin_family      = AF_INET,
+	.sin_port        = htons(port),
+	.sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    if ((c->fd < 0) ||
+	(connect(c->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)) {
+	if (c->fd >= 0) close(c->fd);
+	free(c);
+	return NULL;
+    }
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return client_handshake(c, id, will_topic, will_payload,
+			    will_qos, will_retain);
+}
+
+struct mqtt_client *
+mqtt_client_connect_unix(const char *path, const char *id,
+			 const char *will_topic, const char *will_payload,
+			 int will_qos, bool will_retain)
+{
+    struct sockaddr_un sun = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(sun.sun_path))
+	return NULL;
+    strcpy(sun.sun_path, path);
+
+    struct mqtt_client *c = calloc(1, sizeof(*c));
+    if (c == NULL)
+	return NULL;
+
+    c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if ((c->fd < 0) ||
+	(connect(c->fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)) {
+	if (c->fd >= 0) close(c->fd);
+	free(c);
+	return NULL;
+    }
+
+    return client_handshake(c, id, will_topic, will_payload,
+			    will_qos, will_retain);
+}
+
+void
+mqtt_client_close(struct mqtt_client *c, bool abrupt)
+{
+    if (!abrupt)
+	send_packet(c->fd, MQTT_DISCONNECT, 0, NULL, 0);
+    close(c->fd);
+    free(c);
+}
+
+int
+mqtt_client_subscribe(struct mqtt_client *c, const char *filter, int qos)
+{
+    uint8_t body[512];
+    if (++c->next_id == 0) c->next_id = 1;
+    uint16_t id = c->next_id;
+    size_t   n  = 0;
+    body[n++] = id >> 8;
+    body[n++] = id & 0xff;
+    n += put_string(body + n, filter, strlen(filter));
+    body[n++] = qos;
+    if (send_packet(c->fd, MQTT_SUBSCRIBE, 0x2, body, n) < 0)
+	return -1;
+
+    size_t len;
+    if ((client_wait(c, MQTT_SUBACK, id, body, sizeof(body), &len) < 0) ||
+	(len < 3) || (body[2] & 0x80))
+	return -1;
+    return 0;
+}
+
+int
+mqtt_client_publish(struct mqtt_client *c, const char *topic,
+		    const void *payload, size_t len, int qos, bool retain)
+{
+    size_t   tlen = strlen(topic);
+    uint8_t *body = malloc(tlen + 4 + len);
+    if (body == NULL)
+	return -1;
+
+    uint16_t id = 0;
+    size_t   n  = put_string(body, topic, tlen);
+    if (qos > 0) {
+	if (++c->next_id == 0) c->next_id = 1;
+	id = c->next_id;
+	body[n++] = id >> 8;
+	body[n++] = id & 0xff;
+    }
+    memcpy(body + n, payload, len);
+    n += len;
+    int rc = send_packet(c->fd, MQTT_PUBLISH, (qos << 1) | (retain ? 1 : 0),
+			 body, n);
+    free(body);
+    if ((rc < 0) || (qos == 0))
+	return rc;
+
+    uint8_t ack[64];
+    size_t  alen;
+    if (qos == 1)
+	return client_wait(c, MQTT_PUBACK, id, ack, sizeof(ack), &alen);
+
+    if (client_wait(c, MQTT_PUBREC, id, ack, sizeof(ack), &alen) < 0)
+	return -1;
+    uint8_t rel[2] = { id >> 8, id & 0xff };
+    if (send_packet(c->fd, MQTT_PUBREL, 0x2, rel, 2) < 0)
+	return -1;
+    return client_wait(c, MQTT_PUBCOMP, id, ack, sizeof(ack), &alen);
+}
+
+int
+mqtt_client_receive(struct mqtt_client *c,
+		    struct mqtt_client_message *msg, int timeout_ms)
+{
+    uint64_t deadline = now_ns() + (uint64_t)timeout_ms * 1000000ull;
+
+    while (c->count == 0) {
+	uint64_t now = now_ns();
+	if (now >= deadline)
+	    return 0;
+
+	uint8_t buf[2048];
+	size_t  len;
+	int     type, flags;
+	int rc = client_read(c, &type, &flags, buf, sizeof(buf), &len,
+			     (int)((deadline - now + 999999) / 1000000));
+	if (rc <= 0)
+	    return rc;
+	if (client_handle(c, type, flags, buf, len) < 0)
+	    return -1;
+    }
+
+    *msg = c->queue[c->head];
+    c->head = (c->head + 1) % MAX_QUEUED;
+    c->count--;
+    return 1;
+}
@@ -0,0 +1,130 @@
+#ifndef __MQTT_BROKER_H
+#define __MQTT_BROKER_H
+
+/*
+ * Minimal MQTT 3.1.1 broker stand-in, for the integration tests and
+ * benchmarks. It runs in its own thread on 127.0.0.1 (and optionally on a
+ * Unix domain socket) and supports CONNECT,
+ * SUBSCRIBE/UNSUBSCRIBE, PUBLISH at QoS 0/1/2, retained messages, last
+ * wills and PINGREQ -- enough for libmosquitto clients such as the moses
+ * daemons. There are no persistent sessions, and keep-alive is not
+ * enforced.
+ *
+ * Hooks let a test inject broker-side trouble (delay, drop, refuse,
+ * disconnect), and every packet is timestamped (CLOCK_MONOTONIC) and
+ * reported to an optional trace callback.
+ *
+ * A small synchronous client (mqtt_client_*) is provided too, so tests can
+ * drive the daemons without depending on a client library.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum mqtt_packet_type {
+    MQTT_CONNECT     =  1, MQTT_CONNACK     =  2,
+    MQTT_PUBLISH     =  3, MQTT_PUBACK      =  4,
+    MQTT_PUBREC      =  5, MQTT_PUBREL      =  6,
+    MQTT_PUBCOMP     =  7, MQTT_SUBSCRIBE   =  8,
+    MQTT_SUBACK      =  9, MQTT_UNSUBSCRIBE = 10,
+    MQTT_UNSUBACK    = 11, MQTT_PINGREQ     = 12,
+    MQTT_PINGRESP    = 13, MQTT_DISCONNECT  = 14,
+};
+
+struct mqtt_broker_packet {
+    uint64_t     ts_ns;                 // CLOCK_MONOTONIC
+    bool         inbound;               // client -> broker
+    const char  *client_id;
+    int          type;                  // enum mqtt_packet_type
+    int          qos;                   // PUBLISH only
+    bool         retain;                // PUBLISH only
+    const char  *topic;                 // PUBLISH only (else NULL)
+    const void  *payload;               // PUBLISH only
+    size_t       payloadlen;
+};
+
+typedef void (*mqtt_broker_trace_cb)(void *ctx,
+				     const struct mqtt_broker_packet *pkt);
+
+struct mqtt_broker;
+
+// Start listening on 127.0.0.1:port (0 = any free port). NULL on failure.
+struct mqtt_broker *mqtt_broker_start(uint16_t port);
+void     mqtt_broker_stop(struct mqtt_broker *b);
+uint16_t mqtt_broker_port(struct mqtt_broker *b);
+
+// Also accept clients on a Unix domain socket (created, and removed on
+// stop). Call before any client connects. 0 on success, -1 on failure.
+int mqtt_broker_listen_unix(struct mqtt_broker *b, const char *path);
+
+// Called from the broker thread for every packet received or sent.
+void mqtt_broker_set_trace(struct mqtt_broker *b,
+			   mqtt_broker_trace_cb cb, void *ctx);
+
+// Hooks (take effect on the next packet):
+//  - delay:      hold every incoming PUBLISH this long before acking and
+//                routing it (a slow or loaded broker)
+//  - drop_every: silently lose every Nth incoming PUBLISH (0 = never);
+//                it is neither acknowledged nor routed
+//  - refuse:     CONNACK return code for new connections (0 = accept,
+//                3 = server unavailable, ...)
+void mqtt_broker_set_delay(struct mqtt_broker *b, uint32_t delay_us);
+void mqtt_broker_set_drop(struct mqtt_broker *b, unsigned int drop_every);
+void mqtt_broker_set_refuse(struct mqtt_broker *b, int connack_code);
+
+// Drop every client connection without a DISCONNECT, as a broker crash
+// would (their last wills are published). Returns the number of clients.
+int mqtt_broker_kick(struct mqtt_broker *b);
+
+// Counters
+unsigned long mqtt_broker_publish_count(struct mqtt_broker *b);
+int           mqtt_broker_client_count(struct mqtt_broker *b);
+
+
+
+/*
+ * Synchronous test client.
+ */
+
+struct mqtt_client;
+
+struct mqtt_client_message {
+    char    topic[256];
+    char    payload[1024];              // NUL terminated
+    size_t  payloadlen;
+    int     qos;
+    bool    retain;
+    uint64_t ts_ns;                     // reception (CLOCK_MONOTONIC)
+};
+
+// Connect (clean session) over TCP or to a Unix domain socket;
+// will_topic may be NULL. NULL on failure.
+struct mqtt_client *mqtt_client_connect(uint16_t port, const char *id,
+					const char *will_topic,
+					const char *will_payload,
+					int will_qos, bool will_retain);
+struct mqtt_client *mqtt_client_connect_unix(const char *path, const char *id,
+					     const char *will_topic,
+					     const char *will_payload,
+					     int will_qos, bool will_retain);
+// Send DISCONNECT (unless `abrupt`) and close.
+void mqtt_client_close(struct mqtt_client *c, bool abrupt);
+
+// Both wait for the broker acknowledgement. 0 on success, -1 on failure.
+int mqtt_client_subscribe(struct mqtt_client *c, const char *filter, int qos);
+int mqtt_client_publish(struct mqtt_client *c, const char *topic,
+			const void *payload, size_t len, int qos, bool retain);
+
+// Next message received on a subscription, waiting up to timeout_ms.
+// 1 when a message is returned, 0 on timeout, -1 on error.
+int mqtt_client_receive(struct mqtt_client *c,
+			struct mqtt_client_message *msg, int timeout_ms);
+
+// MQTT topic filter matching ('+' and '#' wildcards).
+bool mqtt_topic_match(const char *filter, const char *topic);
+
+// CLOCK_MONOTONIC (ns), the clock of the ts_ns reception stamps.
+uint64_t now_ns(void);
+
+#endif
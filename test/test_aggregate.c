@@ -0,0 +1,186 @@
+/*
+ * Unit tests for the consumption aggregates (hour/day/month totals, peak
+ * flow, rolling 24 hours, persistence).
+ *
+ * They run in fixed time zones (POSIX TZ strings, no tzdata needed), one of
+ * them with daylight saving time so 23 and 25 hour days are covered.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+
+#include "aggregate.h"
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+#define NEAR(a, b) (fabs((a) - (b)) < 1e-9)
+
+#define HOUR  (3600)
+#define DAY   (24 * HOUR)
+
+// 2025-01-15 00:00:00 UTC
+#define T0    ((time_t)1736899200)
+
+static void
+set_tz(const char *tz)
+{
+    setenv("TZ", tz, 1);
+    tzset();
+}
+
+static void
+test_period_start(void)
+{
+    set_tz("UTC0");
+    time_t t = T0 + 10 * HOUR + 25 * 60 + 7;
+    CHECK(aggregate_period_start(AGGREGATE_HOUR,  t) == T0 + 10 * HOUR);
+    CHECK(aggregate_period_start(AGGREGATE_DAY,   t) == T0);
+    CHECK(aggregate_period_start(AGGREGATE_MONTH, t) == T0 - 14 * DAY);
+
+    // Local time: days start at local midnight
+    set_tz("CET-1");
+    CHECK(aggregate_period_start(AGGREGATE_DAY, T0 + HOUR) == T0 - HOUR);
+
+    // Daylight saving time: 2025-03-30 is 23 hours long, 2025-10-26 25
+    set_tz("CET-1CEST,M3.5.0,M10.5.0/3");
+    time_t mar30 = 1743289200;          // 2025-03-30 00:00 CET
+    time_t oct26 = 1761429600;          // 2025-10-26 00:00 CEST
+    CHECK(aggregate_period_start(AGGREGATE_DAY, mar30 + 12 * HOUR) == mar30);
+    CHECK(aggregate_period_start(AGGREGATE_DAY, mar30 + 23 * HOUR) ==
+	  mar30 + 23 * HOUR);
+    CHECK(aggregate_period_start(AGGREGATE_DAY, oct26 + 24 * HOUR) == oct26);
+    CHECK(aggregate_period_start(AGGREGATE_DAY, oct26 + 25 * HOUR) ==
+	  oct26 + 25 * HOUR);
+}
+
+static void
+test_totals(void)
+{
+    set_tz("UTC0");
+    struct aggregate a;
+    aggregate_init(&a, T0 + 10 * HOUR);
+
+    // Within the hour: nothing closes
+    CHECK(aggregate_add(&a, T0 + 10 * HOUR +  30, 2.0) == 0);
+    CHECK(aggregate_add(&a, T0 + 10 * HOUR +  50, 3.0) == 0);
+    CHECK(aggregate_add(&a, T0 + 10 * HOUR + 150, 1.0) == 0);
+    CHECK(NEAR(a.current[AGGREGATE_HOUR ].volume, 6.0));
+    CHECK(NEAR(a.current[AGGREGATE_DAY  ].volume, 6.0));
+    CHECK(NEAR(a.current[AGGREGATE_MONTH].volume, 6.0));
+
+    // Peak flow: the busiest minute (5 L in the first one)
+    CHECK(NEAR(a.current[AGGREGATE_HOUR].peak_flow, 5.0));
+
+    // Next hour: the hour closes, the day goes on
+    unsigned int closed = aggregate_add(&a, T0 + 11 * HOUR + 10, 4.0);
+    CHECK(closed == (1u << AGGREGATE_HOUR));
+    CHECK(a.previous[AGGREGATE_HOUR].start == T0 + 10 * HOUR);
+    CHECK(NEAR(a.previous[AGGREGATE_HOUR].volume,    6.0));
+    CHECK(NEAR(a.previous[AGGREGATE_HOUR].peak_flow, 5.0));
+    CHECK(a.current[AGGREGATE_HOUR].start == T0 + 11 * HOUR);
+    CHECK(NEAR(a.current[AGGREGATE_HOUR].volume, 4.0));
+    CHECK(NEAR(a.current[AGGREGATE_DAY ].volume, 10.0));
+    CHECK(NEAR(aggregate_last24h(&a), 10.0));
+
+    // Ticking alone closes the pending minute...
+    CHECK(aggregate_tick(&a, T0 + 11 * HOUR + 70) == 0);
+    CHECK(NEAR(a.current[AGGREGATE_HOUR].peak_flow, 4.0));
+    CHECK(NEAR(a.current[AGGREGATE_DAY ].peak_flow, 5.0));
+
+    // ... and the day at midnight
+    closed = aggregate_tick(&a, T0 + DAY);
+    CHECK(closed == ((1u << AGGREGATE_HOUR) | (1u << AGGREGATE_DAY)));
+    CHECK(a.previous[AGGREGATE_DAY].start == T0);
+    CHECK(NEAR(a.previous[AGGREGATE_DAY].volume, 10.0));
+    // The hour just before midnight was empty (gap)
+    CHECK(a.previous[AGGREGATE_HOUR].start == T0 + 23 * HOUR);
+    CHECK(NEAR(a.previous[AGGREGATE_HOUR].volume, 0.0));
+    CHECK(NEAR(a.current[AGGREGATE_DAY].volume, 0.0));
+    CHECK(NEAR(a.current[AGGREGATE_MONTH].volume, 10.0));
+
+    // Rolling 24h still has yesterday's hours, until they get too old
+    CHECK(NEAR(aggregate_last24h(&a), 10.0));
+    aggregate_tick(&a, T0 + DAY + 10 * HOUR + 1);
+    CHECK(NEAR(aggregate_last24h(&a), 4.0));
+    aggregate_tick(&a, T0 + DAY + 11 * HOUR + 1);
+    CHECK(NEAR(aggregate_last24h(&a), 0.0));
+
+    // Month: 2025-02-01
+    closed = aggregate_tick(&a, T0 + 17 * DAY);
+    CHECK(closed & (1u << AGGREGATE_MONTH));
+    CHECK(a.previous[AGGREGATE_MONTH].start == T0 - 14 * DAY);
+    CHECK(NEAR(a.previous[AGGREGATE_MONTH].volume, 10.0));
+
+    // A clock going backwards closes nothing
+    CHECK(aggregate_tick(&a, T0) == 0);
+    CHECK(a.current[AGGREGATE_MONTH].start == T0 + 17 * DAY);
+}
+
+static void
+test_persistence(void)
+{
+    set_tz("UTC0");
+    char path[] = "/tmp/test_aggregate.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    struct aggregate a, b;
+    aggregate_init(&a, T0);
+    aggregate_add(&a, T0 + 10, 1.25);
+    aggregate_add(&a, T0 + HOUR + 10, 0.1);
+
+    // Nothing saved yet
+    CHECK(aggregate_load(&b, path) < 0);
+    CHECK(errno == ENOENT);
+
+    // Round trip, exact
+    CHECK(aggregate_save(&a, path) == 0);
+    CHECK(aggregate_load(&b, path) == 0);
+    CHECK(memcmp(&a, &b, sizeof(a)) == 0);
+
+    // Restarted later: the periods close as time moves on
+    CHECK(aggregate_tick(&b, T0 + DAY) & (1u << AGGREGATE_DAY));
+    CHECK(NEAR(b.previous[AGGREGATE_DAY].volume, 1.35));
+
+    // Garbage is rejected, leaving the state untouched
+    FILE *f = fopen(path, "w");
+    fprintf(f, "not an aggregate\n");
+    fclose(f);
+    CHECK(aggregate_load(&b, path) < 0);
+    CHECK(errno == EINVAL);
+    CHECK(NEAR(b.previous[AGGREGATE_DAY].volume, 1.35));
+
+    unlink(path);
+}
+
+int
+main(void)
+{
+    test_period_start();
+    test_totals();
+    test_persistence();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,223 @@
+/*
+ * Integration test: hot restart of moses_breaker (--handover).
+ *
+ * A first instance closes the (simulated) valve, then a second one is
+ * started with the same options: it must take the line over, the first one
+ * must exit cleanly, and the line must stay driven all along -- it is
+ * sampled continuously during the handover. The second instance must then
+ * be in control, with the availability left online (no last will). The
+ * time from the start of the second instance to the exit of the first is
+ * reported. Finally the second one is killed, as in a crash: the line must
+ * then be released (the valve fails open).
+ *
+ * Usage: test_breaker_handover /path/to/moses_breaker
+ *
+ * Exits with 77 (skipped) when gpio-sim is not available (not root, no
+ * configfs, module not loaded).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include <sys/wait.h>
+
+#include "mqtt_broker.h"
+#include "gpio_sim.h"
+#include "daemon.h"
+
+
+static pid_t
+spawn_breaker(const char *path, uint16_t port, const char *chip,
+	      const char *sock)
+{
+    char s_pin[64];
+    snprintf(s_pin, sizeof(s_pin), "%s:0", chip);
+
+    const char *args[] = { "-P", s_pin, "-H", sock, NULL };
+    return daemon_spawn(path, "breaker", "127.0.0.1", port, args);
+}
+
+// Availability of the breaker, as last seen on the way
+static char avail[16] = "";
+
+static void
+track_avail(const struct mqtt_client_message *msg, void *ctx)
+{
+    (void)ctx;
+    if (!strcmp(msg->topic, PREFIX "/availability/breaker"))
+	snprintf(avail, sizeof(avail), "%.*s", (int)sizeof(avail) - 1,
+		 msg->payload);
+}
+
+// Wait for an instance to be connected, keeping track of the availability
+static int
+wait_connected(struct mqtt_client *c)
+{
+    struct mqtt_client_message msg;
+    return daemon_wait_for_cb(c, PREFIX "/stats/breaker", &msg,
+			      track_avail, NULL);
+}
+
+// Set the valve and check the line follows
+static int
+set_state(struct mqtt_client *c, struct gpio_sim *sim, const char *want)
+{
+    if (daemon_set_state(c, want) < 0)
+	return -1;
+    if (gpio_sim_get(sim, 0) != want[0] - '0') {
+	fprintf(stderr, "line not driven to %s\n", want);
+	return -1;
+    }
+    return 0;
+}
+
+
+// Line sampler, during the handover
+static struct {
+    int                  fd;
+    atomic_bool          stop;
+    _Atomic unsigned long samples;
+    _Atomic unsigned long glitches;     // not driven to 1
+} sampler;
+
+static void *
+sample(void *arg)
+{
+    (void)arg;
+    while (!atomic_load(&sampler.stop)) {
+	char value;
+	if (pread(sampler.fd, &value, 1, 0) != 1)
+	    continue;
+	atomic_fetch_add(&sampler.samples, 1);
+	if (value != '1')
+	    atomic_fetch_add(&sampler.glitches, 1);
+    }
+    return NULL;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s moses_breaker\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    struct gpio_sim sim;
+    if (gpio_sim_create(&sim, "moses-handover", 1) < 0) {
+	printf("SKIP: gpio-sim not available\n");
+	return EXIT_SKIP;
+    }
+
+    int   rc = EXIT_FAILURE;
+    pid_t first = -1, second = -1;
+    char  sock[64];
+    snprintf(sock, sizeof(sock), "/tmp/moses-handover-%d.sock", (int)getpid());
+
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    struct mqtt_client *c = b ? mqtt_client_connect(mqtt_broker_port(b),
+						    "tester", NULL, NULL, 0,
+						    false) : NULL;
+    if ((c == NULL) ||
+	(mqtt_client_subscribe(c, PREFIX "/state",                1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/availability/breaker", 1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/stats/breaker",        0) < 0)) {
+	fprintf(stderr, "failed to set up the broker\n");
+	goto done;
+    }
+
+    // First instance, closing the valve
+    first = spawn_breaker(argv[1], mqtt_broker_port(b), sim.chip, sock);
+    if ((first < 0) || !wait_connected(c)) {
+	fprintf(stderr, "first instance did not connect\n");
+	goto done;
+    }
+    if (set_state(c, &sim, "1") < 0)
+	goto done;
+
+    // Second instance, with the line sampled all along
+    pthread_t thr;
+    sampler.fd = gpio_sim_value_fd(&sim, 0);
+    if ((sampler.fd < 0) || pthread_create(&thr, NULL, sample, NULL)) {
+	fprintf(stderr, "failed to sample the line\n");
+	goto done;
+    }
+    uint64_t t0 = now_ns();
+    second = spawn_breaker(argv[1], mqtt_broker_port(b), sim.chip, sock);
+
+    int      status = -1;
+    uint64_t t1     = 0;
+    while ((now_ns() - t0) < TIMEOUT_MS * 1000000ull) {
+	if (waitpid(first, &status, WNOHANG) == first) {
+	    t1    = now_ns();
+	    first = -1;
+	    break;
+	}
+	usleep(100);
+    }
+    int connected = wait_connected(c);
+    atomic_store(&sampler.stop, true);
+    pthread_join(thr, NULL);
+    close(sampler.fd);
+
+    int errors = 0;
+    if (t1 == 0) {
+	fprintf(stderr, "first instance still running\n");
+	errors++;
+    } else if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0)) {
+	fprintf(stderr, "first instance did not exit cleanly (%#x)\n", status);
+	errors++;
+    }
+    if (!connected) {
+	fprintf(stderr, "second instance did not connect\n");
+	errors++;
+    }
+    if (strcmp(avail, "online") != 0) {
+	fprintf(stderr, "availability left %s\n", avail[0] ? avail : "unset");
+	errors++;
+    }
+    if (atomic_load(&sampler.glitches)) {
+	fprintf(stderr, "line released %lu times out of %lu samples\n",
+		atomic_load(&sampler.glitches), atomic_load(&sampler.samples));
+	errors++;
+    }
+    if (t1)
+	printf("handover: first instance gone %.3f ms after the start of the"
+	       " second, line held (%lu samples)\n",
+	       (t1 - t0) / 1e6, atomic_load(&sampler.samples));
+
+    // Second instance in control, and failing open on a crash
+    if (connected) {
+	if ((set_state(c, &sim, "0") < 0) || (set_state(c, &sim, "1") < 0))
+	    errors++;
+	kill(second, SIGKILL);
+	waitpid(second, NULL, 0);
+	second = -1;
+	usleep(100000);
+	if (gpio_sim_get(&sim, 0) != 0) {
+	    fprintf(stderr, "line not released on a crash\n");
+	    errors++;
+	}
+    }
+    rc = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+    daemon_stop(first);
+    daemon_stop(second);
+    if (c) mqtt_client_close(c, false);
+    if (b) mqtt_broker_stop(b);
+    unlink(sock);
+    gpio_sim_destroy(&sim);
+    return rc;
+}
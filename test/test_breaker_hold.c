@@ -0,0 +1,209 @@
+/*
+ * Integration test: hit-and-hold drive of moses_breaker (--hold-duty).
+ *
+ * The (simulated) valve is closed with a 100ms pull-in, then a 25% hold at
+ * 50 Hz, and the line is sampled for a while: it must be fully driven for
+ * the pull-in time, then switched with the hold duty cycle and frequency,
+ * while `state` stays 1. Once opened, the line must stay low. The coil
+ * usage on `stats/breaker/coil` must account one closure, driven for less
+ * than it was energised. The measured pull-in, duty cycle and frequency
+ * are reported.
+ *
+ * Usage: test_breaker_hold /path/to/moses_breaker
+ *
+ * Exits with 77 (skipped) when gpio-sim is not available (not root, no
+ * configfs, module not loaded).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mqtt_broker.h"
+#include "gpio_sim.h"
+#include "daemon.h"
+
+#define PULL_IN_MS 100
+#define DUTY       25                   // percent
+#define FREQUENCY  50                   // Hz
+#define SAMPLE_MS  1500                 // sampling, pull-in included
+
+
+static pid_t
+spawn_breaker(const char *path, uint16_t port, const char *chip)
+{
+    char s_pin[64], s_duty[8], s_freq[8];
+    snprintf(s_pin,  sizeof(s_pin),  "%s:0", chip);
+    snprintf(s_duty, sizeof(s_duty), "%d%%", DUTY);
+    snprintf(s_freq, sizeof(s_freq), "%d",   FREQUENCY);
+
+    const char *args[] = { "-P", s_pin, "-U", "100ms", "-C", s_duty,
+			   "-F", s_freq, "-W", "8", NULL };
+    return daemon_spawn(path, "breaker", "127.0.0.1", port, args);
+}
+
+// Line sampling: time high, and number of rising edges, after the
+// pull-in (the end of the first high stretch).
+struct sampling {
+    uint64_t first_ns;                  // first high sample
+    uint64_t pull_in_ns;                // first high stretch
+    uint64_t high_ns;                   // then high, in total
+    uint64_t span_ns;                   // then sampled
+    unsigned long edges;                // then rising edges
+    unsigned long samples;
+};
+
+static int
+sample(int fd, uint64_t duration_ns, struct sampling *s)
+{
+    memset(s, 0, sizeof(*s));
+    uint64_t start = now_ns(), last = 0, released = 0;
+    int      level = -1;
+    while (1) {
+	char     value;
+	uint64_t t = now_ns();
+	if (t - start > duration_ns)
+	    break;
+	if (pread(fd, &value, 1, 0) != 1)
+	    return -1;
+	s->samples++;
+	int v = (value == '1');
+	if (s->first_ns == 0) {
+	    if (v) s->first_ns = t;
+	} else if (released == 0) {
+	    if (!v) {
+		s->pull_in_ns = t - s->first_ns;
+		released      = t;
+	    }
+	} else {
+	    if (level == 1)
+		s->high_ns += t - last;
+	    if (v && (level == 0))
+		s->edges++;
+	}
+	level = v;
+	last  = t;
+    }
+    if (released)
+	s->span_ns = last - released;
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s moses_breaker\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    struct gpio_sim sim;
+    if (gpio_sim_create(&sim, "moses-hold", 1) < 0) {
+	printf("SKIP: gpio-sim not available\n");
+	return EXIT_SKIP;
+    }
+
+    int   rc  = EXIT_FAILURE;
+    int   fd  = -1;
+    pid_t pid = -1;
+    struct mqtt_client_message msg;
+
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    struct mqtt_client *c = b ? mqtt_client_connect(mqtt_broker_port(b),
+						    "tester", NULL, NULL, 0,
+						    false) : NULL;
+    if ((c == NULL) ||
+	(mqtt_client_subscribe(c, PREFIX "/state",             1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/stats/breaker",     0) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/stats/breaker/coil", 0) < 0)) {
+	fprintf(stderr, "failed to set up the broker\n");
+	goto done;
+    }
+
+    pid = spawn_breaker(argv[1], mqtt_broker_port(b), sim.chip);
+    if ((pid < 0) || !daemon_wait_connected(c, "breaker")) {
+	fprintf(stderr, "breaker did not connect\n");
+	goto done;
+    }
+    if ((fd = gpio_sim_value_fd(&sim, 0)) < 0) {
+	fprintf(stderr, "failed to sample the line\n");
+	goto done;
+    }
+
+    // Closing: pull-in, then hold
+    struct sampling s;
+    if ((mqtt_client_publish(c, PREFIX "/state/set", "1", 1, 1, false) < 0) ||
+	(sample(fd, SAMPLE_MS * 1000000ull, &s) < 0)) {
+	fprintf(stderr, "failed to close the valve\n");
+	goto done;
+    }
+
+    int errors = 0;
+    if (!daemon_wait_for(c, PREFIX "/state", &msg) ||
+	strcmp(msg.payload, "1")) {
+	fprintf(stderr, "state not published as closed\n");
+	errors++;
+    }
+    double pull_in = s.pull_in_ns / 1e6;
+    double duty    = s.span_ns ? 100.0 * s.high_ns / s.span_ns : 0;
+    double freq    = s.span_ns ? s.edges * 1e9 / s.span_ns     : 0;
+    printf("hit-and-hold: pull-in %.1f ms (%d), duty %.1f%% (%d%%), "
+	   "%.1f Hz (%d), %lu samples\n",
+	   pull_in, PULL_IN_MS, duty, DUTY, freq, FREQUENCY, s.samples);
+    if ((s.first_ns == 0) || (pull_in < PULL_IN_MS - 5) ||
+	(pull_in > PULL_IN_MS + 20)) {
+	fprintf(stderr, "pull-in off\n");
+	errors++;
+    }
+    if ((duty < DUTY - 5) || (duty > DUTY + 5)) {
+	fprintf(stderr, "hold duty cycle off\n");
+	errors++;
+    }
+    if ((freq < FREQUENCY * 0.9) || (freq > FREQUENCY * 1.1)) {
+	fprintf(stderr, "hold frequency off\n");
+	errors++;
+    }
+
+    // Opening: low for good, and the coil accounted
+    if (daemon_set_state(c, "0") < 0) {
+	errors++;
+    } else {
+	usleep(100000);
+	for (int i = 0 ; i < 100 ; i++, usleep(1000))
+	    if (gpio_sim_get(&sim, 0) != 0) {
+		fprintf(stderr, "line driven after opening\n");
+		errors++;
+		break;
+	    }
+    }
+    double energised = 0, driven = 0;
+    const char *p;
+    while (daemon_wait_for(c, PREFIX "/stats/breaker/coil", &msg))
+	if (strstr(msg.payload, "\"energised\": false, \"closures\": 1") &&
+	    (p = strstr(msg.payload, "\"energised_s\": ")) &&
+	    (sscanf(p, "\"energised_s\": %lf, \"driven_s\": %lf",
+		    &energised, &driven) == 2))
+	    break;
+    printf("coil: energised %.3f s, driven %.3f s\n", energised, driven);
+    if ((energised <= 0) ||
+	(driven >= energised) || !strstr(msg.payload, "\"saved_wh\"")) {
+	fprintf(stderr, "coil usage not accounted: %s\n", msg.payload);
+	errors++;
+    }
+    rc = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+    if (fd  >= 0) close(fd);
+    daemon_stop(pid);
+    if (c) mqtt_client_close(c, false);
+    if (b) mqtt_broker_stop(b);
+    gpio_sim_destroy(&sim);
+    return rc;
+}
@@ -0,0 +1,89 @@
+/*
+ * Benchmark: parse throughput of breaker_parse_command, for each payload
+ * form accepted on `state/set`.
+ *
+ * The parser runs on the MQTT network thread, ahead of the hand-over to
+ * the actuator, so it is on the command latency path. The payloads are
+ * parsed from buffers of their exact size, as received, and each parse
+ * must succeed. The rate (parses per second) is reported.
+ *
+ * Usage: test_breaker_parse_throughput [count]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "common.h"
+#include "breaker_state.h"
+
+struct scenario {
+    const char *name;
+    const char *payload;
+    int         state;                  // expected result
+};
+
+static const struct scenario scenarios[] = {
+    { "legacy",  "on",                                                  1 },
+    { "tokens",  "off id=cmd-42 ts=1767225600.125",                     0 },
+    { "json",    "{\"state\":\"on\",\"id\":\"cmd-42\"}",                1 },
+    { "json all",
+      "{ \"state\": \"on\", \"id\": \"cmd-42\", \"ts\": 1767225600.125, "
+      "\"for\": 1800, \"reason\": \"pressure test\", \"source\": \"ha\" }", 1 },
+};
+
+
+// Parse the payload `count` times. Parses per second, or a negative value
+// if one of them did not give the expected state.
+static double
+run(const struct scenario *s, int count)
+{
+    size_t len  = strlen(s->payload);
+    char  *data = malloc(len);          // no terminating NUL
+    if (data == NULL)
+	return -1;
+    memcpy(data, s->payload, len);
+
+    int      failed = 0;
+    uint64_t start  = clock_ns(CLOCK_MONOTONIC);
+    for (int i = 0 ; i < count ; i++) {
+	struct breaker_command cmd;
+	if (breaker_parse_command(data, (int)len, &cmd) != s->state)
+	    failed++;
+    }
+    uint64_t elapsed = clock_ns(CLOCK_MONOTONIC) - start;
+    free(data);
+
+    if (failed) {
+	fprintf(stderr, "%s: %d/%d parses failed\n", s->name, failed, count);
+	return -1;
+    }
+    return elapsed ? count * 1e9 / elapsed : 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 1000000;
+    if (count < 1) count = 1;
+
+    int rc = EXIT_SUCCESS;
+    for (size_t i = 0 ; i < sizeof(scenarios) / sizeof(scenarios[0]) ; i++) {
+	double rate = run(&scenarios[i], count);
+	if (rate < 0) {
+	    rc = EXIT_FAILURE;
+	    continue;
+	}
+	printf("%-9s %3zu bytes: %d parses, %.0f parses/s, %.1f ns/parse\n",
+	       scenarios[i].name, strlen(scenarios[i].payload), count,
+	       rate, 1e9 / rate);
+    }
+    return rc;
+}
@@ -0,0 +1,312 @@
+/*
+ * Integration test / benchmark: `state/set` -> `state` round trip through
+ * moses_breaker, and `state/set` -> GPIO line latency.
+ *
+ * The breaker runs unmodified, as a child process, against the broker
+ * stand-in (mqtt_broker.h) and a simulated GPIO chip (gpio_sim.h), so this
+ * runs on any Linux box with gpio-sim, no Pi needed. Each command is timed
+ * from its publication to the simulated line changing -- what matters when
+ * closing the valve on a leak -- and to the reception of the echoed state.
+ * gpio-sim raises no edge event on a line requested as an output by
+ * another process, so the line value is busy-polled from the moment the
+ * command is published (with a resolution of one read of the value
+ * attribute, a few microseconds). The distributions (p50/p99/max, and a
+ * histogram of the line latency) are reported; a line not following, or a
+ * lost or wrong echo, fails the test. Each command carries a correlation
+ * id, which must come back in its `state/ack`. The breaker also drives two
+ * zone valves, which are then switched together with the main one by
+ * `all/state/set`.
+ *
+ * This is done three times: with every client on loopback TCP, the same
+ * with --reduced-latency, then on a Unix domain socket, as with a broker
+ * co-located on the Pi. --reduced-latency only makes a difference with the
+ * privileges it needs (SCHED_FIFO, mlockall), which this test already
+ * requires for gpio-sim. The Unix socket needs a libmosquitto built with
+ * Unix socket support (2.0+); if the breaker does not connect that way,
+ * that part is only reported as not available.
+ *
+ * Usage: test_breaker_roundtrip /path/to/moses_breaker [count]
+ *
+ * Exits with 77 (skipped) when gpio-sim is not available (not root, no
+ * configfs, module not loaded).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mqtt_broker.h"
+#include "gpio_sim.h"
+#include "daemon.h"
+
+#define LINES      3                    // main valve + 2 zones
+#define BUCKETS    10                   // see bounds_us[]
+
+// Upper bounds of the histogram buckets (the last one is open)
+static const unsigned int bounds_us[BUCKETS - 1] = {
+    50, 100, 200, 500, 1000, 2000, 5000, 10000, 50000,
+};
+
+
+static pid_t
+spawn_breaker(const char *path, const char *host, uint16_t port,
+	      const char *chip, bool reduced_latency)
+{
+    char s_pin[64], s_zone1[80], s_zone2[80];
+    snprintf(s_pin,   sizeof(s_pin),   "%s:0", chip);
+    snprintf(s_zone1, sizeof(s_zone1), "kitchen=%s:1", chip);
+    snprintf(s_zone2, sizeof(s_zone2), "garden=%s:2",  chip);
+
+    const char *args[] = { "-P", s_pin, "-Z", s_zone1, "-Z", s_zone2,
+			   reduced_latency ? "-r" : NULL, NULL };
+    return daemon_spawn(path, "breaker", host, port, args);
+}
+
+// Busy-poll the line until it reads `want`. Time it did, 0 on timeout or
+// failure.
+static uint64_t
+wait_line(int fd, char want, uint64_t deadline)
+{
+    char value;
+    while (pread(fd, &value, 1, 0) == 1) {
+	uint64_t t = now_ns();
+	if (value == want)
+	    return t;
+	if (t > deadline)
+	    break;
+    }
+    return 0;
+}
+
+static void
+print_histogram(const char *label, const uint64_t *latency, int count)
+{
+    unsigned long hist[BUCKETS] = { 0 };
+    for (int i = 0 ; i < count ; i++) {
+	unsigned int bucket = 0;
+	while ((bucket < BUCKETS - 1) &&
+	       (latency[i] > bounds_us[bucket] * 1000ull))
+	    bucket++;
+	hist[bucket]++;
+    }
+    for (int i = 0 ; i < BUCKETS ; i++) {
+	char bound[16];
+	if (i < BUCKETS - 1) snprintf(bound, sizeof(bound), "<= %u", bounds_us[i]);
+	else                 snprintf(bound, sizeof(bound), " > %u", bounds_us[i - 1]);
+	printf("%-7s   %8s us: %6lu\n", label, bound, hist[i]);
+    }
+}
+
+// Run `count` commands with the breaker connected to `host` and the
+// tester through `c`. EXIT_SUCCESS, EXIT_FAILURE, or EXIT_SKIP if the
+// breaker could not connect.
+static int
+roundtrip(const char *label, const char *breaker, const char *host,
+	  bool reduced_latency, struct mqtt_broker *b, struct mqtt_client *c,
+	  struct gpio_sim *sim, uint64_t *rtt, uint64_t *edge, int count)
+{
+    int rc = EXIT_FAILURE;
+
+    if ((mqtt_client_subscribe(c, PREFIX "/state",        1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/state/ack",    1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/all/state/ack", 1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/stats/breaker", 0) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/stats/breaker/actuator", 0) < 0)) {
+	fprintf(stderr, "%s: failed to subscribe\n", label);
+	return EXIT_FAILURE;
+    }
+
+    int fd = gpio_sim_value_fd(sim, 0);
+    if (fd < 0) {
+	fprintf(stderr, "%s: failed to sample the line\n", label);
+	return EXIT_FAILURE;
+    }
+
+    pid_t pid = spawn_breaker(breaker, host, mqtt_broker_port(b), sim->chip,
+			      reduced_latency);
+    if (pid < 0) {
+	close(fd);
+	return EXIT_FAILURE;
+    }
+
+    // The runs share the broker: what the previous breaker left retained
+    // (state, statistics) is delivered first, and passed over here
+    struct mqtt_client_message msg;
+    if (!daemon_wait_connected(c, "breaker")) {
+	fprintf(stderr, "%s: breaker did not connect\n", label);
+	rc = EXIT_SKIP;
+	goto stop;
+    }
+
+    int errors = 0;
+    for (int i = 0 ; i < count ; i++) {
+	const char *want = (i & 1) ? "0" : "1";
+	char        cmd[32], id[32];
+	snprintf(cmd, sizeof(cmd), "%s id=rt-%d", want, i);
+	snprintf(id,  sizeof(id),  "\"id\": \"rt-%d\"", i);
+	uint64_t    t0   = now_ns();
+	if (mqtt_client_publish(c, PREFIX "/state/set", cmd, strlen(cmd),
+				1, false) < 0) {
+	    fprintf(stderr, "%s: publish failed\n", label);
+	    goto stop;
+	}
+	uint64_t t1 = wait_line(fd, want[0], t0 + TIMEOUT_MS * 1000000ull);
+	if (t1 == 0) {
+	    fprintf(stderr, "%s #%d: line not driven to %s\n", label, i, want);
+	    goto stop;
+	}
+	edge[i] = t1 - t0;
+	if (!daemon_wait_for(c, PREFIX "/state", &msg)) {
+	    fprintf(stderr, "%s #%d: no state echoed\n", label, i);
+	    goto stop;
+	}
+	rtt[i] = msg.ts_ns - t0;
+	if (strcmp(msg.payload, want) != 0) {
+	    fprintf(stderr, "%s #%d: state %s, expected %s\n",
+		    label, i, msg.payload, want);
+	    errors++;
+	}
+	if (!daemon_wait_for(c, PREFIX "/state/ack", &msg) ||
+	    (strstr(msg.payload, id) == NULL) ||
+	    (strstr(msg.payload, "\"result\": \"ok\"") == NULL)) {
+	    fprintf(stderr, "%s #%d: command not acknowledged\n", label, i);
+	    errors++;
+	}
+    }
+
+    qsort(rtt,  count, sizeof(*rtt),  cmp_u64);
+    qsort(edge, count, sizeof(*edge), cmp_u64);
+    printf("%-7s state/set -> state round trip over %d commands:"
+	   " p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", label, count,
+	   rtt[count / 2] / 1e6, rtt[(count * 99) / 100] / 1e6,
+	   rtt[count - 1] / 1e6);
+    printf("%-7s state/set -> line over %d commands:"
+	   " p50 %.1f us, p99 %.1f us, max %.1f us\n", label, count,
+	   edge[count / 2] / 1e3, edge[(count * 99) / 100] / 1e3,
+	   edge[count - 1] / 1e3);
+    print_histogram(label, edge, count);
+
+    // Breaker side: receive -> actuate, every command accounted for
+    unsigned long commands = 0;
+    double mean_us = 0, max_us = 0;
+    while ((commands < (unsigned long)count) &&
+	   daemon_wait_for(c, PREFIX "/stats/breaker/actuator", &msg)) {
+	const char *p = strstr(msg.payload, "\"commands\":");
+	const char *m = strstr(msg.payload, "\"mean_us\":");
+	const char *x = strstr(msg.payload, "\"max_us\":");
+	if (p) commands = strtoul(p + 11, NULL, 10);
+	if (m) mean_us  = strtod(m + 10, NULL);
+	if (x) max_us   = strtod(x + 9,  NULL);
+    }
+    if (commands != (unsigned long)count) {
+	fprintf(stderr, "%s: %lu commands reported by the actuator\n",
+		label, commands);
+	errors++;
+    }
+    printf("%-7s state/set receive -> line driven: mean %.1f us, max %.1f us\n",
+	   label, mean_us, max_us);
+
+    // All lines at once
+    for (int want = 1 ; want >= 0 ; want--) {
+	const char *cmd = want ? "1 id=all-1" : "0 id=all-0";
+	if ((mqtt_client_publish(c, PREFIX "/all/state/set", cmd, strlen(cmd),
+				 1, false) < 0) ||
+	    !daemon_wait_for(c, PREFIX "/all/state/ack", &msg) ||
+	    (strstr(msg.payload, "\"result\": \"ok\"") == NULL)) {
+	    fprintf(stderr, "%s: all/state/set %d not acknowledged\n",
+		    label, want);
+	    errors++;
+	    continue;
+	}
+	for (int line = 0 ; line < LINES ; line++)
+	    if (gpio_sim_get(sim, line) != want) {
+		fprintf(stderr, "%s: line %d not driven to %d by all/state/set\n",
+			label, line, want);
+		errors++;
+	    }
+    }
+    rc = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ stop:
+    daemon_stop(pid);
+    close(fd);
+    return rc;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s moses_breaker [count]\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+    int count = (argc > 2) ? atoi(argv[2]) : 500;
+    if (count < 1) count = 1;
+
+    struct gpio_sim sim;
+    if (gpio_sim_create(&sim, "moses-breaker", LINES) < 0) {
+	printf("SKIP: gpio-sim not available\n");
+	return EXIT_SKIP;
+    }
+
+    int rc = EXIT_FAILURE;
+    char path[64], host[80];
+    snprintf(path, sizeof(path), "/tmp/moses-roundtrip-%d.sock", (int)getpid());
+    snprintf(host, sizeof(host), "unix:%s", path);
+
+    uint64_t *rtt  = calloc(count, sizeof(*rtt));
+    uint64_t *edge = calloc(count, sizeof(*edge));
+    struct mqtt_client *c = NULL;
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    if ((rtt == NULL) || (edge == NULL) || (b == NULL) ||
+	(mqtt_broker_listen_unix(b, path) < 0)) {
+	fprintf(stderr, "failed to set up the broker\n");
+	goto done;
+    }
+
+    // Loopback TCP, without and with --reduced-latency
+    for (int reduced = 0 ; reduced <= 1 ; reduced++) {
+	c = mqtt_client_connect(mqtt_broker_port(b), "tester",
+				NULL, NULL, 0, false);
+	if (c == NULL) {
+	    fprintf(stderr, "failed to connect to the broker\n");
+	    rc = EXIT_FAILURE;
+	    goto done;
+	}
+	rc = roundtrip(reduced ? "tcp -r" : "tcp", argv[1], "127.0.0.1",
+		       reduced, b, c, &sim, rtt, edge, count);
+	mqtt_client_close(c, false);
+	if (rc != EXIT_SUCCESS) {
+	    if (rc == EXIT_SKIP) rc = EXIT_FAILURE;
+	    goto done;
+	}
+    }
+
+    // Unix domain socket
+    c = mqtt_client_connect_unix(path, "tester", NULL, NULL, 0, false);
+    if (c == NULL) {
+	fprintf(stderr, "failed to connect to the broker\n");
+	rc = EXIT_FAILURE;
+	goto done;
+    }
+    rc = roundtrip("unix", argv[1], host, false, b, c, &sim, rtt, edge, count);
+    mqtt_client_close(c, false);
+    if (rc == EXIT_SKIP) {
+	printf("unix    not available (libmosquitto without Unix sockets?)\n");
+	rc = EXIT_SUCCESS;
+    }
+
+ done:
+    if (b) mqtt_broker_stop(b);
+    free(rtt);
+    free(edge);
+    gpio_sim_destroy(&sim);
+    return rc;
+}
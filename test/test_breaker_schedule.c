@@ -0,0 +1,140 @@
+/*
+ * Unit tests for the timed and scheduled breaker commands (payload parsing
+ * and persistence).
+ *
+ * They run in a fixed time zone (POSIX TZ string, no tzdata needed) for
+ * the local date/time form.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include "breaker_schedule.h"
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+// 2025-01-15 00:00:00 UTC
+#define T0    ((time_t)1736899200)
+
+// Parse a NUL-terminated string by its length, at T0.
+#define PARSE(s, r) breaker_schedule_parse((s), (int)strlen(s), T0, (r))
+
+static void
+test_parse(void)
+{
+    struct breaker_schedule_request r;
+
+    // <state> for <duration>: now, then the other state
+    CHECK(PARSE("on for 30min", &r) == 0);
+    CHECK(r.command == BREAKER_SCHEDULE_SET);
+    CHECK(r.now == 1);
+    CHECK(r.schedule.pending);
+    CHECK(r.schedule.state == 0);
+    CHECK(r.schedule.at == T0 + 1800);
+
+    // <state> in <duration>: later only
+    CHECK(PARSE("OFF in 2h", &r) == 0);
+    CHECK(r.now == -1);
+    CHECK(r.schedule.state == 0);
+    CHECK(r.schedule.at == T0 + 7200);
+
+    // <state> at <time>
+    CHECK(PARSE("1 at 1736985600", &r) == 0);
+    CHECK(r.now == -1);
+    CHECK(r.schedule.state == 1);
+    CHECK(r.schedule.at == T0 + 86400);
+    setenv("TZ", "CET-1", 1);
+    tzset();
+    CHECK(PARSE("true at 2025-01-16T01:00", &r) == 0);
+    CHECK(r.schedule.at == T0 + 86400);
+    CHECK(PARSE("true at 2025-01-16T01:00:30", &r) == 0);
+    CHECK(r.schedule.at == T0 + 86430);
+
+    // cancel, query
+    CHECK(PARSE("cancel", &r) == 0);
+    CHECK(r.command == BREAKER_SCHEDULE_CANCEL);
+    CHECK(PARSE("Query", &r) == 0);
+    CHECK(r.command == BREAKER_SCHEDULE_QUERY);
+    CHECK(r.now == -1);
+
+    // Rejected
+    CHECK(PARSE("",                 &r) == -1);
+    CHECK(PARSE("on",               &r) == -1);
+    CHECK(PARSE("on for",           &r) == -1);
+    CHECK(PARSE("on for 0",         &r) == -1);   // no duration
+    CHECK(PARSE("on for 2y",        &r) == -1);
+    CHECK(PARSE("on for 53w",       &r) == -1);   // too long
+    CHECK(PARSE("on until 1h",      &r) == -1);
+    CHECK(PARSE("maybe for 1h",     &r) == -1);
+    CHECK(PARSE("on at 1736899200", &r) == -1);   // not in the future
+    CHECK(PARSE("on at tomorrow",   &r) == -1);
+    CHECK(PARSE("on for 1h extra",  &r) == -1);
+    CHECK(breaker_schedule_parse("on for 1h", 6, T0, &r) == -1); // length
+    CHECK(breaker_schedule_parse("cancel\0", 7, T0, &r) == -1);  // NUL
+    CHECK(breaker_schedule_parse("cancel",  -1, T0, &r) == -1);
+}
+
+static void
+test_persistence(void)
+{
+    char path[] = "/tmp/test_breaker_schedule.XXXXXX";
+    int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    unlink(path);
+
+    struct breaker_schedule a = { .pending = true, .state = 1, .at = T0 };
+    struct breaker_schedule b = { 0 };
+
+    // Nothing saved yet
+    CHECK(breaker_schedule_load(&b, path) < 0);
+    CHECK(errno == ENOENT);
+
+    // Round trip, pending or not
+    CHECK(breaker_schedule_save(&a, path) == 0);
+    CHECK(breaker_schedule_load(&b, path) == 0);
+    CHECK(b.pending && (b.state == 1) && (b.at == T0));
+    a.pending = false;
+    CHECK(breaker_schedule_save(&a, path) == 0);
+    CHECK(breaker_schedule_load(&b, path) == 0);
+    CHECK(!b.pending);
+
+    // Garbage is rejected, leaving the schedule untouched
+    FILE *f = fopen(path, "w");
+    fprintf(f, "moses-schedule 1\n2 %lld\n", (long long)T0);
+    fclose(f);
+    b.pending = true;
+    CHECK(breaker_schedule_load(&b, path) < 0);
+    CHECK(errno == EINVAL);
+    CHECK(b.pending);
+
+    unlink(path);
+}
+
+int
+main(void)
+{
+    test_parse();
+    test_persistence();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
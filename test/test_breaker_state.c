@@ -1,5 +1,7 @@
 /*
- * Unit tests for breaker_parse_state -- the valve command parser.
+ * Unit tests for breaker_parse_state / breaker_parse_command -- the valve
+ * command parsers -- and for breaker_admission, which limits how often the
+ * relay may switch.
  *
  * It interprets the payloads received on the MQTT setter topic, so a wrong
  * answer here means misreading an open/close command for the water main.
@@ -7,6 +9,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 
 #include "breaker_state.h"
@@ -25,6 +28,199 @@ static int checks   = 0;
 
 // Parse a NUL-terminated string by its length.
 #define PARSE(s) breaker_parse_state((s), (int)strlen(s))
+#define PARSE_COMMAND(s, c) breaker_parse_command((s), (int)strlen(s), (c))
+
+static void
+test_command(void)
+{
+    struct breaker_command c;
+
+    // Bare state: as breaker_parse_state()
+    CHECK(PARSE_COMMAND("on", &c) == 1);
+    CHECK((c.state == 1) && (c.id[0] == '\0') && !c.has_ts);
+    CHECK(PARSE_COMMAND("off", &c) == 0);
+
+    // With id and/or client timestamp, in any order
+    CHECK(PARSE_COMMAND("1 id=cmd-42", &c) == 1);
+    CHECK(strcmp(c.id, "cmd-42") == 0);
+    CHECK(!c.has_ts);
+    CHECK(PARSE_COMMAND("off ts=1736899200.125 id=a.b:c_d", &c) == 0);
+    CHECK(strcmp(c.id, "a.b:c_d") == 0);
+    CHECK(c.has_ts && (c.ts == 1736899200.125));
+
+    // Not understood, but the id is kept for the acknowledgement
+    CHECK(PARSE_COMMAND("maybe id=7", &c) == -1);
+    CHECK((c.state == -1) && (strcmp(c.id, "7") == 0));
+    CHECK(PARSE_COMMAND("on id=7 ts=soon", &c) == -1);
+    CHECK(strcmp(c.id, "7") == 0);
+
+    // Malformed
+    CHECK(PARSE_COMMAND("on ",          &c) == -1);    // trailing space
+    CHECK(PARSE_COMMAND("on  id=1",     &c) == -1);    // empty token
+    CHECK(PARSE_COMMAND("on id=",       &c) == -1);
+    CHECK(PARSE_COMMAND("on id=\"x\"",  &c) == -1);    // not JSON-safe
+    CHECK(c.id[0] == '\0');
+    CHECK(PARSE_COMMAND("on id=1 id=2", &c) == -1);    // repeated
+    CHECK(PARSE_COMMAND("on ts=-1",     &c) == -1);
+    CHECK(PARSE_COMMAND("on ts=nan",    &c) == -1);
+    CHECK(PARSE_COMMAND("on foo=bar",   &c) == -1);
+    CHECK(PARSE_COMMAND("on id=0123456789012345678901234567890123456789"
+			"012345678901234567890123456789", &c) == -1);  // long
+    CHECK(breaker_parse_command("on id=1", 5, &c) == -1);   // length
+    CHECK(breaker_parse_command("on\0id=1", 7, &c) == -1);  // NUL
+    CHECK(breaker_parse_command("on", -1, &c) == -1);
+}
+
+static void
+test_json(void)
+{
+    struct breaker_command c;
+
+    // State as a string, a number or a boolean
+    CHECK(PARSE_COMMAND("{\"state\":\"on\"}", &c) == 1);
+    CHECK((c.id[0] == '\0') && !c.has_ts && (c.duration == 0));
+    CHECK(PARSE_COMMAND("{\"state\":\"OFF\"}", &c) == 0);
+    CHECK(PARSE_COMMAND("{\"state\":1}",         &c) == 1);
+    CHECK(PARSE_COMMAND("{\"state\":0}",         &c) == 0);
+    CHECK(PARSE_COMMAND("{\"state\":true}",      &c) == 1);
+    CHECK(PARSE_COMMAND("{\"state\":false}",     &c) == 0);
+
+    // All the members, with white space
+    CHECK(PARSE_COMMAND(" { \"id\" : \"cmd-42\", \"state\": \"on\",\n"
+			"   \"ts\": 1736899200.125, \"for\": 1800,\n"
+			"   \"reason\": \"pressure test\", \"source\": \"ha\" }\n",
+			&c) == 1);
+    CHECK(strcmp(c.id, "cmd-42") == 0);
+    CHECK(c.has_ts && (c.ts == 1736899200.125));
+    CHECK(c.duration == 1800);
+    CHECK(strcmp(c.reason, "pressure test") == 0);
+    CHECK(strcmp(c.source, "ha") == 0);
+
+    // Not understood, but the id is kept for the acknowledgement
+    CHECK(PARSE_COMMAND("{\"id\":\"7\",\"state\":\"maybe\"}", &c) == -1);
+    CHECK((c.state == -1) && (strcmp(c.id, "7") == 0));
+    CHECK(PARSE_COMMAND("{\"id\":\"7\",\"state\":1,\"color\":\"red\"}", &c) == -1);
+    CHECK(strcmp(c.id, "7") == 0);
+
+    // Invalid members
+    CHECK(PARSE_COMMAND("{}",                              &c) == -1);
+    CHECK(PARSE_COMMAND("{\"id\":\"7\"}",                  &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":2}",                   &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":null}",                &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"state\":0}",       &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"id\":\"a b\"}",    &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"id\":42}",         &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"ts\":-1}",         &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"for\":0}",         &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"for\":1.5}",       &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"for\":31708801}",  &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"reason\":\"\"}",   &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,\"source\":\"0123456789"
+			"0123456789012345678901234567890123456789"
+			"0123456789012345\"}", &c) == -1);           // long
+
+    // Malformed
+    CHECK(PARSE_COMMAND("{",                               &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1",                    &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1,}",                  &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1} x",                 &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":[1]}",                 &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":{\"on\":1}}",          &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":\"o\\u006e\"}",       &c) == -1);    // escape
+    CHECK(PARSE_COMMAND("{\"state\":\"on",                &c) == -1);
+    CHECK(PARSE_COMMAND("{state:1}",                       &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":1e400}",               &c) == -1);
+    CHECK(PARSE_COMMAND("{\"state\":000000000000000000000000000000001}",
+			&c) == -1);                                 // long number
+    CHECK(breaker_parse_command("{\"state\":1}", 10, &c) == -1); // length
+    CHECK(breaker_parse_command("{\"state\":1}\0", 12, &c) == -1);
+}
+
+#define S(n)  ((uint64_t)(n) * 1000000000ull)
+#define MS(n) ((uint64_t)(n) * 1000000ull)
+
+static void
+test_admission(void)
+{
+    struct breaker_admission a = { .dwell_ns = S(5), .rate = 3 };
+    uint64_t until = 0;
+
+    // Nothing recorded yet
+    CHECK(breaker_admission_allows(&a, 0, S(100), &until));
+
+    // Dwell time between transitions, except to close
+    breaker_admission_record(&a, S(100));
+    CHECK(!breaker_admission_allows(&a, 0, S(102), &until));
+    CHECK(until == S(105));
+    CHECK(breaker_admission_allows(&a, 1, S(102), &until));
+    CHECK(breaker_admission_allows(&a, 0, S(105), &until));
+
+    // At most 3 per minute: the 4th waits for the 1st to leave the window
+    breaker_admission_record(&a, S(105));
+    breaker_admission_record(&a, S(110));
+    CHECK(!breaker_admission_allows(&a, 0, S(120), &until));
+    CHECK(until == S(160));
+    CHECK(breaker_admission_allows(&a, 1, S(120), &until));
+    CHECK(breaker_admission_allows(&a, 0, S(160), &until));
+    breaker_admission_record(&a, S(160));
+    CHECK(!breaker_admission_allows(&a, 0, S(163), &until));
+    CHECK(until == S(165));                         // both limits
+
+    // A close counts too
+    breaker_admission_record(&a, S(170));
+    CHECK(!breaker_admission_allows(&a, 0, S(172), &until));
+    CHECK(until == S(175));                         // dwell
+    breaker_admission_record(&a, S(175));
+    CHECK(!breaker_admission_allows(&a, 0, S(181), &until));
+    CHECK(until == S(220));                         // 160 + 60s
+
+    // No limit
+    struct breaker_admission none = { 0 };
+    for (int i = 1 ; i <= 10 ; i++)
+	breaker_admission_record(&none, S(i));
+    CHECK(breaker_admission_allows(&none, 0, S(10), &until));
+}
+
+static void
+test_hold(void)
+{
+    // 100ms pull-in, then 25% of 20ms: 15ms off, 5ms on
+    struct breaker_hold h = {
+	.pull_in_ns = MS(100), .period_ns = MS(20), .duty = 25 };
+    uint64_t next;
+
+    CHECK(breaker_hold_enabled(&h));
+    CHECK(breaker_hold_driven_ns(&h, S(10)) == 0);          // not energised
+
+    breaker_hold_start(&h, S(10));
+    CHECK(breaker_hold_level(&h, S(10), &next) == 1);
+    CHECK(next == S(10) + MS(100));
+    CHECK(breaker_hold_level(&h, S(10) + MS(99), &next) == 1);
+    CHECK(breaker_hold_level(&h, S(10) + MS(100), &next) == 0);
+    CHECK(next == S(10) + MS(115));
+    CHECK(breaker_hold_level(&h, S(10) + MS(115), &next) == 1);
+    CHECK(next == S(10) + MS(120));
+    CHECK(breaker_hold_level(&h, S(10) + MS(1117), &next) == 1);
+    CHECK(next == S(10) + MS(1120));
+
+    // Driven: the pull-in, then 5ms every 20ms
+    CHECK(breaker_hold_driven_ns(&h, S(10) + MS(50))  == MS(50));
+    CHECK(breaker_hold_driven_ns(&h, S(10) + MS(110)) == MS(100));
+    CHECK(breaker_hold_driven_ns(&h, S(10) + MS(118)) == MS(103));
+    CHECK(breaker_hold_driven_ns(&h, S(10) + MS(300)) == MS(150));
+    CHECK(breaker_hold_driven_ns(&h, S(3610)) == MS(100) + MS(899975));
+
+    breaker_hold_stop(&h);
+    CHECK(breaker_hold_driven_ns(&h, S(20)) == 0);
+
+    // Without a hold duty, fully driven all along
+    struct breaker_hold full = { .pull_in_ns = MS(100), .period_ns = MS(20) };
+    CHECK(!breaker_hold_enabled(&full));
+    breaker_hold_start(&full, S(10));
+    CHECK(breaker_hold_level(&full, S(20), &next) == 1);
+    CHECK(next == UINT64_MAX);
+    CHECK(breaker_hold_driven_ns(&full, S(20)) == S(10));
+}
 
 int
 main(void)
@@ -58,6 +254,11 @@ main(void)
     // Negative length is rejected
     CHECK(breaker_parse_state("on", -1) == -1);
 
+    test_command();
+    test_json();
+    test_admission();
+    test_hold();
+
     printf("%d checks, %d failures\n", checks, failures);
     return failures ? EXIT_FAILURE : EXIT_SUCCESS;
 }
@@ -0,0 +1,167 @@
+/*
+ * Integration test: timed command of moses_breaker overridden by a plain
+ * `state/set`.
+ *
+ * The (simulated) valve is closed for two seconds (`1 for 2s` on
+ * `state/schedule`), so its reopening is pending; it is then closed again
+ * by a plain `state/set`, as a leak shutoff would. The pending reopening
+ * must be cancelled: announced as such on `state/pending`, dropped from
+ * the --schedule file, and once its time is past the valve must still be
+ * closed. A timed command left alone must, on the other hand, be applied.
+ *
+ * Usage: test_breaker_timed /path/to/moses_breaker
+ *
+ * Exits with 77 (skipped) when gpio-sim is not available (not root, no
+ * configfs, module not loaded).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "mqtt_broker.h"
+#include "gpio_sim.h"
+#include "daemon.h"
+
+
+static pid_t
+spawn_breaker(const char *path, uint16_t port, const char *chip,
+	      const char *schedule)
+{
+    char s_pin[64];
+    snprintf(s_pin, sizeof(s_pin), "%s:0", chip);
+
+    const char *args[] = { "-P", s_pin, "-S", schedule, NULL };
+    return daemon_spawn(path, "breaker", "127.0.0.1", port, args);
+}
+
+// Wait for the pending transition to be announced as `want` (a fragment
+// of the `state/pending` payload). 1 if it was.
+static int
+wait_pending(struct mqtt_client *c, const char *want)
+{
+    struct mqtt_client_message msg;
+    while (daemon_wait_for(c, PREFIX "/state/pending", &msg))
+	if (strstr(msg.payload, want))
+	    return 1;
+    return 0;
+}
+
+// Wait for the schedule file to hold no transition. 1 if it does.
+static int
+wait_saved_none(const char *path)
+{
+    for (int i = 0 ; i < TIMEOUT_MS / 10 ; i++, usleep(10000)) {
+	char  buf[64] = "";
+	FILE *f = fopen(path, "r");
+	if (f == NULL)
+	    continue;
+	size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	buf[n] = '\0';
+	if (strstr(buf, "\nnone\n"))
+	    return 1;
+    }
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s moses_breaker\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    struct gpio_sim sim;
+    if (gpio_sim_create(&sim, "moses-timed", 1) < 0) {
+	printf("SKIP: gpio-sim not available\n");
+	return EXIT_SKIP;
+    }
+
+    int   rc  = EXIT_FAILURE;
+    pid_t pid = -1;
+    char  schedule[64];
+    snprintf(schedule, sizeof(schedule), "/tmp/moses-timed-%d.schedule",
+	     (int)getpid());
+    unlink(schedule);
+    struct mqtt_client_message msg;
+
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    struct mqtt_client *c = b ? mqtt_client_connect(mqtt_broker_port(b),
+						    "tester", NULL, NULL, 0,
+						    false) : NULL;
+    if ((c == NULL) ||
+	(mqtt_client_subscribe(c, PREFIX "/state",         1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/state/pending", 1) < 0) ||
+	(mqtt_client_subscribe(c, PREFIX "/stats/breaker", 0) < 0)) {
+	fprintf(stderr, "failed to set up the broker\n");
+	goto done;
+    }
+
+    pid = spawn_breaker(argv[1], mqtt_broker_port(b), sim.chip, schedule);
+    if ((pid < 0) || !daemon_wait_connected(c, "breaker")) {
+	fprintf(stderr, "breaker did not connect\n");
+	goto done;
+    }
+
+    int errors = 0;
+
+    // Closed for 2s, then closed again for good: the reopening is dropped
+    if ((mqtt_client_publish(c, PREFIX "/state/schedule", "1 for 2s", 8,
+			     1, false) < 0) ||
+	!wait_pending(c, "\"pending\": true, \"state\": 0")) {
+	fprintf(stderr, "reopening not pending\n");
+	goto done;
+    }
+    if (daemon_set_state(c, "1") < 0)
+	goto done;
+    if (!wait_pending(c, "\"pending\": false")) {
+	fprintf(stderr, "reopening not cancelled\n");
+	errors++;
+    }
+    if (!wait_saved_none(schedule)) {
+	fprintf(stderr, "cancellation not saved to %s\n", schedule);
+	errors++;
+    }
+    sleep(3);
+    while (mqtt_client_receive(c, &msg, 100) == 1)
+	if (!strcmp(msg.topic, PREFIX "/state") && strcmp(msg.payload, "1")) {
+	    fprintf(stderr, "state %s published after the cancellation\n",
+		    msg.payload);
+	    errors++;
+	}
+    if (gpio_sim_get(&sim, 0) != 1) {
+	fprintf(stderr, "valve reopened by the cancelled transition\n");
+	errors++;
+    }
+
+    // Left alone, the reopening happens
+    bool reopened = false;
+    if (mqtt_client_publish(c, PREFIX "/state/schedule", "1 for 1s", 8,
+			    1, false) == 0)
+	while (!reopened && daemon_wait_for(c, PREFIX "/state", &msg))
+	    reopened = !strcmp(msg.payload, "0");
+    if (!reopened || (gpio_sim_get(&sim, 0) != 0)) {
+	fprintf(stderr, "timed closure not reopened\n");
+	errors++;
+    }
+    printf("timed closure: reopening %s by a plain close, applied otherwise\n",
+	   errors ? "NOT cancelled" : "cancelled");
+    rc = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+    daemon_stop(pid);
+    if (c) mqtt_client_close(c, false);
+    if (b) mqtt_broker_stop(b);
+    unlink(schedule);
+    gpio_sim_destroy(&sim);
+    return rc;
+}
@@ -0,0 +1,125 @@
+/*
+ * Unit tests for the valve closure verification (residual pulses, time to
+ * last pulse, late pulses, history).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "closure.h"
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+#define MS(n) ((uint64_t)(n) * 1000000ull)
+#define S(n)  ((uint64_t)(n) * 1000000000ull)
+
+static void
+test_verified(void)
+{
+    struct closure         c = { .timeout_ns = S(10), .window_ns = S(60) };
+    struct closure_history h = { 0 };
+
+    // Flowing, then closed at 100s: the closure is reported late, after
+    // a residual pulse at 100.2s
+    CHECK(closure_pulse(&c, S(98))       == CLOSURE_PENDING);
+    CHECK(closure_pulse(&c, S(99))       == CLOSURE_PENDING);
+    CHECK(closure_pulse(&c, MS(100200))  == CLOSURE_PENDING);
+    CHECK(closure_deadline(&c) == 0);
+    closure_start(&c, S(100));
+    CHECK(c.residual == 1);
+    CHECK(closure_deadline(&c) == S(170));
+
+    // More residual pulses, then nothing
+    CHECK(closure_pulse(&c, MS(101500))  == CLOSURE_PENDING);
+    CHECK(closure_pulse(&c, S(110))      == CLOSURE_PENDING);    // just in
+    CHECK(c.residual == 3);
+    CHECK(closure_time_to_last_pulse(&c) == S(10));
+    CHECK(closure_tick(&c, S(169))       == CLOSURE_PENDING);
+    CHECK(closure_tick(&c, S(170))       == CLOSURE_VERIFIED);
+    CHECK(closure_tick(&c, S(171))       == CLOSURE_PENDING);    // once
+    closure_record(&h, &c, CLOSURE_VERIFIED);
+    CHECK((h.verified == 1) && (h.count == 1));
+    CHECK(closure_history_at(&h, 0) == S(10));
+
+    // Stale pulses do not count, no pulse at all is verified too
+    closure_start(&c, S(200));
+    CHECK(c.residual == 0);
+    CHECK(closure_time_to_last_pulse(&c) == 0);
+    CHECK(closure_tick(&c, S(270)) == CLOSURE_VERIFIED);
+    closure_record(&h, &c, CLOSURE_VERIFIED);
+    CHECK(closure_history_mean(&h) == S(5));
+    CHECK(closure_history_max(&h)  == S(10));
+}
+
+static void
+test_failed(void)
+{
+    struct closure         c = { .timeout_ns = S(10), .window_ns = S(60) };
+    struct closure_history h = { 0 };
+
+    // Still flowing after the timeout
+    closure_start(&c, S(100));
+    CHECK(closure_pulse(&c, S(105)) == CLOSURE_PENDING);
+    CHECK(closure_pulse(&c, S(130)) == CLOSURE_FAILED);
+    CHECK((c.residual == 1) && (c.late == 1));
+    CHECK(closure_deadline(&c) == 0);
+    CHECK(closure_tick(&c, S(200))  == CLOSURE_PENDING);
+    CHECK(closure_pulse(&c, S(131)) == CLOSURE_PENDING);          // over
+    closure_record(&h, &c, CLOSURE_FAILED);
+    CHECK((h.failed == 1) && (h.verified == 0) && (h.count == 0));
+
+    // Closure reported after the timeout, already failed
+    CHECK(closure_pulse(&c, S(215)) == CLOSURE_PENDING);
+    CHECK(closure_start(&c, S(200)) == CLOSURE_FAILED);
+    CHECK(closure_deadline(&c) == 0);
+
+    // Reopened before the end: no result
+    closure_start(&c, S(300));
+    closure_cancel(&c);
+    CHECK(closure_pulse(&c, S(320)) == CLOSURE_PENDING);
+    CHECK(closure_tick(&c, S(400))  == CLOSURE_PENDING);
+}
+
+static void
+test_history(void)
+{
+    struct closure         c = { .timeout_ns = S(10), .window_ns = S(1) };
+    struct closure_history h = { 0 };
+
+    // Slower and slower: only the last CLOSURE_HISTORY are kept
+    for (int i = 1 ; i <= CLOSURE_HISTORY + 8 ; i++) {
+	uint64_t t = S(100 * i);
+	closure_start(&c, t);
+	closure_pulse(&c, t + MS(10 * i));
+	CHECK(closure_tick(&c, t + S(11)) == CLOSURE_VERIFIED);
+	closure_record(&h, &c, CLOSURE_VERIFIED);
+    }
+    CHECK(h.verified == CLOSURE_HISTORY + 8);
+    CHECK(h.count    == CLOSURE_HISTORY);
+    CHECK(closure_history_at(&h, 0) == MS(90));
+    CHECK(closure_history_at(&h, CLOSURE_HISTORY - 1) ==
+	  MS(10 * (CLOSURE_HISTORY + 8)));
+    CHECK(closure_history_max(&h) == MS(10 * (CLOSURE_HISTORY + 8)));
+}
+
+int
+main(void)
+{
+    test_verified();
+    test_failed();
+    test_history();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,190 @@
+/*
+ * Unit tests for the pure helpers of the MQTT wrapper in common.c.
+ *
+ * Nothing here talks to a broker: only the computations driving the
+ * connection handling are checked.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+
+static void
+test_backoff_delay(void)
+{
+    // Jitter draws from the upper half of each step: [step/2, step]
+    CHECK(mqtt_backoff_delay(1000, 120000, 0, 0)   ==   500);
+    CHECK(mqtt_backoff_delay(1000, 120000, 0, 500) ==  1000);
+    CHECK(mqtt_backoff_delay(1000, 120000, 1, 0)   ==  1000);
+    CHECK(mqtt_backoff_delay(1000, 120000, 1, 1000)==  2000);
+    CHECK(mqtt_backoff_delay(1000, 120000, 3, 0)   ==  4000);
+
+    // Capped at max, however many attempts
+    CHECK(mqtt_backoff_delay(1000, 120000, 10,  0)   ==  60000);
+    CHECK(mqtt_backoff_delay(1000, 120000, 10,  60000) == 120000);
+    CHECK(mqtt_backoff_delay(1000, 120000, 200, 0)   ==  60000);
+    CHECK(mqtt_backoff_delay(1000, 120000, ~0U, 0)   ==  60000);
+
+    // Always within bounds, whatever the random draw
+    for (unsigned int attempt = 0 ; attempt < 40 ; attempt++)
+	for (unsigned int rnd = 0 ; rnd < 100000 ; rnd += 997) {
+	    unsigned int d = mqtt_backoff_delay(250, 30000, attempt, rnd);
+	    CHECK(d >= 125 && d <= 30000);
+	}
+
+    // Degenerate: no backoff range
+    CHECK(mqtt_backoff_delay(1, 1, 5, 12345) <= 1);
+}
+
+static void
+test_ack_bucket(void)
+{
+    // Bucket b holds latencies up to bounds[b] (inclusive)
+    CHECK(mqtt_ack_bucket(0)                  == 0);
+    CHECK(mqtt_ack_bucket(500000)             == 0);
+    CHECK(mqtt_ack_bucket(500001)             == 1);
+    CHECK(mqtt_ack_bucket(1000000)            == 1);
+    CHECK(mqtt_ack_bucket(3000000)            == 3);
+    CHECK(mqtt_ack_bucket(1000000000)         == MQTT_ACK_BUCKETS - 2);
+
+    // Overflow bucket, beyond the last bound
+    CHECK(mqtt_ack_bucket(1000000001)         == MQTT_ACK_BUCKETS - 1);
+    CHECK(mqtt_ack_bucket(UINT64_MAX)         == MQTT_ACK_BUCKETS - 1);
+
+    // Bounds are increasing, and each one lands in its own bucket
+    for (unsigned int b = 0 ; b < MQTT_ACK_BUCKETS - 1 ; b++) {
+	if (b) CHECK(mqtt_ack_bounds_us[b] > mqtt_ack_bounds_us[b - 1]);
+	CHECK(mqtt_ack_bucket(mqtt_ack_bounds_us[b] * 1000ull) == b);
+    }
+}
+
+static void
+test_bucket(void)
+{
+    const uint64_t min = 60000000000ull;
+    struct mqtt_bucket b = { 0 };
+
+    // Starts full: a burst, then nothing
+    for (int i = 0 ; i < 5 ; i++)
+	CHECK(mqtt_bucket_take(&b, 5, 6, 1000) == true);
+    CHECK(mqtt_bucket_take(&b, 5, 6, 1000) == false);
+
+    // 6 per minute: one token every 10s
+    CHECK(mqtt_bucket_take(&b, 5, 6, 1000 + min / 6 - 1) == false);
+    CHECK(mqtt_bucket_take(&b, 5, 6, 1000 + min / 6)     == true);
+    CHECK(mqtt_bucket_take(&b, 5, 6, 1000 + min / 6)     == false);
+
+    // Partial periods are not lost
+    CHECK(mqtt_bucket_take(&b, 5, 6, 1000 + min / 6 + min / 12) == false);
+    CHECK(mqtt_bucket_take(&b, 5, 6, 1000 + min / 3)            == true);
+
+    // Refill capped at the burst
+    uint64_t t = 1000 + 10 * min;
+    for (int i = 0 ; i < 5 ; i++)
+	CHECK(mqtt_bucket_take(&b, 5, 6, t) == true);
+    CHECK(mqtt_bucket_take(&b, 5, 6, t) == false);
+
+    // No rate, no token
+    struct mqtt_bucket z = { 0 };
+    CHECK(mqtt_bucket_take(&z, 5, 0, 1000) == false);
+}
+
+static void
+test_error_dedup(void)
+{
+    // Not connected: reports are tracked, publishing is a no-op
+    struct mqtt mqtt = MQTT_INITIALIZER();
+    struct mqtt_error e;
+
+    CHECK(mqtt_get_error(&mqtt, "error", "src", "read", &e) < 0);
+
+    // Same condition: one entry, counted
+    for (int i = 0 ; i < 1000 ; i++)
+	mqtt_error(&mqtt, "error", 1, "src", "read", "failed to read");
+    CHECK(mqtt_get_error(&mqtt, "error", "src", "read", &e) == 0);
+    CHECK(e.active   == true);
+    CHECK(e.count    == 1000);
+    CHECK(e.reported == 1);             // first one only, then summaries
+    CHECK(e.first_ns <= e.last_ns);
+    CHECK(mqtt.errorcount == 1);
+
+    // Another type is another condition
+    mqtt_error(&mqtt, "error", 1, "src", "write", "failed to write");
+    CHECK(mqtt.errorcount == 2);
+    CHECK(mqtt.errors_active == 2);
+
+    // Cleared, then raised again: counting restarts
+    mqtt_error_clear(&mqtt, "error", "src", "read");
+    CHECK(mqtt_get_error(&mqtt, "error", "src", "read", &e) == 0);
+    CHECK(e.active  == false);
+    CHECK(e.changed == false);          // "cleared" sent
+    CHECK(e.count   == 1000);
+    CHECK(mqtt.errors_active == 1);
+    mqtt_error_clear(&mqtt, "error", "src", "read");
+    CHECK(mqtt.errors_active == 1);
+
+    mqtt_error(&mqtt, "error", 1, "src", "read", "failed to read");
+    CHECK(mqtt_get_error(&mqtt, "error", "src", "read", &e) == 0);
+    CHECK(e.active == true);
+    CHECK(e.count  == 1);
+
+    struct mqtt_stats st;
+    mqtt_get_stats(&mqtt, &st);
+    CHECK(st.errors         == 1002);
+    CHECK(st.errors_sent    == 4);      // raise, raise, clear, raise
+    CHECK(st.errors_dropped == 0);
+
+    // Table full: further conditions are only counted
+    static char types[MQTT_ERROR_MAX][8];
+    for (int i = 0 ; i < MQTT_ERROR_MAX ; i++) {
+	snprintf(types[i], sizeof(types[i]), "t%d", i);
+	mqtt_error(&mqtt, "error", 1, "other", types[i], "failure");
+    }
+    mqtt_get_stats(&mqtt, &st);
+    CHECK(mqtt.errorcount   == MQTT_ERROR_MAX);
+    CHECK(st.errors_dropped == 2);
+}
+
+static void
+test_clock_conversion(void)
+{
+    // Now, in both clocks (read back to back: within a millisecond)
+    uint64_t mono = clock_ns(CLOCK_MONOTONIC);
+    uint64_t rt   = clock_ns(CLOCK_REALTIME);
+    uint64_t conv = clock_monotonic_to_realtime(mono);
+    CHECK((conv > rt ? conv - rt : rt - conv) < 1000000);
+
+    // Differences are preserved
+    int64_t d = (int64_t)(clock_monotonic_to_realtime(mono + 5000000000ull) -
+			  clock_monotonic_to_realtime(mono)) - 5000000000ll;
+    CHECK(llabs(d) < 1000000);
+}
+
+int
+main(void)
+{
+    test_backoff_delay();
+    test_ack_bucket();
+    test_bucket();
+    test_error_dedup();
+    test_clock_conversion();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
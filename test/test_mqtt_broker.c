@@ -0,0 +1,260 @@
+/*
+ * Self-test of the MQTT broker stand-in used by the integration tests.
+ *
+ * The latency and throughput figures of the other tests are only as good
+ * as the stand-in, so check that it routes, retains, acknowledges and
+ * misbehaves as documented.
+ */
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include "mqtt_broker.h"
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+#define PUBLISH(c, topic, payload, qos, retain)				\
+    mqtt_client_publish((c), (topic), (payload), strlen(payload),	\
+			(qos), (retain))
+
+
+static _Atomic unsigned long traced;
+static _Atomic unsigned long unordered;
+static _Atomic uint64_t      last_ts;
+
+static void
+trace(void *ctx, const struct mqtt_broker_packet *pkt)
+{
+    (void)ctx;
+    if (pkt->ts_ns < atomic_load(&last_ts))
+	atomic_fetch_add(&unordered, 1);
+    atomic_store(&last_ts, pkt->ts_ns);
+    atomic_fetch_add(&traced, 1);
+}
+
+
+static void
+test_topic_match(void)
+{
+    CHECK( mqtt_topic_match("a/b",   "a/b"));
+    CHECK(!mqtt_topic_match("a/b",   "a/bc"));
+    CHECK(!mqtt_topic_match("a/b",   "a"));
+    CHECK( mqtt_topic_match("a/+",   "a/b"));
+    CHECK(!mqtt_topic_match("a/+",   "a/b/c"));
+    CHECK( mqtt_topic_match("+/b",   "a/b"));
+    CHECK( mqtt_topic_match("a/#",   "a/b/c"));
+    CHECK( mqtt_topic_match("a/#",   "a"));
+    CHECK( mqtt_topic_match("#",     "a/b"));
+    CHECK( mqtt_topic_match("a/+/c", "a/b/c"));
+    CHECK(!mqtt_topic_match("a/+/c", "a/b/d"));
+}
+
+static void
+test_routing(struct mqtt_broker *b)
+{
+    uint16_t port = mqtt_broker_port(b);
+    struct mqtt_client_message msg;
+
+    struct mqtt_client *sub = mqtt_client_connect(port, "sub", NULL, NULL, 0, false);
+    struct mqtt_client *pub = mqtt_client_connect(port, "pub", NULL, NULL, 0, false);
+    CHECK(sub != NULL && pub != NULL);
+    if (!sub || !pub) return;
+    CHECK(mqtt_broker_client_count(b) == 2);
+
+    CHECK(mqtt_client_subscribe(sub, "a/+", 2) == 0);
+
+    // Each QoS level goes through, downgraded to the subscription QoS
+    for (int qos = 0 ; qos <= 2 ; qos++) {
+	char payload[16];
+	snprintf(payload, sizeof(payload), "q%d", qos);
+	CHECK(PUBLISH(pub, "a/b", payload, qos, false) == 0);
+	CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+	CHECK(strcmp(msg.topic, "a/b") == 0);
+	CHECK(strcmp(msg.payload, payload) == 0);
+	CHECK(msg.qos == qos);
+	CHECK(!msg.retain);
+    }
+
+    // Not matching: nothing received
+    CHECK(PUBLISH(pub, "b/a", "x", 1, false) == 0);
+    CHECK(mqtt_client_receive(sub, &msg, 100) == 0);
+
+    // QoS downgrade
+    CHECK(mqtt_client_subscribe(sub, "d", 1) == 0);
+    CHECK(PUBLISH(pub, "d", "x", 2, false) == 0);
+    CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+    CHECK(msg.qos == 1);
+
+    mqtt_client_close(pub, false);
+    mqtt_client_close(sub, false);
+}
+
+static void
+test_retained(struct mqtt_broker *b)
+{
+    uint16_t port = mqtt_broker_port(b);
+    struct mqtt_client_message msg;
+
+    struct mqtt_client *pub = mqtt_client_connect(port, "pub", NULL, NULL, 0, false);
+    if (pub == NULL) { CHECK(pub != NULL); return; }
+    CHECK(PUBLISH(pub, "r/x", "kept", 1, true) == 0);
+    CHECK(PUBLISH(pub, "r/y", "gone", 1, true) == 0);
+    CHECK(PUBLISH(pub, "r/y", "",     1, true) == 0);  // deletes
+
+    struct mqtt_client *sub = mqtt_client_connect(port, "sub", NULL, NULL, 0, false);
+    if (sub == NULL) { CHECK(sub != NULL); return; }
+    CHECK(mqtt_client_subscribe(sub, "r/#", 1) == 0);
+    CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+    CHECK(strcmp(msg.topic,   "r/x")  == 0);
+    CHECK(strcmp(msg.payload, "kept") == 0);
+    CHECK(msg.retain);
+    CHECK(mqtt_client_receive(sub, &msg, 100) == 0);
+
+    mqtt_client_close(sub, false);
+    mqtt_client_close(pub, false);
+}
+
+static void
+test_will(struct mqtt_broker *b)
+{
+    uint16_t port = mqtt_broker_port(b);
+    struct mqtt_client_message msg;
+
+    struct mqtt_client *sub = mqtt_client_connect(port, "sub", NULL, NULL, 0, false);
+    if (sub == NULL) { CHECK(sub != NULL); return; }
+    CHECK(mqtt_client_subscribe(sub, "will/#", 1) == 0);
+
+    // Clean disconnect: no will
+    struct mqtt_client *c = mqtt_client_connect(port, "w1", "will/w1", "offline", 1, true);
+    CHECK(c != NULL);
+    if (c) mqtt_client_close(c, false);
+    CHECK(mqtt_client_receive(sub, &msg, 100) == 0);
+
+    // Connection lost: will published
+    c = mqtt_client_connect(port, "w2", "will/w2", "offline", 1, true);
+    CHECK(c != NULL);
+    if (c) mqtt_client_close(c, true);
+    CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+    CHECK(strcmp(msg.topic,   "will/w2") == 0);
+    CHECK(strcmp(msg.payload, "offline") == 0);
+
+    mqtt_client_close(sub, false);
+
+    // Broker-side disconnect: will published, and retained
+    c = mqtt_client_connect(port, "w3", "will/w3", "lost", 0, true);
+    CHECK(c != NULL);
+    CHECK(mqtt_broker_kick(b) == 1);
+    CHECK(mqtt_broker_client_count(b) == 0);
+    if (c) mqtt_client_close(c, true);
+
+    sub = mqtt_client_connect(port, "sub", NULL, NULL, 0, false);
+    if (sub == NULL) { CHECK(sub != NULL); return; }
+    CHECK(mqtt_client_subscribe(sub, "will/w3", 0) == 0);
+    CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+    CHECK(strcmp(msg.payload, "lost") == 0);
+    CHECK(msg.retain);
+    mqtt_client_close(sub, false);
+}
+
+static void
+test_unix(struct mqtt_broker *b)
+{
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/mqtt_broker-%d.sock", (int)getpid());
+    CHECK(mqtt_broker_listen_unix(b, path) == 0);
+
+    // A local client talks with a TCP one
+    struct mqtt_client_message msg;
+    struct mqtt_client *sub = mqtt_client_connect_unix(path, "sub",
+						       NULL, NULL, 0, false);
+    struct mqtt_client *pub = mqtt_client_connect(mqtt_broker_port(b), "pub",
+						  NULL, NULL, 0, false);
+    if (!sub || !pub) { CHECK(sub && pub); return; }
+    CHECK(mqtt_client_subscribe(sub, "u", 1) == 0);
+    CHECK(PUBLISH(pub, "u", "local", 1, false) == 0);
+    CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+    CHECK(strcmp(msg.payload, "local") == 0);
+
+    mqtt_client_close(pub, false);
+    mqtt_client_close(sub, false);
+}
+
+static void
+test_hooks(struct mqtt_broker *b)
+{
+    uint16_t port = mqtt_broker_port(b);
+    struct mqtt_client_message msg;
+
+    // Refuse
+    mqtt_broker_set_refuse(b, 3);
+    CHECK(mqtt_client_connect(port, "x", NULL, NULL, 0, false) == NULL);
+    mqtt_broker_set_refuse(b, 0);
+
+    struct mqtt_client *sub = mqtt_client_connect(port, "sub", NULL, NULL, 0, false);
+    struct mqtt_client *pub = mqtt_client_connect(port, "pub", NULL, NULL, 0, false);
+    if (!sub || !pub) { CHECK(sub && pub); return; }
+    CHECK(mqtt_client_subscribe(sub, "h", 0) == 0);
+
+    // Delay
+    mqtt_broker_set_delay(b, 20000);
+    uint64_t start = now_ns();
+    CHECK(PUBLISH(pub, "h", "slow", 1, false) == 0);
+    CHECK(now_ns() - start >= 20000000);
+    CHECK(mqtt_client_receive(sub, &msg, 1000) == 1);
+    mqtt_broker_set_delay(b, 0);
+
+    // Drop every other message
+    unsigned long before = mqtt_broker_publish_count(b);
+    mqtt_broker_set_drop(b, 2);
+    int received = 0;
+    for (int i = 0 ; i < 10 ; i++)
+	CHECK(PUBLISH(pub, "h", "lossy", 0, false) == 0);
+    while (mqtt_client_receive(sub, &msg, 200) == 1)
+	received++;
+    mqtt_broker_set_drop(b, 0);
+    CHECK(received == 5);
+    CHECK(mqtt_broker_publish_count(b) - before == 5);
+
+    mqtt_client_close(pub, false);
+    mqtt_client_close(sub, false);
+}
+
+
+int
+main(void)
+{
+    test_topic_match();
+
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    CHECK(b != NULL);
+    if (b == NULL) return EXIT_FAILURE;
+    mqtt_broker_set_trace(b, trace, NULL);
+
+    test_routing(b);
+    test_retained(b);
+    test_will(b);
+    test_unix(b);
+    test_hooks(b);
+
+    // Every packet went through the trace, in order
+    CHECK(atomic_load(&traced) > 0);
+    CHECK(atomic_load(&unordered) == 0);
+
+    mqtt_broker_stop(b);
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
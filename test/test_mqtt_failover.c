@@ -0,0 +1,134 @@
+/*
+ * Integration test: broker fail-over of the shared MQTT layer (common.c).
+ *
+ * Two broker stand-ins (mqtt_broker.h) play the preferred and the fallback
+ * server. The preferred one is stopped -- the session must move to the
+ * fallback, with the availability restored there -- then restarted, and
+ * the session must come back once it has been healthy for the fail-back
+ * delay. Switchover times are reported.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "mqtt_broker.h"
+
+char *__progname = "test_mqtt_failover";
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+
+// Wait for `payload` on the availability topic. 1 if received.
+static int
+wait_availability(struct mqtt_client *c, const char *payload, int timeout_ms)
+{
+    struct mqtt_client_message msg;
+    uint64_t deadline = clock_ns(CLOCK_MONOTONIC) + timeout_ms * 1000000ull;
+    while (clock_ns(CLOCK_MONOTONIC) < deadline)
+	if ((mqtt_client_receive(c, &msg, 100) == 1) &&
+	    (strcmp(msg.topic,   "availability") == 0) &&
+	    (strcmp(msg.payload, payload)        == 0))
+	    return 1;
+    return 0;
+}
+
+static struct mqtt_client *
+watch(struct mqtt_broker *b)
+{
+    struct mqtt_client *c = mqtt_client_connect(mqtt_broker_port(b), "watch",
+						NULL, NULL, 0, false);
+    if ((c != NULL) && (mqtt_client_subscribe(c, "availability", 1) < 0)) {
+	mqtt_client_close(c, true);
+	c = NULL;
+    }
+    return c;
+}
+
+
+int
+main(void)
+{
+    struct mqtt_broker *primary  = mqtt_broker_start(0);
+    struct mqtt_broker *fallback = mqtt_broker_start(0);
+    if ((primary == NULL) || (fallback == NULL)) {
+	fprintf(stderr, "failed to start the brokers\n");
+	return EXIT_FAILURE;
+    }
+    uint16_t port = mqtt_broker_port(primary);
+
+    struct mqtt *mqtt = &(struct mqtt) MQTT_INITIALIZER();
+    mqtt->cfg.servers[0]    = (struct mqtt_server) {      // owned, as
+	.host = strdup("127.0.0.1"), .port = port };      // if parsed
+    mqtt->cfg.servers[1]    = (struct mqtt_server) {
+	.host = strdup("127.0.0.1"), .port = mqtt_broker_port(fallback) };
+    mqtt->cfg.servercount   = 2;
+    mqtt->cfg.host          = mqtt->cfg.servers[0].host;
+    mqtt->cfg.client_id     = "failover";
+    mqtt->cfg.reconnect_min = 100;
+    mqtt->cfg.reconnect_max = 1000;
+    mqtt->cfg.probe_timeout = 200;
+    mqtt->cfg.failback      = 1;
+
+    struct mqtt_client *w1 = watch(primary);
+    struct mqtt_client *w2 = watch(fallback);
+    CHECK(w1 && w2);
+    if (!w1 || !w2) return EXIT_FAILURE;
+
+    // Starts on the preferred server
+    CHECK(mqtt_connect(mqtt, 0, NULL, "availability", NULL) == 1);
+    CHECK(wait_availability(w1, "online", 2000));
+
+    struct mqtt_stats st;
+    mqtt_get_stats(mqtt, &st);
+    CHECK(st.server == 0);
+    CHECK(st.switchovers == 0);
+
+    // Preferred server goes away: fail over
+    mqtt_client_close(w1, true);
+    mqtt_broker_stop(primary);
+    CHECK(wait_availability(w2, "online", 5000));
+    mqtt_get_stats(mqtt, &st);
+    CHECK(st.server == 1);
+    CHECK(st.switchovers == 1);
+    printf("fail-over:  %.3f ms\n", st.switchover_ns / 1e6);
+
+    // It comes back: return to it once stable (fail-back delay + probe)
+    primary = mqtt_broker_start(port);
+    CHECK(primary != NULL);
+    if (primary == NULL) return EXIT_FAILURE;
+    w1 = watch(primary);
+    CHECK(w1 != NULL);
+    if (w1 == NULL) return EXIT_FAILURE;
+    CHECK(wait_availability(w1, "online",  15000));
+    CHECK(wait_availability(w2, "offline", 1000));   // left cleanly
+    mqtt_get_stats(mqtt, &st);
+    CHECK(st.server == 0);
+    CHECK(st.switchovers == 2);
+    printf("fail-back:  %.3f ms\n", st.switchover_ns / 1e6);
+
+    mqtt_destroy(mqtt);
+    mqtt_client_close(w1, false);
+    mqtt_client_close(w2, false);
+    mqtt_broker_stop(primary);
+    mqtt_broker_stop(fallback);
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -38,6 +38,67 @@ test_mbus_baudrate(void)
     CHECK(parse_mbus_baudrate("2400x", &v) <  0);
 }
 
+static void
+test_pulse_volume(void)
+{
+    double v;
+    CHECK(parse_pulse_volume("1",     &v) == 0 && v == 1.0);
+    CHECK(parse_pulse_volume("0.5",   &v) == 0 && v == 0.5);
+    CHECK(parse_pulse_volume("10L",   &v) == 0 && v == 10.0);
+    CHECK(parse_pulse_volume("2.5l",  &v) == 0 && v == 2.5);
+    CHECK(parse_pulse_volume("0",     &v) <  0);   // under min
+    CHECK(parse_pulse_volume("1001",  &v) <  0);   // over max
+    CHECK(parse_pulse_volume("nan",   &v) <  0);
+    CHECK(parse_pulse_volume("",      &v) <  0);
+    CHECK(parse_pulse_volume("1m3",   &v) <  0);
+}
+
+static void
+test_replay_speed(void)
+{
+    double v;
+    CHECK(parse_replay_speed("1",     &v) == 0 && v == 1.0);
+    CHECK(parse_replay_speed("3600x", &v) == 0 && v == 3600.0);
+    CHECK(parse_replay_speed("0.5",   &v) == 0 && v == 0.5);
+    CHECK(parse_replay_speed("max",   &v) == 0 && v == 0.0);
+    CHECK(parse_replay_speed("0",     &v) <  0);   // under min (use max)
+    CHECK(parse_replay_speed("2e9",   &v) <  0);   // over max
+    CHECK(parse_replay_speed("nan",   &v) <  0);
+    CHECK(parse_replay_speed("",      &v) <  0);
+    CHECK(parse_replay_speed("10y",   &v) <  0);
+}
+
+static void
+test_oversampling(void)
+{
+    uint8_t osr[3] = { 0 };
+    CHECK(parse_oversampling("2",       osr) == 0 &&
+	  osr[0] == 2 && osr[1] == 2 && osr[2] == 2);
+    CHECK(parse_oversampling("1,16,4",  osr) == 0 &&
+	  osr[0] == 1 && osr[1] == 16 && osr[2] == 4);
+    CHECK(parse_oversampling("0",       osr) <  0);   // skipping: not here
+    CHECK(parse_oversampling("3",       osr) <  0);   // not a power of 2
+    CHECK(parse_oversampling("32",      osr) <  0);
+    CHECK(parse_oversampling("1,2",     osr) <  0);
+    CHECK(parse_oversampling("1,2,4,8", osr) <  0);
+    CHECK(parse_oversampling("1,,4",    osr) <  0);
+    CHECK(parse_oversampling("",        osr) <  0);
+    CHECK(osr[0] == 1 && osr[1] == 16 && osr[2] == 4);  // left as is
+}
+
+static void
+test_iir_filter(void)
+{
+    uint8_t v = 1;
+    CHECK(parse_iir_filter("off", &v) == 0 && v == 0);
+    CHECK(parse_iir_filter("0",   &v) == 0 && v == 0);
+    CHECK(parse_iir_filter("16",  &v) == 0 && v == 16);
+    CHECK(parse_iir_filter("3",   &v) <  0);
+    CHECK(parse_iir_filter("32",  &v) <  0);
+    CHECK(parse_iir_filter("",    &v) <  0);
+    CHECK(parse_iir_filter("2x",  &v) <  0);
+}
+
 static void
 test_s_period(void)
 {
@@ -95,6 +156,19 @@ test_gpio(void)
     CHECK(parse_gpio("noseparator", &chip, &pin) < 0);
     CHECK(parse_gpio("gpiochip0:",  &chip, &pin) < 0);   // missing pin
     CHECK(parse_gpio("gpiochip0:x", &chip, &pin) < 0);   // non-numeric pin
+
+    char *name = NULL;
+    CHECK(parse_gpio_zone("kitchen=gpiochip0:5", &name, &chip, &pin) == 0 &&
+	  name && strcmp(name, "kitchen") == 0 &&
+	  chip && strcmp(chip, "gpiochip0") == 0 && pin == 5);
+    free(name); name = NULL;
+    free(chip); chip = NULL;
+
+    CHECK(parse_gpio_zone("gpiochip0:5",          &name, &chip, &pin) < 0);
+    CHECK(parse_gpio_zone("=gpiochip0:5",         &name, &chip, &pin) < 0);
+    CHECK(parse_gpio_zone("Kitchen=gpiochip0:5",  &name, &chip, &pin) < 0);
+    CHECK(parse_gpio_zone("a/b=gpiochip0:5",      &name, &chip, &pin) < 0);
+    CHECK(parse_gpio_zone("kitchen=gpiochip0:",   &name, &chip, &pin) < 0);
 }
 
 static void
@@ -121,15 +195,63 @@ test_gpio_flags(void)
     CHECK(parse_gpio_active("mid",  &f) <  0);
 }
 
+static void
+test_mqtt_servers(void)
+{
+    struct mqtt_server l[4];
+
+    CHECK(parse_mqtt_servers("broker", l, 4) == 1);
+    CHECK(strcmp(l[0].host, "broker") == 0 && l[0].port == 0);
+    free_mqtt_servers(l, 1);
+
+    CHECK(parse_mqtt_servers("a, b:1884 ,10.0.0.3:8883", l, 4) == 3);
+    CHECK(strcmp(l[0].host, "a")        == 0 && l[0].port == 0);
+    CHECK(strcmp(l[1].host, "b")        == 0 && l[1].port == 1884);
+    CHECK(strcmp(l[2].host, "10.0.0.3") == 0 && l[2].port == 8883);
+    free_mqtt_servers(l, 3);
+
+    // IPv6: bracketed with a port, or bare
+    CHECK(parse_mqtt_servers("[::1]:1884,fe80::1,[::2]", l, 4) == 3);
+    CHECK(strcmp(l[0].host, "::1")     == 0 && l[0].port == 1884);
+    CHECK(strcmp(l[1].host, "fe80::1") == 0 && l[1].port == 0);
+    CHECK(strcmp(l[2].host, "::2")     == 0 && l[2].port == 0);
+    free_mqtt_servers(l, 3);
+
+    // Local broker, on a Unix domain socket
+    CHECK(parse_mqtt_servers("unix:/run/mosquitto/mqtt.sock,b", l, 4) == 2);
+    CHECK(strcmp(l[0].host, "/run/mosquitto/mqtt.sock") == 0 && l[0].local);
+    CHECK(strcmp(l[1].host, "b") == 0 && !l[1].local);
+    free_mqtt_servers(l, 2);
+
+    CHECK(parse_mqtt_servers("",          l, 4) <  0);
+    CHECK(parse_mqtt_servers("unix:",     l, 4) <  0);
+    CHECK(parse_mqtt_servers("a,,b",      l, 4) <  0);   // empty entry
+    CHECK(parse_mqtt_servers("a,",        l, 4) <  0);
+    CHECK(parse_mqtt_servers(":1883",     l, 4) <  0);   // no host
+    CHECK(parse_mqtt_servers("a:",        l, 4) <  0);   // no port
+    CHECK(parse_mqtt_servers("a:0",       l, 4) <  0);
+    CHECK(parse_mqtt_servers("a:65536",   l, 4) <  0);
+    CHECK(parse_mqtt_servers("a:12x",     l, 4) <  0);
+    CHECK(parse_mqtt_servers("a:-1",      l, 4) <  0);
+    CHECK(parse_mqtt_servers("[::1",      l, 4) <  0);
+    CHECK(parse_mqtt_servers("[::1]1883", l, 4) <  0);
+    CHECK(parse_mqtt_servers("a,b,c,d,e", l, 4) <  0);   // too many
+}
+
 int
 main(void)
 {
     test_mbus_baudrate();
+    test_pulse_volume();
+    test_replay_speed();
+    test_oversampling();
+    test_iir_filter();
     test_s_period();
     test_us_period();
     test_idle_timeout();
     test_gpio();
     test_gpio_flags();
+    test_mqtt_servers();
 
     printf("%d checks, %d failures\n", checks, failures);
     return failures ? EXIT_FAILURE : EXIT_SUCCESS;
@@ -0,0 +1,180 @@
+/*
+ * Benchmark: publish throughput of the shared MQTT layer (common.c).
+ *
+ * The watermeter and sensors daemons need their hardware (M-Bus, pulse
+ * input, BME280) to produce readings, so rather than the programs it is
+ * their publish path -- mqtt_connect() and mqtt_publish() from moses_common,
+ * on top of libmosquitto -- that is driven here, with the payloads and QoS
+ * levels they use. A subscriber on the broker stand-in (mqtt_broker.h)
+ * counts the deliveries: everything published must arrive, and the rate
+ * (publication of the first message to reception of the last) is reported.
+ * The batching mode (mqtt_publish_reading()) is run too: every reading must
+ * arrive, packed in cfg.batch_size per message.
+ *
+ * Usage: test_publish_throughput [count]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+#include "mqtt_broker.h"
+
+#define TIMEOUT_MS 5000
+
+char *__progname = "test_publish_throughput";
+
+struct scenario {
+    const char *name;
+    const char *topic;
+    int         qos;
+    const char *fmt;                    // one double argument
+};
+
+// As published by the daemons
+static const struct scenario scenarios[] = {
+    { "watermeter pulse", "water/pulse",  2, "%.0f"                      },
+    { "watermeter index", "water/index",  1, "%0.3f"                     },
+    { "sensors",          "sensors",      1,
+      "{ \"temperature\": %.2f, \"pressure\": 1013.25, \"humidity\": 45.00 }" },
+};
+
+
+// Publish `count` messages and wait for all of them. Messages per second,
+// or a negative value if some were lost.
+static double
+run(struct mqtt *mqtt, struct mqtt_client *sub,
+    const struct scenario *s, int count)
+{
+    struct mqtt_client_message msg;
+    int received = 0;
+
+    uint64_t t0 = now_ns();
+    for (int i = 0 ; i < count ; i++)
+	if (mqtt_publish(mqtt, s->topic, s->qos, false, s->fmt, (double)i) < 0)
+	    return -1;
+    while (received < count) {
+	if (mqtt_client_receive(sub, &msg, TIMEOUT_MS) != 1)
+	    break;
+	if (strcmp(msg.topic, s->topic) == 0)
+	    received++;
+    }
+    uint64_t t1 = now_ns();
+
+    if (received < count) {
+	fprintf(stderr, "%s: %d/%d received\n", s->name, received, count);
+	return -1;
+    }
+    return count / ((t1 - t0) / 1e9);
+}
+
+
+// Same, in batching mode: readings are counted inside the arrays.
+static double
+run_batched(struct mqtt *mqtt, struct mqtt_client *sub,
+	    const struct scenario *s, int count, int *messages)
+{
+    struct mqtt_client_message msg;
+    int received = 0;
+
+    *messages = 0;
+    uint64_t t0 = now_ns();
+    for (int i = 0 ; i < count ; i++)
+	if (mqtt_publish_reading(mqtt, s->topic, s->qos, i == count - 1, 0,
+				 s->fmt, (double)i) < 0)
+	    return -1;
+    while (received < count) {
+	if (mqtt_client_receive(sub, &msg, TIMEOUT_MS) != 1)
+	    break;
+	if (strcmp(msg.topic, s->topic) != 0)
+	    continue;
+	if (msg.payload[0] != '[')
+	    break;
+	(*messages)++;
+	for (const char *p = msg.payload ; (p = strstr(p, "\"ts\"")) ; p++)
+	    received++;
+    }
+    uint64_t t1 = now_ns();
+
+    if (received < count) {
+	fprintf(stderr, "%s (batched): %d/%d received\n",
+		s->name, received, count);
+	return -1;
+    }
+    return count / ((t1 - t0) / 1e9);
+}
+
+
+int
+main(int argc, char **argv)
+{
+    int count = (argc > 1) ? atoi(argv[1]) : 5000;
+    if (count < 1) count = 1;
+
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    if (b == NULL) {
+	fprintf(stderr, "failed to start the broker\n");
+	return EXIT_FAILURE;
+    }
+    uint16_t port = mqtt_broker_port(b);
+
+    struct mqtt_client *sub = mqtt_client_connect(port, "counter",
+						  NULL, NULL, 0, false);
+    if ((sub == NULL) || (mqtt_client_subscribe(sub, "#", 2) < 0)) {
+	fprintf(stderr, "failed to subscribe\n");
+	return EXIT_FAILURE;
+    }
+
+    // Daemon side
+    struct mqtt *mqtt = &(struct mqtt) MQTT_INITIALIZER();
+    mqtt->cfg.host      = "127.0.0.1";
+    mqtt->cfg.port      = port;
+    mqtt->cfg.client_id = "publisher";
+    if (mqtt_connect(mqtt, 0, NULL, "availability", NULL) <= 0) {
+	fprintf(stderr, "failed to connect\n");
+	return EXIT_FAILURE;
+    }
+
+    // Connected once the availability is announced
+    struct mqtt_client_message msg;
+    if ((mqtt_client_receive(sub, &msg, TIMEOUT_MS) != 1) ||
+	(strcmp(msg.payload, "online") != 0)) {
+	fprintf(stderr, "publisher did not connect\n");
+	return EXIT_FAILURE;
+    }
+
+    int rc = EXIT_SUCCESS;
+    for (size_t i = 0 ; i < __arraycount(scenarios) ; i++) {
+	double rate = run(mqtt, sub, &scenarios[i], count);
+	if (rate < 0) {
+	    rc = EXIT_FAILURE;
+	    continue;
+	}
+	printf("%-18s QoS %d: %d messages, %.0f msg/s\n",
+	       scenarios[i].name, scenarios[i].qos, count, rate);
+    }
+
+    // Batching mode (small enough readings for the test client buffer)
+    mqtt->cfg.batch_size = 10;
+    int messages;
+    double rate = run_batched(mqtt, sub, &scenarios[0], count, &messages);
+    if ((rate < 0) || (messages != (count + 9) / 10)) {
+	fprintf(stderr, "batching: %d messages for %d readings\n",
+		messages, count);
+	rc = EXIT_FAILURE;
+    } else {
+	printf("%-18s QoS %d: %d readings in %d messages, %.0f readings/s\n",
+	       "batched pulse", scenarios[0].qos, count, messages, rate);
+    }
+
+    mqtt_destroy(mqtt);
+    mqtt_client_close(sub, false);
+    mqtt_broker_stop(b);
+    return rc;
+}
@@ -0,0 +1,179 @@
+/*
+ * Unit tests for the watermeter replay (trace parsing and loading, virtual
+ * clock).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+
+#include "replay.h"
+
+static int failures = 0;
+static int checks   = 0;
+
+#define CHECK(cond) do {						\
+	checks++;							\
+	if (!(cond)) {							\
+	    failures++;							\
+	    fprintf(stderr, "FAIL %s:%d: %s\n",				\
+		    __FILE__, __LINE__, #cond);				\
+	}								\
+    } while (0)
+
+#define MS(n) ((uint64_t)(n) * 1000000ull)
+#define S(n)  ((uint64_t)(n) * 1000000000ull)
+
+static void
+test_parse(void)
+{
+    struct replay_record r;
+
+    CHECK(replay_parse("1718000000 pulse\n", &r) == 1);
+    CHECK((r.ts == S(1718000000)) && (r.kind == REPLAY_PULSE) &&
+	  (r.count == 1));
+    CHECK(replay_parse("1718000000.25 pulse 3", &r) == 1);
+    CHECK((r.ts == S(1718000000) + MS(250)) && (r.count == 3));
+    CHECK(replay_parse("  1.000000001\tpulse\r\n", &r) == 1);
+    CHECK(r.ts == S(1) + 1);
+    CHECK(replay_parse("1.1234567899 pulse", &r) == 1);  // ns, truncated
+    CHECK(r.ts == S(1) + 123456789);
+    CHECK(replay_parse("1718000000 index 123.456", &r) == 1);
+    CHECK((r.kind == REPLAY_INDEX) && (r.index == 123.456));
+    CHECK(replay_parse("1718000000 valve 1", &r) == 1);
+    CHECK((r.kind == REPLAY_VALVE) && (r.state == 1));
+
+    // Nothing to replay
+    CHECK(replay_parse("",               &r) == 0);
+    CHECK(replay_parse("\n",             &r) == 0);
+    CHECK(replay_parse("   # comment\n", &r) == 0);
+
+    // Invalid
+    CHECK(replay_parse("pulse",                 &r) < 0);
+    CHECK(replay_parse("-1 pulse",              &r) < 0);
+    CHECK(replay_parse("1718000000pulse",       &r) < 0);
+    CHECK(replay_parse("1718000000 pulses",     &r) < 0);
+    CHECK(replay_parse("1718000000 pulse 0",    &r) < 0);
+    CHECK(replay_parse("1718000000 pulse x",    &r) < 0);
+    CHECK(replay_parse("1718000000 pulse 2 3",  &r) < 0);
+    CHECK(replay_parse("1718000000 index",      &r) < 0);
+    CHECK(replay_parse("1718000000 index -1",   &r) < 0);
+    CHECK(replay_parse("1718000000 valve 2",    &r) < 0);
+    CHECK(replay_parse("1718000000 valve 1.0",  &r) < 0);
+    CHECK(replay_parse("99999999999999999999 pulse", &r) < 0);
+}
+
+static int
+write_trace(char *path, const char *content)
+{
+    int fd = mkstemp(path);
+    if (fd < 0)
+	return -1;
+    ssize_t len = strlen(content);
+    int rc = (write(fd, content, len) == len) ? 0 : -1;
+    close(fd);
+    return rc;
+}
+
+static void
+test_load(void)
+{
+    struct replay r = { 0 };
+    unsigned long line;
+    char path[] = "/tmp/test_replay.XXXXXX";
+
+    CHECK(write_trace(path,
+		      "# recorded on the kitchen meter\n"
+		      "1718000000.0 index 10.5\n"
+		      "1718000001.5 pulse\n"
+		      "1718000001.5 pulse 2\n"
+		      "\n"
+		      "1718000060   valve 1\n"
+		      "1718000061   pulse\n"
+		      "1718003600   index 10.509\n") == 0);
+    CHECK(replay_load(&r, path, &line) == 0);
+    CHECK(r.count == 6);
+    CHECK((r.pulses == 4) && (r.indexes == 2) && (r.valves == 1));
+    CHECK(r.record[2].kind == REPLAY_PULSE && r.record[2].count == 2);
+    CHECK(r.record[5].ts == S(1718003600));
+    replay_free(&r);
+    unlink(path);
+
+    // Out of order, reported on its line
+    struct replay o = { 0 };
+    char opath[] = "/tmp/test_replay.XXXXXX";
+    CHECK(write_trace(opath,
+		      "1718000002 pulse\n"
+		      "# late\n"
+		      "1718000001 pulse\n") == 0);
+    errno = 0;
+    CHECK(replay_load(&o, opath, &line) < 0);
+    CHECK((errno == EINVAL) && (line == 3));
+    replay_free(&o);
+    unlink(opath);
+
+    // Larger than the first allocation
+    struct replay l = { 0 };
+    char lpath[] = "/tmp/test_replay.XXXXXX";
+    char *content = NULL;
+    size_t size = 0;
+    FILE *f = open_memstream(&content, &size);
+    for (int i = 0 ; i < 5000 ; i++)
+	fprintf(f, "%d.%03d pulse\n", 1718000000 + i / 10, (i % 10) * 100);
+    fclose(f);
+    CHECK(write_trace(lpath, content) == 0);
+    CHECK(replay_load(&l, lpath, &line) == 0);
+    CHECK((l.count == 5000) && (l.pulses == 5000));
+    CHECK(l.record[4999].ts == S(1718000499) + MS(900));
+    replay_free(&l);
+    unlink(lpath);
+    free(content);
+
+    CHECK(replay_load(&l, "/nonexistent/trace", &line) < 0);
+}
+
+static void
+test_clock(void)
+{
+    struct replay r = { 0 };
+    struct replay_record rec[] = {
+	{ .ts = S(1718000000), .kind = REPLAY_PULSE, .count = 1 },
+	{ .ts = S(1718086400), .kind = REPLAY_PULSE, .count = 1 },
+    };
+    r.record = rec;
+    r.count  = 2;
+
+    // Real time: virtual and real monotonic times are the same
+    replay_clock_start(&r, S(50), 1);
+    CHECK(replay_mono(&r, S(1718000000)) == S(50));
+    CHECK(replay_mono(&r, S(1718086400)) == S(50 + 86400));
+    CHECK(replay_realtime(&r, S(50 + 3600)) == S(1718003600));
+    CHECK(replay_due(&r, S(50 + 10)) == S(60));
+
+    // A day in a minute
+    replay_clock_start(&r, S(50), 1440);
+    CHECK(replay_mono(&r, S(1718086400)) == S(50 + 86400));
+    CHECK(replay_due(&r, S(50 + 86400)) == S(50 + 60));
+
+    // No wait at all
+    replay_clock_start(&r, S(50), 0);
+    CHECK(replay_due(&r, S(50 + 86400)) == S(50));
+}
+
+int
+main(void)
+{
+    test_parse();
+    test_load();
+    test_clock();
+
+    printf("%d checks, %d failures\n", checks, failures);
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,357 @@
+/*
+ * Benchmark: pulse capture of moses_watermeter -- throughput, loss,
+ * publish latency and CPU use.
+ *
+ * The watermeter runs unmodified, as a child process, against the broker
+ * stand-in (mqtt_broker.h), counting the pulses of a simulated GPIO input
+ * (gpio_sim.h) that this harness toggles through its pull attribute. Each
+ * scenario generates a known number of pulses with a pattern:
+ *
+ *   - steady     fixed rate
+ *   - bursty     bursts of pulses at a high rate, separated by idle gaps
+ *   - jittered   random period, uniform around the nominal one
+ *
+ * some of them with every CPU kept busy by spinning processes, or with the
+ * broker delaying each message (as a slow broker would). The pulses
+ * published on `pulse` are added up and compared with the generated count
+ * once the watermeter has settled. For each scenario are reported: the
+ * loss, the latency of the `pulse` messages (from the generation of the
+ * last pulse they account for to their reception by the broker, assuming
+ * nothing was lost before), and the CPU used by the watermeter.
+ *
+ * Every pulse must be counted at the baseline rate (the first scenario);
+ * the others only report, as the rate where pulses start being lost
+ * depends on the box.
+ *
+ * Usage: test_watermeter_pulses /path/to/moses_watermeter
+ *
+ * Exits with 77 (skipped) when gpio-sim is not available (not root, no
+ * configfs, module not loaded).
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <sys/wait.h>
+
+#include "mqtt_broker.h"
+#include "gpio_sim.h"
+#include "daemon.h"
+
+#define SETTLE_MS   1000                // no more pulse published
+#define MAX_MSGS    65536               // pulse messages kept per scenario
+#define SPIN_NS     100000              // busy-wait the last 100us
+
+enum pattern { STEADY, BURSTY, JITTERED };
+
+struct scenario {
+    const char   *name;
+    enum pattern  pattern;
+    unsigned int  rate;                 // Hz (within a burst)
+    unsigned int  count;                // pulses
+    unsigned int  burst;                // pulses per burst
+    unsigned int  gap_ms;               // between bursts
+    unsigned int  jitter;               // percent of the period
+    bool          load;                 // every CPU busy
+    uint32_t      delay_us;             // broker delay per message
+};
+
+static const struct scenario scenarios[] = {
+    { "steady",   STEADY,     200,   400, .burst = 0                  },
+    { "steady",   STEADY,    1000,  2000, .burst = 0                  },
+    { "steady",   STEADY,    5000, 10000, .burst = 0                  },
+    { "steady",   STEADY,   20000, 20000, .burst = 0                  },
+    { "bursty",   BURSTY,   10000,  1000, .burst = 100, .gap_ms = 100 },
+    { "jittered", JITTERED,  1000,  2000, .jitter = 50                },
+    { "loaded",   STEADY,    1000,  2000, .load = true                },
+    { "slow mq",  STEADY,    1000,  2000, .delay_us = 5000            },
+};
+
+
+// Sleep until `t` (CLOCK_MONOTONIC), spinning at the end for accuracy
+static void
+wait_until(uint64_t t)
+{
+    uint64_t now = now_ns();
+    if (t > now + SPIN_NS) {
+	uint64_t wake = t - SPIN_NS;
+	struct timespec ts = { .tv_sec  = wake / 1000000000ull,
+			       .tv_nsec = wake % 1000000000ull };
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+    }
+    while (now_ns() < t)
+	;
+}
+
+static pid_t
+spawn_watermeter(const char *path, uint16_t port, const char *chip)
+{
+    char s_pin[64];
+    snprintf(s_pin, sizeof(s_pin), "%s:0", chip);
+
+    const char *args[] = { "-d", "none", "-P", s_pin, "-E", "rising", NULL };
+    return daemon_spawn(path, "watermeter", "127.0.0.1", port, args);
+}
+
+// CPU time (user + system) used so far by `pid`, in clock ticks
+static unsigned long long
+cpu_ticks(pid_t pid)
+{
+    char path[64], buf[1024];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+	return 0;
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+
+    // Fields after the command name (which may contain spaces): state is
+    // the 3rd field, utime and stime the 14th and 15th
+    unsigned long long utime = 0, stime = 0;
+    char *p = strrchr(buf, ')');
+    if ((p == NULL) ||
+	(sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+		&utime, &stime) != 2))
+	return 0;
+    return utime + stime;
+}
+
+
+// Reception of the published pulses (receiver thread)
+static struct {
+    struct mqtt_client   *client;
+    atomic_bool           stop;
+    _Atomic unsigned long total;        // pulses published
+    _Atomic uint64_t      last_ns;      // last pulse message
+    _Atomic unsigned int  count;        // messages kept
+    struct {
+	unsigned long total;            // pulses published up to it
+	uint64_t      ts_ns;            // reception
+    } msgs[MAX_MSGS];
+} rx;
+
+static void *
+receive(void *arg)
+{
+    (void)arg;
+    struct mqtt_client_message msg;
+    while (!atomic_load(&rx.stop)) {
+	if ((mqtt_client_receive(rx.client, &msg, 100) != 1) ||
+	    strcmp(msg.topic, PREFIX "/pulse"))
+	    continue;
+
+	// Plain count, or with --timestamps/batching { "value": N, ... }
+	const char *v = strstr(msg.payload, "\"value\":");
+	unsigned long pulses = strtoul(v ? v + 8 : msg.payload, NULL, 10);
+	if (pulses == 0)                // idle heartbeat
+	    continue;
+	unsigned long total = atomic_fetch_add(&rx.total, pulses) + pulses;
+	unsigned int  i     = atomic_load(&rx.count);
+	if (i < MAX_MSGS) {
+	    rx.msgs[i].total = total;
+	    rx.msgs[i].ts_ns = msg.ts_ns;
+	    atomic_store(&rx.count, i + 1);
+	}
+	atomic_store(&rx.last_ns, msg.ts_ns);
+    }
+    return NULL;
+}
+
+
+// Generate the pulses of `s`, each one's rising edge time in `gen`
+static int
+generate(const struct scenario *s, int fd, uint64_t *gen)
+{
+    uint64_t period = 1000000000ull / s->rate;
+    uint64_t t      = now_ns() + 1000000;
+    for (unsigned int i = 0 ; i < s->count ; i++) {
+	uint64_t p = period;
+	if (s->pattern == JITTERED)
+	    p = period - period * s->jitter / 100
+	      + (uint64_t)(drand48() * 2 * period * s->jitter / 100);
+	wait_until(t);
+	gen[i] = now_ns();
+	if (gpio_sim_pull_fd_set(fd, true) < 0)
+	    return -1;
+	wait_until(t + p / 2);
+	if (gpio_sim_pull_fd_set(fd, false) < 0)
+	    return -1;
+	t += p;
+	if ((s->pattern == BURSTY) && ((i + 1) % s->burst == 0))
+	    t += s->gap_ms * 1000000ull;
+    }
+    return 0;
+}
+
+// Keep every CPU busy. Number of spinning processes started in `pids`.
+static int
+load_start(pid_t *pids, int max)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int  n    = 0;
+    for ( ; (n < cpus) && (n < max) ; n++) {
+	pids[n] = fork();
+	if (pids[n] == 0)
+	    for (volatile unsigned long spin = 0 ; ; spin++)
+		;
+	if (pids[n] < 0)
+	    break;
+    }
+    return n;
+}
+
+static void
+load_stop(pid_t *pids, int n)
+{
+    for (int i = 0 ; i < n ; i++) {
+	kill(pids[i], SIGKILL);
+	waitpid(pids[i], NULL, 0);
+    }
+}
+
+
+// Run a scenario: pulses lost in `lost` (negative if more were counted).
+// 0 on success, -1 on failure.
+static int
+run(const struct scenario *s, struct mqtt_broker *b, int fd, pid_t pid,
+    long *lost)
+{
+    uint64_t *gen = calloc(s->count, sizeof(*gen));
+    if (gen == NULL)
+	return -1;
+
+    atomic_store(&rx.total, 0);
+    atomic_store(&rx.count, 0);
+
+    pid_t load[256];
+    int   loaded = s->load ? load_start(load, 256) : 0;
+    mqtt_broker_set_delay(b, s->delay_us);
+
+    unsigned long long ticks = cpu_ticks(pid);
+    uint64_t           start = now_ns();
+    int                rc    = generate(s, fd, gen);
+    uint64_t           end   = now_ns();
+    load_stop(load, loaded);
+
+    // Settled: everything counted, or nothing published for a while
+    while ((atomic_load(&rx.total) < s->count) &&
+	   (now_ns() - ((atomic_load(&rx.last_ns) > end)
+			? atomic_load(&rx.last_ns) : end))
+	   < SETTLE_MS * 1000000ull)
+	usleep(10000);
+    ticks = cpu_ticks(pid) - ticks;
+    uint64_t settled = now_ns();
+    mqtt_broker_set_delay(b, 0);
+    if (rc < 0) {
+	fprintf(stderr, "%s: failed to toggle the line\n", s->name);
+	free(gen);
+	return -1;
+    }
+
+    // Latency of each message, from its last pulse
+    unsigned long total = atomic_load(&rx.total);
+    unsigned int  msgs  = atomic_load(&rx.count);
+    uint64_t     *lat   = calloc(msgs ? msgs : 1, sizeof(*lat));
+    unsigned int  n     = 0;
+    for (unsigned int i = 0 ; lat && (i < msgs) ; i++) {
+	unsigned long k = rx.msgs[i].total;
+	if ((k >= 1) && (k <= s->count) && (rx.msgs[i].ts_ns > gen[k - 1]))
+	    lat[n++] = rx.msgs[i].ts_ns - gen[k - 1];
+    }
+    if (lat && n)
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+
+    *lost = (long)s->count - (long)total;
+    double cpu  = 100.0 * ticks / sysconf(_SC_CLK_TCK)
+		/ ((settled - start) / 1e9);
+    printf("%-8s %6u Hz %6u pulses: %6lu counted, lost %6ld (%5.2f%%),"
+	   " %5u msgs, latency p50 %.3f ms p99 %.3f ms max %.3f ms,"
+	   " cpu %.1f%% (%.0f ms generating)\n",
+	   s->name, s->rate, s->count, total, *lost, 100.0 * *lost / s->count,
+	   msgs, n ? lat[n / 2] / 1e6 : 0, n ? lat[(n * 99) / 100] / 1e6 : 0,
+	   n ? lat[n - 1] / 1e6 : 0, cpu, (end - start) / 1e6);
+    free(lat);
+    free(gen);
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s moses_watermeter\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    struct gpio_sim sim;
+    if (gpio_sim_create(&sim, "moses-pulses", 1) < 0) {
+	printf("SKIP: gpio-sim not available\n");
+	return EXIT_SKIP;
+    }
+
+    int       rc  = EXIT_FAILURE;
+    int       fd  = gpio_sim_pull_fd(&sim, 0);
+    pid_t     pid = -1;
+    pthread_t thr;
+    bool      receiving = false;
+    srand48(1);                         // same jitter on every run
+
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    rx.client = b ? mqtt_client_connect(mqtt_broker_port(b), "tester",
+					NULL, NULL, 0, false) : NULL;
+    if ((fd < 0) || (gpio_sim_pull_fd_set(fd, false) < 0) ||
+	(rx.client == NULL) ||
+	(mqtt_client_subscribe(rx.client, PREFIX "/stats/watermeter", 0) < 0) ||
+	(mqtt_client_subscribe(rx.client, PREFIX "/pulse",            2) < 0)) {
+	fprintf(stderr, "failed to set up the broker\n");
+	goto done;
+    }
+
+    pid = spawn_watermeter(argv[1], mqtt_broker_port(b), sim.chip);
+    if ((pid < 0) || !daemon_wait_connected(rx.client, "watermeter")) {
+	fprintf(stderr, "watermeter did not connect\n");
+	goto done;
+    }
+    if (pthread_create(&thr, NULL, receive, NULL) != 0) {
+	fprintf(stderr, "failed to start the receiver\n");
+	goto done;
+    }
+    receiving = true;
+
+    int errors = 0;
+    for (size_t i = 0 ; i < sizeof(scenarios) / sizeof(scenarios[0]) ; i++) {
+	long lost;
+	if (run(&scenarios[i], b, fd, pid, &lost) < 0) {
+	    errors++;
+	} else if ((i == 0) && (lost != 0)) {
+	    fprintf(stderr, "pulses miscounted at the baseline rate\n");
+	    errors++;
+	}
+    }
+    rc = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+    if (receiving) {
+	atomic_store(&rx.stop, true);
+	pthread_join(thr, NULL);
+    }
+    daemon_stop(pid);
+    if (rx.client) mqtt_client_close(rx.client, false);
+    if (b) mqtt_broker_stop(b);
+    if (fd >= 0) close(fd);
+    gpio_sim_destroy(&sim);
+    return rc;
+}
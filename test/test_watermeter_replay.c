@@ -0,0 +1,256 @@
+/*
+ * Integration test: trace replay of moses_watermeter (--replay).
+ *
+ * A month of household consumption (three uses a day, an hourly index
+ * reading) and two valve closures, one sealing and one leaking, is
+ * replayed as fast as possible through the unmodified watermeter, against
+ * the broker stand-in (mqtt_broker.h). Every pulse must be published, the
+ * monthly and daily totals must add up, and the closures must be verified
+ * and failed respectively. A two hour trace is then replayed at 3600x, to
+ * check it is paced by the virtual clock: every pulse published, and not
+ * before the two seconds it stands for. The replay rates are reported.
+ *
+ * Usage: test_watermeter_replay /path/to/moses_watermeter
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <signal.h>
+
+#include <sys/wait.h>
+
+#include "mqtt_broker.h"
+#include "daemon.h"
+
+#define REPLAY_TIMEOUT_MS 60000
+
+#define START      1735689600           // 2025-01-01 00:00:00 UTC
+#define DAYS       30
+#define DAILY      100                  // pulses (L) a day
+
+
+// Pulses spread from `t`, `period` seconds apart
+static void
+use(FILE *f, long t, int pulses, double period)
+{
+    for (int i = 0 ; i < pulses ; i++)
+	fprintf(f, "%ld.%03d pulse\n", t + (long)(i * period),
+		(int)(i * period * 1000) % 1000);
+}
+
+// A month: 60 L at 07:00, 10 L at 12:00, 30 L at 19:30; the index every
+// hour. The valve is closed at 22:00 on day 10 (two residual pulses) and
+// on day 20 (one residual pulse, then a leak), reopened at 22:05.
+static int
+write_month(const char *path, unsigned long *pulses)
+{
+    FILE *f = fopen(path, "w");
+    if (f == NULL)
+	return -1;
+
+    double index = 100.0;
+    *pulses = 0;
+    fprintf(f, "# generated by test_watermeter_replay\n");
+    for (int d = 0 ; d < DAYS ; d++) {
+	long day = START + d * 86400L;
+	for (int h = 0 ; h < 24 ; h++) {
+	    long t = day + h * 3600L;
+	    fprintf(f, "%ld index %.3f\n", t, index);
+	    if (h ==  7) { use(f, t,        60, 6.0); index += 0.060; }
+	    if (h == 12) { use(f, t,        10, 5.0); index += 0.010; }
+	    if (h == 19) { use(f, t + 1800, 30, 2.0); index += 0.030; }
+	    if ((h == 22) && ((d == 9) || (d == 19))) {
+		fprintf(f, "%ld valve 1\n", t);
+		if (d == 9) {
+		    fprintf(f, "%ld.500 pulse\n", t);
+		    fprintf(f, "%ld.500 pulse\n", t + 1);
+		} else {
+		    fprintf(f, "%ld pulse\n",     t + 2);
+		    fprintf(f, "%ld pulse\n",     t + 30);
+		}
+		fprintf(f, "%ld valve 0\n", t + 300);
+		*pulses += 2;
+	    }
+	}
+	*pulses += DAILY;
+    }
+    return fclose(f);
+}
+
+static pid_t
+spawn_watermeter(const char *path, uint16_t port, const char *trace,
+		 const char *speed, const char *state)
+{
+    const char *args[] = { "-d", "none", "-R", trace, "-S", speed,
+			   "-A", state, "-C", "10", "-W", "60", NULL };
+    return daemon_spawn(path, "watermeter", "127.0.0.1", port, args);
+}
+
+// Run a replay to its end, adding up the `pulse` messages. Elapsed time
+// (ns), 0 on failure.
+static uint64_t
+replay(const char *watermeter, struct mqtt_broker *b, struct mqtt_client *c,
+       const char *trace, const char *speed, const char *state,
+       unsigned long *pulses)
+{
+    unlink(state);
+    uint64_t start = now_ns();
+    pid_t    pid   = spawn_watermeter(watermeter, mqtt_broker_port(b),
+				      trace, speed, state);
+    if (pid < 0)
+	return 0;
+
+    int      status  = -1;
+    uint64_t end     = 0;
+    *pulses = 0;
+    while (now_ns() - start < REPLAY_TIMEOUT_MS * 1000000ull) {
+	struct mqtt_client_message msg;
+	int rc = mqtt_client_receive(c, &msg, end ? 200 : 10);
+	if (rc == 1) {
+	    if (!strcmp(msg.topic, PREFIX "/pulse"))
+		*pulses += strtoul(msg.payload, NULL, 10);
+	    continue;
+	}
+	if (end)                        // exited, and drained
+	    break;
+	if (waitpid(pid, &status, WNOHANG) == pid)
+	    end = now_ns();
+    }
+    if (end == 0) {
+	fprintf(stderr, "replay of %s not over in time\n", trace);
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	return 0;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status)) {
+	fprintf(stderr, "replay of %s failed (status %d)\n", trace, status);
+	return 0;
+    }
+    return end - start;
+}
+
+// Retained message of `topic` (subscribing to it)
+static int
+retained(struct mqtt_client *c, const char *topic,
+	 struct mqtt_client_message *msg)
+{
+    if (mqtt_client_subscribe(c, topic, 1) < 0)
+	return 0;
+    while (mqtt_client_receive(c, msg, 1000) == 1)
+	if (!strcmp(msg->topic, topic) && msg->retain)
+	    return 1;
+    return 0;
+}
+
+
+int
+main(int argc, char **argv)
+{
+    if (argc < 2) {
+	fprintf(stderr, "usage: %s moses_watermeter\n", argv[0]);
+	return EXIT_FAILURE;
+    }
+
+    // The totals are checked against UTC days and months
+    setenv("TZ", "UTC0", 1);
+
+    int  rc     = EXIT_FAILURE;
+    int  errors = 0;
+    char month[] = "/tmp/moses-replay-month.XXXXXX";
+    char hours[] = "/tmp/moses-replay-hours.XXXXXX";
+    char state[] = "/tmp/moses-replay-state.XXXXXX";
+    int  fds[3]  = { mkstemp(month), mkstemp(hours), mkstemp(state) };
+    for (int i = 0 ; i < 3 ; i++)
+	if (fds[i] >= 0) close(fds[i]);
+
+    struct mqtt_client_message msg;
+    struct mqtt_broker *b = mqtt_broker_start(0);
+    struct mqtt_client *c = b ? mqtt_client_connect(mqtt_broker_port(b),
+						    "tester", NULL, NULL, 0,
+						    false) : NULL;
+    if ((c == NULL) || (mqtt_client_subscribe(c, PREFIX "/pulse", 2) < 0)) {
+	fprintf(stderr, "failed to set up the broker\n");
+	goto done;
+    }
+
+    // A month, as fast as possible
+    unsigned long expected, published;
+    if (write_month(month, &expected) < 0) {
+	fprintf(stderr, "failed to write the trace\n");
+	goto done;
+    }
+    uint64_t elapsed = replay(argv[1], b, c, month, "max", state, &published);
+    if (elapsed == 0)
+	goto done;
+    printf("month replayed in %.3f s (x%.0f), %lu pulses published (%lu)\n",
+	   elapsed / 1e9, DAYS * 86400.0 / (elapsed / 1e9), published,
+	   expected);
+    if (published != expected) {
+	fprintf(stderr, "pulses lost\n");
+	errors++;
+    }
+
+    // Totals, in trace time: January, and the 29th
+    char volume[64];
+    snprintf(volume, sizeof(volume), "\"volume\": %lu.000", expected);
+    if (!retained(c, PREFIX "/consumption/month", &msg) ||
+	!strstr(msg.payload, "\"start\": 1735689600") ||
+	!strstr(msg.payload, volume)) {
+	fprintf(stderr, "monthly total off: %s\n", msg.payload);
+	errors++;
+    }
+    if (!retained(c, PREFIX "/consumption/day", &msg) ||
+	!strstr(msg.payload, "\"previous\": { \"start\": 1738108800, "
+			     "\"volume\": 100.000")) {
+	fprintf(stderr, "daily total off: %s\n", msg.payload);
+	errors++;
+    }
+
+    // Closures: the sealing one verified (last pulse 1.5s after), the
+    // leaking one failed
+    if (!retained(c, PREFIX "/stats/watermeter/closure", &msg) ||
+	!strstr(msg.payload, "\"verified\": 1, \"failed\": 1") ||
+	!strstr(msg.payload, "\"history\": [ 1.500 ]")) {
+	fprintf(stderr, "closure history off: %s\n", msg.payload);
+	errors++;
+    }
+    if (!retained(c, PREFIX "/closure", &msg) ||
+	!strstr(msg.payload, "\"result\": \"failed\"") ||
+	!strstr(msg.payload, "\"closed\": 1737410400.000000")) {
+	fprintf(stderr, "last closure off: %s\n", msg.payload);
+	errors++;
+    }
+
+    // Two hours at 3600x: two seconds at least, every pulse published.
+    // Only the lower bound is tight: the virtual clock may never run
+    // ahead, while a loaded machine may always lag behind it.
+    FILE *f = fopen(hours, "w");
+    if (f == NULL)
+	goto done;
+    for (int i = 0 ; i <= 4 ; i++)
+	fprintf(f, "%d pulse\n", START + i * 1800);
+    fclose(f);
+    elapsed = replay(argv[1], b, c, hours, "3600", state, &published);
+    printf("two hours replayed at 3600x in %.3f s\n", elapsed / 1e9);
+    if ((elapsed < 2000000000ull) || (elapsed > 20000000000ull) ||
+	(published != 5)) {
+	fprintf(stderr, "virtual clock off (%lu pulses)\n", published);
+	errors++;
+    }
+    rc = errors ? EXIT_FAILURE : EXIT_SUCCESS;
+
+ done:
+    if (c) mqtt_client_close(c, false);
+    if (b) mqtt_broker_stop(b);
+    unlink(month);
+    unlink(hours);
+    unlink(state);
+    return rc;
+}